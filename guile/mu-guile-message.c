@@ -412,8 +412,8 @@ get_query_iter (MuQuery *query, const char* expr, int maxnum)
 	GError *err;
 
 	err = NULL;
-	iter = mu_query_run (query, expr,
-			     FALSE, MU_MSG_FIELD_ID_NONE, TRUE, maxnum, &err);
+	iter = mu_query_run (query, expr, MU_MSG_FIELD_ID_NONE, maxnum,
+			     MU_QUERY_FLAG_DESCENDING, &err);
 	if (!iter) {
 		mu_guile_g_error ("<internal error>", err);
 		g_clear_error (&err);
@@ -467,6 +467,116 @@ SCM_DEFINE (for_each_message, "mu:c:for-each-message", 3, 0, 0,
 #undef FUNC_NAME
 
 
+SCM_DEFINE (count_messages, "mu:c:count", 2, 0, 0,
+	    (SCM EXPR, SCM ESTIMATE),
+"Get the number of messages in the message store matching EXPR. EXPR "
+"is either a string containing a mu search expression or a boolean; in "
+"the former case, count the messages matching the expression, in the "
+"latter case, count /all/ messages if the EXPR equals #t, and none if EXPR "
+"equals #f. If ESTIMATE is #t, only get an estimate, which is faster for "
+"large numbers of matches.")
+#define FUNC_NAME s_count_messages
+{
+	char* expr;
+	unsigned count;
+	GError *err;
+
+	MU_GUILE_INITIALIZED_OR_ERROR;
+
+	SCM_ASSERT (scm_is_bool(EXPR) || scm_is_string (EXPR),
+		    EXPR, SCM_ARG1, FUNC_NAME);
+	SCM_ASSERT (scm_is_bool(ESTIMATE), ESTIMATE, SCM_ARG2, FUNC_NAME);
+
+	if (EXPR == SCM_BOOL_F)
+		return scm_from_uint (0);
+
+	if (EXPR == SCM_BOOL_T)
+		expr = strdup (""); 	/* note, "" matches *all* messages */
+	else
+		expr = scm_to_utf8_string(EXPR);
+
+	err = NULL;
+	if (ESTIMATE == SCM_BOOL_T)
+		count = mu_query_count_estimate (mu_guile_instance()->query,
+						 expr, &err);
+	else
+		count = mu_query_count (mu_guile_instance()->query,
+					expr, &err);
+	free (expr);
+
+	if (count == (unsigned)-1) {
+		mu_guile_g_error (FUNC_NAME, err);
+		g_clear_error (&err);
+		return SCM_UNSPECIFIED;
+	}
+
+	return scm_from_uint (count);
+}
+#undef FUNC_NAME
+
+
+static void
+each_facet (MuQueryFacet facet, const char *val, unsigned count, SCM *lst)
+{
+	SCM key;
+
+	if (mu_query_facet_is_numeric (facet))
+		key = scm_from_int64 (g_ascii_strtoll (val, NULL, 10));
+	else
+		key = mu_guile_scm_from_str (val);
+
+	*lst = scm_cons (scm_cons (key, scm_from_uint (count)), *lst);
+}
+
+
+SCM_DEFINE (get_facet, "mu:c:facet", 2, 0, 0,
+	    (SCM EXPR, SCM FACET),
+"Count the messages in the message store matching EXPR by FACET, one of the "
+"mu:facet:... values. EXPR is either a string containing a mu search "
+"expression or a boolean; in the former case, count the messages matching "
+"the expression, in the latter case, count /all/ messages if the EXPR "
+"equals #t, and none if EXPR equals #f. Returns an alist mapping each "
+"value of FACET to its frequency.")
+#define FUNC_NAME s_get_facet
+{
+	char* expr;
+	SCM lst;
+	GError *err;
+	gboolean rv;
+
+	MU_GUILE_INITIALIZED_OR_ERROR;
+
+	SCM_ASSERT (scm_is_bool(EXPR) || scm_is_string (EXPR),
+		    EXPR, SCM_ARG1, FUNC_NAME);
+	SCM_ASSERT (scm_is_integer (FACET), FACET, SCM_ARG2, FUNC_NAME);
+
+	if (EXPR == SCM_BOOL_F)
+		return SCM_EOL;
+
+	if (EXPR == SCM_BOOL_T)
+		expr = strdup (""); 	/* note, "" matches *all* messages */
+	else
+		expr = scm_to_utf8_string(EXPR);
+
+	lst = SCM_EOL;
+	err = NULL;
+	rv  = mu_query_facets (mu_guile_instance()->query, expr,
+			       (MuQueryFacet)scm_to_int (FACET),
+			       (MuQueryFacetForeachFunc)each_facet,
+			       &lst, &err);
+	free (expr);
+
+	if (!rv) {
+		mu_guile_g_error (FUNC_NAME, err);
+		g_clear_error (&err);
+		return SCM_UNSPECIFIED;
+	}
+
+	return scm_reverse_x (lst, SCM_EOL);
+}
+#undef FUNC_NAME
+
+
 static SCM
 register_symbol (const char *name)
 {
@@ -528,7 +638,16 @@ static struct  {
 	{ "mu:field:to",	MU_MSG_FIELD_ID_TO },
 
 	/* non-Xapian field: timestamp */
-	{ "mu:field:timestamp",  MU_GUILE_MSG_FIELD_ID_TIMESTAMP }
+	{ "mu:field:timestamp",  MU_GUILE_MSG_FIELD_ID_TIMESTAMP },
+
+	/* facets, see mu:facet */
+	{ "mu:facet:maildir",	MU_QUERY_FACET_MAILDIR },
+	{ "mu:facet:flag",	MU_QUERY_FACET_FLAG },
+	{ "mu:facet:year",	MU_QUERY_FACET_YEAR },
+	{ "mu:facet:month",	MU_QUERY_FACET_MONTH },
+	{ "mu:facet:weekday",	MU_QUERY_FACET_WEEKDAY },
+	{ "mu:facet:from",	MU_QUERY_FACET_FROM },
+	{ "mu:facet:size",	MU_QUERY_FACET_SIZE }
 };
 
 static void
@@ -34,6 +34,15 @@
     mu:for-each-message
     mu:for-each-msg
     mu:message-list
+    mu:message-count
+    mu:facet
+    mu:facet:maildir
+    mu:facet:flag
+    mu:facet:year
+    mu:facet:month
+    mu:facet:weekday
+    mu:facet:from
+    mu:facet:size
     ;; message funcs
     mu:header
     ;; message accessors
@@ -93,6 +102,8 @@
   (define mu:c:get-field)
   (define mu:c:get-contacts)
   (define mu:c:for-each-message)
+  (define mu:c:count)
+  (define mu:c:facet)
   (define mu:c:get-header)
   (define mu:critical)
   (define mu:c:log)
@@ -173,6 +184,24 @@ store. MAXRESULTS specifies the maximum of messages to return, or
 	(set! lst (append! lst (list m)))) expr maxresults)
     lst))
 
+(define* (mu:message-count #:optional (expr #t) (estimate #f))
+  "Return the number of messages matching mu search expression EXPR. If
+EXPR is not provided, count /all/ messages in the store. If ESTIMATE
+is #t, only return an estimate, which is faster for large numbers of
+matches. This is much faster than counting the messages using
+mu:for-each-message, as the messages themselves are not retrieved."
+  (mu:c:count expr estimate))
+
+(define* (mu:facet facet #:optional (expr #t))
+  "Count the messages matching mu search expression EXPR (or /all/
+messages if EXPR is not provided) by FACET, which is one of
+mu:facet:maildir, mu:facet:flag, mu:facet:year, mu:facet:month (1-12),
+mu:facet:weekday (0-6, 0 being Sunday), mu:facet:from or
+mu:facet:size (the lower bound of the size range, in bytes). Returns
+an alist mapping each value to its frequency, like mu:tabulate, but
+much faster, as the messages themselves are not retrieved."
+  (mu:c:facet expr facet))
+
 ;; contacts
 (define-class <mu:contact> ()
   (name #:init-value #f  #:accessor mu:name  #:init-keyword #:name)
@@ -54,11 +54,7 @@ get back a list like
 (define* (mu:count #:optional (expr #t))
   "Count the number of messages matching EXPR. If EXPR is not
 provided, match /all/ messages."
-  (let ((num 0))
-    (mu:for-each-message
-      (lambda (msg) (set! num (1+ num)))
-      expr)
-    num))
+  (mu:message-count expr))
 
 
 (define (average lst)
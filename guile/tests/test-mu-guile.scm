@@ -26,11 +26,12 @@ exec guile -e main -s $0 $@
 
 (define (n-results-or-exit query n)
   "Run QUERY, and exit 1 if the number of results != N."
-  (let ((lst (mu:message-list query)))
-    (if (not (= (length lst) n))
+  (let ((lst (mu:message-list query))
+	 (count (mu:message-count query)))
+    (if (not (and (= (length lst) n) (= count n)))
       (begin
-	(simple-format (current-error-port) "Query: \"~A\"; expected ~A, got ~A\n"
-	  query n (length lst))
+	(simple-format (current-error-port) "Query: \"~A\"; expected ~A, got ~A (~A)\n"
+	  query n (length lst) count)
 	(exit 1)))))
 
 (define (test-queries)
@@ -101,7 +102,10 @@ exec guile -e main -s $0 $@
   (num-equal-or-exit (floor (mu:stddev mu:size))
     (floor 13414.7101616927))
   (num-equal-or-exit (mu:max mu:size) 46230)
-  (num-equal-or-exit (mu:min mu:size) 111))
+  (num-equal-or-exit (mu:min mu:size) 111)
+  ;; facets
+  (num-equal-or-exit (apply + (map cdr (mu:facet mu:facet:maildir))) 12)
+  (num-equal-or-exit (apply + (map cdr (mu:facet mu:facet:year))) 12))
 
 (define (main args)
   (let* ((optionspec  '((muhome  (value #t))
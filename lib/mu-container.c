@@ -39,18 +39,67 @@ typedef struct _Path Path;
 static Path* path_new (guint initial);
 static void  path_destroy (Path *p);
 static void  path_inc (Path *p, guint index);
-static gchar* path_to_string (Path *p, const char* frmt);
+static guint path_to_string (Path *p, unsigned digits, GString *str);
+
+
+/* the size of the first block of containers; each next block is
+ * twice as big as the one before */
+#define ARENA_MIN_BLOCK_SIZE 1024
+
+struct _MuContainerArena {
+	GPtrArray	*blocks;
+	size_t		 first_size; /* size of the first block */
+	size_t		 size;	     /* size of the last block */
+	size_t		 used;	     /* containers used in the last block */
+};
+
+
+MuContainerArena*
+mu_container_arena_new (size_t sizehint)
+{
+	MuContainerArena *arena;
+
+	arena		  = g_slice_new0 (MuContainerArena);
+	arena->blocks	  = g_ptr_array_new_with_free_func (g_free);
+	arena->first_size = MAX (sizehint, ARENA_MIN_BLOCK_SIZE);
+	arena->size	  = arena->first_size;
+	arena->used	  = 0;
+
+	g_ptr_array_add (arena->blocks, g_new (MuContainer, arena->size));
+
+	return arena;
+}
+
+
+void
+mu_container_arena_destroy (MuContainerArena *arena)
+{
+	if (!arena)
+		return;
+
+	g_ptr_array_free (arena->blocks, TRUE);
+	g_slice_free (MuContainerArena, arena);
+}
+
 
 MuContainer*
-mu_container_new (MuMsg *msg, guint docid, const char *msgid)
+mu_container_arena_alloc (MuContainerArena *arena, guint docid,
+			  const char* msgid)
 {
 	MuContainer *c;
 
-	g_return_val_if_fail (!msg || docid != 0, NULL);
+	g_return_val_if_fail (arena, NULL);
 
-	c = g_slice_new0 (MuContainer);
-	if (msg)
-		c->msg = mu_msg_ref (msg);
+	if (arena->used == arena->size) {
+		arena->size *= 2;
+		arena->used  = 0;
+		g_ptr_array_add (arena->blocks,
+				 g_new (MuContainer, arena->size));
+	}
+
+	c = (MuContainer*)g_ptr_array_index
+		(arena->blocks, arena->blocks->len - 1) + arena->used++;
+	memset (c, 0, sizeof(MuContainer));
 
 	c->docid = docid;
 	c->msgid = msgid;
@@ -58,16 +107,31 @@ mu_container_new (MuMsg *msg, guint docid, const char *msgid)
 	return c;
 }
 
+
 void
-mu_container_destroy (MuContainer *c)
+mu_container_arena_foreach (MuContainerArena *arena,
+			    MuContainerForeachFunc func, gpointer user_data)
 {
-	if (!c)
-		return;
+	guint b;
+	size_t u, size;
 
-	if (c->msg)
-		mu_msg_unref (c->msg);
+	g_return_if_fail (arena);
+	g_return_if_fail (func);
 
-	g_slice_free (MuContainer, c);
+	/* all blocks but the last one are full */
+	for (b = 0, size = arena->first_size; b != arena->blocks->len;
+	     ++b, size *= 2) {
+
+		MuContainer *block;
+		size_t used;
+
+		block = (MuContainer*)g_ptr_array_index (arena->blocks, b);
+		used  = (b == arena->blocks->len - 1) ? arena->used : size;
+
+		for (u = 0; u != used; ++u)
+			if (!func (&block[u], user_data))
+				return;
+	}
 }
 
 
@@ -199,21 +263,22 @@ mu_container_remove_child (MuContainer *c, MuContainer *child)
 
 typedef void (*MuContainerPathForeachFunc) (MuContainer*, gpointer, Path*);
 
+/* note: we only recurse for the children, not for the siblings, so
+ * the stack depth is bounded by the depth of the threads, not by the
+ * (possibly huge) number of siblings */
 static void
 mu_container_path_foreach_real (MuContainer *c, guint level, Path *path,
 			     MuContainerPathForeachFunc func, gpointer user_data)
 {
-	if (!c)
-		return;
-
-	path_inc (path, level);
-	func (c, user_data, path);
+	for (; c; c = c->next) {
 
-	/* children */
-	mu_container_path_foreach_real (c->child, level + 1, path, func, user_data);
+		path_inc (path, level);
+		func (c, user_data, path);
 
-	/* siblings */
-	mu_container_path_foreach_real (c->next, level, path, func, user_data);
+		/* children */
+		mu_container_path_foreach_real (c->child, level + 1, path,
+						func, user_data);
+	}
 }
 
 static void
@@ -236,17 +301,24 @@ mu_container_foreach (MuContainer *c, MuContainerForeachFunc func,
 {
 	g_return_val_if_fail (func, FALSE);
 
-	if (!c)
-		return TRUE;
+	/* as in mu_container_path_foreach_real, we only recurse for
+	 * the children */
+	while (c) {
+
+		MuContainer *next;
+
+		next = c->next;
 
-	if (!mu_container_foreach (c->child, func, user_data))
-		return FALSE; /* recurse into children */
+		if (!mu_container_foreach (c->child, func, user_data))
+			return FALSE; /* recurse into children */
 
-	/* recurse into siblings */
-	if (!mu_container_foreach (c->next, func, user_data))
-		return FALSE;
+		if (!func (c, user_data))
+			return FALSE;
 
-	return func (c, user_data);
+		c = next;
+	}
+
+	return TRUE;
 }
 
 
@@ -268,69 +340,166 @@ mu_container_splice_children (MuContainer *parent, MuContainer *child)
 }
 
 
-static GSList*
-mu_container_to_list (MuContainer *c)
-{
-	GSList *lst;
+/*
+ * sorting: we don't compare the messages themselves, but the sort
+ * keys (sortnum or sortstr) that were computed once for each message
+ * when its container was created; and we sort arrays rather than
+ * lists. For numeric fields (such as the date), we use a radix sort
+ * if there are enough containers to make that worthwhile.
+ *
+ * note that the sort is stable, so sorting a list of siblings that is
+ * already sorted does not change it.
+ */
+#define RADIX_SORT_MIN 64
+
+struct _SortItem {
+	guint64		 key;	/* for the radix sort */
+	MuContainer	*c;
+	MuContainer	*keyc;	/* the container with the sort key,
+				 * or NULL if there's none */
+};
+typedef struct _SortItem SortItem;
+
+struct _SortFuncData {
+	gboolean             numeric;
+	gboolean             revert;
+};
+typedef struct _SortFuncData SortFuncData;
 
-	for (lst = NULL; c; c = c->next)
-		lst = g_slist_prepend (lst, c);
 
-	return lst;
+static int
+cmp_items (const SortItem *a, const SortItem *b, SortFuncData *data)
+{
+	int cmp;
+
+	/* containers without any message go last */
+	if (!a->keyc || !b->keyc)
+		return (a->keyc ? 0 : 1) - (b->keyc ? 0 : 1);
+
+	if (data->numeric)
+		cmp = (a->keyc->sortnum > b->keyc->sortnum) -
+			(a->keyc->sortnum < b->keyc->sortnum);
+	else if (a->keyc->sortstr == b->keyc->sortstr)
+		cmp = 0;
+	else if (!a->keyc->sortstr)
+		cmp = -1;
+	else if (!b->keyc->sortstr)
+		cmp = 1;
+	else
+		cmp = strcmp (a->keyc->sortstr, b->keyc->sortstr);
+
+	return data->revert ? -cmp : cmp;
 }
 
 
-static MuContainer*
-mu_container_from_list (GSList *lst)
+/* LSD radix sort of the items, by their key, one byte at a time;
+ * returns the sorted array, which is either items or tmp */
+static SortItem*
+radix_sort (SortItem *items, SortItem *tmp, size_t n)
 {
-	MuContainer *c, *cur;
+	size_t counts[8][256];
+	size_t u;
+	unsigned byte, b;
 
-	if (!lst)
-		return NULL;
+	memset (counts, 0, sizeof(counts));
+	for (u = 0; u != n; ++u)
+		for (byte = 0; byte != 8; ++byte)
+			++counts[byte][(items[u].key >> (8 * byte)) & 0xff];
 
-	for (c = cur = (MuContainer*)lst->data; cur; lst = g_slist_next(lst)) {
-		cur->next = lst ? (MuContainer*)lst->data : NULL;
-		cur=cur->next;
+	for (byte = 0; byte != 8; ++byte) {
+
+		size_t sum, num, *count;
+		SortItem *swap;
+
+		count = counts[byte];
+
+		/* skip the bytes that are the same for all keys,
+		 * such as the high bytes of dates */
+		if (count[(items[0].key >> (8 * byte)) & 0xff] == n)
+			continue;
+
+		for (sum = 0, b = 0; b != 256; ++b) {
+			num	 = count[b];
+			count[b] = sum;
+			sum	+= num;
+		}
+
+		for (u = 0; u != n; ++u)
+			tmp[count[(items[u].key >> (8 * byte)) & 0xff]++] =
+				items[u];
+
+		swap  = items;
+		items = tmp;
+		tmp   = swap;
 	}
 
-	return c;
+	return items;
 }
 
-struct _SortFuncData {
-	MuMsgFieldId         mfid;
-	gboolean             revert;
-	gpointer             user_data;
-};
-typedef struct _SortFuncData SortFuncData;
-
 
-static int
-sort_func_wrapper (MuContainer *a, MuContainer *b, SortFuncData *data)
+static MuContainer*
+sort_siblings (MuContainer *c, SortFuncData *sfdata)
 {
-	MuContainer *a1, *b1;
+	SortItem *items, *tmp, *sorted;
+	MuContainer *cur;
+	size_t n, u;
 
-	/* use the first non-empty 'left child' message if this one
-	 * is */
-	for (a1 = a; a1->msg == NULL && a1->child != NULL; a1 = a1->child);
-	for (b1 = b; b1->msg == NULL && b1->child != NULL; b1 = b1->child);
+	for (n = 0, cur = c; cur; cur = cur->next)
+		++n;
+	if (n < 2)
+		return c;
 
-	if (a1 == b1)
-		return 0;
-	else if (!a1->msg)
-		return 1;
-	else if (!b1->msg)
-		return -1;
+	items = g_new (SortItem, n);
 
-	if (data->revert)
-		return mu_msg_cmp (b1->msg, a1->msg, data->mfid);
-	else
-		return mu_msg_cmp (a1->msg, b1->msg, data->mfid);
+	for (u = 0, cur = c; cur; cur = cur->next, ++u) {
+
+		MuContainer *keyc;
+
+		/* use the first non-empty 'left child' message if this one
+		 * is */
+		for (keyc = cur; keyc->docid == 0 && keyc->child;
+		     keyc = keyc->child);
+
+		items[u].c    = cur;
+		items[u].keyc = keyc->docid != 0 ? keyc : NULL;
+
+		if (!items[u].keyc)
+			items[u].key = G_MAXUINT64; /* last */
+		else {
+			/* flip the sign bit, so the signed order
+			 * becomes the unsigned order */
+			items[u].key = (guint64)keyc->sortnum ^
+				((guint64)1 << 63);
+			if (sfdata->revert)
+				items[u].key = ~items[u].key;
+		}
+	}
+
+	tmp = NULL;
+	if (sfdata->numeric && n >= RADIX_SORT_MIN) {
+		tmp    = g_new (SortItem, n);
+		sorted = radix_sort (items, tmp, n);
+	} else {
+		g_qsort_with_data (items, n, sizeof(SortItem),
+				   (GCompareDataFunc)cmp_items, sfdata);
+		sorted = items;
+	}
+
+	for (u = 0; u != n - 1; ++u)
+		sorted[u].c->next = sorted[u + 1].c;
+	sorted[n - 1].c->next = NULL;
+	c = sorted[0].c;
+
+	g_free (items);
+	g_free (tmp);
+
+	return c;
 }
 
+
 static MuContainer*
 mu_container_sort_real (MuContainer *c, SortFuncData *sfdata)
 {
-	GSList *lst;
 	MuContainer *cur;
 
 	if (!c)
@@ -340,15 +509,7 @@ mu_container_sort_real (MuContainer *c, SortFuncData *sfdata)
 		if (cur->child)
 			cur->child = mu_container_sort_real (cur->child, sfdata);
 
-	/* sort siblings */
-	lst = mu_container_to_list (c);
-	lst = g_slist_sort_with_data(lst,
-				     (GCompareDataFunc)sort_func_wrapper,
-				     sfdata);
-	c = mu_container_from_list (lst);
-	g_slist_free (lst);
-
-	return c;
+	return sort_siblings (c, sfdata);
 }
 
 
@@ -358,17 +519,40 @@ mu_container_sort (MuContainer *c, MuMsgFieldId mfid, gboolean revert,
 {
 	SortFuncData sfdata;
 
-	sfdata.mfid	 = mfid;
-	sfdata.revert	 = revert;
-	sfdata.user_data = user_data;
-
 	g_return_val_if_fail (c, NULL);
 	g_return_val_if_fail (mu_msg_field_id_is_valid(mfid), NULL);
 
+	sfdata.numeric = mu_msg_field_is_numeric (mfid);
+	sfdata.revert  = revert;
+
 	return mu_container_sort_real (c, &sfdata);
 }
 
 
+MuContainer*
+mu_container_sort_siblings (MuContainer *c, MuMsgFieldId mfid,
+			    gboolean revert, gpointer user_data)
+{
+	SortFuncData sfdata;
+	MuContainer *cur;
+
+	g_return_val_if_fail (c, NULL);
+	g_return_val_if_fail (mu_msg_field_id_is_valid(mfid), NULL);
+
+	sfdata.numeric = mu_msg_field_is_numeric (mfid);
+	sfdata.revert  = revert;
+
+	/* empty containers are sorted by their first child, so we
+	 * need to sort those children first */
+	for (cur = c; cur; cur = cur->next)
+		if (cur->docid == 0 && cur->child)
+			cur->child = mu_container_sort_real (cur->child,
+							     &sfdata);
+
+	return sort_siblings (c, &sfdata);
+}
+
+
 static gboolean
 unequal (MuContainer *a, MuContainer *b)
 {
@@ -393,18 +577,14 @@ mu_container_reachable (MuContainer *haystack, MuContainer *needle)
 static gboolean
 dump_container (MuContainer *c)
 {
-	const gchar* subject;
-
 	if (!c) {
 		g_print ("<empty>\n");
 		return TRUE;
 	}
 
-	subject =  (c->msg) ? mu_msg_get_subject (c->msg) : "<none>";
-
-	g_print ("[%s][%s m:%p p:%p docid:%u %s]\n",c->msgid, subject, (void*)c,
-		 (void*)c->parent, c->docid,
-		 c->msg ? mu_msg_get_path (c->msg) : "");
+	g_print ("[%s][%s m:%p p:%p docid:%u %" G_GINT64_FORMAT "]\n",
+		 c->msgid, c->sortstr ? c->sortstr : "<none>", (void*)c,
+		 (void*)c->parent, c->docid, c->sortnum);
 
 	return TRUE;
 }
@@ -452,7 +632,7 @@ path_inc (Path *p, guint index)
 {
 	if (index + 1 >= p->_len) {
 		p->_data = g_renew (int, p->_data, 2 * p->_len);
-		memset (&p->_data[p->_len], 0, p->_len);
+		memset (&p->_data[p->_len], 0, p->_len * sizeof(int));
 		p->_len *= 2;
 	}
 
@@ -461,155 +641,142 @@ path_inc (Path *p, guint index)
 }
 
 
-static gchar*
-path_to_string (Path *p, const char* frmt)
+/* write the path to str, as segments of (at least) 'digits' hex
+ * digits, separated by ':'; we re-use the same GString for all
+ * paths, so we don't need to allocate memory for each segment. Returns
+ * the number of segments - 1, ie. the thread level */
+static guint
+path_to_string (Path *p, unsigned digits, GString *str)
 {
-	char *str;
 	guint u;
 
-	if (!p->_data)
-		return NULL;
+	g_string_truncate (str, 0);
 
-	for (u = 0, str = NULL; p->_data[u] != 0; ++u) {
+	for (u = 0; p->_data[u] != 0; ++u) {
 
 		char segm[16];
-		snprintf (segm, sizeof(segm), frmt, p->_data[u] - 1);
+		int len;
 
-		if (!str)
-			str = g_strdup (segm);
-		else {
-			gchar *tmp;
-			tmp = g_strdup_printf ("%s:%s", str, segm);
-			g_free (str);
-			str = tmp;
-		}
+		len = snprintf (segm, sizeof(segm), "%s%0*x",
+				u == 0 ? "" : ":", (int)digits,
+				p->_data[u] - 1);
+		g_string_append_len (str, segm, len);
 	}
 
-	return str;
-}
-
-static unsigned
-count_colons (const char *str)
-{
-	unsigned num;
-
-	num = 0;
-	while (str++ && *str)
-		if (*str == ':')
-			++num;
-
-	return num;
-}
-
-
-
-static MuMsgIterThreadInfo*
-thread_info_new (gchar *threadpath, gboolean root, gboolean child,
-		 gboolean empty_parent, gboolean has_child, gboolean is_dup)
-{
-	MuMsgIterThreadInfo *ti;
-
-	ti		     = g_slice_new (MuMsgIterThreadInfo);
-	ti->threadpath	     = threadpath;
-	ti->level            = count_colons (threadpath); /* hacky... */
-
-	ti->prop  = 0;
-	ti->prop |= root         ? MU_MSG_ITER_THREAD_PROP_ROOT         : 0;
-	ti->prop |= child        ? MU_MSG_ITER_THREAD_PROP_FIRST_CHILD  : 0;
-	ti->prop |= empty_parent ? MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT : 0;
-	ti->prop |= is_dup       ? MU_MSG_ITER_THREAD_PROP_DUP          : 0;
-	ti->prop |= has_child    ? MU_MSG_ITER_THREAD_PROP_HAS_CHILD    : 0;
-
-	return ti;
-}
-
-static void
-thread_info_destroy (MuMsgIterThreadInfo *ti)
-{
-	if (ti) {
-		g_free (ti->threadpath);
-		g_slice_free (MuMsgIterThreadInfo, ti);
-	}
+	return u == 0 ? 0 : u - 1;
 }
 
 
 struct _ThreadInfo {
-	GHashTable		*hash;
-	const char*		 format;
+	MuContainerThreadInfo	*tinfo;
+	size_t			 size;	 /* allocated size of the arrays */
+	unsigned		 digits; /* per path segment */
+	GString			*pathstr;
 };
 typedef struct _ThreadInfo	 ThreadInfo;
 
 
 static void
-add_to_thread_info_hash (GHashTable *thread_info_hash, MuContainer *c,
-			 char *threadpath)
-{
-	gboolean is_root, first_child, empty_parent, is_dup, has_child;
+add_to_thread_info (ThreadInfo *ti, MuContainer *c, guint level)
+{
+	MuMsgIterThreadInfo *info;
+	MuContainerThreadInfo *tinfo;
+	gboolean is_root;
+
+	tinfo = ti->tinfo;
+	if (tinfo->len == ti->size) {
+		ti->size      *= 2;
+		tinfo->docids  = g_renew (guint, tinfo->docids, ti->size);
+		tinfo->infos   = g_renew (MuMsgIterThreadInfo, tinfo->infos,
+					  ti->size);
+	}
+
+	tinfo->docids[tinfo->len] = c->docid;
+	info = &tinfo->infos[tinfo->len++];
+
+	info->threadpath = g_string_chunk_insert_len (tinfo->paths,
+						      ti->pathstr->str,
+						      ti->pathstr->len);
+	info->level	 = level;
 
 	/* 'root' means we're a child of the dummy root-container */
 	is_root = (c->parent == NULL);
 
-	first_child  = is_root ? FALSE : (c->parent->child == c);
-	empty_parent = is_root ? FALSE : (!c->parent->msg);
-	is_dup	     = c->flags & MU_CONTAINER_FLAG_DUP;
-	has_child    = c->child ? TRUE : FALSE;
-
-	g_hash_table_insert (thread_info_hash,
-			     GUINT_TO_POINTER(c->docid),
-			     thread_info_new (threadpath,
-					      is_root,
-					      first_child,
-					      empty_parent,
-					      has_child,
-					      is_dup));
+	info->prop  = 0;
+	if (is_root)
+		info->prop |= MU_MSG_ITER_THREAD_PROP_ROOT;
+	else {
+		if (c->parent->child == c)
+			info->prop |= MU_MSG_ITER_THREAD_PROP_FIRST_CHILD;
+		if (c->parent->docid == 0)
+			info->prop |= MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT;
+	}
+	if (c->flags & MU_CONTAINER_FLAG_DUP)
+		info->prop |= MU_MSG_ITER_THREAD_PROP_DUP;
+	if (c->child)
+		info->prop |= MU_MSG_ITER_THREAD_PROP_HAS_CHILD;
 }
 
-/* device a format string that is the minimum size to fit up to
- * matchnum matches -- returns static memory */
-static const char*
-thread_segment_format_string (size_t matchnum)
+/* get the number of digits needed in a hex-representation of
+ * matchnum; this is the minimum size for the path segments */
+static unsigned
+thread_segment_digits (size_t matchnum)
 {
-	unsigned digitnum;
-	static char frmt[16];
-
-	/* get the number of digits needed in a hex-representation of
-	 * matchnum */
-	digitnum = (unsigned) (ceil (log(matchnum)/log(16)));
-	snprintf (frmt, sizeof(frmt),"%%0%ux", digitnum);
-
-	return frmt;
+	return (unsigned) (ceil (log(matchnum)/log(16)));
 }
 
 static gboolean
 add_thread_info (MuContainer *c, ThreadInfo *ti, Path *path)
 {
-	gchar *pathstr;
+	guint level;
 
-	pathstr = path_to_string (path, ti->format);
-	add_to_thread_info_hash (ti->hash, c, pathstr);
+	/* containers without a message still take up their place in
+	 * the paths, but they don't get thread info themselves */
+	level = path_to_string (path, ti->digits, ti->pathstr);
+	if (c->docid != 0)
+		add_to_thread_info (ti, c, level);
 
 	return TRUE;
 }
 
 
-GHashTable*
-mu_container_thread_info_hash_new (MuContainer *root_set, size_t matchnum)
+MuContainerThreadInfo*
+mu_container_thread_info_new (MuContainer *root_set, size_t matchnum)
 {
 	ThreadInfo ti;
 
-	g_return_val_if_fail (root_set, NULL);
 	g_return_val_if_fail (matchnum > 0, NULL);
 
-	/* create hash docid => thread-info */
-	ti.hash = g_hash_table_new_full (g_direct_hash, g_direct_equal,
-					 NULL,
-					 (GDestroyNotify)thread_info_destroy);
+	ti.size		 = MAX (matchnum, 16);
+	ti.tinfo	 = g_slice_new0 (MuContainerThreadInfo);
+	ti.tinfo->docids = g_new (guint, ti.size);
+	ti.tinfo->infos  = g_new (MuMsgIterThreadInfo, ti.size);
+	ti.tinfo->paths  = g_string_chunk_new (4096);
 
-	ti.format     = thread_segment_format_string (matchnum);
+	ti.digits  = thread_segment_digits (matchnum);
+	ti.pathstr = g_string_sized_new (64);
 
+	/* we walk the containers in thread order, so that's the
+	 * order in which we get them */
 	mu_container_path_foreach (root_set,
 				(MuContainerPathForeachFunc)add_thread_info,
 				&ti);
 
-	return ti.hash;
+	g_string_free (ti.pathstr, TRUE);
+
+	return ti.tinfo;
+}
+
+
+void
+mu_container_thread_info_destroy (MuContainerThreadInfo *tinfo)
+{
+	if (!tinfo)
+		return;
+
+	g_free (tinfo->docids);
+	g_free (tinfo->infos);
+	g_string_chunk_free (tinfo->paths);
+
+	g_slice_free (MuContainerThreadInfo, tinfo);
 }
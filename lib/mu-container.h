@@ -22,12 +22,16 @@
 
 #include <glib.h>
 #include <mu-msg.h>
+#include <mu-msg-iter.h>
+
+G_BEGIN_DECLS
 
 enum _MuContainerFlag {
 	MU_CONTAINER_FLAG_NONE    = 0,
 	MU_CONTAINER_FLAG_DELETE  = 1 << 0,
 	MU_CONTAINER_FLAG_SPLICE  = 1 << 1,
-	MU_CONTAINER_FLAG_DUP     = 1 << 2
+	MU_CONTAINER_FLAG_DUP     = 1 << 2,
+	MU_CONTAINER_FLAG_REPLY   = 1 << 3  /* subject had a Re: etc. */
 };
 
 typedef guint8 MuContainerFlag;
@@ -35,36 +39,67 @@ typedef guint8 MuContainerFlag;
 /*
  * MuContainer data structure, as seen in JWZs document:
  *     http://www.jwz.org/doc/threading.html
+ *
+ * a container without a message has docid 0. When sorting, we don't
+ * look at the messages, but at the sort key, which is computed once
+ * for each message: sortnum for numeric fields (such as the date),
+ * and sortstr for string fields; the latter is a collation key (see
+ * g_utf8_collate_key), so it can be compared with strcmp.
+ *
+ * subject and date are only set when grouping threads by subject;
+ * the subject is normalized (see mu_str_subject_normalize) and
+ * interned, so equal subjects are equal pointers.
  */
 struct _MuContainer {
 	struct _MuContainer *parent, *child, *next;
 	MuContainerFlag flags;
-	MuMsg *msg;
 	guint docid;
 	const char* msgid;
+	gint64 sortnum;
+	const char* sortstr;
+	const char* subject;
+	gint64 date;
 };
 typedef struct _MuContainer MuContainer;
 
 
+/*
+ * containers are allocated from an arena, ie. in big blocks, rather
+ * than one-by-one; they are all freed together when the arena is
+ * destroyed
+ */
+struct _MuContainerArena;
+typedef struct _MuContainerArena MuContainerArena;
+
 /**
- * create a new Container object
+ * create a new arena for allocating containers
  *
- * @param msg a MuMsg, or NULL; when it's NULL, docid should be 0
- * @param docid a Xapian docid, or 0
- * @param msgid a message id, or NULL
+ * @param sizehint the expected number of containers, or 0
  *
- * @return a new Container instance, or NULL in case of error; free
- * with mu_container_destroy
+ * @return a new arena; free with mu_container_arena_destroy
  */
-MuContainer* mu_container_new (MuMsg *msg, guint docid, const char* msgid);
+MuContainerArena* mu_container_arena_new (size_t sizehint);
 
+/**
+ * free an arena, and all the containers allocated from it
+ *
+ * @param arena an arena, or NULL
+ */
+void mu_container_arena_destroy (MuContainerArena *arena);
 
 /**
- * free a Container object
+ * allocate a new container from the arena
+ *
+ * @param arena an arena
+ * @param docid a Xapian docid, or 0 for a container without a message
+ * @param msgid a message id, or NULL; this string is not copied, so
+ * it must live at least as long as the container
  *
- * @param c a Container object, or NULL
+ * @return a new container (with an empty sort key); it's freed with
+ * the arena
  */
-void       mu_container_destroy (MuContainer *c);
+MuContainer* mu_container_arena_alloc (MuContainerArena *arena, guint docid,
+				       const char* msgid);
 
 
 
@@ -141,6 +176,19 @@ gboolean   mu_container_foreach (MuContainer *c,
 				 MuContainerForeachFunc func,
 				 gpointer user_data);
 
+/**
+ * call a function for each container in the arena, in the order in
+ * which they were allocated, until all containers have been visited
+ * or the callback function returns FALSE
+ *
+ * @param arena an arena
+ * @param func a function to call for each container
+ * @param user_data a pointer to pass to the callback function
+ */
+void mu_container_arena_foreach (MuContainerArena *arena,
+				 MuContainerForeachFunc func,
+				 gpointer user_data);
+
 /**
  * check wither container needle is a child or sibling (recursively)
  * of container haystack
@@ -167,11 +215,13 @@ typedef int (*MuContainerCmpFunc) (MuContainer *c1, MuContainer *c2,
 
 /**
  * sort the tree of MuContainers, recursively; ie. each of the list of
- * siblings (children) will be sorted according to @func; if the
- * container is empty, the first non-empty 'leftmost' child is used.
+ * siblings (children) will be sorted according to their sort keys; if
+ * the container is empty, the first non-empty 'leftmost' child is
+ * used. The sort is stable.
  *
  * @param c a container
- * @param mfid the field to sort by
+ * @param mfid the field to sort by; for numeric fields, we use the
+ * sortnum keys, and the sortstr keys otherwise
  * @param revert if TRUE, revert the sorting order *
  * @param user_data a user pointer to pass to the sorting function
  *
@@ -182,16 +232,55 @@ MuContainer* mu_container_sort (MuContainer *c, MuMsgFieldId mfid, gboolean reve
 
 
 /**
- * create a hashtable with maps document-ids to information about them,
- * ie. Xapian docid => MuMsgIterThreadInfo
+ * like mu_container_sort, but only sort the list of siblings, not
+ * their children (except for containers without a message, which are
+ * sorted by their first child). The resulting order is the same as the
+ * order of the siblings after mu_container_sort
  *
- * @param root_set the containers @param matchnum the number of
- * matches in the list (this is needed to determine the shortest
- * possible collation keys ('threadpaths') for the messages
+ * @param c a container
+ * @param mfid the field to sort by
+ * @param revert if TRUE, revert the sorting order
+ * @param user_data a user pointer to pass to the sorting function
+ *
+ * @return the sorted list of siblings
+ */
+MuContainer* mu_container_sort_siblings (MuContainer *c, MuMsgFieldId mfid,
+					 gboolean revert, gpointer user_data);
+
+
+/*
+ * the thread information for a set of containers: the docids of the
+ * messages in thread order, and the MuMsgIterThreadInfo for each of
+ * them (infos[i] is the info for docids[i])
+ */
+struct _MuContainerThreadInfo {
+	guint			 len;
+	guint			*docids;
+	MuMsgIterThreadInfo	*infos;
+	GStringChunk		*paths; /* the storage for the threadpaths */
+};
+typedef struct _MuContainerThreadInfo MuContainerThreadInfo;
+
+/**
+ * get the thread information for a set of containers
  *
- * @return a hash; free with g_hash_table_destroy
+ * @param root_set the containers, or NULL
+ * @param matchnum the number of matches in the list (this is needed
+ * to determine the shortest possible collation keys ('threadpaths')
+ * for the messages
+ *
+ * @return the thread info; free with mu_container_thread_info_destroy
  */
-GHashTable* mu_container_thread_info_hash_new (MuContainer *root_set,
-					       size_t matchnum);
+MuContainerThreadInfo* mu_container_thread_info_new (MuContainer *root_set,
+						     size_t matchnum);
+
+/**
+ * free the thread info
+ *
+ * @param tinfo thread info, or NULL
+ */
+void mu_container_thread_info_destroy (MuContainerThreadInfo *tinfo);
+
+G_END_DECLS
 
 #endif /*__MU_CONTAINER_H__*/
@@ -218,6 +218,24 @@ mu_date_interpret (const char *datespec, gboolean is_begin)
 }
 
 
+/* days since 1970-01-01 for a date in the (proleptic) gregorian
+ * calendar; m is 1..12, d is 1..31 */
+static long
+days_from_civil (long y, unsigned m, unsigned d)
+{
+	long era;
+	unsigned yoe, doy, doe;
+
+	y  -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned)(y - era * 400);
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + (long)doe - 719468;
+}
+
+
 time_t
 mu_date_str_to_time_t (const char* date, gboolean local)
 {
@@ -240,6 +258,16 @@ mu_date_str_to_time_t (const char* date, gboolean local)
 	tm.tm_year  = atoi (mydate) - 1900;
 	tm.tm_isdst = -1; /* figure out the dst */
 
+	/* for UTC, we don't need mktime (and switching the timezone
+	 * for each call); this matters when converting many dates,
+	 * e.g. when sorting */
+	if (!local && tm.tm_mon >= 0 && tm.tm_mon < 12 &&
+	    tm.tm_mday >= 1 && tm.tm_mday <= 31)
+		return (time_t)days_from_civil (tm.tm_year + 1900,
+						tm.tm_mon + 1,
+						tm.tm_mday) * 24 * 3600 +
+			tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+
 	if (!local) { /* temporarily switch to UTC */
 		tz = getenv ("TZ");
 		setenv ("TZ", "", 1);
@@ -317,6 +317,7 @@ mu_index_run (MuIndex *index, const char* path,
 {
 	MuIndexCallbackData cb_data;
 	MuError rv;
+	GError *err;
 
 	g_return_val_if_fail (index && index->_store, MU_ERROR);
 	g_return_val_if_fail (msg_cb, MU_ERROR);
@@ -333,12 +334,23 @@ mu_index_run (MuIndex *index, const char* path,
 		      index->_max_filesize, stats,
 		      msg_cb, dir_cb, user_data);
 
+	/* needs_index checks every message we find; for that, it's
+	 * much faster to have all the ids in memory. If that fails,
+	 * we can still ask the database for each of them. */
+	err = NULL;
+	if (!reindex && !mu_store_load_uid_filter (index->_store, &err)) {
+		g_warning ("failed to load uid filter: %s",
+			   err ? err->message : "something went wrong");
+		g_clear_error (&err);
+	}
+
 	rv = mu_maildir_walk (path,
 			      (MuMaildirWalkMsgCallback)on_run_maildir_msg,
 			      (MuMaildirWalkDirCallback)on_run_maildir_dir,
 			      reindex, /* re-index, ie. do a full update */
 			      &cb_data);
 
+	mu_store_unload_uid_filter (index->_store);
 	mu_store_flush (index->_store);
 
 	return rv;
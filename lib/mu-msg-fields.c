@@ -238,6 +238,14 @@ static const MuMsgField FIELD_DATA[] = {
 		FLAG_XAPIAN_ESCAPE
 	},
 
+	{
+		MU_MSG_FIELD_ID_THREAD_ID,
+		MU_MSG_FIELD_TYPE_STRING,
+		"thread", 'w', 'W',
+		FLAG_GMIME | FLAG_XAPIAN_TERM | FLAG_XAPIAN_VALUE |
+		FLAG_XAPIAN_PREFIX_ONLY
+	},
+
 	{	/* special, internal field, to get a unique key */
 		MU_MSG_FIELD_ID_UID,
 		MU_MSG_FIELD_TYPE_STRING,
@@ -55,6 +55,10 @@ enum _MuMsgFieldId {
 	MU_MSG_FIELD_ID_PRIO,
 	MU_MSG_FIELD_ID_SIZE,
 
+	/* an id for the thread a message belongs to; derived from the
+	 * first reference (or, if there is none, the message-id) */
+	MU_MSG_FIELD_ID_THREAD_ID,
+
 	MU_MSG_FIELD_ID_NUM
 };
 typedef guint8 MuMsgFieldId;
@@ -557,6 +557,45 @@ maybe_cleanup (const char* str, const char *path, gboolean *do_free)
 }
 
 
+/* the thread-id is a hash of the message-id of the first message
+ * in the thread, as far as we know it: the first of the references,
+ * or the message's own message-id. This way, messages in a thread get
+ * the same id without us having to look at other messages. We use a
+ * hash, so it's short and can be used as a xapian term as-is.
+ *
+ * note that this is an approximation of the threads mu-threader
+ * finds: when a message's references don't go back all the way to
+ * the first message (e.g., because the sender's client trimmed them,
+ * or there's only an In-reply-to:), or when a message has no
+ * references at all, though it's part of a thread (e.g., by subject),
+ * it gets a thread-id of its own. We can't do better at indexing
+ * time, as the messages in between may not be indexed (yet). */
+static char*
+get_thread_id (MuMsgFile *self)
+{
+	GSList *refs;
+	const char *root;
+	char *thread_id;
+	guint64 hash;
+
+	refs = get_references (self);
+	if (refs)
+		root = (const char*)refs->data;
+	else if (!(root = g_mime_message_get_message_id (self->_mime_msg)))
+		root = self->_path; /* fake it */
+
+	/* 64-bit FNV-1a */
+	for (hash = G_GUINT64_CONSTANT(14695981039346656037); *root; ++root)
+		hash = (hash ^ (guchar)*root) *
+			G_GUINT64_CONSTANT(1099511628211);
+
+	thread_id = g_strdup_printf ("%016" G_GINT64_MODIFIER "x", hash);
+	mu_str_free_list (refs);
+
+	return thread_id;
+}
+
+
 G_GNUC_CONST static GMimeRecipientType
 recipient_type (MuMsgFieldId mfid)
 {
@@ -602,6 +641,9 @@ mu_msg_file_get_str_field (MuMsgFile *self, MuMsgFieldId mfid,
 
 	case MU_MSG_FIELD_ID_MAILDIR: return self->_maildir;
 
+	case MU_MSG_FIELD_ID_THREAD_ID: *do_free = TRUE;
+		return get_thread_id (self);
+
 	case MU_MSG_FIELD_ID_BODY_TEXT:
 	case MU_MSG_FIELD_ID_BODY_HTML:
 	case MU_MSG_FIELD_ID_EMBEDDED_TEXT:
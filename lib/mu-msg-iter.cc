@@ -25,74 +25,220 @@
 #include <algorithm>
 #include <xapian.h>
 #include <string>
+#include <map>
+#include <vector>
 
 #include "mu-util.h"
 #include "mu-msg.h"
+#include "mu-flags.h"
 #include "mu-msg-iter.h"
 #include "mu-threader.h"
+#include "mu-date.h"
+
+/*
+ * when not threading, we don't retrieve all matches at once, but page
+ * through them in windows; the first window is small, so we can
+ * start producing results quickly.
+ *
+ * note that xapian runs the whole match again for every window, and
+ * keeps offset + size candidates while doing so; so, each window is
+ * WINDOW_GROWTH times the size of the previous one. That way, going
+ * through N matches takes about log(N/MIN_WINDOW_SIZE) matches in
+ * total, rather than a number of matches that grows with N; and at
+ * the end, we use about as much memory as getting all N at once.
+ *
+ * if the database is modified while we're paging, we reopen it and
+ * get the window again; other errors end the iteration, see
+ * mu_msg_iter_failed.
+ */
+#define MIN_WINDOW_SIZE 256
+#define WINDOW_GROWTH	4
+
+/* we prefetch the documents for this many matches ahead of the
+ * cursor; this seems to make search slightly faster, some
+ * non-scientific testing suggests. 5-10% or so */
+#define PREFETCH_SIZE 128
+
+/* a match in thread order: its rank in the mset, and its thread
+ * info */
+struct ThreadedMatch {
+	Xapian::doccount		 rank;
+	const MuMsgIterThreadInfo	*ti;
+};
+typedef std::vector<ThreadedMatch> ThreadedMatches;
+
+/* thrown when the iter is cancelled while it's being constructed */
+struct MuMsgIterCancelled {};
+
 
-/* just a guess... */
-#define MAX_FETCH_SIZE 10000
+typedef std::map<std::string, MuMsgIterConvInfo> ConvInfoMap;
 
-class ThreadKeyMaker: public Xapian::KeyMaker {
+/* count the messages for the conversations we're interested in */
+class ConvCountSpy: public Xapian::MatchSpy {
 public:
-	ThreadKeyMaker (GHashTable *threadinfo): _threadinfo(threadinfo) {}
-	virtual std::string operator()(const Xapian::Document &doc) const  {
-		MuMsgIterThreadInfo *ti;
-		ti = (MuMsgIterThreadInfo*)g_hash_table_lookup
-			(_threadinfo,
-			 GUINT_TO_POINTER(doc.get_docid()));
-		return std::string (ti && ti->threadpath ? ti->threadpath : "");
+	ConvCountSpy (ConvInfoMap& convs): _convs(convs) {}
+	virtual void operator()(const Xapian::Document &doc,
+				Xapian::weight wt) {
+
+		ConvInfoMap::iterator it;
+		std::string flagstr;
+		MuFlags flags;
+
+		it = _convs.find (doc.get_value (MU_MSG_FIELD_ID_THREAD_ID));
+		if (it == _convs.end())
+			return;
+
+		++it->second.msgnum;
+
+		flagstr = doc.get_value (MU_MSG_FIELD_ID_FLAGS);
+		flags	= flagstr.empty() ? MU_FLAG_NONE :
+			(MuFlags)Xapian::sortable_unserialise (flagstr);
+		if ((flags & MU_FLAG_NEW) || !(flags & MU_FLAG_SEEN))
+			++it->second.unreadnum;
 	}
 private:
-	GHashTable *_threadinfo;
+	ConvInfoMap& _convs;
 };
 
 
 struct _MuMsgIter {
 public:
-	_MuMsgIter (Xapian::Enquire &enq, size_t maxnum,
-		    gboolean threads, MuMsgFieldId sortfield, bool revert):
-		   _enq(enq), _thread_hash (0), _msg(0) {
+	_MuMsgIter (Xapian::Enquire &enq, Xapian::Database &db,
+		    size_t matchnum, size_t maxnum,
+		    MuMsgFieldId sortfield, MuThreadCache *tcache,
+		    volatile gint *cancelled, MuMsgIterFlags flags):
+		_enq(enq), _db(db), _maxnum(std::min(matchnum, maxnum)),
+		_offset(0), _pos(0), _window(MIN_WINDOW_SIZE), _more(false),
+		_failed(false), _cancelled(cancelled), _tinfo (0), _msg(0) {
+
+		bool threads, revert;
+
+		threads = flags & MU_MSG_ITER_FLAG_THREADS;
+		revert	= flags & MU_MSG_ITER_FLAG_DESCENDING;
+
+		if (flags & MU_MSG_ITER_FLAG_CONVERSATIONS) {
+			/* one match per thread; we get them all at
+			 * once, as we need to count them */
+			_window	 = _maxnum;
+			_enq.set_collapse_key (MU_MSG_FIELD_ID_THREAD_ID);
+			_matches = _enq.get_mset (0, _maxnum);
+			_matches.fetch ();
+			if (cancelled ())
+				throw MuMsgIterCancelled ();
+			count_conversations ();
+			_cursor = _matches.begin();
+			prefetch ();
+
+		} else if (threads) {
+			/* for threading, we need all the matches at once */
+			_maxnum	 = _window = matchnum;
+			_matches = _enq.get_mset (0, matchnum);
+
+			if (!_matches.empty()) {
+				/* with a thread cache, we may not need
+				 * to look at most of the documents */
+				if (!tcache)
+					_matches.fetch();
+				_tinfo = mu_threader_calculate
+					(this, tcache, _matches.size(), maxnum,
+					 sortfield, revert ? TRUE: FALSE,
+					 (flags & MU_MSG_ITER_FLAG_GROUP_SUBJECTS) ?
+					 TRUE : FALSE);
+				if (!_tinfo)
+					throw MuMsgIterCancelled ();
+				order_threaded_matches ();
+			}
+			_pos = 0;
+			set_threaded_cursor ();
+		} else
+			fetch_window (0);
+	}
+
+	~_MuMsgIter () {
+		mu_container_thread_info_destroy (_tinfo);
+
+		set_msg (NULL);
+	}
+
+	const Xapian::Enquire& enquire() const { return _enq; }
+
+	Xapian::MSet::const_iterator cursor () const { return _cursor; }
 
-		_matches = _enq.get_mset (0, maxnum);
+	bool is_done () const {
+		return _cursor == _matches.end() || cancelled () || _failed;
+	}
 
-		if (threads && !_matches.empty()) {
+	/* end the iteration because of some error */
+	void fail (const std::string& errmsg) {
+		_failed = true;
+		_errmsg = errmsg;
+	}
 
-			_matches.fetch();
-			_thread_hash = mu_threader_calculate
-				(this, _matches.size(), sortfield,
-				 revert ? TRUE: FALSE);
+	bool failed () const { return _failed; }
+	const std::string& errmsg () const { return _errmsg; }
 
-			ThreadKeyMaker keymaker(_thread_hash);
+	bool cancelled () const {
+		return _cancelled && g_atomic_int_get (_cancelled);
+	}
 
-			enq.set_sort_by_key (&keymaker, false);
-			_matches = _enq.get_mset (0, maxnum);
+	void cursor_next () {
+		if (_tinfo) {
+			++_pos;
+			set_threaded_cursor ();
+			return;
 		}
 
-		_cursor	 = _matches.begin();
+		++_cursor;
+		if (_cursor == _matches.end()) {
+			if (_more && !cancelled ()) /* get the next window, if any */
+				fetch_window (_offset + _matches.size());
+		} else if (++_pos % PREFETCH_SIZE == 0)
+			prefetch ();
+	}
 
-		/* this seems to make search slightly faster, some
-		 * non-scientific testing suggests. 5-10% or so */
-		if (_matches.size() <= MAX_FETCH_SIZE)
-			_matches.fetch ();
+	void reset () {
+		if (_tinfo) {
+			_pos = 0;
+			set_threaded_cursor ();
+		} else if (_offset != 0) /* we moved past the first window */
+			fetch_window (0);
+		else {
+			_cursor = _matches.begin();
+			_pos	= 0;
+			prefetch ();
+		}
 	}
 
-	~_MuMsgIter () {
-		if (_thread_hash)
-			g_hash_table_destroy (_thread_hash);
+	bool threaded () const { return _tinfo != NULL; }
 
-		set_msg (NULL);
+	const MuMsgIterThreadInfo* thread_info () const {
+		return _pos < _threaded.size() ? _threaded[_pos].ti : NULL;
 	}
 
-	const Xapian::Enquire& enquire() const { return _enq; }
-	Xapian::MSet& matches() { return _matches; }
+	const MuMsgIterConvInfo* conv_info () const {
+		ConvInfoMap::const_iterator it;
+		it = _convs.find (_cursor.get_document().get_value
+				  (MU_MSG_FIELD_ID_THREAD_ID));
+		return it == _convs.end() ? NULL : &it->second;
+	}
 
-	Xapian::MSet::const_iterator cursor () const { return _cursor; }
-	void set_cursor (Xapian::MSetIterator cur) { _cursor = cur; }
-	void cursor_next () { ++_cursor; }
+	const char* field_str (MuMsgFieldId mfid) {
+		_values[mfid] = _cursor.get_document().get_value(mfid);
+		return _values[mfid].empty() ? NULL : _values[mfid].c_str();
+	}
 
-	GHashTable *thread_hash () { return _thread_hash; }
+	gint64 field_numeric (MuMsgFieldId mfid) {
+		const std::string s (_cursor.get_document().get_value(mfid));
+		if (s.empty())
+			return 0;
+		/* dates are stored as strings */
+		else if (mfid == MU_MSG_FIELD_ID_DATE)
+			return static_cast<gint64>
+				(mu_date_str_to_time_t (s.c_str(), FALSE/*utc*/));
+		else
+			return static_cast<gint64>
+				(Xapian::sortable_unserialise(s));
+	}
 
 	MuMsg *msg() { return _msg; }
 	MuMsg *set_msg (MuMsg *msg) {
@@ -102,31 +248,176 @@ public:
 	}
 
 private:
-	const Xapian::Enquire		_enq;
+	/* the threader gives us the docids in thread order (only for
+	 * the threads that will be shown); find the matches for them
+	 * in the mset we already have, so we don't need to run the
+	 * query again */
+	void order_threaded_matches () {
+
+		typedef std::pair<Xapian::docid, Xapian::doccount> DocRank;
+		std::vector<DocRank> ranks;
+		std::vector<DocRank>::const_iterator r;
+		Xapian::MSet::const_iterator it;
+		guint u;
+
+		ranks.reserve (_matches.size());
+		for (it = _matches.begin(); it != _matches.end(); ++it)
+			ranks.push_back (DocRank (*it, it.get_rank()));
+		std::sort (ranks.begin(), ranks.end());
+
+		_threaded.reserve (_tinfo->len);
+		for (u = 0; u != _tinfo->len; ++u) {
+			ThreadedMatch tm;
+			r = std::lower_bound (ranks.begin(), ranks.end(),
+					      DocRank (_tinfo->docids[u], 0));
+			if (r == ranks.end() || r->first != _tinfo->docids[u])
+				continue;
+			tm.rank = r->second;
+			tm.ti	= &_tinfo->infos[u];
+			_threaded.push_back (tm);
+		}
+	}
+
+	void set_threaded_cursor () {
+		if (_pos < _threaded.size())
+			_cursor = _matches[_threaded[_pos].rank];
+		else
+			_cursor = _matches.end();
+	}
+
+	/* count the matching (and unread) messages for each of the
+	 * conversations we got, by running the query again,
+	 * restricted to those conversations. So, this only looks at
+	 * the messages in the conversations we're showing */
+	void count_conversations () {
+
+		Xapian::MSet::const_iterator it;
+		std::vector<Xapian::Query> threads;
+		const Xapian::Query query (_enq.get_query());
+		const std::string pfx
+			(1, mu_msg_field_xapian_prefix
+			 (MU_MSG_FIELD_ID_THREAD_ID));
+		ConvCountSpy spy (_convs);
+
+		for (it = _matches.begin(); it != _matches.end(); ++it) {
+			MuMsgIterConvInfo info = { 0, 0 };
+			const std::string id (it.get_document().get_value
+					      (MU_MSG_FIELD_ID_THREAD_ID));
+			if (id.empty())
+				continue;
+			_convs[id] = info;
+			threads.push_back (Xapian::Query(pfx + id));
+		}
+
+		if (threads.empty())
+			return;
+
+		_enq.set_collapse_key (Xapian::BAD_VALUENO);
+		_enq.set_query (Xapian::Query
+				(Xapian::Query::OP_FILTER, query,
+				 Xapian::Query (Xapian::Query::OP_OR,
+						threads.begin(),
+						threads.end())));
+		_enq.add_matchspy (&spy);
+
+		/* we don't need the matches, but the spy needs to see
+		 * all of them; xapian limits checkatleast to the
+		 * number of documents */
+		_enq.get_mset (0, 0, G_MAXUINT);
+
+		/* restore our enquire */
+		_enq.clear_matchspies ();
+		_enq.set_query (query);
+		_enq.set_collapse_key (MU_MSG_FIELD_ID_THREAD_ID);
+	}
+
+	/* get the matches starting at offset, and grow the window
+	 * for the next time */
+	void fetch_window (size_t offset) {
+
+		size_t num;
+
+		num	 = std::min (_window, _maxnum - offset);
+		try {
+			_matches = _enq.get_mset (offset, num);
+
+		} catch (const Xapian::DatabaseModifiedError&) {
+			/* as in mu_query_run; the enquire shares the
+			 * database with _db, so it sees the new one */
+			_db.reopen ();
+			MU_WRITE_LOG ("reopening db after modification");
+			_matches = _enq.get_mset (offset, num);
+		}
+		_offset  = offset;
+		_cursor  = _matches.begin();
+		_pos	 = 0;
+
+		/* if we got less than we asked for, there's nothing
+		 * more to get */
+		_more    = _matches.size() == num && offset + num < _maxnum;
+		_window  = std::min (_window * WINDOW_GROWTH, _maxnum);
+
+		prefetch ();
+	}
+
+	void prefetch () {
+		Xapian::MSet::const_iterator end (_cursor);
+		for (unsigned u = 0; u != PREFETCH_SIZE &&
+			     end != _matches.end(); ++u)
+			++end;
+		_matches.fetch (_cursor, end);
+	}
+
+	Xapian::Enquire			_enq;
+	Xapian::Database		_db;
 	Xapian::MSet			_matches;
 	Xapian::MSet::const_iterator	_cursor;
 
-	GHashTable      *_thread_hash;
-	MuMsg		*_msg;
+	size_t		_maxnum;	/* the maximum number of matches */
+	size_t		_offset;	/* offset of the current window */
+	size_t		_pos;		/* cursor position in the window,
+					 * or in thread order */
+	size_t		_window;	/* size of the next window */
+	bool		_more;		/* are there more windows? */
+	bool		_failed;	/* did getting a window fail? */
+	std::string	_errmsg;	/* ... and if so, why */
+	volatile gint  *_cancelled;	/* cancellation flag, or NULL */
+
+	MuContainerThreadInfo	*_tinfo;
+	ThreadedMatches		 _threaded;
+	ConvInfoMap		 _convs;
+	MuMsg			*_msg;
+	std::string		 _values[MU_MSG_FIELD_ID_NUM];
 };
 
 
 
 MuMsgIter*
-mu_msg_iter_new (XapianEnquire *enq, size_t maxnum,
-		 gboolean threads, MuMsgFieldId sortfield, gboolean revert,
-		 GError **err)
+mu_msg_iter_new (XapianEnquire *enq, XapianDatabase *db,
+		 size_t matchnum, size_t maxnum,
+		 MuMsgFieldId sortfield, MuThreadCache *tcache,
+		 volatile gint *cancelled, MuMsgIterFlags flags, GError **err)
 {
 	g_return_val_if_fail (enq, NULL);
+	g_return_val_if_fail (db, NULL);
 	/* sortfield should be set to .._NONE when we're not threading */
-	g_return_val_if_fail (threads || sortfield == MU_MSG_FIELD_ID_NONE,
+	g_return_val_if_fail ((flags & MU_MSG_ITER_FLAG_THREADS) ||
+			      sortfield == MU_MSG_FIELD_ID_NONE,
 			      NULL);
 	g_return_val_if_fail (mu_msg_field_id_is_valid (sortfield) ||
 			      sortfield == MU_MSG_FIELD_ID_NONE,
 			      FALSE);
 	try {
-		return new MuMsgIter ((Xapian::Enquire&)*enq, maxnum, threads,
-				      sortfield, revert ? true : false);
+		return new MuMsgIter ((Xapian::Enquire&)*enq,
+				      (Xapian::Database&)*db, matchnum,
+				      maxnum, sortfield, tcache, cancelled,
+				      flags);
+
+	} catch (const MuMsgIterCancelled &cex) {
+
+		mu_util_g_set_error (err, MU_ERROR_CANCELLED,
+				     "query was cancelled");
+		return 0;
 
 	} catch (const Xapian::DatabaseModifiedError &dbmex) {
 
@@ -175,7 +466,7 @@ mu_msg_iter_reset (MuMsgIter *iter)
 	iter->set_msg (NULL);
 
 	try {
-		iter->set_cursor(iter->matches().begin());
+		iter->reset ();
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN (FALSE);
 
@@ -195,9 +486,41 @@ mu_msg_iter_next (MuMsgIter *iter)
 
 	try {
 		iter->cursor_next();
-		return iter->cursor() == iter->matches().end() ? FALSE:TRUE;
+		return iter->is_done() ? FALSE:TRUE;
+
+	} catch (const Xapian::Error &xerr) {
+		/* we can't tell our caller here; see mu_msg_iter_failed */
+		iter->fail (xerr.get_msg());
+		return FALSE;
+
+	} catch (...) {
+		iter->fail ("caught exception");
+		return FALSE;
+	}
+}
+
+
+gboolean
+mu_msg_iter_is_cancelled (MuMsgIter *iter)
+{
+	g_return_val_if_fail (iter, TRUE);
 
-	} MU_XAPIAN_CATCH_BLOCK_RETURN(FALSE);
+	return iter->cancelled () ? TRUE : FALSE;
+}
+
+
+gboolean
+mu_msg_iter_failed (MuMsgIter *iter, GError **err)
+{
+	g_return_val_if_fail (iter, TRUE);
+
+	if (!iter->failed ())
+		return FALSE;
+
+	mu_util_g_set_error (err, MU_ERROR_XAPIAN,
+			     "failed to get the results: %s",
+			     iter->errmsg().c_str());
+	return TRUE;
 }
 
 
@@ -207,7 +530,7 @@ mu_msg_iter_is_done (MuMsgIter *iter)
 	g_return_val_if_fail (iter, TRUE);
 
 	try {
-		return iter->cursor() == iter->matches().end() ? TRUE : FALSE;
+		return iter->is_done() ? TRUE : FALSE;
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN (TRUE);
 }
@@ -221,7 +544,8 @@ mu_msg_iter_get_docid (MuMsgIter *iter)
 	g_return_val_if_fail (!mu_msg_iter_is_done(iter),
 			      (unsigned int)-1);
 	try {
-		return iter->cursor().get_document().get_docid();
+		/* no need to get the document for this */
+		return *iter->cursor();
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN (0);
 }
@@ -232,20 +556,49 @@ const MuMsgIterThreadInfo*
 mu_msg_iter_get_thread_info (MuMsgIter *iter)
 {
 	g_return_val_if_fail (!mu_msg_iter_is_done(iter), NULL);
-	g_return_val_if_fail (iter->thread_hash(), NULL);
+	g_return_val_if_fail (iter->threaded(), NULL);
+
+	return iter->thread_info ();
+}
+
+
+const char*
+mu_msg_iter_get_field_str (MuMsgIter *iter, MuMsgFieldId mfid)
+{
+	g_return_val_if_fail (!mu_msg_iter_is_done(iter), NULL);
+	g_return_val_if_fail (mu_msg_field_id_is_valid(mfid), NULL);
+	g_return_val_if_fail (mu_msg_field_xapian_value(mfid), NULL);
+	g_return_val_if_fail (!mu_msg_field_is_numeric(mfid), NULL);
 
 	try {
-		const MuMsgIterThreadInfo *ti;
-		unsigned int docid;
+		return iter->field_str (mfid);
 
-		docid = mu_msg_iter_get_docid (iter);
-		ti    = (const MuMsgIterThreadInfo*)g_hash_table_lookup
-			(iter->thread_hash(), GUINT_TO_POINTER(docid));
+	} MU_XAPIAN_CATCH_BLOCK_RETURN (NULL);
+}
 
-		if (!ti)
-			g_printerr ("no ti for %u\n", docid);
 
-		return ti;
+gint64
+mu_msg_iter_get_field_numeric (MuMsgIter *iter, MuMsgFieldId mfid)
+{
+	g_return_val_if_fail (!mu_msg_iter_is_done(iter), -1);
+	g_return_val_if_fail (mu_msg_field_id_is_valid(mfid), -1);
+	g_return_val_if_fail (mu_msg_field_xapian_value(mfid), -1);
+	g_return_val_if_fail (mu_msg_field_is_numeric(mfid), -1);
+
+	try {
+		return iter->field_numeric (mfid);
+
+	} MU_XAPIAN_CATCH_BLOCK_RETURN (-1);
+}
+
+
+const MuMsgIterConvInfo*
+mu_msg_iter_get_conv_info (MuMsgIter *iter)
+{
+	g_return_val_if_fail (!mu_msg_iter_is_done(iter), NULL);
+
+	try {
+		return iter->conv_info ();
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN (NULL);
 }
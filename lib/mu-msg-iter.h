@@ -22,6 +22,7 @@
 
 #include <glib.h>
 #include <mu-msg.h>
+#include <mu-thread-cache.h>
 
 G_BEGIN_DECLS
 
@@ -37,26 +38,56 @@ struct _MuMsgIter;
 typedef struct _MuMsgIter MuMsgIter;
 
 
+enum _MuMsgIterFlags {
+	MU_MSG_ITER_FLAG_NONE		 = 0,
+	/* calculate the message threads */
+	MU_MSG_ITER_FLAG_THREADS	 = 1 << 0,
+	/* revert the sorting order (for threads) */
+	MU_MSG_ITER_FLAG_DESCENDING	 = 1 << 1,
+	/* give only one message per thread, see
+	 * mu_msg_iter_get_conv_info */
+	MU_MSG_ITER_FLAG_CONVERSATIONS	 = 1 << 2,
+	/* when threading, also group threads by subject */
+	MU_MSG_ITER_FLAG_GROUP_SUBJECTS	 = 1 << 3
+};
+typedef guint8 MuMsgIterFlags;
+
 /**
  * create a new MuMsgIter -- basically, an iterator over the search
  * results
  *
  * @param enq a Xapian::Enquire* cast to XapianEnquire* (because this
  * is C, not C++),providing access to search results
- * @param batchsize how many results to retrieve at once
- * @param threads whether to calculate threads
- * @param sorting field when using threads; note, when 'threads' is
- * FALSE, this should be MU_MSG_FIELD_ID_NONE
- * @param if TRUE, revert the sorting order
+ * @param db the Xapian::Database* (cast to XapianDatabase*) that enq
+ * searches; it is reopened when it's modified while we're getting the
+ * next window of results
+ * @param matchnum the maximum number of matches to retrieve; when
+ * threading, all of these are used to determine the threads. When not
+ * threading, the results are retrieved in windows of growing size,
+ * rather than all at once
+ * @param maxnum the maximum number of results; when threading, the
+ * iter gives the complete threads for the first maxnum messages (so it
+ * may give somewhat more than maxnum messages)
+ * @param sorting field when using threads; note, when not threading,
+ * this should be MU_MSG_FIELD_ID_NONE
+ * @param tcache a thread cache to use when threading, or NULL
+ * @param cancelled a flag (read with g_atomic_int_get) that another
+ * thread can set to a non-zero value to cancel threading and
+ * iteration, or NULL
+ * @param flags flags for this iter (see MuMsgIterFlags)
  * @param err receives error information. if the error is MU_ERROR_XAPIAN_MODIFIED,
- * the database should be reloaded.
+ * the database should be reloaded; if it is MU_ERROR_CANCELLED, the
+ * iter was cancelled before it was ready.
  *
  * @return a new MuMsgIter, or NULL in case of error
  */
 MuMsgIter *mu_msg_iter_new (XapianEnquire *enq,
-			    size_t batchsize, gboolean threads,
+			    XapianDatabase *db,
+			    size_t matchnum, size_t maxnum,
 			    MuMsgFieldId threadsortfield,
-			    gboolean revert,
+			    MuThreadCache *tcache,
+			    volatile gint *cancelled,
+			    MuMsgIterFlags flags,
 			    GError **err) G_GNUC_WARN_UNUSED_RESULT;
 
 /**
@@ -85,12 +116,40 @@ gboolean mu_msg_iter_reset (MuMsgIter *iter);
  *
  * @param iter a valid MuMsgIter iterator
  *
- * @return TRUE if the iter points past end of the list, FALSE
- * otherwise
+ * @return TRUE if the iter points past end of the list (or if it was
+ * cancelled), FALSE otherwise
  */
 gboolean         mu_msg_iter_is_done (MuMsgIter *iter);
 
 
+/**
+ * was this iterator cancelled (see mu_msg_iter_new)? A cancelled
+ * iterator behaves as if it's at the end of the list.
+ *
+ * @param iter a valid MuMsgIter iterator
+ *
+ * @return TRUE if it was cancelled, FALSE otherwise
+ */
+gboolean         mu_msg_iter_is_cancelled (MuMsgIter *iter);
+
+
+/**
+ * did getting the results fail part-way? When not threading, the
+ * results are retrieved in windows (see mu_msg_iter_new); if getting
+ * one of the later ones fails, the iter behaves as if it's at the end
+ * of the list, and this function tells you why. Note, if the database
+ * was modified in the meantime, it is reopened and the window is
+ * retrieved again; in that case, the results are from the new
+ * database, and some may be missing, or appear twice.
+ *
+ * @param iter a valid MuMsgIter iterator
+ * @param err receives the error information, if any (or NULL)
+ *
+ * @return TRUE if there was an error, FALSE otherwise
+ */
+gboolean         mu_msg_iter_failed (MuMsgIter *iter, GError **err);
+
+
 /**
  * destroy the sequence of messages; ie. /all/ of them
  *
@@ -161,6 +220,52 @@ typedef struct _MuMsgIterThreadInfo MuMsgIterThreadInfo;
  */
 const MuMsgIterThreadInfo* mu_msg_iter_get_thread_info (MuMsgIter *iter);
 
+
+struct _MuMsgIterConvInfo {
+	guint msgnum;	 /* the number of matching messages in the
+			  * conversation (thread) */
+	guint unreadnum; /* the number of those that are unread */
+};
+typedef struct _MuMsgIterConvInfo MuMsgIterConvInfo;
+
+/**
+ * get the MuMsgIterConvInfo struct for this message; this only works
+ * when you created the mu-msg-iter with MU_MSG_ITER_FLAG_CONVERSATIONS;
+ * in that case, the iter gives one message for each conversation, ie.,
+ * the first one in the sort order
+ *
+ * @param iter a valid MuMsgIter iterator
+ *
+ * @return an info struct, or NULL if it's not available
+ */
+const MuMsgIterConvInfo* mu_msg_iter_get_conv_info (MuMsgIter *iter);
+
+/**
+ * get the value of some string field for the current message,
+ * straight from the database, ie. without creating a MuMsg. This only
+ * works for fields that are stored as values; for string-list fields
+ * (such as MU_MSG_FIELD_ID_REFS), you get a comma-separated list.
+ *
+ * @param iter a valid MuMsgIter iterator
+ * @param mfid the field id
+ *
+ * @return the value, or NULL if there is none; the string is valid
+ * until the next call to this function for the same field
+ */
+const char* mu_msg_iter_get_field_str (MuMsgIter *iter, MuMsgFieldId mfid);
+
+/**
+ * get the value of some numeric field for the current message,
+ * straight from the database, ie. without creating a MuMsg. This only
+ * works for fields that are stored as values.
+ *
+ * @param iter a valid MuMsgIter iterator
+ * @param mfid the field id
+ *
+ * @return the value (0 if there is none), or -1 in case of error
+ */
+gint64 mu_msg_iter_get_field_numeric (MuMsgIter *iter, MuMsgFieldId mfid);
+
 /* FIXME */
 const char* mu_msg_iter_get_path (MuMsgIter *iter);
 
@@ -30,6 +30,37 @@
 
 #include "mu-maildir.h"
 
+/*
+ * the s-expressions are written straight into a GString the caller
+ * provides (and may re-use for many messages), escaping the strings
+ * on the way; we don't allocate any temporary strings for that.
+ */
+
+static void
+append_uint (GString *gstr, guint64 u)
+{
+	char buf[24], *cur;
+
+	cur  = buf + sizeof(buf);
+	do {
+		*--cur = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+
+	g_string_append_len (gstr, cur, buf + sizeof(buf) - cur);
+}
+
+static void
+append_int (GString *gstr, int i)
+{
+	if (i < 0) {
+		g_string_append_c (gstr, '-');
+		append_uint (gstr, -(unsigned)i);
+	} else
+		append_uint (gstr, (unsigned)i);
+}
+
+
 static void
 append_sexp_attr_list (GString *gstr, const char* elm, const GSList *lst)
 {
@@ -38,14 +69,13 @@ append_sexp_attr_list (GString *gstr, const char* elm, const GSList *lst)
 	if (!lst)
 		return; /* empty list, don't include */
 
-	g_string_append_printf (gstr, "\t:%s ( ", elm);
+	g_string_append (gstr, "\t:");
+	g_string_append (gstr, elm);
+	g_string_append (gstr, " ( ");
 
 	for (cur = lst; cur; cur = g_slist_next(cur)) {
-		char *str;
-		str = mu_str_escape_c_literal
-			((const gchar*)cur->data, TRUE);
-		g_string_append_printf (gstr, "%s ", str);
-		g_free (str);
+		mu_str_append_c_literal (gstr, (const gchar*)cur->data, TRUE);
+		g_string_append_c (gstr, ' ');
 	}
 
 	g_string_append (gstr, ")\n");
@@ -55,15 +85,14 @@ append_sexp_attr_list (GString *gstr, const char* elm, const GSList *lst)
 static void
 append_sexp_attr (GString *gstr, const char* elm, const char *str)
 {
-	gchar *esc;
-
-	if (!str || strlen(str) == 0)
+	if (!str || !*str)
 		return; /* empty: don't include */
 
-	esc = mu_str_escape_c_literal (str, TRUE);
-
-	g_string_append_printf (gstr, "\t:%s %s\n", elm, esc);
-	g_free (esc);
+	g_string_append (gstr, "\t:");
+	g_string_append (gstr, elm);
+	g_string_append_c (gstr, ' ');
+	mu_str_append_c_literal (gstr, str, TRUE);
+	g_string_append_c (gstr, '\n');
 }
 
 
@@ -74,24 +103,25 @@ struct _ContactData {
 };
 typedef struct _ContactData ContactData;
 
-static gchar*
-get_name_addr_pair (MuMsgContact *c)
+static void
+append_name_addr_pair (GString *gstr, MuMsgContact *c)
 {
-	gchar *name, *addr, *pair;
-
-	name = (char*)mu_msg_contact_name(c);
-	addr = (char*)mu_msg_contact_address(c);
+	const char *name, *addr;
 
-	name = name ? mu_str_escape_c_literal (name, TRUE) : NULL;
-	addr = addr ? mu_str_escape_c_literal (addr, TRUE) : NULL;
+	name = mu_msg_contact_name(c);
+	addr = mu_msg_contact_address(c);
 
-	pair = g_strdup_printf ("(%s . %s)",
-				name ? name : "nil",
-				addr ? addr : "nil");
-	g_free (name);
-	g_free (addr);
-
-	return pair;
+	g_string_append_c (gstr, '(');
+	if (name)
+		mu_str_append_c_literal (gstr, name, TRUE);
+	else
+		g_string_append (gstr, "nil");
+	g_string_append (gstr, " . ");
+	if (addr)
+		mu_str_append_c_literal (gstr, addr, TRUE);
+	else
+		g_string_append (gstr, "nil");
+	g_string_append_c (gstr, ')');
 }
 
 static void
@@ -107,7 +137,6 @@ add_prefix_maybe (GString *gstr, gboolean *field, const char *prefix)
 static gboolean
 each_contact (MuMsgContact *c, ContactData *cdata)
 {
-	char *pair;
 	MuMsgContactType ctype;
 
 	ctype = mu_msg_contact_type (c);
@@ -138,10 +167,7 @@ each_contact (MuMsgContact *c, ContactData *cdata)
 	}
 
 	cdata->prev_ctype = ctype;
-
-	pair = get_name_addr_pair (c);
-	g_string_append (cdata->gstr, pair);
-	g_free (pair);
+	append_name_addr_pair (cdata->gstr, c);
 
 	return TRUE;
 }
@@ -165,8 +191,9 @@ append_sexp_contacts (GString *gstr, MuMsg *msg)
 }
 
 struct _FlagData {
-	char *flagstr;
+	GString *gstr;
 	MuFlags msgflags;
+	gboolean first;
 };
 typedef struct _FlagData FlagData;
 
@@ -176,15 +203,13 @@ each_flag (MuFlags flag, FlagData *fdata)
 	if (!(flag & fdata->msgflags))
 		return;
 
-	if (!fdata->flagstr)
-		fdata->flagstr = g_strdup (mu_flag_name(flag));
-	else {
-		gchar *tmp;
-		tmp = g_strconcat (fdata->flagstr, " ",
-				   mu_flag_name(flag), NULL);
-		g_free (fdata->flagstr);
-		fdata->flagstr = tmp;
-	}
+	if (fdata->first)
+		g_string_append (fdata->gstr, "\t:flags (");
+	else
+		g_string_append_c (fdata->gstr, ' ');
+
+	g_string_append (fdata->gstr, mu_flag_name(flag));
+	fdata->first = FALSE;
 }
 
 static void
@@ -192,14 +217,13 @@ append_sexp_flags (GString *gstr, MuMsg *msg)
 {
 	FlagData fdata;
 
+	fdata.gstr     = gstr;
 	fdata.msgflags = mu_msg_get_flags (msg);
-	fdata.flagstr  = NULL;
+	fdata.first    = TRUE;
 
 	mu_flags_foreach ((MuFlagsForeachFunc)each_flag, &fdata);
-	if (fdata.flagstr)
-		g_string_append_printf (gstr, "\t:flags (%s)\n",
-					fdata.flagstr);
-	g_free (fdata.flagstr);
+	if (!fdata.first)
+		g_string_append (gstr, ")\n");
 }
 
 static char*
@@ -230,24 +254,17 @@ errexit:
 static gchar*
 get_temp_file_maybe (MuMsg *msg, MuMsgPart *part, MuMsgOptions opts)
 {
-	char *tmp, *tmpfile;
-
 	if  (!(opts & MU_MSG_OPTION_EXTRACT_IMAGES) ||
 	     g_ascii_strcasecmp (part->type, "image") != 0)
 		return NULL;
 
-	tmp = get_temp_file (msg, opts, part->index);
-	if (!tmp)
-		return NULL;
-
-	tmpfile = mu_str_escape_c_literal (tmp, TRUE);
-	g_free (tmp);
-	return tmpfile;
+	return get_temp_file (msg, opts, part->index);
 }
 
 
 struct _PartInfo {
-	char        *parts;
+	GString     *gstr;
+	gboolean     first;
 	MuMsgOptions opts;
 };
 typedef struct _PartInfo PartInfo;
@@ -282,11 +299,11 @@ sig_verdict (GSList *sig_infos)
 }
 
 
-static gchar *
-get_part_type_string (MuMsgPartType ptype)
+static void
+append_part_type (GString *gstr, MuMsgPartType ptype)
 {
-	GString *gstr;
 	unsigned u;
+	gboolean first;
 	struct PartTypes {
 		MuMsgPartType ptype;
 		const char* name;
@@ -299,49 +316,60 @@ get_part_type_string (MuMsgPartType ptype)
 		{ MU_MSG_PART_TYPE_ENCRYPTED,  "encrypted" }
 	};
 
-	gstr = g_string_sized_new (100); /* more than enough */
-	gstr = g_string_append_c (gstr, '(');
+	g_string_append_c (gstr, '(');
 
-	for (u = 0; u!= G_N_ELEMENTS(ptypes); ++u) {
+	for (first = TRUE, u = 0; u!= G_N_ELEMENTS(ptypes); ++u) {
 		if (ptype & ptypes[u].ptype) {
-			if (gstr->len > 1)
-				gstr = g_string_append_c (gstr, ' ');
-			gstr = g_string_append (gstr, ptypes[u].name);
+			if (!first)
+				g_string_append_c (gstr, ' ');
+			g_string_append (gstr, ptypes[u].name);
+			first = FALSE;
 		}
 	}
 
-	gstr = g_string_append_c (gstr, ')');
-
-	return g_string_free (gstr, FALSE);
+	g_string_append_c (gstr, ')');
 }
 
 
 static void
 each_part (MuMsg *msg, MuMsgPart *part, PartInfo *pinfo)
 {
-	char *name, *tmp, *parttype;
-	char *tmpfile;
-
-	name     = mu_msg_part_get_filename (part, TRUE);
-	tmpfile  = get_temp_file_maybe (msg, part, pinfo->opts);
-	parttype = get_part_type_string (part->part_type);
+	char *name, *tmpfile;
+	GString *gstr;
 
-	tmp = g_strdup_printf
-		("%s(:index %d :name \"%s\" :mime-type \"%s/%s\"%s%s "
-		 ":type %s "
-		 ":attachment %s :size %i %s)",
-		 elvis (pinfo->parts, ""), part->index,
-		 name ? name : "noname",
-		 elvis (part->type, "application"),
-		 elvis (part->subtype, "octet-stream"),
-		 tmpfile ? " :temp" : "", tmpfile ? tmpfile : "",
-		 parttype,
-		 mu_msg_part_maybe_attachment (part) ? "t" : "nil",
-		 (int)part->size,
-		 sig_verdict (part->sig_infos));
+	gstr	= pinfo->gstr;
+	name	= mu_msg_part_get_filename (part, TRUE);
+	tmpfile = get_temp_file_maybe (msg, part, pinfo->opts);
+
+	g_string_append (gstr, pinfo->first ? "\t:parts (" : "");
+	pinfo->first = FALSE;
+
+	g_string_append (gstr, "(:index ");
+	append_uint (gstr, part->index);
+	g_string_append (gstr, " :name \"");
+	g_string_append (gstr, name ? name : "noname");
+	g_string_append (gstr, "\" :mime-type \"");
+	g_string_append (gstr, elvis (part->type, "application"));
+	g_string_append_c (gstr, '/');
+	g_string_append (gstr, elvis (part->subtype, "octet-stream"));
+	g_string_append_c (gstr, '"');
+	if (tmpfile) {
+		g_string_append (gstr, " :temp");
+		mu_str_append_c_literal (gstr, tmpfile, TRUE);
+	}
+	g_string_append (gstr, " :type ");
+	append_part_type (gstr, part->part_type);
+	g_string_append (gstr, " :attachment ");
+	g_string_append (gstr, mu_msg_part_maybe_attachment (part) ?
+			 "t" : "nil");
+	g_string_append (gstr, " :size ");
+	append_int (gstr, (int)part->size);
+	g_string_append_c (gstr, ' ');
+	g_string_append (gstr, sig_verdict (part->sig_infos));
+	g_string_append_c (gstr, ')');
 
-	g_free (pinfo->parts);
-	pinfo->parts = tmp;
+	g_free (name);
+	g_free (tmpfile);
 }
 
 
@@ -349,35 +377,39 @@ static void
 append_sexp_parts (GString *gstr, MuMsg *msg, MuMsgOptions opts)
 {
 	PartInfo pinfo;
+	gsize len;
 
-	pinfo.parts = NULL;
+	pinfo.gstr  = gstr;
+	pinfo.first = TRUE;
 	pinfo.opts  = opts;
 
+	len = gstr->len;
 	if (!mu_msg_part_foreach (msg, opts, (MuMsgPartForeachFunc)each_part,
 				  &pinfo)) {
-		/* if decryption failed, mark this message as encrypted */
+		/* if decryption failed, mark this message as encrypted
+		 * (instead of listing the parts we saw so far) */
+		g_string_truncate (gstr, len);
 		g_string_append (gstr, "\t:encrypted t\n");
-	} else if (pinfo.parts) {
-		g_string_append_printf (gstr, "\t:parts (%s)\n", pinfo.parts);
-		g_free (pinfo.parts);
-	}
+	} else if (!pinfo.first)
+		g_string_append (gstr, ")\n");
 }
 
 static void
 append_sexp_thread_info (GString *gstr, const MuMsgIterThreadInfo *ti)
 {
-	g_string_append_printf
-		(gstr, "\t:thread (:path \"%s\":level %u%s%s%s%s)\n",
-		 ti->threadpath,
-		 ti->level,
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_FIRST_CHILD  ?
-		 " :first-child t" : "",
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT ?
-		 " :empty-parent t" : "",
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_DUP          ?
-		 " :duplicate t" : "",
-		 ti->prop & MU_MSG_ITER_THREAD_PROP_HAS_CHILD    ?
-		 " :has-child t" : "");
+	g_string_append (gstr, "\t:thread (:path \"");
+	g_string_append (gstr, ti->threadpath);
+	g_string_append (gstr, "\":level ");
+	append_uint (gstr, ti->level);
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_FIRST_CHILD)
+		g_string_append (gstr, " :first-child t");
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT)
+		g_string_append (gstr, " :empty-parent t");
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_DUP)
+		g_string_append (gstr, " :duplicate t");
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_HAS_CHILD)
+		g_string_append (gstr, " :has-child t");
+	g_string_append (gstr, ")\n");
 }
 
 
@@ -407,26 +439,41 @@ append_message_file_parts (GString *gstr, MuMsg *msg, MuMsgOptions opts)
 }
 
 
-char*
-mu_msg_to_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
-		MuMsgOptions opts)
+static void
+append_sexp_conv_info (GString *gstr, const MuMsgIterConvInfo *ci)
+{
+	g_string_append (gstr, "\t:conversation (:count ");
+	append_uint (gstr, ci->msgnum);
+	g_string_append (gstr, " :unread ");
+	append_uint (gstr, ci->unreadnum);
+	g_string_append (gstr, ")\n");
+}
+
+
+void
+mu_msg_append_sexp (GString *gstr, MuMsg *msg, unsigned docid,
+		    const MuMsgIterThreadInfo *ti,
+		    const MuMsgIterConvInfo *ci, MuMsgOptions opts)
 {
-	GString *gstr;
 	time_t t;
 
-	g_return_val_if_fail (msg, NULL);
-	g_return_val_if_fail (!((opts & MU_MSG_OPTION_HEADERS_ONLY) &&
-				(opts & MU_MSG_OPTION_EXTRACT_IMAGES)),NULL);
-	gstr = g_string_sized_new
-		((opts & MU_MSG_OPTION_HEADERS_ONLY) ?  1024 : 8192);
+	g_return_if_fail (gstr);
+	g_return_if_fail (msg);
+	g_return_if_fail (!((opts & MU_MSG_OPTION_HEADERS_ONLY) &&
+			    (opts & MU_MSG_OPTION_EXTRACT_IMAGES)));
 
 	if (docid == 0)
 		g_string_append (gstr, "(\n");
-	else
-		g_string_append_printf (gstr, "(\n\t:docid %u\n", docid);
+	else {
+		g_string_append (gstr, "(\n\t:docid ");
+		append_uint (gstr, docid);
+		g_string_append_c (gstr, '\n');
+	}
 
 	if (ti)
 		append_sexp_thread_info (gstr, ti);
+	if (ci)
+		append_sexp_conv_info (gstr, ci);
 
 	append_sexp_attr (gstr, "subject", mu_msg_get_subject (msg));
 
@@ -437,14 +484,20 @@ mu_msg_to_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
 
 	t = mu_msg_get_date (msg);
 	/* weird time format for emacs 29-bit ints...*/
-	g_string_append_printf (gstr,"\t:date (%u %u 0)\n\t:size %u\n",
-				(unsigned)(t >> 16), (unsigned)(t & 0xffff),
-				(unsigned)mu_msg_get_size (msg));
+	g_string_append (gstr, "\t:date (");
+	append_uint (gstr, (unsigned)(t >> 16));
+	g_string_append_c (gstr, ' ');
+	append_uint (gstr, (unsigned)(t & 0xffff));
+	g_string_append (gstr, " 0)\n\t:size ");
+	append_uint (gstr, (unsigned)mu_msg_get_size (msg));
+	g_string_append_c (gstr, '\n');
+
 	append_sexp_attr (gstr, "message-id", mu_msg_get_msgid (msg));
 	append_sexp_attr (gstr, "path",	 mu_msg_get_path (msg));
 	append_sexp_attr (gstr, "maildir", mu_msg_get_maildir (msg));
-	g_string_append_printf (gstr, "\t:priority %s\n",
-				mu_msg_prio_name(mu_msg_get_prio(msg)));
+	g_string_append (gstr, "\t:priority ");
+	g_string_append (gstr, mu_msg_prio_name(mu_msg_get_prio(msg)));
+	g_string_append_c (gstr, '\n');
 	append_sexp_flags (gstr, msg);
 
 	/* headers are retrieved from the database, views from the message file
@@ -454,5 +507,329 @@ mu_msg_to_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
 		append_message_file_parts (gstr, msg, opts);
 
 	g_string_append (gstr, ")\n");
+}
+
+
+static char*
+msg_to_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
+	     const MuMsgIterConvInfo *ci, MuMsgOptions opts)
+{
+	GString *gstr;
+
+	g_return_val_if_fail (msg, NULL);
+	g_return_val_if_fail (!((opts & MU_MSG_OPTION_HEADERS_ONLY) &&
+				(opts & MU_MSG_OPTION_EXTRACT_IMAGES)),NULL);
+
+	gstr = g_string_sized_new
+		((opts & MU_MSG_OPTION_HEADERS_ONLY) ?  1024 : 8192);
+	mu_msg_append_sexp (gstr, msg, docid, ti, ci, opts);
+
 	return g_string_free (gstr, FALSE);
 }
+
+
+char*
+mu_msg_to_sexp (MuMsg *msg, unsigned docid, const MuMsgIterThreadInfo *ti,
+		MuMsgOptions opts)
+{
+	return msg_to_sexp (msg, docid, ti, NULL, opts);
+}
+
+
+char*
+mu_msg_conv_to_sexp (MuMsg *msg, unsigned docid,
+		     const MuMsgIterConvInfo *ci, MuMsgOptions opts)
+{
+	return msg_to_sexp (msg, docid, NULL, ci, opts);
+}
+
+
+
+/*
+ * the compact representation (see mu_msg_append_fields): a single
+ * line, with only the fields that were asked for, either as a plist
+ * (sexp) or as a JSON object.
+ */
+
+struct _FieldsOut {
+	GString		*gstr;
+	MuMsgFormat	 format;
+	gboolean	 first;
+};
+typedef struct _FieldsOut FieldsOut;
+
+static void
+out_begin (FieldsOut *out, gboolean object)
+{
+	if (out->format == MU_MSG_FORMAT_JSON)
+		g_string_append_c (out->gstr, object ? '{' : '[');
+	else
+		g_string_append_c (out->gstr, '(');
+
+	out->first = TRUE;
+}
+
+static void
+out_end (FieldsOut *out, gboolean object)
+{
+	if (out->format == MU_MSG_FORMAT_JSON)
+		g_string_append_c (out->gstr, object ? '}' : ']');
+	else
+		g_string_append_c (out->gstr, ')');
+
+	out->first = FALSE;
+}
+
+/* separate list elements */
+static void
+out_next (FieldsOut *out)
+{
+	if (!out->first)
+		g_string_append_c (out->gstr,
+				   out->format == MU_MSG_FORMAT_JSON ?
+				   ',' : ' ');
+	out->first = FALSE;
+}
+
+static void
+out_key (FieldsOut *out, const char *key)
+{
+	out_next (out);
+
+	if (out->format == MU_MSG_FORMAT_JSON) {
+		g_string_append_c (out->gstr, '"');
+		g_string_append (out->gstr, key);
+		g_string_append (out->gstr, "\":");
+	} else {
+		g_string_append_c (out->gstr, ':');
+		g_string_append (out->gstr, key);
+		g_string_append_c (out->gstr, ' ');
+	}
+}
+
+static void
+out_str (FieldsOut *out, const char *str)
+{
+	if (out->format == MU_MSG_FORMAT_JSON)
+		mu_str_append_json_string (out->gstr, str);
+	else
+		mu_str_append_c_literal (out->gstr, str, TRUE);
+}
+
+/* a symbol in a sexp, a string in JSON */
+static void
+out_symbol (FieldsOut *out, const char *sym)
+{
+	if (out->format == MU_MSG_FORMAT_JSON) {
+		g_string_append_c (out->gstr, '"');
+		g_string_append (out->gstr, sym);
+		g_string_append_c (out->gstr, '"');
+	} else
+		g_string_append (out->gstr, sym);
+}
+
+static void
+out_true (FieldsOut *out)
+{
+	g_string_append (out->gstr,
+			 out->format == MU_MSG_FORMAT_JSON ? "true" : "t");
+}
+
+static void
+out_date (FieldsOut *out, time_t t)
+{
+	/* the sexps use the same weird format as mu_msg_to_sexp,
+	 * for emacs' 29-bit ints */
+	if (out->format == MU_MSG_FORMAT_JSON)
+		append_uint (out->gstr, (guint64)t);
+	else {
+		g_string_append_c (out->gstr, '(');
+		append_uint (out->gstr, (unsigned)(t >> 16));
+		g_string_append_c (out->gstr, ' ');
+		append_uint (out->gstr, (unsigned)(t & 0xffff));
+		g_string_append (out->gstr, " 0)");
+	}
+}
+
+struct _FlagsOut {
+	FieldsOut	*out;
+	MuFlags		 msgflags;
+};
+typedef struct _FlagsOut FlagsOut;
+
+static void
+each_flag_out (MuFlags flag, FlagsOut *fout)
+{
+	if (!(flag & fout->msgflags))
+		return;
+
+	out_next (fout->out);
+	out_symbol (fout->out, mu_flag_name (flag));
+}
+
+static void
+out_flags (FieldsOut *out, MuFlags flags)
+{
+	FlagsOut fout;
+
+	fout.out      = out;
+	fout.msgflags = flags;
+
+	out_begin (out, FALSE);
+	mu_flags_foreach ((MuFlagsForeachFunc)each_flag_out, &fout);
+	out_end (out, FALSE);
+}
+
+static gboolean
+out_field (FieldsOut *out, MuMsg *msg, MuMsgFieldId mfid)
+{
+	const char *key;
+
+	/* 'thread' is the thread-info */
+	key = mfid == MU_MSG_FIELD_ID_THREAD_ID ?
+		"thread-id" : mu_msg_field_name (mfid);
+
+	switch (mfid) {
+	case MU_MSG_FIELD_ID_FLAGS:
+		out_key (out, key);
+		out_flags (out, mu_msg_get_flags (msg));
+		return TRUE;
+	case MU_MSG_FIELD_ID_PRIO:
+		out_key (out, key);
+		out_symbol (out, mu_msg_prio_name (mu_msg_get_prio (msg)));
+		return TRUE;
+	default:
+		break;
+	}
+
+	switch (mu_msg_field_type (mfid)) {
+
+	case MU_MSG_FIELD_TYPE_STRING: {
+		const char *str;
+		str = mu_msg_get_field_string (msg, mfid);
+		if (!str || !*str)
+			return FALSE; /* empty: don't include */
+		out_key (out, key);
+		out_str (out, str);
+		return TRUE;
+	}
+	case MU_MSG_FIELD_TYPE_STRING_LIST: {
+		const GSList *lst, *cur;
+		lst = mu_msg_get_field_string_list (msg, mfid);
+		if (!lst)
+			return FALSE;
+		out_key (out, key);
+		out_begin (out, FALSE);
+		for (cur = lst; cur; cur = g_slist_next (cur)) {
+			out_next (out);
+			out_str (out, (const char*)cur->data);
+		}
+		out_end (out, FALSE);
+		return TRUE;
+	}
+	case MU_MSG_FIELD_TYPE_TIME_T:
+		out_key (out, key);
+		out_date (out, (time_t)mu_msg_get_field_numeric (msg, mfid));
+		return TRUE;
+	case MU_MSG_FIELD_TYPE_BYTESIZE:
+	case MU_MSG_FIELD_TYPE_INT:
+		out_key (out, key);
+		append_uint (out->gstr,
+			     (guint64)mu_msg_get_field_numeric (msg, mfid));
+		return TRUE;
+	default:
+		g_return_val_if_reached (FALSE);
+	}
+}
+
+static void
+out_thread_info (FieldsOut *out, const MuMsgIterThreadInfo *ti)
+{
+	out_key (out, "thread");
+	out_begin (out, TRUE);
+
+	out_key (out, "path");
+	out_str (out, ti->threadpath);
+	out_key (out, "level");
+	append_uint (out->gstr, ti->level);
+
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_FIRST_CHILD) {
+		out_key (out, "first-child");
+		out_true (out);
+	}
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_EMPTY_PARENT) {
+		out_key (out, "empty-parent");
+		out_true (out);
+	}
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_DUP) {
+		out_key (out, "duplicate");
+		out_true (out);
+	}
+	if (ti->prop & MU_MSG_ITER_THREAD_PROP_HAS_CHILD) {
+		out_key (out, "has-child");
+		out_true (out);
+	}
+
+	out_end (out, TRUE);
+}
+
+static void
+out_conv_info (FieldsOut *out, const MuMsgIterConvInfo *ci)
+{
+	out_key (out, "conversation");
+	out_begin (out, TRUE);
+
+	out_key (out, "count");
+	append_uint (out->gstr, ci->msgnum);
+	out_key (out, "unread");
+	append_uint (out->gstr, ci->unreadnum);
+
+	out_end (out, TRUE);
+}
+
+
+gboolean
+mu_msg_field_is_projectable (MuMsgFieldId mfid)
+{
+	/* only the fields we have in the database, and not the
+	 * internal uid */
+	return mu_msg_field_id_is_valid (mfid) &&
+		mfid != MU_MSG_FIELD_ID_UID &&
+		mu_msg_field_xapian_value (mfid);
+}
+
+
+void
+mu_msg_append_fields (GString *gstr, MuMsg *msg, MuMsgFormat format,
+		      unsigned docid, const MuMsgFieldId *fields,
+		      const MuMsgIterThreadInfo *ti,
+		      const MuMsgIterConvInfo *ci)
+{
+	FieldsOut out;
+	const MuMsgFieldId *cur;
+
+	g_return_if_fail (gstr);
+	g_return_if_fail (msg);
+	g_return_if_fail (fields);
+
+	out.gstr   = gstr;
+	out.format = format;
+
+	out_begin (&out, TRUE);
+
+	if (docid != 0) {
+		out_key (&out, "docid");
+		append_uint (gstr, docid);
+	}
+
+	if (ti)
+		out_thread_info (&out, ti);
+	if (ci)
+		out_conv_info (&out, ci);
+
+	for (cur = fields; *cur != MU_MSG_FIELD_ID_NONE; ++cur)
+		if (mu_msg_field_is_projectable (*cur))
+			out_field (&out, msg, *cur);
+
+	out_end (&out, TRUE);
+}
@@ -266,6 +266,17 @@ const char*     mu_msg_get_subject         (MuMsg *msg);
  */
 const char*     mu_msg_get_msgid           (MuMsg *msg);
 
+/**
+ * get the thread-id of this message; messages in the same thread
+ * (usually) have the same thread-id; see MU_MSG_FIELD_ID_THREAD_ID
+ *
+ * @param msg a valid MuMsg* instance
+ *
+ * @return the thread-id or NULL in case of error. the returned string
+ * should *not* be modified or freed.
+ */
+const char*     mu_msg_get_thread_id       (MuMsg *msg);
+
 
 /**
  * get any arbitrary header from this message
@@ -424,6 +435,7 @@ gboolean mu_msg_is_readable (MuMsg *self);
 
 
 struct _MuMsgIterThreadInfo;
+struct _MuMsgIterConvInfo;
 
 
 /**
@@ -451,6 +463,77 @@ char* mu_msg_to_sexp (MuMsg *msg, unsigned docid,
 		      const struct _MuMsgIterThreadInfo *ti,
 		      MuMsgOptions ops);
 
+/**
+ * like mu_msg_to_sexp, but for a message that represents a
+ * conversation (see MU_QUERY_FLAG_CONVERSATIONS); the sexp gets a
+ * :conversation property with the number of messages and the number
+ * of unread messages in the conversation
+ *
+ * @param msg a valid message
+ * @param docid the docid for this message, or 0
+ * @param ci conversation info for the current message, or NULL
+ * @param opts bitwise OR'ed options, as in mu_msg_to_sexp
+ *
+ * @return a string with the sexp (free with g_free) or NULL in case of error
+ */
+char* mu_msg_conv_to_sexp (MuMsg *msg, unsigned docid,
+			   const struct _MuMsgIterConvInfo *ci,
+			   MuMsgOptions opts);
+
+enum _MuMsgFormat {
+	MU_MSG_FORMAT_SEXP,
+	MU_MSG_FORMAT_JSON
+};
+typedef enum _MuMsgFormat MuMsgFormat;
+
+/**
+ * can a field be used with mu_msg_append_fields? Only the fields that
+ * are stored in the database can.
+ *
+ * @param mfid a message field id
+ *
+ * @return TRUE if it can, FALSE otherwise
+ */
+gboolean mu_msg_field_is_projectable (MuMsgFieldId mfid);
+
+/**
+ * append a compact representation of a message to a GString: a single
+ * line, with only the given fields (plus the docid, and thread or
+ * conversation info when specified), as either a plist sexp or a JSON
+ * object. Unlike mu_msg_to_sexp, this only reads the fields that are
+ * asked for, which is cheap for database-backed messages.
+ *
+ * @param gstr a GString to append to
+ * @param msg a valid message
+ * @param format the format to use
+ * @param docid the docid for this message, or 0
+ * @param fields the fields to include, terminated by
+ * MU_MSG_FIELD_ID_NONE; fields that are not projectable are ignored
+ * @param ti thread info for the current message, or NULL
+ * @param ci conversation info for the current message, or NULL
+ */
+void mu_msg_append_fields (GString *gstr, MuMsg *msg, MuMsgFormat format,
+			   unsigned docid, const MuMsgFieldId *fields,
+			   const struct _MuMsgIterThreadInfo *ti,
+			   const struct _MuMsgIterConvInfo *ci);
+
+/**
+ * like mu_msg_to_sexp and mu_msg_conv_to_sexp, but append the sexp to
+ * a GString; this way, the caller can re-use the same buffer for
+ * many messages, and no temporary strings are allocated
+ *
+ * @param gstr a GString to append to
+ * @param msg a valid message
+ * @param docid the docid for this message, or 0
+ * @param ti thread info for the current message, or NULL
+ * @param ci conversation info for the current message, or NULL
+ * @param opts bitwise OR'ed options, as in mu_msg_to_sexp
+ */
+void mu_msg_append_sexp (GString *gstr, MuMsg *msg, unsigned docid,
+			 const struct _MuMsgIterThreadInfo *ti,
+			 const struct _MuMsgIterConvInfo *ci,
+			 MuMsgOptions opts);
+
 /**
  * move a message to another maildir; note that this does _not_ update
  * the database
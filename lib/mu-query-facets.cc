@@ -0,0 +1,349 @@
+/* -*-mode: c++; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8-*- */
+/*
+** Copyright (C) 2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#include <cstring>
+#include <ctime>
+
+#include "mu-query-priv.hh"
+#include "mu-flags.h"
+#include "mu-date.h"
+
+static const struct {
+	MuQueryFacet	 facet;
+	const char	*name;
+	gboolean	 numeric;
+} FACET_INFO[] = {
+	{ MU_QUERY_FACET_MAILDIR,	"maildir",	FALSE },
+	{ MU_QUERY_FACET_FLAG,		"flag",		FALSE },
+	{ MU_QUERY_FACET_YEAR,		"year",		TRUE },
+	{ MU_QUERY_FACET_MONTH,		"month",	TRUE },
+	{ MU_QUERY_FACET_WEEKDAY,	"weekday",	TRUE },
+	{ MU_QUERY_FACET_FROM,		"from",		FALSE },
+	{ MU_QUERY_FACET_SIZE,		"size",		TRUE }
+};
+
+
+const char*
+mu_query_facet_name (MuQueryFacet facet)
+{
+	unsigned u;
+
+	for (u = 0; u != G_N_ELEMENTS(FACET_INFO); ++u)
+		if (FACET_INFO[u].facet == facet)
+			return FACET_INFO[u].name;
+
+	return NULL;
+}
+
+
+gboolean
+mu_query_facet_is_numeric (MuQueryFacet facet)
+{
+	unsigned u;
+
+	for (u = 0; u != G_N_ELEMENTS(FACET_INFO); ++u)
+		if (FACET_INFO[u].facet == facet)
+			return FACET_INFO[u].numeric;
+
+	return FALSE;
+}
+
+
+static MuQueryFacet
+facet_from_name (const char *name)
+{
+	unsigned u;
+
+	if (g_strcmp0 (name, "all") == 0)
+		return MU_QUERY_FACET_ALL;
+
+	for (u = 0; u != G_N_ELEMENTS(FACET_INFO); ++u)
+		if (g_strcmp0 (FACET_INFO[u].name, name) == 0)
+			return FACET_INFO[u].facet;
+
+	return MU_QUERY_FACET_NONE;
+}
+
+
+MuQueryFacet
+mu_query_facets_from_str (const char *str)
+{
+	gchar **names, **cur;
+	int facets;
+
+	g_return_val_if_fail (str, MU_QUERY_FACET_NONE);
+
+	names = g_strsplit (str, ",", -1);
+	for (facets = MU_QUERY_FACET_NONE, cur = names; cur && *cur; ++cur) {
+		MuQueryFacet facet;
+		facet = facet_from_name (g_strstrip (*cur));
+		if (facet == MU_QUERY_FACET_NONE) {
+			facets = MU_QUERY_FACET_NONE;
+			break;
+		}
+		facets |= facet;
+	}
+	g_strfreev (names);
+
+	return (MuQueryFacet)facets;
+}
+
+
+/* dates are stored as YYYYMMDDHHMMSS (UTC) strings, see
+ * mu-store-write.cc */
+static bool
+date_value_to_tm (const std::string& val, struct tm *tm)
+{
+	time_t t;
+
+	if (val.length() < 14)
+		return false;
+
+	t = mu_date_str_to_time_t (val.c_str(), FALSE /*utc*/);
+
+	return localtime_r (&t, tm) != NULL;
+}
+
+
+/* the lower bounds of the size buckets, in bytes */
+static const gint64 SIZE_BUCKETS[] = {
+	0, 1024, 10 * 1024, 100 * 1024, 1024 * 1024, 10 * 1024 * 1024
+};
+
+/* the number of flag bits, ie. up to and including MU_FLAG_UNREAD */
+#define FLAG_BITS 11
+
+
+/*
+ * a MatchSpy that counts values for the facets we're interested in;
+ * it's called for each matching document, and only looks at the
+ * values it needs (which xapian reads from its value streams), so we
+ * don't need to create any MuMsg objects.
+ */
+class MuFacetSpy : public Xapian::MatchSpy {
+public:
+	MuFacetSpy (MuQueryFacet facets): _facets(facets) {
+		memset (_flags, 0, sizeof(_flags));
+		memset (_months, 0, sizeof(_months));
+		memset (_weekdays, 0, sizeof(_weekdays));
+		memset (_sizes, 0, sizeof(_sizes));
+	}
+
+	void operator() (const Xapian::Document& doc, Xapian::weight wt) {
+
+		if (_facets & MU_QUERY_FACET_MAILDIR)
+			++_maildirs[doc.get_value (MU_MSG_FIELD_ID_MAILDIR)];
+
+		if (_facets & MU_QUERY_FACET_FROM)
+			++_senders[doc.get_value (MU_MSG_FIELD_ID_FROM)];
+
+		if (_facets & MU_QUERY_FACET_FLAG)
+			count_flags (doc.get_value (MU_MSG_FIELD_ID_FLAGS));
+
+		if (_facets & (MU_QUERY_FACET_YEAR|MU_QUERY_FACET_MONTH|
+			       MU_QUERY_FACET_WEEKDAY))
+			count_date (doc.get_value (MU_MSG_FIELD_ID_DATE));
+
+		if (_facets & MU_QUERY_FACET_SIZE)
+			count_size (doc.get_value (MU_MSG_FIELD_ID_SIZE));
+	}
+
+	void report (MuQueryFacetForeachFunc func, gpointer user_data) const {
+
+		unsigned u;
+
+		report_strs (MU_QUERY_FACET_MAILDIR, _maildirs, func, user_data);
+
+		if (_facets & MU_QUERY_FACET_FLAG)
+			for (u = 0; u != FLAG_BITS; ++u)
+				if (_flags[u] > 0)
+					func (MU_QUERY_FACET_FLAG,
+					      mu_flag_name ((MuFlags)(1 << u)),
+					      _flags[u], user_data);
+
+		if (_facets & MU_QUERY_FACET_YEAR) {
+			std::map<int,unsigned>::const_iterator it;
+			for (it = _years.begin(); it != _years.end(); ++it)
+				report_num (MU_QUERY_FACET_YEAR, it->first,
+					    it->second, func, user_data);
+		}
+
+		report_nums (MU_QUERY_FACET_MONTH, _months, 12, 1,
+			     func, user_data);
+		report_nums (MU_QUERY_FACET_WEEKDAY, _weekdays, 7, 0,
+			     func, user_data);
+
+		report_strs (MU_QUERY_FACET_FROM, _senders, func, user_data);
+
+		if (_facets & MU_QUERY_FACET_SIZE)
+			for (u = 0; u != G_N_ELEMENTS(SIZE_BUCKETS); ++u)
+				if (_sizes[u] > 0)
+					report_num (MU_QUERY_FACET_SIZE,
+						    SIZE_BUCKETS[u], _sizes[u],
+						    func, user_data);
+	}
+
+private:
+	typedef std::map<std::string, unsigned> StrCounts;
+
+	void count_flags (const std::string& val) {
+
+		unsigned u;
+		MuFlags flags;
+
+		if (val.empty())
+			return;
+
+		flags = (MuFlags)Xapian::sortable_unserialise (val);
+		/* unread is a pseudo-flag */
+		if ((flags & MU_FLAG_NEW) || !(flags & MU_FLAG_SEEN))
+			flags = (MuFlags)(flags | MU_FLAG_UNREAD);
+
+		for (u = 0; u != FLAG_BITS; ++u)
+			if (flags & (1 << u))
+				++_flags[u];
+	}
+
+	void count_date (const std::string& val) {
+
+		struct tm tm;
+
+		if (!date_value_to_tm (val, &tm))
+			return;
+
+		++_years[tm.tm_year + 1900];
+		++_months[tm.tm_mon];
+		++_weekdays[tm.tm_wday];
+	}
+
+	void count_size (const std::string& val) {
+
+		gint64 size;
+		unsigned u;
+
+		if (val.empty())
+			return;
+
+		size = (gint64)Xapian::sortable_unserialise (val);
+		for (u = G_N_ELEMENTS(SIZE_BUCKETS) - 1; u != 0; --u)
+			if (size >= SIZE_BUCKETS[u])
+				break;
+		++_sizes[u];
+	}
+
+	void report_strs (MuQueryFacet facet, const StrCounts& counts,
+			  MuQueryFacetForeachFunc func,
+			  gpointer user_data) const {
+
+		StrCounts::const_iterator it;
+
+		if (!(_facets & facet))
+			return;
+
+		for (it = counts.begin(); it != counts.end(); ++it)
+			if (!it->first.empty())
+				func (facet, it->first.c_str(), it->second,
+				      user_data);
+	}
+
+	void report_num (MuQueryFacet facet, gint64 val, unsigned count,
+			 MuQueryFacetForeachFunc func,
+			 gpointer user_data) const {
+
+		char buf[24];
+
+		snprintf (buf, sizeof(buf), "%" G_GINT64_FORMAT, val);
+		func (facet, buf, count, user_data);
+	}
+
+	void report_nums (MuQueryFacet facet, const unsigned *counts,
+			  unsigned num, int offset,
+			  MuQueryFacetForeachFunc func,
+			  gpointer user_data) const {
+
+		unsigned u;
+
+		if (!(_facets & facet))
+			return;
+
+		for (u = 0; u != num; ++u)
+			if (counts[u] > 0)
+				report_num (facet, (gint64)u + offset,
+					    counts[u], func, user_data);
+	}
+
+	const MuQueryFacet	_facets;
+
+	StrCounts		_maildirs, _senders;
+	std::map<int,unsigned>	_years;
+	unsigned		_flags[FLAG_BITS];
+	unsigned		_months[12];
+	unsigned		_weekdays[7];
+	unsigned		_sizes[G_N_ELEMENTS(SIZE_BUCKETS)];
+};
+
+
+
+static void
+run_facets (MuQuery *self, const char *searchexpr, MuQueryFacet facets,
+	    MuQueryFacetForeachFunc func, gpointer user_data, GError **err)
+{
+	MuFacetSpy spy (facets);
+	Xapian::Enquire enq (self->db());
+
+	enq.set_query (mu_query_xapian_query (self, searchexpr, err));
+	enq.add_matchspy (&spy);
+
+	/* we don't need the matches themselves; but we do
+	 * want the spy to see every one of them */
+	enq.get_mset (0, 0, self->db().get_doccount());
+	spy.report (func, user_data);
+}
+
+
+gboolean
+mu_query_facets (MuQuery *self, const char *searchexpr, MuQueryFacet facets,
+		 MuQueryFacetForeachFunc func, gpointer user_data,
+		 GError **err)
+{
+	g_return_val_if_fail (self, FALSE);
+	g_return_val_if_fail (searchexpr, FALSE);
+	g_return_val_if_fail (func, FALSE);
+
+	try {
+		try {
+			run_facets (self, searchexpr, facets, func,
+				    user_data, err);
+
+		} catch (const Xapian::DatabaseModifiedError&) {
+			/* as in mu_query_count; the spy only reports
+			 * after the match completed, so nothing has
+			 * been passed to func yet */
+			self->db().reopen();
+			self->cache().clear ();
+			MU_WRITE_LOG ("reopening db after modification");
+			run_facets (self, searchexpr, facets, func,
+				    user_data, err);
+		}
+
+		return TRUE;
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN (err, MU_ERROR_XAPIAN, FALSE);
+}
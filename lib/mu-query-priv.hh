@@ -0,0 +1,314 @@
+/* -*-mode: c++; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8-*- */
+/*
+** Copyright (C) 2008-2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#ifndef __MU_QUERY_PRIV_HH__
+#define __MU_QUERY_PRIV_HH__
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif /*HAVE_CONFIG_H*/
+
+#include <stdexcept>
+#include <string>
+#include <list>
+#include <map>
+#include <cstdio>
+#include <stdlib.h>
+
+#include <xapian.h>
+
+#include "mu-query.h"
+#include "mu-msg-fields.h"
+#include "mu-store.h"
+#include "mu-util.h"
+#include "mu-str.h"
+#include "mu-date.h"
+#include "mu-thread-cache.h"
+
+/*
+ * custom parser for date ranges
+ */
+class MuDateRangeProcessor : public Xapian::StringValueRangeProcessor {
+public:
+	MuDateRangeProcessor():
+		Xapian::StringValueRangeProcessor(
+			(Xapian::valueno)MU_MSG_FIELD_ID_DATE) {}
+
+	Xapian::valueno operator()(std::string &begin, std::string &end) {
+
+		if (!clear_prefix (begin))
+			return Xapian::BAD_VALUENO;
+
+		 begin = to_sortable (begin, true);
+		 end   = to_sortable (end, false);
+
+		if (begin > end)
+			throw Xapian::QueryParserError
+				("end time is before begin");
+
+		return (Xapian::valueno)MU_MSG_FIELD_ID_DATE;
+	}
+private:
+	std::string to_sortable (std::string& s, bool is_begin) {
+
+		const char* str;
+		time_t t;
+
+		str = mu_date_interpret_s (s.c_str(), is_begin ? TRUE: FALSE);
+		str = mu_date_complete_s (str, is_begin ? TRUE: FALSE);
+		t   = mu_date_str_to_time_t (str, TRUE /*local*/);
+		str = mu_date_time_t_to_str_s (t, FALSE /*UTC*/);
+
+		return s = std::string(str);
+	}
+
+
+	bool clear_prefix (std::string& begin) {
+
+		const std::string colon (":");
+		const std::string name (mu_msg_field_name
+					(MU_MSG_FIELD_ID_DATE) + colon);
+		const std::string shortcut (
+			std::string(1, mu_msg_field_shortcut
+				    (MU_MSG_FIELD_ID_DATE)) + colon);
+
+		if (begin.find (name) == 0) {
+			begin.erase (0, name.length());
+			return true;
+		} else if (begin.find (shortcut) == 0) {
+			begin.erase (0, shortcut.length());
+			return true;
+		} else
+			return false;
+	}
+
+
+};
+
+
+class MuSizeRangeProcessor : public Xapian::NumberValueRangeProcessor {
+public:
+	MuSizeRangeProcessor():
+		Xapian::NumberValueRangeProcessor(MU_MSG_FIELD_ID_SIZE) {
+	}
+
+	Xapian::valueno operator()(std::string &begin, std::string &end) {
+
+		if (!clear_prefix (begin))
+			return Xapian::BAD_VALUENO;
+
+		if (!substitute_size (begin) || !substitute_size (end))
+			return Xapian::BAD_VALUENO;
+
+		/* swap if b > e */
+		if (begin > end)
+			std::swap (begin, end);
+
+		begin = Xapian::sortable_serialise (atol(begin.c_str()));
+		end = Xapian::sortable_serialise (atol(end.c_str()));
+
+		return (Xapian::valueno)MU_MSG_FIELD_ID_SIZE;
+	}
+private:
+	bool clear_prefix (std::string& begin) {
+
+		const std::string colon (":");
+		const std::string name (mu_msg_field_name
+					(MU_MSG_FIELD_ID_SIZE) + colon);
+		const std::string shortcut (
+			std::string(1, mu_msg_field_shortcut
+				    (MU_MSG_FIELD_ID_SIZE)) + colon);
+
+		if (begin.find (name) == 0) {
+			begin.erase (0, name.length());
+			return true;
+		} else if (begin.find (shortcut) == 0) {
+			begin.erase (0, shortcut.length());
+			return true;
+		} else
+			return false;
+	}
+
+	bool substitute_size (std::string& size) {
+		gchar str[16];
+		gint64 num = mu_str_size_parse_bkm(size.c_str());
+		if (num < 0)
+			throw Xapian::QueryParserError ("invalid size");
+		snprintf (str, sizeof(str), "%" G_GUINT64_FORMAT, num);
+		size = str;
+		return true;
+	}
+};
+
+
+
+/*
+ * a small LRU-cache for parsed queries; parsing a query (including
+ * expanding wildcards and synonyms) is not free, and front-ends such
+ * as mu4e tend to repeat the same queries many times. As parsing
+ * depends on the contents of the database (wildcards), the cache is
+ * only valid for a specific state of the database.
+ *
+ * the store revision only counts the changes made through our own
+ * store; changes by other processes (e.g. 'mu index') become visible
+ * when the database is reopened, so the state includes the last docid
+ * and the number of documents as well.
+ */
+class MuQueryCache {
+public:
+	struct State {
+		State (): revision(0), lastdocid(0), doccount(0) {}
+		State (guint64 rev, const Xapian::Database& db):
+			revision(rev), lastdocid(db.get_lastdocid()),
+			doccount(db.get_doccount()) {}
+
+		bool operator!= (const State& other) const {
+			return revision  != other.revision  ||
+				lastdocid != other.lastdocid ||
+				doccount  != other.doccount;
+		}
+
+		guint64			revision;
+		Xapian::docid		lastdocid;
+		Xapian::doccount	doccount;
+	};
+
+	MuQueryCache (size_t max_size):
+		_max_size(max_size), _hits(0), _misses(0) {}
+
+	bool lookup (const std::string& expr, const State& state,
+		     Xapian::Query& query) {
+
+		Lookup::iterator it;
+
+		if (state != _state) {
+			clear ();
+			_state = state;
+		}
+
+		it = _lookup.find (expr);
+		if (it == _lookup.end()) {
+			++_misses;
+			return false;
+		}
+
+		/* move to the front; it's the most recently used now */
+		_entries.splice (_entries.begin(), _entries, it->second);
+		query = it->second->second;
+		++_hits;
+
+		return true;
+	}
+
+	void insert (const std::string& expr, const Xapian::Query& query) {
+
+		if (_lookup.find (expr) != _lookup.end())
+			return;
+
+		_entries.push_front (Entry (expr, query));
+		_lookup[expr] = _entries.begin();
+
+		if (_entries.size() > _max_size) {
+			_lookup.erase (_entries.back().first);
+			_entries.pop_back ();
+		}
+	}
+
+	void clear () {
+		_entries.clear ();
+		_lookup.clear ();
+	}
+
+	unsigned hits   () const { return _hits; }
+	unsigned misses () const { return _misses; }
+	size_t   size   () const { return _entries.size(); }
+
+private:
+	typedef std::pair<std::string, Xapian::Query>		Entry;
+	typedef std::list<Entry>				Entries;
+	typedef std::map<std::string, Entries::iterator>	Lookup;
+
+	Entries		_entries;
+	Lookup		_lookup;
+	const size_t	_max_size;
+	State		_state;
+	unsigned	_hits, _misses;
+};
+
+
+struct _MuQuery {
+public:
+	_MuQuery (MuStore *store);
+
+	~_MuQuery () { mu_store_unref (_store); }
+
+	Xapian::Database& db() const {
+		Xapian::Database* db;
+		db = reinterpret_cast<Xapian::Database*>
+			(mu_store_get_read_only_database (_store));
+		if (!db)
+			throw std::runtime_error ("no database");
+		return *db;
+	}
+	Xapian::QueryParser& query_parser () { return _qparser; }
+
+	MuQueryCache& cache () { return _cache; }
+	MuQueryCache::State state () const {
+		return MuQueryCache::State (mu_store_revision (_store), db());
+	}
+
+	MuThreadCache* thread_cache () const { return _tcache; }
+	void set_thread_cache (MuThreadCache *tcache) { _tcache = tcache; }
+
+	volatile gint* cancel_flag () const { return _cancelled; }
+	void set_cancel_flag (volatile gint *cancelled) { _cancelled = cancelled; }
+
+	/* the maximum number of parsed queries we remember */
+	static const size_t QUERY_CACHE_SIZE = 64;
+
+private:
+	Xapian::QueryParser	_qparser;
+	MuDateRangeProcessor	_date_range_processor;
+	MuSizeRangeProcessor	_size_range_processor;
+	MuQueryCache		_cache;
+
+	MuStore		*_store;
+	MuThreadCache	*_tcache; /* not owned by us */
+	volatile gint	*_cancelled; /* ditto */
+};
+
+
+/**
+ * get the Xapian query for some search expression; "" (or \"\") match
+ * all messages. Parsed queries are cached.
+ *
+ * throws in case of error, after setting err
+ *
+ * @param self a MuQuery instance
+ * @param searchexpr the search expression
+ * @param err receives error information
+ *
+ * @return the Xapian query
+ */
+const Xapian::Query mu_query_xapian_query (MuQuery *self,
+					   const char *searchexpr,
+					   GError **err);
+
+#endif /*__MU_QUERY_PRIV_HH__*/
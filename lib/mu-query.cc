@@ -19,6 +19,7 @@
 
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <cctype>
 #include <cstring>
 #include <stdlib.h>
@@ -26,167 +27,26 @@
 #include <xapian.h>
 #include <glib/gstdio.h>
 
-#include "mu-query.h"
-#include "mu-msg-fields.h"
-
+#include "mu-query-priv.hh"
 #include "mu-msg-iter.h"
 
-#include "mu-util.h"
-#include "mu-str.h"
-#include "mu-date.h"
-
-/*
- * custom parser for date ranges
- */
-class MuDateRangeProcessor : public Xapian::StringValueRangeProcessor {
-public:
-	MuDateRangeProcessor():
-		Xapian::StringValueRangeProcessor(
-			(Xapian::valueno)MU_MSG_FIELD_ID_DATE) {}
-
-	Xapian::valueno operator()(std::string &begin, std::string &end) {
-
-		if (!clear_prefix (begin))
-			return Xapian::BAD_VALUENO;
-
-		 begin = to_sortable (begin, true);
-		 end   = to_sortable (end, false);
-
-		if (begin > end)
-			throw Xapian::QueryParserError
-				("end time is before begin");
-
-		return (Xapian::valueno)MU_MSG_FIELD_ID_DATE;
-	}
-private:
-	std::string to_sortable (std::string& s, bool is_begin) {
-
-		const char* str;
-		time_t t;
-
-		str = mu_date_interpret_s (s.c_str(), is_begin ? TRUE: FALSE);
-		str = mu_date_complete_s (str, is_begin ? TRUE: FALSE);
-		t   = mu_date_str_to_time_t (str, TRUE /*local*/);
-		str = mu_date_time_t_to_str_s (t, FALSE /*UTC*/);
-
-		return s = std::string(str);
-	}
-
-
-	bool clear_prefix (std::string& begin) {
-
-		const std::string colon (":");
-		const std::string name (mu_msg_field_name
-					(MU_MSG_FIELD_ID_DATE) + colon);
-		const std::string shortcut (
-			std::string(1, mu_msg_field_shortcut
-				    (MU_MSG_FIELD_ID_DATE)) + colon);
-
-		if (begin.find (name) == 0) {
-			begin.erase (0, name.length());
-			return true;
-		} else if (begin.find (shortcut) == 0) {
-			begin.erase (0, shortcut.length());
-			return true;
-		} else
-			return false;
-	}
-
-
-};
-
-
-class MuSizeRangeProcessor : public Xapian::NumberValueRangeProcessor {
-public:
-	MuSizeRangeProcessor():
-		Xapian::NumberValueRangeProcessor(MU_MSG_FIELD_ID_SIZE) {
-	}
-
-	Xapian::valueno operator()(std::string &begin, std::string &end) {
-
-		if (!clear_prefix (begin))
-			return Xapian::BAD_VALUENO;
-
-		if (!substitute_size (begin) || !substitute_size (end))
-			return Xapian::BAD_VALUENO;
-
-		/* swap if b > e */
-		if (begin > end)
-			std::swap (begin, end);
-
-		begin = Xapian::sortable_serialise (atol(begin.c_str()));
-		end = Xapian::sortable_serialise (atol(end.c_str()));
-
-		return (Xapian::valueno)MU_MSG_FIELD_ID_SIZE;
-	}
-private:
-	bool clear_prefix (std::string& begin) {
-
-		const std::string colon (":");
-		const std::string name (mu_msg_field_name
-					(MU_MSG_FIELD_ID_SIZE) + colon);
-		const std::string shortcut (
-			std::string(1, mu_msg_field_shortcut
-				    (MU_MSG_FIELD_ID_SIZE)) + colon);
-
-		if (begin.find (name) == 0) {
-			begin.erase (0, name.length());
-			return true;
-		} else if (begin.find (shortcut) == 0) {
-			begin.erase (0, shortcut.length());
-			return true;
-		} else
-			return false;
-	}
-
-	bool substitute_size (std::string& size) {
-		gchar str[16];
-		gint64 num = mu_str_size_parse_bkm(size.c_str());
-		if (num < 0)
-			throw Xapian::QueryParserError ("invalid size");
-		snprintf (str, sizeof(str), "%" G_GUINT64_FORMAT, num);
-		size = str;
-		return true;
-	}
-};
-
-
 
 static void add_prefix (MuMsgFieldId field, Xapian::QueryParser* qparser);
 
-struct _MuQuery {
-public:
-	_MuQuery (MuStore *store): _store(mu_store_ref(store)) {
-
-		_qparser.set_database (db());
-		_qparser.set_default_op (Xapian::Query::OP_AND);
-
-		_qparser.add_valuerangeprocessor (&_date_range_processor);
-		_qparser.add_valuerangeprocessor (&_size_range_processor);
-
-		mu_msg_field_foreach ((MuMsgFieldForeachFunc)add_prefix,
-				      &_qparser);
-	}
-
-	~_MuQuery () { mu_store_unref (_store); }
+_MuQuery::_MuQuery (MuStore *store): _cache(QUERY_CACHE_SIZE),
+				     _store(mu_store_ref(store)), _tcache(0),
+				     _cancelled(0)
+{
+	_qparser.set_database (db());
+	_qparser.set_default_op (Xapian::Query::OP_AND);
 
-	Xapian::Database& db() const {
-		Xapian::Database* db;
-		db = reinterpret_cast<Xapian::Database*>
-			(mu_store_get_read_only_database (_store));
-		if (!db)
-			throw std::runtime_error ("no database");
-		return *db;
-	}
-	Xapian::QueryParser& query_parser () { return _qparser; }
+	_qparser.add_valuerangeprocessor (&_date_range_processor);
+	_qparser.add_valuerangeprocessor (&_size_range_processor);
 
-private:
-	Xapian::QueryParser	_qparser;
-	MuDateRangeProcessor	_date_range_processor;
-	MuSizeRangeProcessor	_size_range_processor;
+	mu_msg_field_foreach ((MuMsgFieldForeachFunc)add_prefix,
+			      &_qparser);
+}
 
-	MuStore *_store;
-};
 
 static const Xapian::Query
 get_query (MuQuery *mqx, const char* searchexpr, GError **err)
@@ -194,6 +54,9 @@ get_query (MuQuery *mqx, const char* searchexpr, GError **err)
 	Xapian::Query query;
 	char *preprocessed;
 
+	if (mqx->cache().lookup (searchexpr, mqx->state(), query))
+		return query;
+
 	preprocessed = mu_query_preprocess (searchexpr, err);
 	if (!preprocessed)
 		throw std::runtime_error
@@ -209,6 +72,8 @@ get_query (MuQuery *mqx, const char* searchexpr, GError **err)
 			 Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE
 			 );
 		g_free (preprocessed);
+		mqx->cache().insert (searchexpr, query);
+
 		return query;
 
 	} catch (...) {
@@ -221,6 +86,25 @@ get_query (MuQuery *mqx, const char* searchexpr, GError **err)
 
 
 
+static bool
+matches_all (const char *searchexpr)
+{
+	/* NULL or "" or """" */
+	return mu_str_is_empty (searchexpr) ||
+		g_strcmp0 (searchexpr, "\"\"") == 0;
+}
+
+
+const Xapian::Query
+mu_query_xapian_query (MuQuery *mqx, const char *searchexpr, GError **err)
+{
+	if (matches_all (searchexpr))
+		return Xapian::Query::MatchAll;
+	else
+		return get_query (mqx, searchexpr, err);
+}
+
+
 static void
 add_prefix (MuMsgFieldId mfid, Xapian::QueryParser* qparser)
 {
@@ -309,29 +193,72 @@ mu_query_preprocess (const char *query, GError **err)
 }
 
 
+/* we include the related messages for at most this many threads */
+#define MAX_RELATED_THREADS 1000
+
+/* expand the query, so it also matches all messages that are in the
+ * same thread as any of the messages that match query; we find those
+ * using their thread-id terms, so this requires only one extra query
+ * (with the thread-id as collapse key, so we get each thread only
+ * once). If there are too many threads, we include only the first
+ * MAX_RELATED_THREADS of them, in the sort order. */
+static Xapian::Query
+include_related (MuQuery *self, const Xapian::Query& query,
+		 MuMsgFieldId sortfieldid, bool revert)
+{
+	Xapian::Enquire enq (self->db());
+	Xapian::MSet threads;
+	Xapian::MSet::const_iterator it;
+	std::vector<Xapian::Query> terms;
+	const std::string pfx
+		(1, mu_msg_field_xapian_prefix (MU_MSG_FIELD_ID_THREAD_ID));
+
+	enq.set_query (query);
+	enq.set_collapse_key (MU_MSG_FIELD_ID_THREAD_ID);
+	if (sortfieldid != MU_MSG_FIELD_ID_NONE)
+		enq.set_sort_by_value ((Xapian::valueno)sortfieldid, revert);
+
+	threads = enq.get_mset (0, MAX_RELATED_THREADS);
+	for (it = threads.begin(); it != threads.end(); ++it)
+		if (!it.get_collapse_key().empty())
+			terms.push_back (Xapian::Query
+					 (pfx + it.get_collapse_key()));
+	if (terms.empty())
+		return query;
+
+	return Xapian::Query (Xapian::Query::OP_OR, query,
+			      Xapian::Query (Xapian::Query::OP_OR,
+					     terms.begin(), terms.end()));
+}
+
+
 /* this function is for handling the case where a DatabaseModified
  * exception is raised. We try to reopen the database, and run the
  * query again. */
 static MuMsgIter *
-try_requery (MuQuery *self, const char* searchexpr, gboolean threads,
-	     MuMsgFieldId sortfieldid, gboolean revert, int maxnum,
-	     GError **err)
+try_requery (MuQuery *self, const char* searchexpr, MuMsgFieldId sortfieldid,
+	     int maxnum, MuQueryFlags flags, GError **err)
 {
 	try {
 		/* let's assume that infinite regression is
 		 * impossible */
 		self->db().reopen();
+		/* wildcard expansions may be different now, and
+		 * so may the messages */
+		self->cache().clear ();
+		if (self->thread_cache())
+			mu_thread_cache_clear (self->thread_cache());
 		MU_WRITE_LOG ("reopening db after modification");
-		return mu_query_run (self, searchexpr, threads, sortfieldid,
-				     revert, maxnum, err);
+		return mu_query_run (self, searchexpr, sortfieldid, maxnum,
+				     flags, err);
 
 	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN (err, MU_ERROR_XAPIAN, 0);
 }
 
 
 MuMsgIter*
-mu_query_run (MuQuery *self, const char* searchexpr, gboolean threads,
-	      MuMsgFieldId sortfieldid, gboolean revert, int maxnum,
+mu_query_run (MuQuery *self, const char* searchexpr,
+	      MuMsgFieldId sortfieldid, int maxnum, MuQueryFlags flags,
 	      GError **err)
 {
 	g_return_val_if_fail (self, NULL);
@@ -341,32 +268,66 @@ mu_query_run (MuQuery *self, const char* searchexpr, gboolean threads,
 			      NULL);
 	try {
 		MuMsgIter *iter;
+		MuMsgIterFlags iflags;
+		size_t doccount;
+		bool threads, revert;
 		Xapian::Enquire enq (self->db());
 
+		iflags = MU_MSG_ITER_FLAG_NONE;
+		if (flags & MU_QUERY_FLAG_CONVERSATIONS) {
+			iflags |= MU_MSG_ITER_FLAG_CONVERSATIONS;
+			/* by default, show the latest message of each
+			 * conversation */
+			if (sortfieldid == MU_MSG_FIELD_ID_NONE) {
+				sortfieldid = MU_MSG_FIELD_ID_DATE;
+				flags = (MuQueryFlags)
+					(flags | MU_QUERY_FLAG_DESCENDING);
+			}
+		} else if (flags & MU_QUERY_FLAG_THREADS) {
+			iflags |= MU_MSG_ITER_FLAG_THREADS;
+			if (flags & MU_QUERY_FLAG_GROUP_SUBJECTS)
+				iflags |= MU_MSG_ITER_FLAG_GROUP_SUBJECTS;
+		}
+		if (flags & MU_QUERY_FLAG_DESCENDING)
+			iflags |= MU_MSG_ITER_FLAG_DESCENDING;
+
+		threads = iflags & MU_MSG_ITER_FLAG_THREADS;
+		revert	= flags & MU_QUERY_FLAG_DESCENDING;
+
 		/* note, when our result will be *threaded*, we sort
 		 * in our threading code (mu-threader etc.), and don't
 		 * let Xapian do any sorting */
 		if (!threads && sortfieldid != MU_MSG_FIELD_ID_NONE)
 			enq.set_sort_by_value ((Xapian::valueno)sortfieldid,
-					       revert ? true : false);
-		if (!mu_str_is_empty(searchexpr) &&
-		    g_strcmp0 (searchexpr, "\"\"") != 0) /* NULL or "" or """" */
-			enq.set_query(get_query (self, searchexpr, err));
+					       revert);
+		if (flags & MU_QUERY_FLAG_INCLUDE_RELATED)
+			enq.set_query (include_related
+				       (self,
+					mu_query_xapian_query (self, searchexpr,
+							       err),
+					sortfieldid, revert));
 		else
-			enq.set_query(Xapian::Query::MatchAll);
-
+			enq.set_query (mu_query_xapian_query (self, searchexpr,
+							      err));
 		enq.set_cutoff(0,0);
 
+		/* when threading, we need all the matches to
+		 * determine the threads, even if we only want a few of
+		 * them */
+		doccount = self->db().get_doccount();
 		iter = mu_msg_iter_new (
 			reinterpret_cast<XapianEnquire*>(&enq),
-			maxnum <= 0 ? self->db().get_doccount() : maxnum,
-			threads, threads ? sortfieldid : MU_MSG_FIELD_ID_NONE,
-			revert,	err);
+			reinterpret_cast<XapianDatabase*>(&self->db()),
+			threads || maxnum <= 0 ? doccount : maxnum,
+			maxnum <= 0 ? doccount : maxnum,
+			threads ? sortfieldid : MU_MSG_FIELD_ID_NONE,
+			self->thread_cache(), self->cancel_flag(), iflags,
+			err);
 
 		if (err && *err && (*err)->code == MU_ERROR_XAPIAN_MODIFIED) {
 			g_clear_error (err);
-			return try_requery (self, searchexpr, threads, sortfieldid,
-					    revert, maxnum, err);
+			return try_requery (self, searchexpr, sortfieldid,
+					    maxnum, flags, err);
 		} else
 			return iter;
 
@@ -374,6 +335,71 @@ mu_query_run (MuQuery *self, const char* searchexpr, gboolean threads,
 }
 
 
+static unsigned
+count_matches (MuQuery *self, const char *searchexpr, bool estimate,
+	       GError **err)
+{
+	/* there's no need to search when we match everything */
+	if (matches_all (searchexpr))
+		return self->db().get_doccount();
+
+	Xapian::Enquire enq (self->db());
+	enq.set_query (get_query (self, searchexpr, err));
+
+	/* we only want the number of matches, not the matches
+	 * themselves, hence the zero-sized mset. By default, xapian
+	 * only gives an estimate; to get the exact number we ask it
+	 * to check at least as many documents as there are in the
+	 * database */
+	Xapian::MSet mset (enq.get_mset
+			   (0, 0, estimate ? 0 : self->db().get_doccount()));
+
+	return estimate ? mset.get_matches_estimated() :
+		mset.get_matches_lower_bound();
+}
+
+
+static unsigned
+count_matches_maybe_requery (MuQuery *self, const char *searchexpr,
+			     bool estimate, GError **err)
+{
+	try {
+		try {
+			return count_matches (self, searchexpr, estimate, err);
+
+		} catch (const Xapian::DatabaseModifiedError&) {
+			/* as in try_requery, reopen once and try again */
+			self->db().reopen();
+			self->cache().clear ();
+			MU_WRITE_LOG ("reopening db after modification");
+			return count_matches (self, searchexpr, estimate, err);
+		}
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN (err, MU_ERROR_XAPIAN,
+						(unsigned)-1);
+}
+
+
+unsigned
+mu_query_count (MuQuery *self, const char *searchexpr, GError **err)
+{
+	g_return_val_if_fail (self, (unsigned)-1);
+	g_return_val_if_fail (searchexpr, (unsigned)-1);
+
+	return count_matches_maybe_requery (self, searchexpr, false, err);
+}
+
+
+unsigned
+mu_query_count_estimate (MuQuery *self, const char *searchexpr, GError **err)
+{
+	g_return_val_if_fail (self, (unsigned)-1);
+	g_return_val_if_fail (searchexpr, (unsigned)-1);
+
+	return count_matches_maybe_requery (self, searchexpr, true, err);
+}
+
+
 char*
 mu_query_as_string (MuQuery *self, const char *searchexpr, GError **err)
 {
@@ -386,3 +412,33 @@ mu_query_as_string (MuQuery *self, const char *searchexpr, GError **err)
 
 	} MU_XAPIAN_CATCH_BLOCK_RETURN(NULL);
 }
+
+
+void
+mu_query_cache_stats (MuQuery *self, unsigned *hits, unsigned *misses)
+{
+	g_return_if_fail (self);
+
+	if (hits)
+		*hits = self->cache().hits();
+	if (misses)
+		*misses = self->cache().misses();
+}
+
+
+void
+mu_query_set_thread_cache (MuQuery *self, MuThreadCache *tcache)
+{
+	g_return_if_fail (self);
+
+	self->set_thread_cache (tcache);
+}
+
+
+void
+mu_query_set_cancel_flag (MuQuery *self, volatile gint *cancelled)
+{
+	g_return_if_fail (self);
+
+	self->set_cancel_flag (cancelled);
+}
@@ -30,6 +30,31 @@ G_BEGIN_DECLS
 struct _MuQuery;
 typedef struct _MuQuery MuQuery;
 
+enum _MuQueryFlags {
+	MU_QUERY_FLAG_NONE		= 0,
+	/* calculate the message threads */
+	MU_QUERY_FLAG_THREADS		= 1 << 0,
+	/* sort in descending (Z-A) order */
+	MU_QUERY_FLAG_DESCENDING	= 1 << 1,
+	/* give one message per thread ('conversation'); this
+	 * overrides MU_QUERY_FLAG_THREADS. The threads are based on
+	 * the thread-ids given at indexing time (the first
+	 * reference); these approximate the ones the threader
+	 * finds, but messages with partial references may end up
+	 * in a thread of their own */
+	MU_QUERY_FLAG_CONVERSATIONS	= 1 << 2,
+	/* also give the messages that are in the same thread as
+	 * any of the matches (for at most 1000 threads); this uses
+	 * the same thread-ids as MU_QUERY_FLAG_CONVERSATIONS, so it
+	 * may miss some messages the threader would put in the
+	 * thread */
+	MU_QUERY_FLAG_INCLUDE_RELATED	= 1 << 3,
+	/* when threading, also group threads with the same subject
+	 * (see mu_threader_group_subjects) */
+	MU_QUERY_FLAG_GROUP_SUBJECTS	= 1 << 4
+};
+typedef enum _MuQueryFlags MuQueryFlags;
+
 /**
  * create a new MuQuery instance.
  *
@@ -70,13 +95,15 @@ char* mu_query_version (MuQuery *store)
  *
  * @param self a valid MuQuery instance
  * @param expr the search expression; use "" to match all messages
- * @param threads calculate message-threads
  * @param sortfield the field id to sort by or MU_MSG_FIELD_ID_NONE if
- * sorting is not desired
- * @param reverse if TRUE, sort in descending (Z-A) order, otherwise,
- * sort in descending (A-Z) order
+ * sorting is not desired; for conversations, the default is to sort by
+ * date, newest first, so each conversation is represented by its
+ * latest message
  * @param maxnum maximum number of search results to return, or <= 0 for
- * unlimited
+ * unlimited; when threading, all matches are used for determining the
+ * threads, and the complete threads for the first maxnum messages are
+ * returned. For conversations, it's the maximum number of conversations.
+ * @param flags bitwise OR of MuQueryFlags
  * @param err receives error information (if there is any); if
  * function returns non-NULL, err will _not_be set. err can be NULL
  * possible error (err->code) is MU_ERROR_QUERY,
@@ -84,13 +111,114 @@ char* mu_query_version (MuQuery *store)
  * @return a MuMsgIter instance you can iterate over, or NULL in
  * case of error
  */
-MuMsgIter* mu_query_run (MuQuery *self, const char* expr, gboolean threads,
-			 MuMsgFieldId sortfieldid, gboolean ascending, int maxnum,
-			 GError **err)
+MuMsgIter* mu_query_run (MuQuery *self, const char* expr,
+			 MuMsgFieldId sortfieldid, int maxnum,
+			 MuQueryFlags flags, GError **err)
     G_GNUC_MALLOC G_GNUC_WARN_UNUSED_RESULT;
 
 
 
+/**
+ * get the number of messages matching a query, without retrieving
+ * the messages themselves.
+ *
+ * @param self a valid MuQuery instance
+ * @param expr the search expression; use "" to match all messages
+ * @param err receives error information (if there is any); if
+ * function returns non-NULL, err will _not_be set. err can be NULL
+ *
+ * @return the exact number of matches, or (unsigned)-1 in case of error
+ */
+unsigned mu_query_count (MuQuery *self, const char* expr, GError **err);
+
+/**
+ * like mu_query_count, but only return an estimate of the number of
+ * matches; this is (much) faster for big result sets. Note that for
+ * small result sets, the estimate is typically exact.
+ *
+ * @param self a valid MuQuery instance
+ * @param expr the search expression; use "" to match all messages
+ * @param err receives error information (if there is any); if
+ * function returns non-NULL, err will _not_be set. err can be NULL
+ *
+ * @return the estimated number of matches, or (unsigned)-1 in case
+ * of error
+ */
+unsigned mu_query_count_estimate (MuQuery *self, const char* expr,
+				  GError **err);
+
+
+enum _MuQueryFacet {
+	MU_QUERY_FACET_NONE	= 0,
+
+	MU_QUERY_FACET_MAILDIR	= 1 << 0,
+	MU_QUERY_FACET_FLAG	= 1 << 1,
+	MU_QUERY_FACET_YEAR	= 1 << 2,	/* e.g. 2012 */
+	MU_QUERY_FACET_MONTH	= 1 << 3,	/* 1..12 */
+	MU_QUERY_FACET_WEEKDAY	= 1 << 4,	/* 0..6, 0 = Sunday */
+	MU_QUERY_FACET_FROM	= 1 << 5,
+	MU_QUERY_FACET_SIZE	= 1 << 6	/* lower bound of the
+						 * size bucket, in bytes */
+};
+typedef enum _MuQueryFacet MuQueryFacet;
+
+#define MU_QUERY_FACET_ALL ((MuQueryFacet)((1 << 7) - 1))
+
+/**
+ * get the name of a facet (e.g., "maildir" for MU_QUERY_FACET_MAILDIR)
+ *
+ * @param facet a single MuQueryFacet
+ *
+ * @return the name or NULL if not found
+ */
+const char* mu_query_facet_name (MuQueryFacet facet);
+
+/**
+ * get the facets for a comma-separated list of facet names, such as
+ * "maildir,flag,year"; "all" means all of them
+ *
+ * @param str a string with facet names
+ *
+ * @return the facets, or MU_QUERY_FACET_NONE if any of the names was
+ * not recognized
+ */
+MuQueryFacet mu_query_facets_from_str (const char *str);
+
+/**
+ * whether the values for some facet are numbers
+ *
+ * @param facet a single MuQueryFacet
+ *
+ * @return TRUE if the values are numeric, FALSE otherwise
+ */
+gboolean mu_query_facet_is_numeric (MuQueryFacet facet);
+
+
+typedef void (*MuQueryFacetForeachFunc) (MuQueryFacet facet, const char *val,
+					 unsigned count, gpointer user_data);
+/**
+ * count the messages matching some query by some facets (maildir,
+ * flags, date, sender, size); this is done in a single pass over the
+ * matches, without retrieving the messages themselves.
+ *
+ * Dates are in local time; flags are counted per flag, so a message
+ * counts for each of its flags.
+ *
+ * @param self a valid MuQuery instance
+ * @param expr the search expression; use "" to match all messages
+ * @param facets the facets to count (OR'ed MuQueryFacet values)
+ * @param func function to call for each facet/value; for each facet,
+ * it is called in ascending order of the values
+ * @param user_data user pointer passed to func
+ * @param err receives error information (if there is any); err can
+ * be NULL
+ *
+ * @return TRUE if it worked, FALSE otherwise
+ */
+gboolean mu_query_facets (MuQuery *self, const char *expr, MuQueryFacet facets,
+			  MuQueryFacetForeachFunc func, gpointer user_data,
+			  GError **err);
+
 
 /**
  * get a string representation of the Xapian search query
@@ -106,6 +234,49 @@ MuMsgIter* mu_query_run (MuQuery *self, const char* expr, gboolean threads,
 char* mu_query_as_string (MuQuery *self, const char* searchexpr, GError **err)
     G_GNUC_MALLOC G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * get statistics about the cache of parsed queries; MuQuery keeps
+ * the most recently used parsed queries around, as long as the
+ * underlying store does not change.
+ *
+ * @param self a MuQuery instance
+ * @param hits receives the number of cache hits, or NULL
+ * @param misses receives the number of cache misses, or NULL
+ */
+void mu_query_cache_stats (MuQuery *self, unsigned *hits, unsigned *misses);
+
+
+/**
+ * use a thread cache for threaded queries (see mu-thread-cache.h);
+ * the cache gets the threading information for the messages that are
+ * not in there yet, so re-running threaded queries becomes cheaper.
+ * The caller must remove messages from the cache when it changes or
+ * removes them; MuQuery only clears the cache when it has to reopen
+ * the database.
+ *
+ * @param self a MuQuery instance
+ * @param tcache a thread cache (which must outlive its use by
+ * MuQuery; it is not freed with the MuQuery), or NULL to not use a cache
+ */
+void mu_query_set_thread_cache (MuQuery *self, MuThreadCache *tcache);
+
+
+/**
+ * let another thread cancel the queries run with mu_query_run; when
+ * *cancelled becomes non-zero, the threading of the results is
+ * abandoned (and mu_query_run returns NULL with MU_ERROR_CANCELLED),
+ * and iterating over the results stops, as if there were no more
+ * matches. The caller should reset the flag to 0 before running the
+ * next query.
+ *
+ * @param self a MuQuery instance
+ * @param cancelled pointer to a flag that is read with
+ * g_atomic_int_get (which must outlive its use by MuQuery), or NULL
+ * to make queries not cancellable
+ */
+void mu_query_set_cancel_flag (MuQuery *self, volatile gint *cancelled);
+
+
 /**
  * pre-process the query; this function is useful mainly for debugging mu
  *
@@ -35,6 +35,8 @@
 #define MU_CACHE_DIRNAME        "cache"
 #define MU_CONTACTS_FILENAME	"contacts"
 #define MU_LOG_DIRNAME		"log"
+#define MU_SOCKET_FILENAME	"server.sock"
+#define MU_SPOOL_DIRNAME	"spool"
 
 
 struct _MuRuntimeData {
@@ -156,6 +158,12 @@ create_dirs_maybe (MuRuntimeData *data)
 		return FALSE;
 	}
 
+	if (!mu_util_create_dir_maybe
+	    (data->_str[MU_RUNTIME_PATH_SPOOL], 0700, TRUE)) {
+		g_warning ("failed to create spool dir");
+		return FALSE;
+	}
+
 	return TRUE;
 }
 
@@ -184,6 +192,14 @@ init_paths (const char* muhome, MuRuntimeData *data)
 		g_strdup_printf ("%s%c%s", muhome,
 				 G_DIR_SEPARATOR, MU_LOG_DIRNAME);
 
+	data->_str [MU_RUNTIME_PATH_SOCKET] =
+		g_strdup_printf ("%s%c%s", muhome,
+				 G_DIR_SEPARATOR, MU_SOCKET_FILENAME);
+
+	data->_str [MU_RUNTIME_PATH_SPOOL] =
+		g_strdup_printf ("%s%c%s", muhome,
+				 G_DIR_SEPARATOR, MU_SPOOL_DIRNAME);
+
 	if (!create_dirs_maybe (data))
 		return FALSE;
 
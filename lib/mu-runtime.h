@@ -68,6 +68,8 @@ enum _MuRuntimePath {
 	MU_RUNTIME_PATH_CACHE,      /* mu cache path */
 	MU_RUNTIME_PATH_LOG,        /* mu path for log files */
 	MU_RUNTIME_PATH_CONTACTS,   /* mu path to the contacts cache */
+	MU_RUNTIME_PATH_SOCKET,     /* the socket for 'mu server --daemon' */
+	MU_RUNTIME_PATH_SPOOL,      /* the spool for 'mu add', 'mu remove' */
 
 	MU_RUNTIME_PATH_NUM
 };
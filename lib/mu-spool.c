@@ -0,0 +1,250 @@
+/* -*-mode: c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-*/
+/*
+** Copyright (C) 2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+#include "mu-spool.h"
+
+/*
+ * each request is a file in the spool directory; sorting the names
+ * gives us the order in which the requests were made. The file
+ * contains the operation ("add" or "remove") on the first line,
+ * followed by the path of the message.
+ *
+ * we write the request to a hidden file first, and rename it when it's
+ * complete, so whoever handles the requests never sees half of one.
+ * We don't fsync; if a request gets lost in a crash, the next 'mu
+ * index' picks up the message anyway.
+ */
+
+static const char*
+op_name (MuSpoolOp op)
+{
+	switch (op) {
+	case MU_SPOOL_OP_ADD:	 return "add";
+	case MU_SPOOL_OP_REMOVE: return "remove";
+	default:
+		g_return_val_if_reached (NULL);
+	}
+}
+
+
+static gboolean
+write_request (const char *path, const char *contents, GError **err)
+{
+	int fd;
+	size_t len;
+	ssize_t rv;
+
+	fd = g_open (path, O_WRONLY|O_CREAT|O_EXCL, 0600);
+	if (fd == -1)
+		goto errexit;
+
+	for (len = strlen (contents); len > 0; len -= rv, contents += rv) {
+		rv = write (fd, contents, len);
+		if (rv == -1 && errno == EINTR)
+			rv = 0;
+		else if (rv == -1) {
+			close (fd);
+			g_unlink (path);
+			goto errexit;
+		}
+	}
+
+	if (close (fd) == 0)
+		return TRUE;
+
+	g_unlink (path);
+errexit:
+	mu_util_g_set_error (err, MU_ERROR_FILE_CANNOT_CREATE,
+			     "cannot write %s: %s", path, strerror (errno));
+	return FALSE;
+}
+
+
+gboolean
+mu_spool_add (const char *spooldir, MuSpoolOp op, const char *path,
+	      GError **err)
+{
+	static unsigned seq = 0;
+	GTimeVal tv;
+	char *name, *reqpath, *tmppath, *contents;
+	gboolean rv;
+
+	g_return_val_if_fail (spooldir, FALSE);
+	g_return_val_if_fail (path, FALSE);
+	g_return_val_if_fail (op_name (op), FALSE);
+
+	g_get_current_time (&tv);
+	name	 = g_strdup_printf ("%010lu.%06lu.%u.%u",
+				    (unsigned long)tv.tv_sec,
+				    (unsigned long)tv.tv_usec,
+				    (unsigned)getpid (), seq++);
+	reqpath	 = g_strdup_printf ("%s%c%s", spooldir, G_DIR_SEPARATOR, name);
+	tmppath	 = g_strdup_printf ("%s%c.%s", spooldir, G_DIR_SEPARATOR, name);
+	contents = g_strdup_printf ("%s\n%s", op_name (op), path);
+
+	rv = write_request (tmppath, contents, err);
+	if (rv && g_rename (tmppath, reqpath) != 0) {
+		mu_util_g_set_error (err, MU_ERROR_FILE,
+				     "cannot rename %s: %s", tmppath,
+				     strerror (errno));
+		g_unlink (tmppath);
+		rv = FALSE;
+	}
+
+	g_free (contents);
+	g_free (tmppath);
+	g_free (reqpath);
+	g_free (name);
+
+	return rv;
+}
+
+
+static int
+cmp_names (const char **name1, const char **name2)
+{
+	return strcmp (*name1, *name2);
+}
+
+/* get the names of the requests, oldest first */
+static GPtrArray*
+get_requests (const char *spooldir, GError **err)
+{
+	GDir *dir;
+	GPtrArray *names;
+	const char *name;
+
+	dir = g_dir_open (spooldir, 0, err);
+	if (!dir)
+		return NULL;
+
+	names = g_ptr_array_new_with_free_func ((GDestroyNotify)g_free);
+	while ((name = g_dir_read_name (dir)))
+		if (name[0] != '.') /* not ready yet */
+			g_ptr_array_add (names, g_strdup (name));
+	g_dir_close (dir);
+
+	g_ptr_array_sort (names, (GCompareFunc)cmp_names);
+
+	return names;
+}
+
+
+static MuError
+handle_request (const char *reqpath, MuSpoolForeachFunc func,
+		gpointer user_data)
+{
+	char *contents, *path;
+	MuError rv;
+
+	/* it's gone; nothing to do */
+	if (!g_file_get_contents (reqpath, &contents, NULL, NULL))
+		return MU_OK;
+
+	path = strchr (contents, '\n');
+	if (path)
+		*path++ = '\0';
+
+	if (path && g_strcmp0 (contents, op_name (MU_SPOOL_OP_ADD)) == 0)
+		rv = func (MU_SPOOL_OP_ADD, path, user_data);
+	else if (path &&
+		 g_strcmp0 (contents, op_name (MU_SPOOL_OP_REMOVE)) == 0)
+		rv = func (MU_SPOOL_OP_REMOVE, path, user_data);
+	else {
+		g_warning ("invalid request in spool: %s", reqpath);
+		rv = MU_OK; /* get rid of it */
+	}
+
+	g_free (contents);
+
+	return rv;
+}
+
+
+int
+mu_spool_foreach (const char *spooldir, MuSpoolForeachFunc func,
+		  gpointer user_data, GError **err)
+{
+	GPtrArray *names;
+	unsigned u;
+	int num;
+
+	g_return_val_if_fail (spooldir, -1);
+	g_return_val_if_fail (func, -1);
+
+	names = get_requests (spooldir, err);
+	if (!names)
+		return -1;
+
+	for (u = 0, num = 0; u != names->len; ++u) {
+
+		char *reqpath;
+		MuError rv;
+
+		reqpath = g_strdup_printf ("%s%c%s", spooldir, G_DIR_SEPARATOR,
+					   (char*)g_ptr_array_index (names, u));
+		rv = handle_request (reqpath, func, user_data);
+		if (rv != MU_STOP) {
+			g_unlink (reqpath);
+			++num;
+		}
+		g_free (reqpath);
+
+		if (rv == MU_STOP)
+			break;
+	}
+
+	g_ptr_array_free (names, TRUE);
+
+	return num;
+}
+
+
+static MuError
+each_request (MuSpoolOp op, const char *path, MuStore *store)
+{
+	if (op == MU_SPOOL_OP_ADD) {
+		if (mu_store_add_path (store, path, NULL, NULL) ==
+		    MU_STORE_INVALID_DOCID)
+			MU_WRITE_LOG ("spool: failed to add %s", path);
+	} else if (!mu_store_remove_path (store, path))
+		MU_WRITE_LOG ("spool: failed to remove %s", path);
+
+	/* either way, we're done with it */
+	return MU_OK;
+}
+
+
+int
+mu_spool_drain (const char *spooldir, MuStore *store, GError **err)
+{
+	g_return_val_if_fail (spooldir, -1);
+	g_return_val_if_fail (store, -1);
+
+	return mu_spool_foreach (spooldir, (MuSpoolForeachFunc)each_request,
+				 store, err);
+}
@@ -0,0 +1,96 @@
+/*
+** Copyright (C) 2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#ifndef __MU_SPOOL_H__
+#define __MU_SPOOL_H__
+
+#include <glib.h>
+#include <mu-store.h>
+#include <mu-util.h>
+
+G_BEGIN_DECLS
+
+/*
+ * the spool is a directory where 'mu add' and 'mu remove' leave their
+ * requests when some other process (such as 'mu index' or 'mu server')
+ * has the store open for writing; that process then handles them
+ * as part of what it's doing anyway. Putting a request in the spool
+ * does not touch the database at all, so it's very cheap.
+ */
+
+enum _MuSpoolOp {
+	MU_SPOOL_OP_ADD,	/* add (or update) a message */
+	MU_SPOOL_OP_REMOVE	/* remove a message from the database */
+};
+typedef enum _MuSpoolOp MuSpoolOp;
+
+/**
+ * put a request in the spool
+ *
+ * @param spooldir the spool directory
+ * @param op the operation
+ * @param path the full path to the message
+ * @param err receives error information, or NULL
+ *
+ * @return TRUE if it succeeded, FALSE otherwise
+ */
+gboolean mu_spool_add (const char *spooldir, MuSpoolOp op, const char *path,
+		       GError **err);
+
+/**
+ * callback function for mu_spool_foreach
+ *
+ * @param op the operation
+ * @param path the full path to the message
+ * @param user_data user pointer
+ *
+ * @return MU_STOP to stop (the request stays in the spool), anything
+ * else to remove the request and continue with the next one
+ */
+typedef MuError (*MuSpoolForeachFunc) (MuSpoolOp op, const char *path,
+				       gpointer user_data);
+
+/**
+ * handle the requests in the spool, in the order in which they were
+ * made, and remove them
+ *
+ * @param spooldir the spool directory
+ * @param func function to call for each request
+ * @param user_data user pointer passed to func
+ * @param err receives error information, or NULL
+ *
+ * @return the number of requests handled, or -1 in case of error
+ */
+int mu_spool_foreach (const char *spooldir, MuSpoolForeachFunc func,
+		      gpointer user_data, GError **err);
+
+/**
+ * add and remove the messages for the requests in the spool
+ *
+ * @param spooldir the spool directory
+ * @param store a writable store
+ * @param err receives error information, or NULL
+ *
+ * @return the number of requests handled, or -1 in case of error
+ */
+int mu_spool_drain (const char *spooldir, MuStore *store, GError **err);
+
+G_END_DECLS
+
+#endif /*__MU_SPOOL_H__*/
@@ -29,6 +29,8 @@
 #include <xapian.h>
 #include <cstring>
 #include <stdexcept>
+#include <vector>
+#include <set>
 
 #include "mu-store.h"
 #include "mu-contacts.h"
@@ -97,6 +99,8 @@ public:
 		_processed	= 0;
 		_read_only      = read_only;
 		_ref_count      = 1;
+		_revision       = 0;
+		_uid_filter     = false;
 		_version        = NULL;
 	}
 
@@ -163,11 +167,26 @@ public:
 		// clear the contacts cache
 		if (_contacts)
 			mu_contacts_clear (_contacts);
+
+		drop_uid_filter ();
+
+		inc_revision ();
+	}
+
+	/* get a unique id for this message, ie. a 64-bit hash of its
+	 * real path */
+	guint64 get_uid (const char *path);
+
+	/* get the term for a unique id; note, this function returns
+	 * a static buffer -- not reentrant */
+	const char *get_uid_term (guint64 uid);
+	const char *get_uid_term (const char *path) {
+		return get_uid_term (get_uid (path));
 	}
 
-	/* get a unique id for this message; note, this function returns a
-	 * static buffer -- not reentrant */
-	const char *get_uid_term (const char *path);
+	/* get the term for a message-id, as added to the documents
+	 * for the msgid field */
+	std::string get_msgid_term (const char *msgid);
 
 	MuContacts* contacts() { return _contacts; }
 
@@ -183,6 +202,17 @@ public:
 
 	static unsigned max_term_length() { return MAX_TERM_LENGTH; }
 
+	/* the uid filter holds the uids of all messages in memory, so
+	 * mu_store_contains_message does not need the database; we
+	 * keep it up to date with the messages we add and remove, but
+	 * it's only meant for the duration of an index run */
+	void load_uid_filter ();
+	void drop_uid_filter ();
+	bool has_uid_filter () const { return _uid_filter; }
+	bool uid_filter_contains (guint64 uid) const;
+	void uid_filter_add (guint64 uid);
+	void uid_filter_remove (guint64 uid);
+
 	void begin_transaction ();
 	void commit_transaction ();
 	void rollback_transaction ();
@@ -210,6 +240,12 @@ public:
 	int    set_processed (int n) { return _processed = n;}
 	int    inc_processed () { return ++_processed; }
 
+	/* the revision is increased for every change we make to the
+	 * database through this store, so users can tell whether
+	 * anything they cached is still valid */
+	guint64 revision () const { return _revision; }
+	guint64 inc_revision () { return ++_revision; }
+
 	/* MuStore is ref-counted */
 	guint  ref   () { return ++_ref_count; }
 	guint  unref () {
@@ -240,6 +276,13 @@ private:
 	Xapian::Database *_db;
 	bool _read_only;
 	guint _ref_count;
+	guint64 _revision;
+
+	/* the uid filter: the uids found when it was loaded (sorted),
+	 * and the ones added since */
+	bool _uid_filter;
+	std::vector<guint64> _uids;
+	std::set<guint64> _uids_added;
 
 	GSList *_my_addresses;
 };
@@ -29,6 +29,8 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <algorithm>
+#include <vector>
 
 #include "mu-store.h"
 #include "mu-store-priv.hh" /* _MuStore */
@@ -43,9 +45,8 @@
 #include "mu-contacts.h"
 
 
-// note: not re-entrant
-const char*
-_MuStore::get_uid_term (const char* path)
+guint64
+_MuStore::get_uid (const char* path)
 {
 	// combination of DJB, BKDR hash functions to get a 64 bit
 	// value
@@ -53,9 +54,6 @@ _MuStore::get_uid_term (const char* path)
 	unsigned u;
 
 	char real_path[PATH_MAX + 1];
-	static char hex[18];
-	static const char uid_prefix =
-		mu_msg_field_xapian_prefix(MU_MSG_FIELD_ID_UID);
 
 	/* check profile to see if realpath is expensive; we need
 	 * realpath here (and in mu-msg-file) to ensure that the same
@@ -75,13 +73,112 @@ _MuStore::get_uid_term (const char* path)
 		bkdrhash = bkdrhash * bkdrseed + real_path[u];
 	}
 
+	return ((guint64)djbhash << 32) | bkdrhash;
+}
+
+
+// note: not re-entrant
+const char*
+_MuStore::get_uid_term (guint64 uid)
+{
+	static char hex[18];
+	static const char uid_prefix =
+		mu_msg_field_xapian_prefix(MU_MSG_FIELD_ID_UID);
+
 	snprintf (hex, sizeof(hex), "%c%08x%08x",
-		  uid_prefix, djbhash, bkdrhash);
+		  uid_prefix, (unsigned)(uid >> 32), (unsigned)uid);
 
 	return hex;
 }
 
 
+void
+_MuStore::load_uid_filter ()
+{
+	static const std::string pfx
+		(1, mu_msg_field_xapian_prefix(MU_MSG_FIELD_ID_UID));
+	Xapian::TermIterator it;
+	const Xapian::Database& db (*db_read_only());
+
+	drop_uid_filter ();
+
+	/* the uid terms are consecutive in the term list, so we read
+	 * them in one sequential sweep; and they come out sorted
+	 * already */
+	_uids.reserve (db.get_doccount());
+	for (it = db.allterms_begin (pfx); it != db.allterms_end (pfx); ++it) {
+		const std::string term (*it);
+		if (term.length() == 17)
+			_uids.push_back (g_ascii_strtoull
+					 (term.c_str() + 1, NULL, 16));
+	}
+	std::sort (_uids.begin(), _uids.end());
+
+	_uid_filter = true;
+}
+
+
+bool
+_MuStore::uid_filter_contains (guint64 uid) const
+{
+	return std::binary_search (_uids.begin(), _uids.end(), uid) ||
+		_uids_added.find (uid) != _uids_added.end();
+}
+
+
+void
+_MuStore::uid_filter_add (guint64 uid)
+{
+	if (_uid_filter && !uid_filter_contains (uid))
+		_uids_added.insert (uid);
+}
+
+
+void
+_MuStore::uid_filter_remove (guint64 uid)
+{
+	std::vector<guint64>::iterator it;
+
+	if (!_uid_filter)
+		return;
+
+	/* removals are rare (the cleanup doesn't use the filter), so
+	 * we can afford moving the tail of the vector */
+	it = std::lower_bound (_uids.begin(), _uids.end(), uid);
+	if (it != _uids.end() && *it == uid)
+		_uids.erase (it);
+
+	_uids_added.erase (uid);
+}
+
+
+void
+_MuStore::drop_uid_filter ()
+{
+	std::vector<guint64>().swap (_uids);
+	_uids_added.clear ();
+
+	_uid_filter = false;
+}
+
+
+std::string
+_MuStore::get_msgid_term (const char *msgid)
+{
+	static const std::string pfx
+		(1, mu_msg_field_xapian_prefix(MU_MSG_FIELD_ID_MSGID));
+	char *esc;
+
+	/* this must match what add_terms_values_str in
+	 * mu-store-write.cc does */
+	esc = mu_str_xapian_escape (msgid, TRUE /*esc_space*/, NULL);
+	const std::string term (pfx + std::string(esc, 0, MAX_TERM_LENGTH));
+	g_free (esc);
+
+	return term;
+}
+
+
 MuStore*
 mu_store_new_read_only (const char* xpath, GError **err)
 {
@@ -126,6 +223,32 @@ mu_store_count (MuStore *store, GError **err)
 }
 
 
+guint64
+mu_store_revision (MuStore *store)
+{
+	g_return_val_if_fail (store, 0);
+
+	return store->revision ();
+}
+
+
+gboolean
+mu_store_reopen (MuStore *store, GError **err)
+{
+	g_return_val_if_fail (store, FALSE);
+	g_return_val_if_fail (store->is_read_only(), FALSE);
+
+	try {
+		store->db_read_only()->reopen ();
+		/* we can't tell whether anything changed, so assume
+		 * it did */
+		store->inc_revision ();
+		return TRUE;
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN (err, MU_ERROR_XAPIAN, FALSE);
+}
+
+
 const char*
 mu_store_version (MuStore *store)
 {
@@ -174,14 +297,53 @@ mu_store_contains_message (MuStore *store, const char* path, GError **err)
 	g_return_val_if_fail (path, FALSE);
 
 	try {
-		const std::string term (store->get_uid_term(path));
- 		return store->db_read_only()->term_exists (term) ? TRUE: FALSE;
+		const guint64 uid (store->get_uid(path));
+
+		/* during index walks, we have all the uids in memory */
+		if (store->has_uid_filter())
+			return store->uid_filter_contains (uid) ? TRUE : FALSE;
+
+		return store->db_read_only()->term_exists
+			(store->get_uid_term(uid)) ? TRUE: FALSE;
 
 	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN(err, MU_ERROR_XAPIAN, FALSE);
 
 }
 
 
+gboolean
+mu_store_load_uid_filter (MuStore *store, GError **err)
+{
+	g_return_val_if_fail (store, FALSE);
+
+	try {
+		store->load_uid_filter ();
+		return TRUE;
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN(err, MU_ERROR_XAPIAN, FALSE);
+}
+
+
+void
+mu_store_unload_uid_filter (MuStore *store)
+{
+	g_return_if_fail (store);
+
+	store->drop_uid_filter ();
+}
+
+
+/* get the first document for some term, straight from its posting
+ * list; this is much cheaper than a query (Enquire, MSet etc.) */
+static Xapian::docid
+first_docid_for_term (const Xapian::Database& db, const std::string& term)
+{
+	Xapian::PostingIterator it (db.postlist_begin (term));
+
+	return it == db.postlist_end (term) ? MU_STORE_INVALID_DOCID : *it;
+}
+
+
 unsigned
 mu_store_get_docid_for_path (MuStore *store, const char* path, GError **err)
 {
@@ -189,24 +351,126 @@ mu_store_get_docid_for_path (MuStore *store, const char* path, GError **err)
 	g_return_val_if_fail (path, FALSE);
 
 	try {
+		Xapian::docid docid;
 		const std::string term (store->get_uid_term(path));
-		Xapian::Query query (term);
-		Xapian::Enquire enq (*store->db_read_only());
 
-		enq.set_query (query);
-
-		Xapian::MSet mset (enq.get_mset (0,1));
-		if (mset.empty())
-			throw MuStoreError (MU_ERROR_NO_MATCHES,
-					    "message not found");
-
-		return *mset.begin();
+		docid = first_docid_for_term (*store->db_read_only(), term);
+		if (docid == MU_STORE_INVALID_DOCID)
+			mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
+					     "message not found");
+		return docid;
 
 	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN(err, MU_ERROR_XAPIAN,
 					       MU_STORE_INVALID_DOCID);
 }
 
 
+typedef std::vector<std::pair<std::string,size_t> > TermVec;
+
+gboolean
+mu_store_get_docids_for_paths (MuStore *store, const char **paths,
+			       size_t num, unsigned *docids, GError **err)
+{
+	g_return_val_if_fail (store, FALSE);
+	g_return_val_if_fail (paths || num == 0, FALSE);
+	g_return_val_if_fail (docids || num == 0, FALSE);
+
+	try {
+		TermVec terms;
+		TermVec::const_iterator it;
+		size_t u;
+
+		/* we look up the terms in sorted order, so we walk
+		 * through the posting lists table in one direction */
+		terms.reserve (num);
+		for (u = 0; u != num; ++u)
+			terms.push_back (std::make_pair
+					 (std::string(store->get_uid_term
+						      (paths[u])), u));
+		std::sort (terms.begin(), terms.end());
+
+		for (it = terms.begin(); it != terms.end(); ++it)
+			docids[it->second] = first_docid_for_term
+				(*store->db_read_only(), it->first);
+
+		return TRUE;
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN(err, MU_ERROR_XAPIAN, FALSE);
+}
+
+
+GSList*
+mu_store_get_docids_for_msgids (MuStore *store, const char **msgids,
+				size_t num, GError **err)
+{
+	g_return_val_if_fail (store, NULL);
+	g_return_val_if_fail (msgids || num == 0, NULL);
+
+	try {
+		TermVec terms;
+		TermVec::const_iterator it;
+		GSList *docids;
+		size_t u;
+
+		terms.reserve (num);
+		for (u = 0; u != num; ++u)
+			terms.push_back (std::make_pair
+					 (store->get_msgid_term (msgids[u]), u));
+		std::sort (terms.begin(), terms.end());
+
+		/* the same message-id can appear in multiple
+		 * messages; get all of them */
+		const Xapian::Database& db (*store->db_read_only());
+		docids = NULL;
+		for (it = terms.begin(); it != terms.end(); ++it) {
+			Xapian::PostingIterator post;
+			if (it != terms.begin() && it->first == (it - 1)->first)
+				continue; /* we have those already */
+			for (post = db.postlist_begin (it->first);
+			     post != db.postlist_end (it->first); ++post)
+				docids = g_slist_prepend
+					(docids, GSIZE_TO_POINTER(*post));
+		}
+
+		if (!docids)
+			mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
+					     "message not found");
+
+		return g_slist_reverse (docids);
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN(err, MU_ERROR_XAPIAN, NULL);
+}
+
+
+char*
+mu_store_get_path (MuStore *store, unsigned docid, GError **err)
+{
+	g_return_val_if_fail (store, NULL);
+	g_return_val_if_fail (docid != MU_STORE_INVALID_DOCID, NULL);
+
+	try {
+		const Xapian::Document doc
+			(store->db_read_only()->get_document (docid));
+		const std::string path
+			(doc.get_value (MU_MSG_FIELD_ID_PATH));
+
+		if (path.empty()) {
+			mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
+					     "no path for message %u", docid);
+			return NULL;
+		}
+
+		return g_strdup (path.c_str());
+
+	} catch (const Xapian::DocNotFoundError& dnfe) {
+		mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
+				     "message %u not found", docid);
+		return NULL;
+
+	} MU_XAPIAN_CATCH_BLOCK_G_ERROR_RETURN(err, MU_ERROR_XAPIAN, NULL);
+}
+
+
 
 time_t
 mu_store_get_timestamp (MuStore *store, const char *msgpath, GError **err)
@@ -237,21 +501,29 @@ mu_store_foreach (MuStore *self,
 	g_return_val_if_fail (func, MU_ERROR);
 
 	try {
-		Xapian::Enquire enq (*self->db_read_only());
-
-		enq.set_query  (Xapian::Query::MatchAll);
-		enq.set_cutoff (0,0);
-
-		Xapian::MSet matches
-			(enq.get_mset (0, self->db_read_only()->get_doccount()));
-		if (matches.empty())
-			return MU_OK; /* database is empty */
-
-		for (Xapian::MSet::iterator iter = matches.begin();
-		     iter != matches.end(); ++iter) {
-			Xapian::Document doc (iter.get_document());
-			const std::string path(doc.get_value(MU_MSG_FIELD_ID_PATH));
-			MuError res = func (path.c_str(), user_data);
+		const Xapian::Database& db (*self->db_read_only());
+		std::vector<Xapian::docid> docids;
+		std::vector<Xapian::docid>::const_iterator it;
+		Xapian::PostingIterator post;
+
+		/* the posting list for the empty term has all the
+		 * documents; no need for a query. We get the docids
+		 * first, as func may remove documents */
+		docids.reserve (db.get_doccount());
+		for (post = db.postlist_begin (""); post != db.postlist_end ("");
+		     ++post)
+			docids.push_back (*post);
+
+		for (it = docids.begin(); it != docids.end(); ++it) {
+			std::string path;
+			MuError res;
+			try {
+				path = db.get_document(*it).get_value
+					(MU_MSG_FIELD_ID_PATH);
+			} catch (const Xapian::DocNotFoundError&) {
+				continue; /* removed in the mean time */
+			}
+			res = func (path.c_str(), user_data);
 			if (res != MU_OK)
 				return res;
 		}
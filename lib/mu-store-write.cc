@@ -62,6 +62,9 @@ _MuStore::rollback_transaction () {
 	try {
 		in_transaction (false);
 		db_writable()->cancel_transaction();
+		/* the filter may have uids of messages that are gone
+		 * now */
+		drop_uid_filter ();
 	} MU_XAPIAN_CATCH_BLOCK;
 }
 
@@ -677,8 +680,8 @@ mu_store_add_msg (MuStore *store, MuMsg *msg, GError **err)
 	try {
 		Xapian::docid id;
 		Xapian::Document doc (new_doc_from_message(store, msg));
-		const std::string term (store->get_uid_term
-					(mu_msg_get_path(msg)));
+		const guint64 uid (store->get_uid (mu_msg_get_path(msg)));
+		const std::string term (store->get_uid_term (uid));
 
 		if (!store->in_transaction())
 			store->begin_transaction();
@@ -689,6 +692,8 @@ mu_store_add_msg (MuStore *store, MuMsg *msg, GError **err)
 
 		/* note, this will replace any other messages for this path */
 		id = store->db_writable()->replace_document (term, doc);
+		store->uid_filter_add (uid);
+		store->inc_revision ();
 
 		if (store->inc_processed() % store->batch_size() == 0)
 			store->commit_transaction();
@@ -722,6 +727,9 @@ mu_store_update_msg (MuStore *store, unsigned docid, MuMsg *msg, GError **err)
 		doc.add_term (term);
 
 		store->db_writable()->replace_document (docid, doc);
+		/* we don't know the uid the message had before */
+		store->drop_uid_filter ();
+		store->inc_revision ();
 
 		if (store->inc_processed() % store->batch_size() == 0)
 			store->commit_transaction();
@@ -775,11 +783,13 @@ mu_store_remove_path (MuStore *store, const char *msgpath)
 	g_return_val_if_fail (msgpath, FALSE);
 
 	try {
-		const std::string term
-			(store->get_uid_term(msgpath));
+		const guint64 uid (store->get_uid (msgpath));
 
-		store->db_writable()->delete_document (term);
+		store->db_writable()->delete_document
+			(store->get_uid_term (uid));
+		store->uid_filter_remove (uid);
 		store->inc_processed();
+		store->inc_revision ();
 
 		return TRUE;
 
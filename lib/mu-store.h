@@ -100,12 +100,6 @@ typedef gpointer XapianWritableDatabase;
 XapianWritableDatabase* mu_store_get_writable_database (MuStore *store);
 
 
-/**
- * we need this when using Xapian::WritableDatabase* from C
- */
-typedef gpointer XapianDatabase;
-
-
 /**
  * get the underlying read-only database object for this store; not that this
  * pointer becomes in valid after mu_store_destroy
@@ -155,6 +149,33 @@ void mu_store_set_my_addresses (MuStore *store, const char **my_addresses);
  */
 unsigned mu_store_count (MuStore *store, GError **err);
 
+
+/**
+ * get the revision of the store; this is a number that increases
+ * whenever a message is added to, updated in or removed from the
+ * database through this MuStore object. It can be used to check
+ * whether cached results are still valid.
+ *
+ * @param store a valid MuStore
+ *
+ * @return the revision number
+ */
+guint64 mu_store_revision (MuStore *store);
+
+
+/**
+ * reopen a read-only store, so it sees the latest changes that were
+ * committed to the database (e.g. by some other process or
+ * thread). A read-only store is a snapshot of the database as it was
+ * when it was opened (or reopened); this also increases the revision.
+ *
+ * @param store a valid, read-only MuStore
+ * @param err to receive error info or NULL. err->code is MuError value
+ *
+ * @return TRUE if reopening succeeded, FALSE otherwise
+ */
+gboolean mu_store_reopen (MuStore *store, GError **err);
+
 /**
  * get a version string for the database; it's a const string, which
  * is valid as long MuStore exists and mu_store_version is not called
@@ -248,6 +269,31 @@ gboolean mu_store_contains_message (MuStore *store,  const char* path,
 				    GError **err);
 
 
+/**
+ * read the ids of all messages in the store into memory (in one
+ * sequential sweep), so mu_store_contains_message can answer without
+ * looking in the database. This is useful when checking many
+ * messages, such as during an index run. Messages added or removed
+ * through this store are taken into account, until
+ * mu_store_unload_uid_filter is called.
+ *
+ * @param store a store
+ * @param err to receive error info or NULL. err->code is MuError value
+ *
+ * @return TRUE if the filter was loaded, FALSE otherwise
+ */
+gboolean mu_store_load_uid_filter (MuStore *store, GError **err);
+
+
+/**
+ * free the memory used by mu_store_load_uid_filter;
+ * mu_store_contains_message will use the database again
+ *
+ * @param store a store
+ */
+void mu_store_unload_uid_filter (MuStore *store);
+
+
 
 /**
  * get the docid for message at path
@@ -260,6 +306,58 @@ gboolean mu_store_contains_message (MuStore *store,  const char* path,
  * */
 unsigned mu_store_get_docid_for_path (MuStore *store, const char* path, GError **err);
 
+
+/**
+ * get the docids for a number of messages at once; this looks up the
+ * terms directly in the database (no query is involved), in sorted
+ * order, which is cheaper than getting them one-by-one
+ *
+ * @param store a store
+ * @param paths an array of num message paths
+ * @param num the number of paths
+ * @param docids an array of (at least) num elements, which receives
+ * the docid for each of the paths, or MU_STORE_INVALID_DOCID (0) for
+ * the ones that were not found
+ * @param err to receive error info or NULL. err->code is MuError value
+ *
+ * @return TRUE if the lookup succeeded, FALSE otherwise
+ */
+gboolean mu_store_get_docids_for_paths (MuStore *store, const char **paths,
+					size_t num, unsigned *docids,
+					GError **err);
+
+/**
+ * get the docids for all messages with one of the given
+ * message-ids. Like mu_store_get_docids_for_paths, this looks up the
+ * terms directly.
+ *
+ * @param store a store
+ * @param msgids an array of num message-ids
+ * @param num the number of message-ids
+ * @param err to receive error info or NULL. err->code is MuError value
+ *
+ * @return a list of docids (use GPOINTER_TO_SIZE to get them), or
+ * NULL if none of the message-ids was found (err->code is then
+ * MU_ERROR_NO_MATCHES) or in case of error; free with g_slist_free
+ */
+GSList* mu_store_get_docids_for_msgids (MuStore *store, const char **msgids,
+					size_t num, GError **err)
+	G_GNUC_WARN_UNUSED_RESULT;
+
+
+/**
+ * get the path of the message with the given docid, without creating
+ * a MuMsg for it
+ *
+ * @param store a store
+ * @param docid a docid
+ * @param err to receive error info or NULL. err->code is MuError value
+ *
+ * @return the path (free with g_free), or NULL in case of error
+ */
+char* mu_store_get_path (MuStore *store, unsigned docid, GError **err)
+	G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * store a timestamp for a directory
  *
@@ -528,28 +528,80 @@ mu_str_fullpath_s (const char* path, const char* name)
 }
 
 
-char*
-mu_str_escape_c_literal (const gchar* str, gboolean in_quotes)
+GString*
+mu_str_append_c_literal (GString *gstr, const gchar* str, gboolean in_quotes)
 {
-	const char* cur;
-	GString *tmp;
+	const char *cur, *run;
 
-	g_return_val_if_fail (str, NULL);
+	g_return_val_if_fail (gstr, NULL);
+	g_return_val_if_fail (str, gstr);
 
-	tmp = g_string_sized_new (2 * strlen(str));
+	if (in_quotes)
+		g_string_append_c (gstr, '"');
+
+	/* copy the runs of characters that don't need escaping in one
+	 * go */
+	for (run = cur = str; *cur; ++cur)
+		if (*cur == '\\' || *cur == '"') {
+			g_string_append_len (gstr, run, cur - run);
+			g_string_append_c (gstr, '\\');
+			run = cur;
+		}
+	g_string_append_len (gstr, run, cur - run);
 
 	if (in_quotes)
-		g_string_append_c (tmp, '"');
+		g_string_append_c (gstr, '"');
+
+	return gstr;
+}
+
+
+GString*
+mu_str_append_json_string (GString *gstr, const gchar* str)
+{
+	const char *cur, *run;
+
+	g_return_val_if_fail (gstr, NULL);
+	g_return_val_if_fail (str, gstr);
+
+	g_string_append_c (gstr, '"');
+
+	for (run = cur = str; *cur; ++cur) {
+
+		if (*cur != '\\' && *cur != '"' && (unsigned char)*cur >= 0x20)
+			continue;
+
+		g_string_append_len (gstr, run, cur - run);
+		run = cur + 1;
 
-	for (cur = str; *cur; ++cur)
 		switch (*cur) {
-		case '\\': tmp = g_string_append   (tmp, "\\\\"); break;
-		case '"':  tmp = g_string_append   (tmp, "\\\""); break;
-		default:   tmp = g_string_append_c (tmp, *cur);
+		case '\\': g_string_append (gstr, "\\\\"); break;
+		case '"':  g_string_append (gstr, "\\\""); break;
+		case '\n': g_string_append (gstr, "\\n"); break;
+		case '\r': g_string_append (gstr, "\\r"); break;
+		case '\t': g_string_append (gstr, "\\t"); break;
+		default:
+			g_string_append_printf (gstr, "\\u%04x",
+						(unsigned char)*cur);
 		}
+	}
+	g_string_append_len (gstr, run, cur - run);
 
-	if (in_quotes)
-		g_string_append_c (tmp, '"');
+	g_string_append_c (gstr, '"');
+
+	return gstr;
+}
+
+
+char*
+mu_str_escape_c_literal (const gchar* str, gboolean in_quotes)
+{
+	GString *tmp;
+
+	g_return_val_if_fail (str, NULL);
+
+	tmp = g_string_sized_new (strlen(str) + 8);
+	mu_str_append_c_literal (tmp, str, in_quotes);
 
 	return g_string_free (tmp, FALSE);
 }
@@ -215,6 +215,30 @@ const char* mu_str_fullpath_s (const char* path, const char* name);
 char* mu_str_escape_c_literal (const gchar* str, gboolean in_quotes)
         G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * like mu_str_escape_c_literal, but append the escaped string to a
+ * GString, without allocating a temporary one
+ *
+ * @param gstr a GString
+ * @param str a non-NULL str
+ * @param in_quotes whether the result should be enclosed in ""
+ *
+ * @return gstr
+ */
+GString* mu_str_append_c_literal (GString *gstr, const gchar* str,
+				  gboolean in_quotes);
+
+/**
+ * append a (utf8) string to a GString as a JSON string, ie., in
+ * double quotes, with ", \ and control characters escaped
+ *
+ * @param gstr a GString
+ * @param str a non-NULL str
+ *
+ * @return gstr
+ */
+GString* mu_str_append_json_string (GString *gstr, const gchar* str);
+
 
 
 /**
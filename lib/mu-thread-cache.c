@@ -0,0 +1,247 @@
+/* -*-mode: c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-*/
+/*
+** Copyright (C) 2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#include "mu-thread-cache.h"
+
+/*
+ * the strings live in a GStringChunk, which cannot free individual
+ * strings; so, when messages are removed or replaced, their strings
+ * become garbage. When there's more garbage than there are live
+ * messages, we move the live strings to a fresh chunk.
+ */
+#define GARBAGE_MIN 4096
+
+struct _MuThreadCache {
+	GHashTable	*entries; /* docid => Entry */
+	GStringChunk	*strs;
+	guint		 garbage;
+};
+
+struct _Entry {
+	const char	*msgid;
+	const char	*refs;
+	MuMsgFieldId	 sortfield;
+	gint64		 sortnum;
+	const char	*sortstr;
+};
+typedef struct _Entry Entry;
+
+
+static Entry*
+entry_new (void)
+{
+	Entry *entry;
+
+	entry = g_slice_new0 (Entry);
+	entry->sortfield = MU_MSG_FIELD_ID_NONE;
+
+	return entry;
+}
+
+static void
+entry_destroy (Entry *entry)
+{
+	g_slice_free (Entry, entry);
+}
+
+
+MuThreadCache*
+mu_thread_cache_new (void)
+{
+	MuThreadCache *self;
+
+	self	      = g_slice_new0 (MuThreadCache);
+	self->entries = g_hash_table_new_full
+		(g_direct_hash, g_direct_equal, NULL,
+		 (GDestroyNotify)entry_destroy);
+	self->strs    = g_string_chunk_new (4096);
+
+	return self;
+}
+
+
+void
+mu_thread_cache_destroy (MuThreadCache *self)
+{
+	if (!self)
+		return;
+
+	g_hash_table_destroy (self->entries);
+	g_string_chunk_free (self->strs);
+
+	g_slice_free (MuThreadCache, self);
+}
+
+
+static const char*
+intern (GStringChunk *strs, const char *str)
+{
+	return str ? g_string_chunk_insert_const (strs, str) : NULL;
+}
+
+
+static void
+each_reintern (gpointer docid, Entry *entry, GStringChunk *strs)
+{
+	entry->msgid   = intern (strs, entry->msgid);
+	entry->refs    = intern (strs, entry->refs);
+	entry->sortstr = intern (strs, entry->sortstr);
+}
+
+static void
+maybe_collect_garbage (MuThreadCache *self)
+{
+	GStringChunk *strs;
+
+	if (self->garbage < GARBAGE_MIN ||
+	    self->garbage < g_hash_table_size (self->entries))
+		return;
+
+	strs = g_string_chunk_new (4096);
+	g_hash_table_foreach (self->entries, (GHFunc)each_reintern, strs);
+	g_string_chunk_free (self->strs);
+
+	self->strs    = strs;
+	self->garbage = 0;
+}
+
+
+gboolean
+mu_thread_cache_lookup (MuThreadCache *self, guint docid,
+			const char **msgid, const char **refs)
+{
+	Entry *entry;
+
+	g_return_val_if_fail (self, FALSE);
+	g_return_val_if_fail (msgid && refs, FALSE);
+
+	entry = g_hash_table_lookup (self->entries, GUINT_TO_POINTER(docid));
+	if (!entry)
+		return FALSE;
+
+	*msgid = entry->msgid;
+	*refs  = entry->refs;
+
+	return TRUE;
+}
+
+
+gboolean
+mu_thread_cache_lookup_sort (MuThreadCache *self, guint docid,
+			     MuMsgFieldId sortfield, gint64 *sortnum,
+			     const char **sortstr)
+{
+	Entry *entry;
+
+	g_return_val_if_fail (self, FALSE);
+	g_return_val_if_fail (sortnum && sortstr, FALSE);
+
+	entry = g_hash_table_lookup (self->entries, GUINT_TO_POINTER(docid));
+	if (!entry || entry->sortfield != sortfield)
+		return FALSE;
+
+	*sortnum = entry->sortnum;
+	*sortstr = entry->sortstr;
+
+	return TRUE;
+}
+
+
+void
+mu_thread_cache_insert (MuThreadCache *self, guint docid,
+			const char *msgid, const char *refs)
+{
+	Entry *entry;
+
+	g_return_if_fail (self);
+	g_return_if_fail (docid != 0);
+	g_return_if_fail (msgid);
+
+	entry = g_hash_table_lookup (self->entries, GUINT_TO_POINTER(docid));
+	if (entry)
+		++self->garbage;
+	else {
+		entry = entry_new ();
+		g_hash_table_insert (self->entries, GUINT_TO_POINTER(docid),
+				     entry);
+	}
+
+	entry->msgid	 = intern (self->strs, msgid);
+	entry->refs	 = intern (self->strs, refs);
+	entry->sortfield = MU_MSG_FIELD_ID_NONE;
+	entry->sortstr	 = NULL;
+
+	maybe_collect_garbage (self);
+}
+
+
+void
+mu_thread_cache_insert_sort (MuThreadCache *self, guint docid,
+			     MuMsgFieldId sortfield, gint64 sortnum,
+			     const char *sortstr)
+{
+	Entry *entry;
+
+	g_return_if_fail (self);
+
+	entry = g_hash_table_lookup (self->entries, GUINT_TO_POINTER(docid));
+	if (!entry)
+		return;
+	if (entry->sortstr)
+		++self->garbage;
+
+	entry->sortfield = sortfield;
+	entry->sortnum	 = sortnum;
+	entry->sortstr	 = intern (self->strs, sortstr);
+
+	maybe_collect_garbage (self);
+}
+
+
+void
+mu_thread_cache_remove (MuThreadCache *self, guint docid)
+{
+	g_return_if_fail (self);
+
+	if (g_hash_table_remove (self->entries, GUINT_TO_POINTER(docid))) {
+		++self->garbage;
+		maybe_collect_garbage (self);
+	}
+}
+
+
+void
+mu_thread_cache_clear (MuThreadCache *self)
+{
+	g_return_if_fail (self);
+
+	g_hash_table_remove_all (self->entries);
+	g_string_chunk_clear (self->strs);
+	self->garbage = 0;
+}
+
+
+guint
+mu_thread_cache_size (MuThreadCache *self)
+{
+	g_return_val_if_fail (self, 0);
+
+	return g_hash_table_size (self->entries);
+}
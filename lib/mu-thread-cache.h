@@ -0,0 +1,144 @@
+/*
+** Copyright (C) 2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#ifndef __MU_THREAD_CACHE_H__
+#define __MU_THREAD_CACHE_H__
+
+#include <glib.h>
+#include <mu-msg-fields.h>
+
+G_BEGIN_DECLS
+
+/*
+ * the thread cache remembers, for each message (docid) that was
+ * threaded before, what the threader needs to know about it: the
+ * message-id, the references and the value of the last-used sort
+ * field. The message-ids and references are interned, so each of
+ * them is stored only once, no matter how many messages refer to
+ * it.
+ *
+ * A long-running process (such as mu server) can keep a thread
+ * cache around, so re-running a threaded query does not have to read
+ * all of this again from the database for every match; it's up to
+ * that process to tell the cache about messages that were changed
+ * or removed.
+ */
+struct _MuThreadCache;
+typedef struct _MuThreadCache MuThreadCache;
+
+/**
+ * create a new, empty thread cache
+ *
+ * @return a new thread cache; free with mu_thread_cache_destroy
+ */
+MuThreadCache* mu_thread_cache_new (void) G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * free a thread cache
+ *
+ * @param self a thread cache, or NULL
+ */
+void mu_thread_cache_destroy (MuThreadCache *self);
+
+/**
+ * get the cached threading information for a message
+ *
+ * @param self a thread cache
+ * @param docid the docid of the message
+ * @param msgid receives the message-id (or the path, if there is no message-id)
+ * @param refs receives the references, or NULL if there are none
+ *
+ * the strings are owned by the cache, and are only valid until the
+ * next change to the cache
+ *
+ * @return TRUE if the message was found in the cache, FALSE otherwise
+ */
+gboolean mu_thread_cache_lookup (MuThreadCache *self, guint docid,
+				 const char **msgid, const char **refs);
+
+/**
+ * get the cached sort value for a message
+ *
+ * @param self a thread cache
+ * @param docid the docid of the message
+ * @param sortfield the sort field we're interested in
+ * @param sortnum receives the value if the sort field is numeric
+ * @param sortstr receives the value if the sort field is a string
+ *
+ * @return TRUE if the sort value was found in the cache, FALSE otherwise
+ */
+gboolean mu_thread_cache_lookup_sort (MuThreadCache *self, guint docid,
+				      MuMsgFieldId sortfield, gint64 *sortnum,
+				      const char **sortstr);
+
+/**
+ * add the threading information for a message to the cache, or
+ * replace it if it's already there
+ *
+ * @param self a thread cache
+ * @param docid the docid of the message (!= 0)
+ * @param msgid the message-id (or some other unique string, such as
+ * the path)
+ * @param refs the references as a comma-separated list, or NULL
+ */
+void mu_thread_cache_insert (MuThreadCache *self, guint docid,
+			     const char *msgid, const char *refs);
+
+/**
+ * remember the sort value for a message that's in the cache; only the
+ * value for one sort field is kept for each message
+ *
+ * @param self a thread cache
+ * @param docid the docid of the message
+ * @param sortfield the sort field
+ * @param sortnum the value if the sort field is numeric
+ * @param sortstr the value if the sort field is a string, or NULL
+ */
+void mu_thread_cache_insert_sort (MuThreadCache *self, guint docid,
+				  MuMsgFieldId sortfield, gint64 sortnum,
+				  const char *sortstr);
+
+/**
+ * forget about some message, e.g. because it was changed or
+ * removed
+ *
+ * @param self a thread cache
+ * @param docid the docid of the message
+ */
+void mu_thread_cache_remove (MuThreadCache *self, guint docid);
+
+/**
+ * forget about all messages
+ *
+ * @param self a thread cache
+ */
+void mu_thread_cache_clear (MuThreadCache *self);
+
+/**
+ * get the number of messages in the cache
+ *
+ * @param self a thread cache
+ *
+ * @return the number of messages
+ */
+guint mu_thread_cache_size (MuThreadCache *self);
+
+G_END_DECLS
+
+#endif /*__MU_THREAD_CACHE_H__*/
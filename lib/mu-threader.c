@@ -30,10 +30,10 @@
  * the implementation follows the terminology from that doc, so should
  * be understandable from that... I did change things a bit though
  *
- * the end result of the threading operation is a hashtable which maps
- * docids (ie., Xapian documents == messages) to 'thread paths'; a
- * thread path is a string denoting the 2-dimensional place of a
- * message in a list of messages,
+ * the end result of the threading operation is the list of docids
+ * (ie., Xapian documents == messages) in thread order, each with a
+ * 'thread path'; a thread path is a string denoting the 2-dimensional
+ * place of a message in a list of messages,
  *
  * Msg1                        => 00000
  * Msg2                        => 00001
@@ -49,204 +49,450 @@
  */
 
 
-/* step 1 */ static GHashTable* create_containers (MuMsgIter *iter);
-/* step 2 */ static MuContainer *find_root_set (GHashTable *ids);
+/*
+ * the id table maps message-ids to their containers; it's a flat
+ * open-addressing hash table (with linear probing), rather than a
+ * GHashTable, so we don't need a separate allocation for each
+ * entry. The message-ids are interned: each of them is stored only
+ * once (in a GStringChunk), and the containers point to that copy.
+ */
+#define ID_TABLE_MIN_SIZE 1024
+
+struct _MuThreader {
+	MuContainerArena	 *arena;
+	GStringChunk		 *ids;
+
+	MuMsgFieldId		  sortfield;
+	GStringChunk		 *sortstrs;
+
+	/* for grouping by subject (step 5); subjects is NULL when
+	 * we're not doing that */
+	GStringChunk		 *subjects;
+	time_t			  subject_window;
+
+	MuContainer		**slots;
+	guint32			 *hashes;
+	size_t			  size;	/* always a power of 2 */
+	size_t			  num;
+};
+
+
+/* step 2 */ static MuContainer *find_root_set (MuContainerArena *arena);
 static MuContainer* prune_empty_containers (MuContainer *root);
-/* static void group_root_set_by_subject (GSList *root_set); */
-GHashTable* create_doc_id_thread_path_hash (MuContainer *root, size_t match_num);
+static MuContainer* group_root_set_by_subject (MuThreader *self,
+					       MuContainer *root_set);
+static MuContainer* sort_first_threads (MuContainer *root_set, size_t maxnum,
+				       MuMsgFieldId sortfield, gboolean revert);
+
+
+static gboolean
+get_sort_value (MuMsgIter *iter, MuMsgFieldId sortfield,
+		gint64 *sortnum, const char **sortstr)
+{
+	*sortnum = 0;
+	*sortstr = NULL;
+
+	if (sortfield == MU_MSG_FIELD_ID_NONE ||
+	    !mu_msg_field_xapian_value (sortfield))
+		return FALSE;
+
+	if (mu_msg_field_is_numeric (sortfield))
+		*sortnum = mu_msg_iter_get_field_numeric (iter, sortfield);
+	else
+		*sortstr = mu_msg_iter_get_field_str (iter, sortfield);
+
+	return TRUE;
+}
+
+
+/* add the message the iter is pointing at to the threader, using the
+ * cache (if any) instead of the document when we can */
+static void
+add_msg (MuThreader *self, MuMsgIter *iter, MuThreadCache *tcache)
+{
+	const char *msgid, *refs, *sortstr, *subject;
+	gint64 sortnum, date;
+	guint docid;
+	gboolean cached, sort_cached, has_sort;
+
+	docid	    = mu_msg_iter_get_docid (iter);
+	cached	    = tcache && mu_thread_cache_lookup (tcache, docid,
+							&msgid, &refs);
+	sort_cached = cached && mu_thread_cache_lookup_sort
+		(tcache, docid, self->sortfield, &sortnum, &sortstr);
+
+	if (!cached) {
+		msgid = mu_msg_iter_get_field_str (iter,
+						   MU_MSG_FIELD_ID_MSGID);
+		if (!msgid) /* fake it */
+			msgid = mu_msg_iter_get_field_str
+				(iter, MU_MSG_FIELD_ID_PATH);
+		if (!msgid)
+			return;
+		refs = mu_msg_iter_get_field_str (iter, MU_MSG_FIELD_ID_REFS);
+	}
+
+	has_sort = sort_cached ? TRUE :
+		get_sort_value (iter, self->sortfield, &sortnum, &sortstr);
+
+	subject = NULL;
+	date	= 0;
+	if (self->subjects) {
+		subject = mu_msg_iter_get_field_str (iter,
+						     MU_MSG_FIELD_ID_SUBJECT);
+		date	= (has_sort && self->sortfield == MU_MSG_FIELD_ID_DATE) ?
+			sortnum : mu_msg_iter_get_field_numeric
+			(iter, MU_MSG_FIELD_ID_DATE);
+	}
+
+	mu_threader_add (self, docid, msgid, refs, subject, date,
+			 sortnum, sortstr);
+
+	/* note: updating the cache may invalidate the strings we got
+	 * from it, so we do it only after the threader has its own
+	 * copies */
+	if (!tcache)
+		return;
+	if (!cached)
+		mu_thread_cache_insert (tcache, docid, msgid, refs);
+	if (!sort_cached && has_sort)
+		mu_thread_cache_insert_sort (tcache, docid, self->sortfield,
+					     sortnum, sortstr);
+}
+
 
 /* msg threading algorithm, based on JWZ's algorithm,
  * http://www.jwz.org/doc/threading.html */
-GHashTable*
-mu_threader_calculate (MuMsgIter *iter, size_t matchnum,
-		       MuMsgFieldId sortfield, gboolean revert)
+MuContainerThreadInfo*
+mu_threader_calculate (MuMsgIter *iter, MuThreadCache *tcache,
+		       size_t matchnum, size_t maxnum,
+		       MuMsgFieldId sortfield, gboolean revert,
+		       gboolean group_subjects)
 {
-	GHashTable *id_table, *thread_ids;
-	MuContainer *root_set;
+	MuThreader *self;
+	MuContainerThreadInfo *tinfo;
 
 	g_return_val_if_fail (iter, FALSE);
 	g_return_val_if_fail (mu_msg_field_id_is_valid (sortfield) ||
 			      sortfield == MU_MSG_FIELD_ID_NONE,
 			      FALSE);
 
-	/* step 1 */
-	id_table = create_containers (iter);
+	self = mu_threader_new (matchnum, sortfield);
+	if (group_subjects)
+		mu_threader_group_subjects (self, MU_THREADER_SUBJECT_WINDOW);
 
-	/* step 2 -- the root_set is the list of children without parent */
-	root_set = find_root_set (id_table);
+	/* step 1; we only need the message-id, the references and
+	 * the sort field, which we get from the cache or straight
+	 * from the documents */
+	for (mu_msg_iter_reset (iter); !mu_msg_iter_is_done (iter);
+	     mu_msg_iter_next (iter))
+		add_msg (self, iter, tcache);
+
+	/* the iter ends early when it's cancelled; don't bother with
+	 * the rest then */
+	if (mu_msg_iter_is_cancelled (iter)) {
+		mu_threader_destroy (self);
+		return NULL;
+	}
 
-	/* step 3: skip until the end; we still need to containers */
+	mu_msg_iter_reset (iter); /* go all the way back */
 
-	/* step 4: prune empty containers */
-	root_set = prune_empty_containers (root_set);
+	tinfo = mu_threader_finish (self, matchnum, maxnum, revert);
+	mu_threader_destroy (self);
 
-	/* sort root set */
-	if (sortfield != MU_MSG_FIELD_ID_NONE)
-		root_set = mu_container_sort (root_set, sortfield, revert,
-					      NULL);
+	return tinfo;
+}
 
-	/* step 5: group root set by subject */
-	/* group_root_set_by_subject (root_set); */
 
-	/* sort */
-	mu_msg_iter_reset (iter); /* go all the way back */
+MuThreader*
+mu_threader_new (size_t sizehint, MuMsgFieldId sortfield)
+{
+	MuThreader *self;
+
+	g_return_val_if_fail (mu_msg_field_id_is_valid (sortfield) ||
+			      sortfield == MU_MSG_FIELD_ID_NONE,
+			      NULL);
+
+	self		= g_slice_new0 (MuThreader);
+	self->arena	= mu_container_arena_new (sizehint);
+	self->ids	= g_string_chunk_new (4096);
+	self->sortfield = sortfield;
+	self->sortstrs	= g_string_chunk_new (4096);
+
+	/* the references typically add some message-ids we don't
+	 * have messages for; and we keep the table at most half full */
+	for (self->size = ID_TABLE_MIN_SIZE; self->size < 4 * sizehint;
+	     self->size *= 2);
+
+	self->slots  = g_new0 (MuContainer*, self->size);
+	self->hashes = g_new (guint32, self->size);
+
+	return self;
+}
 
-	/* finally, deliver the docid => thread-path hash */
-	thread_ids = mu_container_thread_info_hash_new (root_set,
-							matchnum);
 
-	g_hash_table_destroy (id_table); /* step 3*/
+void
+mu_threader_destroy (MuThreader *self)
+{
+	if (!self)
+		return;
 
-	return thread_ids;
+	mu_container_arena_destroy (self->arena);
+	g_string_chunk_free (self->ids);
+	g_string_chunk_free (self->sortstrs);
+	if (self->subjects)
+		g_string_chunk_free (self->subjects);
+	g_free (self->slots);
+	g_free (self->hashes);
+
+	g_slice_free (MuThreader, self);
 }
 
-G_GNUC_UNUSED static void
-check_dup (const char *msgid, MuContainer *c, GHashTable *hash)
+
+void
+mu_threader_group_subjects (MuThreader *self, time_t window)
 {
-	if (g_hash_table_lookup (hash, c)) {
-		g_warning ("ALREADY!!");
-		mu_container_dump (c, FALSE);
-		g_assert (0);
-	} else
-		g_hash_table_insert (hash, c, GUINT_TO_POINTER(TRUE));
+	g_return_if_fail (self);
+	g_return_if_fail (self->num == 0);
+
+	if (!self->subjects)
+		self->subjects = g_string_chunk_new (4096);
+
+	self->subject_window = window;
 }
 
 
-G_GNUC_UNUSED static void
-assert_no_duplicates (GHashTable *ids)
+/* FNV-1a */
+static guint32
+id_hash (const char *id, size_t len)
 {
-	GHashTable *hash;
+	guint32 hash;
+	size_t u;
+
+	for (hash = 2166136261U, u = 0; u != len; ++u)
+		hash = (hash ^ (guchar)id[u]) * 16777619U;
 
-	hash = g_hash_table_new (g_direct_hash, g_direct_equal);
+	return hash;
+}
+
+
+/* get the slot for the id; this is either the slot with the
+ * container for this id, or the empty slot where it should go */
+static size_t
+id_slot (MuThreader *self, const char *id, size_t len, guint32 hash)
+{
+	size_t u, mask;
 
-	g_hash_table_foreach (ids, (GHFunc)check_dup, hash);
+	mask = self->size - 1;
+	for (u = hash & mask; self->slots[u]; u = (u + 1) & mask)
+		if (self->hashes[u] == hash &&
+		    strncmp (self->slots[u]->msgid, id, len) == 0 &&
+		    self->slots[u]->msgid[len] == '\0')
+			break;
 
-	g_hash_table_destroy (hash);
+	return u;
 }
 
 
+/* make sure there's room for at least one more id */
+static void
+maybe_grow_id_table (MuThreader *self)
+{
+	MuContainer **oldslots;
+	guint32 *oldhashes;
+	size_t u, oldsize;
+
+	if (2 * (self->num + 1) <= self->size)
+		return;
+
+	oldslots  = self->slots;
+	oldhashes = self->hashes;
+	oldsize	  = self->size;
+
+	self->size  *= 2;
+	self->slots  = g_new0 (MuContainer*, self->size);
+	self->hashes = g_new (guint32, self->size);
+
+	for (u = 0; u != oldsize; ++u) {
+		size_t v, mask;
+		if (!oldslots[u])
+			continue;
+		mask = self->size - 1;
+		for (v = oldhashes[u] & mask; self->slots[v];
+		     v = (v + 1) & mask);
+		self->slots[v]	= oldslots[u];
+		self->hashes[v] = oldhashes[u];
+	}
+
+	g_free (oldslots);
+	g_free (oldhashes);
+}
 
 
 /* a referred message is a message that is refered by some other message */
 static MuContainer*
-find_or_create_referred (GHashTable *id_table, const char *msgid,
-			 gboolean *created)
+find_or_create_referred (MuThreader *self, const char *msgid, size_t len)
 {
-	MuContainer *c;
+	guint32 hash;
+	size_t slot;
+
+	maybe_grow_id_table (self);
 
-	g_return_val_if_fail (msgid, NULL);
+	hash = id_hash (msgid, len);
+	slot = id_slot (self, msgid, len, hash);
 
-	c = g_hash_table_lookup (id_table, msgid);
-	*created = !c;
-	if (!c) {
-		c = mu_container_new (NULL, 0, msgid);
-		g_hash_table_insert (id_table, (gpointer)msgid, c);
-		/* assert_no_duplicates (id_table); */
+	if (!self->slots[slot]) {
+		self->slots[slot] = mu_container_arena_alloc
+			(self->arena, 0,
+			 g_string_chunk_insert_len (self->ids, msgid, len));
+		self->hashes[slot] = hash;
+		++self->num;
 	}
 
+	return self->slots[slot];
+}
+
 
-	return c;
+/* get the sort key for a string; we do the normalization (and
+ * collation) once for each message here, rather than for each
+ * comparison when sorting. Messages in the same thread tend to have
+ * the same subject, so we only store each key once. */
+static const char*
+sort_key_str (MuThreader *self, const char *str)
+{
+	gchar *down, *key;
+	const char *rv;
+
+	if (!str)
+		return NULL;
+
+	if (self->sortfield == MU_MSG_FIELD_ID_SUBJECT)
+		str = mu_str_subject_normalize (str);
+
+	down = g_utf8_strdown (str, -1);
+	key  = g_utf8_collate_key (down, -1);
+	rv   = g_string_chunk_insert_const (self->sortstrs, key);
+
+	g_free (down);
+	g_free (key);
+
+	return rv;
 }
 
+
 /* find a container for the given msgid; if it does not exist yet,
- * create a new one, and register it */
+ * create a new one, and register it. Returns the container for the
+ * message, which is a duplicate (MU_CONTAINER_FLAG_DUP) if we had
+ * already seen the msgid */
 static MuContainer*
-find_or_create (GHashTable *id_table, MuMsg *msg, guint docid)
+find_or_create (MuThreader *self, guint docid, const char *msgid)
 {
 	MuContainer *c;
-	const char* msgid;
 
-	g_return_val_if_fail (msg, NULL);
 	g_return_val_if_fail (docid != 0, NULL);
 
-	msgid = mu_msg_get_msgid (msg);
-	if (!msgid)
-		msgid = mu_msg_get_path (msg); /* fake it */
-
-	c = g_hash_table_lookup (id_table, msgid);
+	c = find_or_create_referred (self, msgid, strlen (msgid));
 
 	/* If id_table contains an empty MuContainer for this ID: * *
 	 * Store this message in the MuContainer's message slot. */
-	if (c) {
-		if (!c->msg) {
-			c->msg	  = mu_msg_ref (msg);
-			c->docid  = docid;
-			return c;
-		} else {
-			/* special case, not in the JWZ algorithm: the
-			 * container exists already and has a message; this
-			 * means that we are seeing *another message* with a
-			 * message-id we already saw... create this message,
-			 * and mark it as a duplicate, and a child of the one
-			 * we saw before; use its path as a fake message-id
-			 * */
-			MuContainer *c2;
-			const char* fake_msgid;
-
-			fake_msgid = mu_msg_get_path (msg);
-
-			c2	  = mu_container_new (msg, docid, fake_msgid);
-			c2->flags = MU_CONTAINER_FLAG_DUP;
-			c	  = mu_container_append_children (c, c2);
-
-			g_hash_table_insert (id_table, (gpointer)fake_msgid, c2);
-
-			return NULL; /* don't process this message further */
-		}
-	} else { /* Else: Create a new MuContainer object holding
-		    this message; Index the MuContainer by
-		    Message-ID in id_table. */
-		c = mu_container_new (msg, docid, msgid);
-		g_hash_table_insert (id_table, (gpointer)msgid, c);
-		/* assert_no_duplicates (id_table); */
-
+	if (c->docid == 0) {
+		c->docid  = docid;
 		return c;
+	} else {
+		/* special case, not in the JWZ algorithm: the
+		 * container exists already and has a message; this
+		 * means that we are seeing *another message* with a
+		 * message-id we already saw... create this message,
+		 * and mark it as a duplicate, and a child of the one
+		 * we saw before. We don't need to put it in the
+		 * id_table, as no-one can refer to it. */
+		MuContainer *c2;
+
+		c2	  = mu_container_arena_alloc (self->arena, docid,
+						      c->msgid);
+		c2->flags = MU_CONTAINER_FLAG_DUP;
+		mu_container_append_children (c, c2);
+
+		return c2;
 	}
 }
 
+
+/* is container a an ancestor of container c, or c itself? */
 static gboolean
-child_elligible (MuContainer *parent, MuContainer *child, gboolean created)
+is_ancestor (MuContainer *a, MuContainer *c)
+{
+	for (; c; c = c->parent)
+		if (c == a)
+			return TRUE;
+
+	return FALSE;
+}
+
+
+static gboolean
+child_elligible (MuContainer *parent, MuContainer *child)
 {
 	if (!parent || !child)
 		return FALSE;
 	if (child->parent)
 		return FALSE;
-	/* if (created) */
-	/* 	return TRUE; */
-	if (mu_container_reachable (parent, child))
-		return FALSE;
-	if (mu_container_reachable (child, parent))
+
+	/* since child has no parent, it cannot be reachable from
+	 * parent; and parent is reachable from child if child is
+	 * one of its ancestors. Walking up from parent is much cheaper
+	 * than searching down the whole tree of child. */
+	if (is_ancestor (child, parent))
 		return FALSE;
 
 	return TRUE;
 }
 
 
+/* skip leading/trailing whitespace in the reference [*ref, *end> */
+static void
+strip_ref (const char **ref, const char **end)
+{
+	while (*ref < *end && g_ascii_isspace (**ref))
+		++*ref;
+	while (*end > *ref && g_ascii_isspace ((*end)[-1]))
+		--*end;
+}
+
 
 static void /* 1B */
-handle_references (GHashTable *id_table, MuContainer *c)
+handle_references (MuThreader *self, MuContainer *c, const char *refs)
 {
-	const GSList *refs, *cur;
 	MuContainer *parent;
-	gboolean created;
-
-	refs = mu_msg_get_references (c->msg);
-	if (!refs)
-		return; /* nothing to do */
+	const char *ref;
 
 	/* For each element in the message's References field:
 
 	   Find a MuContainer object for the given Message-ID: If
 	   there's one in id_table use that; Otherwise, make (and
-	   index) one with a null Message. */
+	   index) one with a null Message.
+
+	   The references are the comma-separated list as stored in
+	   the database; we don't split them into separate strings,
+	   but look them up in place. */
 
-	/* go over over our list of refs, until 1 before the last... */
-	created = FALSE;
-	for (parent = NULL, cur = refs; cur; cur = g_slist_next (cur)) {
+	for (parent = NULL, ref = refs; ref && *ref; ) {
 
 		MuContainer *child;
-		child = find_or_create_referred (id_table, (gchar*)cur->data,
-						 &created);
+		const char *end, *next;
+
+		end  = strchr (ref, ',');
+		next = end ? end + 1 : NULL;
+		if (!end)
+			end = ref + strlen (ref);
+
+		strip_ref (&ref, &end);
+		if (ref == end) {
+			ref = next;
+			continue;
+		}
+
+		child = find_or_create_referred (self, ref, end - ref);
 
 		/*Link the References field's MuContainers together in
 		 * the order implied by the References header.
@@ -259,10 +505,11 @@ handle_references (GHashTable *id_table, MuContainer *c)
 		 see if B is reachable. If either is already reachable
 		 as a child of the other, don't add the link. */
 
-		if (child_elligible (parent, child, created))
+		if (child_elligible (parent, child))
 			parent = mu_container_append_children (parent, child);
 
 		parent = child;
+		ref    = next;
 	}
 
 	/* 'parent' points to the last ref: our direct parent;
@@ -284,77 +531,142 @@ handle_references (GHashTable *id_table, MuContainer *c)
 	   Note that at all times, the various ``parent'' and ``child'' fields
 	   must be kept inter-consistent. */
 
-           /* optimization: if the the message was newly added, it's by
-	    * definition not reachable yet */
-	if (child_elligible (parent, c, created))
+	if (child_elligible (parent, c))
 		parent = mu_container_append_children (parent, c);
 }
 
 
+/* remember the (normalized, interned) subject of the message, and
+ * whether it was a reply; we only need those for step 5 */
+static void
+set_subject (MuThreader *self, MuContainer *c, const char *subject,
+	     gint64 date)
+{
+	const char *norm;
+
+	c->date = date;
+	if (!subject)
+		return;
+
+	norm = mu_str_subject_normalize (subject);
+	if (norm != subject)
+		c->flags |= MU_CONTAINER_FLAG_REPLY;
+
+	if (*norm)
+		c->subject = g_string_chunk_insert_const (self->subjects,
+							  norm);
+}
+
 
-/* step 1: create the containers, connect them, and fill the id_table */
-static GHashTable*
-create_containers (MuMsgIter *iter)
+void
+mu_threader_add (MuThreader *self, guint docid, const char *msgid,
+		 const char *refs, const char *subject, gint64 date,
+		 gint64 sortnum, const char *sortstr)
 {
-	GHashTable *id_table;
-	id_table = g_hash_table_new_full (g_str_hash,
-					  g_str_equal,
-					  NULL,
-					  (GDestroyNotify)mu_container_destroy);
+	MuContainer *c;
 
-	for (mu_msg_iter_reset (iter); !mu_msg_iter_is_done (iter);
-	     mu_msg_iter_next (iter)) {
+	g_return_if_fail (self);
+	g_return_if_fail (docid != 0);
+	g_return_if_fail (msgid);
 
-		MuContainer *c;
-		MuMsg *msg;
-		unsigned docid;
+	/* 1.A */
+	c = find_or_create (self, docid, msgid);
 
-		/* 1.A */
-		msg   = mu_msg_iter_get_msg_floating (iter); /* don't unref */
-		docid = mu_msg_iter_get_docid (iter);
+	c->sortnum = sortnum;
+	c->sortstr = sort_key_str (self, sortstr);
+	if (self->subjects)
+		set_subject (self, c, subject, date);
 
-		c = find_or_create (id_table, msg, docid);
+	/* 1.B and C; but not for duplicates */
+	if (!(c->flags & MU_CONTAINER_FLAG_DUP))
+		handle_references (self, c, refs);
+}
 
-		/* 1.B and C */
-		if (c)
-			handle_references (id_table, c);
-	}
 
-	return id_table;
+MuContainerThreadInfo*
+mu_threader_finish (MuThreader *self, size_t matchnum, size_t maxnum,
+		    gboolean revert)
+{
+	MuContainer *root_set;
+	MuMsgFieldId sortfield;
+
+	g_return_val_if_fail (self, NULL);
+
+	sortfield = self->sortfield;
+
+	/* step 2 -- the root_set is the list of children without parent */
+	root_set = find_root_set (self->arena);
+
+	/* step 3: skip until the end; we still need to containers */
+
+	/* step 4: prune empty containers */
+	if (root_set)
+		root_set = prune_empty_containers (root_set);
+	if (!root_set)
+		return mu_container_thread_info_new (NULL, matchnum);
+
+	/* step 5: group root set by subject */
+	if (self->subjects)
+		root_set = group_root_set_by_subject (self, root_set);
+
+	/* sort root set */
+	if (maxnum > 0 && maxnum < matchnum)
+		root_set = sort_first_threads (root_set, maxnum, sortfield,
+					       revert);
+	else if (sortfield != MU_MSG_FIELD_ID_NONE)
+		root_set = mu_container_sort (root_set, sortfield, revert,
+					      NULL);
+
+	/* finally, deliver the docids in thread order, with their
+	 * thread info; note that we use matchnum here even if we
+	 * dropped some threads, so the thread-paths are the same as
+	 * when we don't */
+	return mu_container_thread_info_new (root_set, matchnum);
 }
 
 
+struct _RootSet {
+	MuContainer *first, *last;
+};
+typedef struct _RootSet RootSet;
 
-static void
-filter_root_set (const gchar *msgid, MuContainer *c, MuContainer **root_set)
+
+static gboolean
+filter_root_set (MuContainer *c, RootSet *root_set)
 {
 	/* ignore children */
 	if (c->parent)
-		return;
+		return TRUE;
 
 	/* ignore duplicates */
 	if (c->flags & MU_CONTAINER_FLAG_DUP)
-		return;
+		return TRUE;
 
-	if (*root_set == NULL) {
-		*root_set = c;
-		return;
-	} else
-		*root_set = mu_container_append_siblings (*root_set, c);
+	if (!root_set->first)
+		root_set->first = c;
+	else
+		root_set->last->next = c;
+
+	root_set->last = c;
+
+	return TRUE;
 }
 
 
 /* 2.  Walk over the elements of id_table, and gather a list of the
-   MuContainer objects that have no parents, but do have children */
+   MuContainer objects that have no parents, but do have children;
+   we go through the arena rather than the id_table, so the root set
+   is in the order in which we saw the containers */
 static MuContainer*
-find_root_set (GHashTable *ids)
+find_root_set (MuContainerArena *arena)
 {
-	MuContainer *root_set;
-
-	root_set = NULL;
-	g_hash_table_foreach (ids, (GHFunc)filter_root_set, &root_set);
+	RootSet root_set;
 
-	return root_set;
+	root_set.first = root_set.last = NULL;
+	mu_container_arena_foreach (arena,
+				    (MuContainerForeachFunc)filter_root_set,
+				    &root_set);
+	return root_set.first;
 }
 
 
@@ -373,7 +685,7 @@ prune_maybe (MuContainer *c)
 	g_return_val_if_fail (c, FALSE);
 
 	/* don't touch containers with messages */
-	if (c->msg)
+	if (c->docid != 0)
 		return TRUE;
 
 	/* A. If it is an msg-less container with no children, mark it
@@ -404,23 +716,287 @@ prune_maybe (MuContainer *c)
 static MuContainer*
 prune_empty_containers (MuContainer *root_set)
 {
-	MuContainer *cur;
+	MuContainer *cur, *prev, *last;
 
 	mu_container_foreach (root_set, (MuContainerForeachFunc)prune_maybe, NULL);
 
-	/* and prune the root_set itself... */
-	for (cur = root_set; cur; cur = cur->next) {
+	/* and prune the root_set itself... we do that in one pass,
+	 * keeping track of the last container, so we can append
+	 * spliced children without walking the whole list */
+	for (last = root_set; last->next; last = last->next);
 
-		if (cur->flags & MU_CONTAINER_FLAG_DELETE)
-			root_set = mu_container_remove_sibling (root_set, cur);
+	for (prev = NULL, cur = root_set; cur; cur = cur->next) {
 
-		else if (cur->flags & MU_CONTAINER_FLAG_SPLICE) {
-			MuContainer *newchild;
-			newchild = cur->child;
+		if (cur->flags & MU_CONTAINER_FLAG_SPLICE) {
+			/* its children go to the end of the root set;
+			 * after that, it's empty and childless, so it
+			 * goes away, just like a deleted one */
+			last->next = cur->child;
 			cur->child = NULL;
-			root_set = mu_container_append_siblings (root_set, newchild);
+			for (; last->next; last = last->next)
+				last->next->parent = NULL;
+		} else if (!(cur->flags & MU_CONTAINER_FLAG_DELETE)) {
+			prev = cur;
+			continue;
 		}
+
+		if (prev)
+			prev->next = cur->next;
+		else
+			root_set = cur->next;
+		if (cur == last)
+			last = prev;
 	}
 
 	return root_set;
 }
+
+
+/* the container that represents some subject in step 5; 'last' is
+ * its last child (once we need it), so we can append to it without
+ * walking the list of children each time */
+struct _SubjectGroup {
+	MuContainer *root, *last;
+};
+typedef struct _SubjectGroup SubjectGroup;
+
+
+/* the first container with a message in the thread; for an empty
+ * root, that's (a descendant of) its first child */
+static MuContainer*
+first_msg (MuContainer *c)
+{
+	for (; c && c->docid == 0; c = c->child);
+
+	return c;
+}
+
+
+/* should c, rather than the current one, represent its subject? Like
+ * JWZ, we prefer empty containers, and then non-replies */
+static gboolean
+better_group_root (MuContainer *c, MuContainer *cur)
+{
+	if (cur->docid == 0)
+		return FALSE;
+	if (c->docid == 0)
+		return TRUE;
+
+	return (cur->flags & MU_CONTAINER_FLAG_REPLY) &&
+		!(c->flags & MU_CONTAINER_FLAG_REPLY);
+}
+
+
+static gboolean
+within_window (MuThreader *self, MuContainer *msg1, MuContainer *msg2)
+{
+	gint64 diff;
+
+	if (self->subject_window <= 0)
+		return TRUE;
+
+	diff = msg1->date - msg2->date;
+
+	return ABS(diff) <= (gint64)self->subject_window;
+}
+
+
+/* append c (and its siblings) to the children of the group's root */
+static void
+group_append (SubjectGroup *group, MuContainer *c)
+{
+	MuContainer *root;
+
+	root = group->root;
+	if (!group->last)
+		for (group->last = root->child;
+		     group->last && group->last->next;
+		     group->last = group->last->next);
+
+	if (group->last)
+		group->last->next = c;
+	else
+		root->child = c;
+
+	for (; c; c = c->next) {
+		c->parent   = root;
+		group->last = c;
+	}
+}
+
+
+/* turn the group's root (which has a message) into an empty
+ * container, with the message as its only child; we do it this way
+ * (rather than putting a new empty container in the root set), so
+ * the group's root stays where it is in the root set */
+static void
+make_empty_root (MuThreader *self, SubjectGroup *group)
+{
+	MuContainer *root, *c, *cur;
+
+	root = group->root;
+
+	c	   = mu_container_arena_alloc (self->arena, root->docid,
+					       root->msgid);
+	c->flags   = root->flags;
+	c->sortnum = root->sortnum;
+	c->sortstr = root->sortstr;
+	c->subject = root->subject;
+	c->date	   = root->date;
+	c->child   = root->child;
+	for (cur = c->child; cur; cur = cur->next)
+		cur->parent = c;
+	c->parent  = root;
+
+	root->docid   = 0;
+	root->flags   = MU_CONTAINER_FLAG_NONE;
+	root->sortnum = 0;
+	root->sortstr = NULL;
+	root->child   = c;
+
+	group->last = c;
+}
+
+
+/* 5. group the root set by subject; we compute the (normalized)
+ * subject only once for each message (in mu_threader_add), and as
+ * they are interned, we can look them up by pointer. Roots whose
+ * messages are further apart than the subject window are left
+ * alone. */
+static MuContainer*
+group_root_set_by_subject (MuThreader *self, MuContainer *root_set)
+{
+	GHashTable *subjects;
+	SubjectGroup *groups, *group;
+	MuContainer *cur, *next, *prev, *msg;
+	size_t num;
+
+	for (num = 0, cur = root_set; cur; cur = cur->next)
+		++num;
+
+	groups	 = g_new0 (SubjectGroup, num);
+	subjects = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	/* 5.A-C: find the container that represents each subject */
+	for (num = 0, cur = root_set; cur; cur = cur->next) {
+
+		msg = first_msg (cur);
+		if (!msg || !msg->subject)
+			continue;
+
+		group = g_hash_table_lookup (subjects, msg->subject);
+		if (!group) {
+			group	    = &groups[num++];
+			group->root = cur;
+			g_hash_table_insert (subjects, (gpointer)msg->subject,
+					     group);
+		} else if (better_group_root (cur, group->root))
+			group->root = cur;
+	}
+
+	/* 5.D: move the other roots into that container */
+	for (prev = NULL, cur = root_set; cur; cur = next) {
+
+		next  = cur->next;
+		msg   = first_msg (cur);
+		group = (msg && msg->subject) ?
+			g_hash_table_lookup (subjects, msg->subject) : NULL;
+
+		if (!group || group->root == cur ||
+		    !within_window (self, msg, first_msg (group->root))) {
+			prev = cur;
+			continue;
+		}
+
+		if (prev)
+			prev->next = next;
+		else
+			root_set = next;
+		cur->next = NULL;
+
+		/* both are empty: the group gets cur's children */
+		if (cur->docid == 0 && group->root->docid == 0) {
+			group_append (group, cur->child);
+			cur->child = NULL;
+			continue;
+		}
+
+		/* cur becomes a child of the group's root if that is
+		 * an empty container, or if cur is a reply to it;
+		 * otherwise, they both become children of a new empty
+		 * container */
+		if (group->root->docid != 0 &&
+		    ((group->root->flags & MU_CONTAINER_FLAG_REPLY) ||
+		     !(cur->flags & MU_CONTAINER_FLAG_REPLY) ||
+		     cur->docid == 0))
+			make_empty_root (self, group);
+
+		group_append (group, cur);
+	}
+
+	g_hash_table_destroy (subjects);
+	g_free (groups);
+
+	return root_set;
+}
+
+
+static gboolean
+count_msgs (MuContainer *c, size_t *num)
+{
+	if (c->docid != 0)
+		++*num;
+
+	return TRUE;
+}
+
+/* cut off the root set after the first threads that together have
+ * (at least) maxnum messages; the containers we cut off are still in
+ * the id_table, and will be freed with it */
+static MuContainer*
+first_threads (MuContainer *root_set, size_t maxnum)
+{
+	MuContainer *cur;
+	size_t num;
+
+	for (num = 0, cur = root_set; cur; cur = cur->next) {
+
+		count_msgs (cur, &num);
+		mu_container_foreach (cur->child,
+				      (MuContainerForeachFunc)count_msgs,
+				      &num);
+		if (num >= maxnum) {
+			cur->next = NULL;
+			break;
+		}
+	}
+
+	return root_set;
+}
+
+
+/* when we only want the first maxnum messages, there's no need to
+ * sort all the threads; instead, we sort the root set, keep only the
+ * threads we need, and sort those. The result is the same as sorting
+ * everything. */
+static MuContainer*
+sort_first_threads (MuContainer *root_set, size_t maxnum,
+		    MuMsgFieldId sortfield, gboolean revert)
+{
+	MuContainer *cur;
+
+	if (sortfield == MU_MSG_FIELD_ID_NONE)
+		return first_threads (root_set, maxnum);
+
+	/* this also sorts the threads with an empty root */
+	root_set = mu_container_sort_siblings (root_set, sortfield, revert,
+					       NULL);
+	root_set = first_threads (root_set, maxnum);
+
+	/* the threads with an empty root are sorted already */
+	for (cur = root_set; cur; cur = cur->next)
+		if (cur->docid != 0 && cur->child)
+			cur->child = mu_container_sort (cur->child, sortfield,
+							revert, NULL);
+	return root_set;
+}
@@ -24,31 +24,128 @@
 
 #include <glib.h>
 #include <mu-msg-iter.h>
+#include <mu-container.h>
+#include <mu-thread-cache.h>
 
 G_BEGIN_DECLS
 
 /**
  * takes an iter and the total number of matches, and from this
- * generates a hash-table with information about the thread structure
- * of these matches.
+ * generates information about the thread structure of these matches.
  *
  * the algorithm to find this structure is based on JWZ's
  * message-threading algorithm, as descrbed in:
  *     http://www.jwz.org/doc/threading.html
  *
- * the returned hashtable maps the Xapian docid of iter (msg) to a ptr
- * to a MuMsgIterThreadInfo structure (see mu-msg-iter.h)
+ * the result has the Xapian docids of the messages in thread order,
+ * and a MuMsgIterThreadInfo structure (see mu-msg-iter.h) for each of
+ * them
  *
  * @param iter an iter; note this function will mu_msgi_iter_reset this iterator
- * @param matches the number of matches in the set *
+ * @param tcache a thread cache to get the message-ids, references and
+ * sort values from (and to add them to, for the messages that are
+ * not in there yet), or NULL
+ * @param matches the number of matches in the set
+ * @param maxnum if > 0, only generate the thread information for the
+ * (sorted) threads containing the first maxnum messages; the
+ * thread-paths are the same as when generating it for all of them
  * @param sortfield the field to sort results by, or
  * MU_MSG_FIELD_ID_NONE if no sorting should be performed
  * @param revert if TRUE, if revert the sorting order
+ * @param group_subjects if TRUE, also group threads with the same
+ * subject (see mu_threader_group_subjects), using
+ * MU_THREADER_SUBJECT_WINDOW
  *
- * @return a hashtable; free with g_hash_table_destroy when done with it
+ * @return the thread info; free with
+ * mu_container_thread_info_destroy; or NULL if the iter was cancelled
+ * (see mu_msg_iter_is_cancelled)
  */
-GHashTable *mu_threader_calculate (MuMsgIter *iter, size_t matches,
-				   MuMsgFieldId sortfield, gboolean revert);
+MuContainerThreadInfo *mu_threader_calculate (MuMsgIter *iter,
+					      MuThreadCache *tcache,
+					      size_t matches, size_t maxnum,
+					      MuMsgFieldId sortfield,
+					      gboolean revert,
+					      gboolean group_subjects);
+
+/* when grouping threads by subject in mu_threader_calculate, only
+ * group threads that started at most this many seconds apart */
+#define MU_THREADER_SUBJECT_WINDOW (60 * 60 * 24 * 30)
+
+
+/*
+ * the lower-level interface used by mu_threader_calculate; first add
+ * all the messages to thread with mu_threader_add, then get the
+ * thread information with mu_threader_finish
+ */
+struct _MuThreader;
+typedef struct _MuThreader MuThreader;
+
+/**
+ * create a new threader object
+ *
+ * @param sizehint the expected number of messages, or 0
+ * @param sortfield the field to sort results by, or
+ * MU_MSG_FIELD_ID_NONE if no sorting should be performed
+ *
+ * @return a new threader; free with mu_threader_destroy
+ */
+MuThreader* mu_threader_new (size_t sizehint, MuMsgFieldId sortfield);
+
+/**
+ * free a threader object
+ *
+ * @param self a threader, or NULL
+ */
+void mu_threader_destroy (MuThreader *self);
+
+/**
+ * group the threads by subject as well (step 5 of JWZ's algorithm):
+ * threads whose root messages have the same subject (ignoring Re:,
+ * Fwd: etc.) are joined into one thread. This helps for messages with
+ * missing or broken references, at the cost of sometimes joining
+ * unrelated threads. Call this before adding any messages.
+ *
+ * @param self a threader
+ * @param window if > 0, only group threads whose root messages are at
+ * most this many seconds apart
+ */
+void mu_threader_group_subjects (MuThreader *self, time_t window);
+
+/**
+ * add a message to the threader
+ *
+ * @param self a threader
+ * @param docid the Xapian docid for the message (!= 0)
+ * @param msgid the message-id (or some other unique string, such as
+ * the path, if the message doesn't have one)
+ * @param refs the references for the message as a comma-separated
+ * list (as they are stored in the database), or NULL
+ * @param subject the subject of the message, or NULL; only used when
+ * grouping by subject
+ * @param date the date of the message (as a time_t); only used when
+ * grouping by subject
+ * @param sortnum the value of the sort field, if it's numeric
+ * @param sortstr the value of the sort field if it's a string, or NULL
+ */
+void mu_threader_add (MuThreader *self, guint docid, const char *msgid,
+		      const char *refs, const char *subject, gint64 date,
+		      gint64 sortnum, const char *sortstr);
+
+/**
+ * calculate the threads for the messages added to the threader; you
+ * should call this only once for each threader. The parameters are
+ * the same as for mu_threader_calculate
+ *
+ * @param self a threader
+ * @param matches the number of matches in the set
+ * @param maxnum if > 0, only generate the thread information for the
+ * (sorted) threads containing the first maxnum messages
+ * @param revert if TRUE, if revert the sorting order
+ *
+ * @return the thread info; free with mu_container_thread_info_destroy
+ */
+MuContainerThreadInfo *mu_threader_finish (MuThreader *self, size_t matches,
+					   size_t maxnum, gboolean revert);
 
 
 G_END_DECLS
@@ -271,6 +271,12 @@ typedef gpointer XapianDocument;
  */
 typedef gpointer XapianEnquire;
 
+/**
+ * we need this when using Xapian::Database* from C
+ *
+ */
+typedef gpointer XapianDatabase;
+
 
 /* print a warning for a GError, and free it */
 #define MU_HANDLE_G_ERROR(GE)							\
@@ -392,6 +398,8 @@ enum _MuError {
 	MU_ERROR_IN_PARAMETERS                = 2,
 	MU_ERROR_INTERNAL                     = 3,
 	MU_ERROR_NO_MATCHES                   = 4,
+	/* the operation was cancelled */
+	MU_ERROR_CANCELLED                    = 5,
 
 	/* general xapian related error */
 	MU_ERROR_XAPIAN                       = 11,
@@ -171,6 +171,23 @@ test_mu_date_interpret_end (void)
 }
 
 
+static void
+test_mu_date_str_to_time_t_utc (void)
+{
+	g_assert_cmpint (mu_date_str_to_time_t ("19700101000000", FALSE),
+			 ==, 0);
+	g_assert_cmpint (mu_date_str_to_time_t ("19991231235959", FALSE),
+			 ==, 946684799);
+	g_assert_cmpint (mu_date_str_to_time_t ("20120301123456", FALSE),
+			 ==, 1330605296);
+
+	/* round-trip */
+	g_assert_cmpstr (mu_date_time_t_to_str_s
+			 (mu_date_str_to_time_t ("20120229000000", FALSE),
+			  FALSE), ==, "20120229000000");
+}
+
+
 
 
 
@@ -194,6 +211,8 @@ main (int argc, char *argv[])
 			 test_mu_date_interpret_begin);
 	g_test_add_func ("/mu-str/mu_date_interpret_end",
 			 test_mu_date_interpret_end);
+	g_test_add_func ("/mu-str/mu_date_str_to_time_t_utc",
+			 test_mu_date_str_to_time_t_utc);
 
 
 	g_log_set_handler (NULL,
@@ -24,6 +24,7 @@
 
 #include <glib.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -440,6 +441,108 @@ test_mu_msg_comp_unix_programmer (void)
 	mu_msg_unref (msg);
 }
 
+
+static void
+test_mu_msg_sexp (void)
+{
+	MuMsg *msg;
+	char *sexp;
+	GString *gstr;
+
+	msg  = get_msg (MU_TESTMAILDIR4 "/181736.eml");
+	sexp = mu_msg_to_sexp (msg, 123, NULL, MU_MSG_OPTION_HEADERS_ONLY);
+	g_assert (g_str_has_prefix (sexp, "(\n\t:docid 123\n"));
+	g_assert (strstr (sexp, "\t:subject \"Re: Are writes "
+			  "\\\"atomic\\\" to readers of the file?\"\n"));
+	g_assert (strstr (sexp, "\t:from (("));
+	g_assert (strstr (sexp, "\t:date (19830 24980 0)\n"));
+
+	/* appending to a buffer gives the same, and does not touch
+	 * what was there already */
+	gstr = g_string_new (NULL);
+	mu_msg_append_sexp (gstr, msg, 123, NULL, NULL,
+			    MU_MSG_OPTION_HEADERS_ONLY);
+	g_assert_cmpstr (gstr->str, ==, sexp);
+	mu_msg_append_sexp (gstr, msg, 123, NULL, NULL,
+			    MU_MSG_OPTION_HEADERS_ONLY);
+	g_assert_cmpuint (gstr->len, ==, 2 * strlen (sexp));
+	g_assert_cmpstr (gstr->str + strlen (sexp), ==, sexp);
+
+	g_string_free (gstr, TRUE);
+	g_free (sexp);
+	mu_msg_unref (msg);
+}
+
+
+static void
+test_mu_msg_fields (void)
+{
+	MuMsg *msg;
+	GString *gstr;
+	MuMsgFieldId fields[] = {
+		MU_MSG_FIELD_ID_SUBJECT, MU_MSG_FIELD_ID_DATE,
+		MU_MSG_FIELD_ID_TO, /* empty, so left out */
+		MU_MSG_FIELD_ID_PRIO, MU_MSG_FIELD_ID_NONE };
+
+	msg  = get_msg (MU_TESTMAILDIR4 "/181736.eml");
+	gstr = g_string_new (NULL);
+
+	mu_msg_append_fields (gstr, msg, MU_MSG_FORMAT_SEXP, 7, fields,
+			      NULL, NULL);
+	g_assert_cmpstr (gstr->str, ==,
+			 "(:docid 7 :subject \"Re: Are writes "
+			 "\\\"atomic\\\" to readers of the file?\" "
+			 ":date (19830 24980 0) :prio normal)");
+
+	g_string_truncate (gstr, 0);
+	mu_msg_append_fields (gstr, msg, MU_MSG_FORMAT_JSON, 7, fields,
+			      NULL, NULL);
+	g_assert_cmpstr (gstr->str, ==,
+			 "{\"docid\":7,\"subject\":\"Re: Are writes "
+			 "\\\"atomic\\\" to readers of the file?\","
+			 "\"date\":1299603860,\"prio\":\"normal\"}");
+
+	g_assert (!mu_msg_field_is_projectable (MU_MSG_FIELD_ID_BODY_TEXT));
+	g_assert (mu_msg_field_is_projectable (MU_MSG_FIELD_ID_FROM));
+
+	g_string_free (gstr, TRUE);
+	mu_msg_unref (msg);
+}
+
+
+/* measure how fast we render header-listings (as 'mu find' and 'mu
+ * server' do them) with mu_msg_append_sexp into a re-used buffer.
+ * This only gives the throughput of the current code; it's not
+ * compared against anything. Only run with "-m perf" */
+#define PERF_SEXP_NUM 100000
+
+static void
+test_mu_msg_sexp_perf (void)
+{
+	MuMsg *msg;
+	GString *gstr;
+	unsigned u;
+	double secs;
+
+	msg  = get_msg (MU_TESTMAILDIR4 "/181736.eml");
+	gstr = g_string_sized_new (4096);
+
+	g_test_timer_start ();
+	for (u = 0; u != PERF_SEXP_NUM; ++u) {
+		g_string_truncate (gstr, 0);
+		mu_msg_append_sexp (gstr, msg, u + 1, NULL, NULL,
+				    MU_MSG_OPTION_HEADERS_ONLY);
+		g_assert (gstr->len > 0);
+	}
+	secs = g_test_timer_elapsed ();
+	g_test_minimized_result (secs, "%u header sexps: %.3fs",
+				 PERF_SEXP_NUM, secs);
+
+	g_string_free (gstr, TRUE);
+	mu_msg_unref (msg);
+}
+
+
 int
 main (int argc, char *argv[])
 {
@@ -472,6 +575,13 @@ main (int argc, char *argv[])
 			 test_mu_msg_umlaut);
 	g_test_add_func ("/mu-msg/mu-msg-comp-unix-programmer",
 			 test_mu_msg_comp_unix_programmer);
+	g_test_add_func ("/mu-msg/mu-msg-sexp",
+			 test_mu_msg_sexp);
+	g_test_add_func ("/mu-msg/mu-msg-fields",
+			 test_mu_msg_fields);
+	if (g_test_perf ())
+		g_test_add_func ("/mu-msg/mu-msg-sexp-perf",
+				 test_mu_msg_sexp_perf);
 
 	g_log_set_handler (NULL,
 			   G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL|
@@ -0,0 +1,127 @@
+/* -*-mode: c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-*/
+/*
+** Copyright (C) 2012 Dirk-Jan C. Binnema <djcb@djcbsoftware.nl>
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms of the GNU General Public License as published by the
+** Free Software Foundation; either version 3, or (at your option) any
+** later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software Foundation,
+** Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+**
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /*HAVE_CONFIG_H*/
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <string.h>
+
+#include "test-mu-common.h"
+#include "mu-spool.h"
+#include "mu-util.h"
+
+
+static char*
+make_spooldir (void)
+{
+	char *tmpdir;
+
+	tmpdir = test_mu_common_get_random_tmpdir ();
+	g_assert (mu_util_create_dir_maybe (tmpdir, 0700, FALSE));
+
+	return tmpdir;
+}
+
+
+static MuError
+each_request (MuSpoolOp op, const char *path, GString *gstr)
+{
+	g_string_append_printf (gstr, "%s %s;",
+				op == MU_SPOOL_OP_ADD ? "add" : "remove",
+				path);
+
+	/* stop at the first remove */
+	return op == MU_SPOOL_OP_REMOVE ? MU_STOP : MU_OK;
+}
+
+
+static void
+test_mu_spool_foreach (void)
+{
+	char *spooldir;
+	GString *gstr;
+
+	spooldir = make_spooldir ();
+
+	g_assert (mu_spool_add (spooldir, MU_SPOOL_OP_ADD, "/foo/a", NULL));
+	g_assert (mu_spool_add (spooldir, MU_SPOOL_OP_ADD, "/foo/b c", NULL));
+	g_assert (mu_spool_add (spooldir, MU_SPOOL_OP_REMOVE, "/foo/a", NULL));
+	g_assert (mu_spool_add (spooldir, MU_SPOOL_OP_ADD, "/foo/d", NULL));
+
+	/* requests come in order, up to and including the one that
+	 * stops us; that one stays in the spool */
+	gstr = g_string_new (NULL);
+	g_assert_cmpint (mu_spool_foreach
+			 (spooldir, (MuSpoolForeachFunc)each_request, gstr,
+			  NULL), ==, 2);
+	g_assert_cmpstr (gstr->str, ==,
+			 "add /foo/a;add /foo/b c;remove /foo/a;");
+
+	g_string_truncate (gstr, 0);
+	g_assert_cmpint (mu_spool_foreach
+			 (spooldir, (MuSpoolForeachFunc)each_request, gstr,
+			  NULL), ==, 0);
+	g_assert_cmpstr (gstr->str, ==, "remove /foo/a;");
+
+	g_string_free (gstr, TRUE);
+	g_free (spooldir);
+}
+
+
+static void
+test_mu_spool_no_dir (void)
+{
+	GError *err;
+
+	err = NULL;
+	g_assert (!mu_spool_add ("/non/existent/spool", MU_SPOOL_OP_ADD,
+				 "/foo/a", &err));
+	g_assert (err);
+	g_clear_error (&err);
+
+	g_assert_cmpint (mu_spool_foreach
+			 ("/non/existent/spool",
+			  (MuSpoolForeachFunc)each_request, NULL, &err),
+			 ==, -1);
+	g_clear_error (&err);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+	g_test_init (&argc, &argv, NULL);
+
+	g_test_add_func ("/mu-spool/mu-spool-foreach",
+			 test_mu_spool_foreach);
+	g_test_add_func ("/mu-spool/mu-spool-no-dir",
+			 test_mu_spool_no_dir);
+
+	g_log_set_handler (NULL,
+			   G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL|
+			   G_LOG_FLAG_RECURSION,
+			   (GLogFunc)black_hole, NULL);
+
+	return g_test_run ();
+}
@@ -179,6 +179,139 @@ test_mu_store_store_msg_remove_and_count (void)
 }
 
 
+static void
+test_mu_store_lookups (void)
+{
+	MuStore *store;
+	gchar* tmpdir;
+	unsigned docid1, docid2, docids[3];
+	GSList *lst;
+	char *path;
+	const char *paths[] = {
+		MU_TESTMAILDIR "/cur/1283599333.1840_11.cthulhu!2,",
+		MU_TESTMAILDIR2 "/bar/cur/mail4",
+		MU_TESTMAILDIR2 "/bar/cur/no-such-message"
+	};
+	const char *msgids[] = {
+		"no-such-message@example.com",
+		"293847329847@web.de"
+	};
+
+	tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert (tmpdir);
+	store = mu_store_new_writable (tmpdir, NULL, FALSE, NULL);
+	g_assert (store);
+	g_free (tmpdir);
+
+	docid1 = mu_store_add_path (store, paths[0], NULL, NULL);
+	docid2 = mu_store_add_path (store, paths[1], NULL, NULL);
+	g_assert_cmpuint (docid1, !=, MU_STORE_INVALID_DOCID);
+	g_assert_cmpuint (docid2, !=, MU_STORE_INVALID_DOCID);
+
+	g_assert_cmpuint (mu_store_get_docid_for_path (store, paths[1], NULL),
+			  ==, docid2);
+	g_assert_cmpuint (mu_store_get_docid_for_path (store, paths[2], NULL),
+			  ==, MU_STORE_INVALID_DOCID);
+
+	g_assert (mu_store_get_docids_for_paths (store, paths, 3, docids,
+						 NULL));
+	g_assert_cmpuint (docids[0], ==, docid1);
+	g_assert_cmpuint (docids[1], ==, docid2);
+	g_assert_cmpuint (docids[2], ==, MU_STORE_INVALID_DOCID);
+
+	lst = mu_store_get_docids_for_msgids (store, msgids, 2, NULL);
+	g_assert_cmpuint (g_slist_length (lst), ==, 1);
+	g_assert_cmpuint (GPOINTER_TO_SIZE(lst->data), ==, docid2);
+	g_slist_free (lst);
+
+	g_assert (!mu_store_get_docids_for_msgids (store, msgids, 1, NULL));
+
+	path = mu_store_get_path (store, docid2, NULL);
+	g_assert (path);
+	g_assert (g_str_has_suffix (path, "/bar/cur/mail4"));
+	g_free (path);
+
+	mu_store_unref (store);
+}
+
+
+/* a read-only store only sees the changes committed before it was
+ * (re)opened */
+static void
+test_mu_store_reopen (void)
+{
+	MuStore *store, *rostore;
+	gchar* tmpdir;
+	guint64 rev;
+
+	tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert (tmpdir);
+	store = mu_store_new_writable (tmpdir, NULL, FALSE, NULL);
+	g_assert (store);
+
+	g_assert_cmpuint (mu_store_add_path
+			  (store, MU_TESTMAILDIR2 "/bar/cur/mail3", NULL, NULL),
+			  !=, MU_STORE_INVALID_DOCID);
+	mu_store_flush (store);
+
+	rostore = mu_store_new_read_only (tmpdir, NULL);
+	g_assert (rostore);
+	g_assert_cmpuint (mu_store_count (rostore, NULL), ==, 1);
+
+	g_assert_cmpuint (mu_store_add_path
+			  (store, MU_TESTMAILDIR2 "/bar/cur/mail4", NULL, NULL),
+			  !=, MU_STORE_INVALID_DOCID);
+	mu_store_flush (store);
+	g_assert_cmpuint (mu_store_count (rostore, NULL), ==, 1);
+
+	rev = mu_store_revision (rostore);
+	g_assert (mu_store_reopen (rostore, NULL));
+	g_assert_cmpuint (mu_store_count (rostore, NULL), ==, 2);
+	g_assert_cmpuint (mu_store_revision (rostore), >, rev);
+
+	mu_store_unref (rostore);
+	mu_store_unref (store);
+	g_free (tmpdir);
+}
+
+
+static void
+test_mu_store_uid_filter (void)
+{
+	MuStore *store;
+	gchar* tmpdir;
+	const char *mail3 = MU_TESTMAILDIR2 "/bar/cur/mail3";
+	const char *mail4 = MU_TESTMAILDIR2 "/bar/cur/mail4";
+
+	tmpdir = test_mu_common_get_random_tmpdir();
+	g_assert (tmpdir);
+	store = mu_store_new_writable (tmpdir, NULL, FALSE, NULL);
+	g_assert (store);
+	g_free (tmpdir);
+
+	g_assert_cmpuint (mu_store_add_path (store, mail3, NULL, NULL),
+			  !=, MU_STORE_INVALID_DOCID);
+	mu_store_flush (store);
+
+	g_assert (mu_store_load_uid_filter (store, NULL));
+	g_assert (mu_store_contains_message (store, mail3, NULL));
+	g_assert (!mu_store_contains_message (store, mail4, NULL));
+
+	/* the filter follows our changes */
+	g_assert_cmpuint (mu_store_add_path (store, mail4, NULL, NULL),
+			  !=, MU_STORE_INVALID_DOCID);
+	g_assert (mu_store_contains_message (store, mail4, NULL));
+	g_assert (mu_store_remove_path (store, mail3));
+	g_assert (!mu_store_contains_message (store, mail3, NULL));
+
+	mu_store_unload_uid_filter (store);
+	g_assert (!mu_store_contains_message (store, mail3, NULL));
+	g_assert (mu_store_contains_message (store, mail4, NULL));
+
+	mu_store_unref (store);
+}
+
+
 int
 main (int argc, char *argv[])
 {
@@ -193,6 +326,12 @@ main (int argc, char *argv[])
 			 test_mu_store_store_msg_and_count);
 	g_test_add_func ("/mu-store/mu-store-store-remove-and-count",
 			 test_mu_store_store_msg_remove_and_count);
+	g_test_add_func ("/mu-store/mu-store-lookups",
+			 test_mu_store_lookups);
+	g_test_add_func ("/mu-store/mu-store-reopen",
+			 test_mu_store_reopen);
+	g_test_add_func ("/mu-store/mu-store-uid-filter",
+			 test_mu_store_uid_filter);
 
 	if (!g_test_verbose())
 		g_log_set_handler (NULL,
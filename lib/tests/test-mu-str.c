@@ -459,6 +459,66 @@ test_mu_str_subject_normalize (void)
 
 
 
+static void
+test_mu_str_escape_c_literal (void)
+{
+	int i;
+	GString *gstr;
+
+	struct {
+		char *src, *exp;
+	} tests[] = {
+		{ "test123", "\"test123\"" },
+		{ "say \"hi\"", "\"say \\\"hi\\\"\"" },
+		{ "c:\\dos", "\"c:\\\\dos\"" },
+		{ "\\\"", "\"\\\\\\\"\"" },
+		{ "", "\"\"" }
+	};
+
+	gstr = g_string_new ("x ");
+	for (i = 0; i != G_N_ELEMENTS(tests); ++i) {
+		char *esc;
+		esc = mu_str_escape_c_literal (tests[i].src, TRUE);
+		g_assert_cmpstr (esc, ==, tests[i].exp);
+		g_free (esc);
+
+		/* appending should give the same, after what's there */
+		g_string_truncate (gstr, 2);
+		mu_str_append_c_literal (gstr, tests[i].src, TRUE);
+		g_assert_cmpstr (gstr->str + 2, ==, tests[i].exp);
+		g_assert (g_str_has_prefix (gstr->str, "x "));
+	}
+	g_string_free (gstr, TRUE);
+}
+
+
+static void
+test_mu_str_append_json_string (void)
+{
+	int i;
+	GString *gstr;
+
+	struct {
+		char *src, *exp;
+	} tests[] = {
+		{ "test123", "\"test123\"" },
+		{ "say \"hi\"", "\"say \\\"hi\\\"\"" },
+		{ "c:\\dos", "\"c:\\\\dos\"" },
+		{ "a\tb\nc\001", "\"a\\tb\\nc\\u0001\"" },
+		{ "Māori", "\"Māori\"" },
+		{ "", "\"\"" }
+	};
+
+	gstr = g_string_new (NULL);
+	for (i = 0; i != G_N_ELEMENTS(tests); ++i) {
+		g_string_truncate (gstr, 0);
+		mu_str_append_json_string (gstr, tests[i].src);
+		g_assert_cmpstr (gstr->str, ==, tests[i].exp);
+	}
+	g_string_free (gstr, TRUE);
+}
+
+
 
 
 int
@@ -510,6 +570,10 @@ main (int argc, char *argv[])
 	g_test_add_func ("/mu-str/mu_str_guess_nick",
 			 test_mu_str_guess_nick);
 
+	g_test_add_func ("/mu-str/mu-str-escape-c-literal",
+			 test_mu_str_escape_c_literal);
+	g_test_add_func ("/mu-str/mu-str-append-json-string",
+			 test_mu_str_append_json_string);
 	g_test_add_func ("/mu-str/mu_str_subject_normalize",
 			 test_mu_str_subject_normalize);
 
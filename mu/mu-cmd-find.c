@@ -61,6 +61,46 @@ print_xapian_query (MuQuery *xapian, const gchar *query, GError **err)
 	return TRUE;
 }
 
+static gboolean
+print_count (MuQuery *xapian, const gchar *query, GError **err)
+{
+	unsigned count;
+
+	count = mu_query_count (xapian, query, err);
+	if (count == (unsigned)-1)
+		return FALSE;
+
+	g_print ("%u\n", count);
+
+	return TRUE;
+}
+
+static void
+each_facet (MuQueryFacet facet, const char *val, unsigned count,
+	    gpointer user_data)
+{
+	g_print ("%s\t%s\t%u\n", mu_query_facet_name (facet), val, count);
+}
+
+
+static gboolean
+print_facets (MuQuery *xapian, const gchar *query, MuConfig *opts,
+	      GError **err)
+{
+	MuQueryFacet facets;
+
+	facets = mu_query_facets_from_str (opts->facets);
+	if (facets == MU_QUERY_FACET_NONE) {
+		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+				     "invalid facets '%s'", opts->facets);
+		return FALSE;
+	}
+
+	return mu_query_facets (xapian, query, facets,
+				(MuQueryFacetForeachFunc)each_facet,
+				NULL, err);
+}
+
 /* returns MU_MSG_FIELD_ID_NONE if there is an error */
 static MuMsgFieldId
 sort_field_from_string (const char* fieldstr, GError **err)
@@ -112,6 +152,7 @@ run_query (MuQuery *xapian, const gchar *query, MuConfig *opts,  GError **err)
 {
 	MuMsgIter *iter;
 	MuMsgFieldId sortid;
+	int qflags;
 
 	sortid = MU_MSG_FIELD_ID_NONE;
 	if (opts->sortfield) {
@@ -120,8 +161,20 @@ run_query (MuQuery *xapian, const gchar *query, MuConfig *opts,  GError **err)
 			return FALSE;
 	}
 
-	iter = mu_query_run (xapian, query, opts->threads, sortid,
-			     opts->reverse, -1, err);
+	qflags = MU_QUERY_FLAG_NONE;
+	if (opts->conversations)
+		qflags |= MU_QUERY_FLAG_CONVERSATIONS;
+	else if (opts->threads)
+		qflags |= MU_QUERY_FLAG_THREADS;
+	if (opts->reverse)
+		qflags |= MU_QUERY_FLAG_DESCENDING;
+	if (opts->include_related)
+		qflags |= MU_QUERY_FLAG_INCLUDE_RELATED;
+	if (opts->group_subjects)
+		qflags |= MU_QUERY_FLAG_GROUP_SUBJECTS;
+
+	iter = mu_query_run (xapian, query, sortid, -1,
+			     (MuQueryFlags)qflags, err);
 	return iter;
 }
 
@@ -442,6 +495,24 @@ thread_indent (MuMsgIter *iter)
 
 
 
+/* print the number of messages and unread messages for the
+ * conversation, like: (5/2) */
+static void
+conv_counts (MuMsgIter *iter)
+{
+	const MuMsgIterConvInfo *ci;
+
+	ci = mu_msg_iter_get_conv_info (iter);
+	if (!ci) {
+		g_warning ("cannot get conversation-info for message %u",
+			   mu_msg_iter_get_docid (iter));
+		return;
+	}
+
+	printf ("(%u/%u) ", ci->msgnum, ci->unreadnum);
+}
+
+
 static void
 output_plain_fields (MuMsg *msg, const char *fields,
 		     gboolean color, gboolean threads)
@@ -477,7 +548,9 @@ output_plain (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err)
 	/* we reuse the color (whatever that may be)
 	 * for message-priority for threads, too */
 	ansi_color_maybe (MU_MSG_FIELD_ID_PRIO, !opts->nocolor);
-	if (opts->threads)
+	if (opts->conversations)
+		conv_counts (iter);
+	else if (opts->threads)
 		thread_indent (iter);
 
 	output_plain_fields (msg, opts->fields, !opts->nocolor, opts->threads);
@@ -490,17 +563,24 @@ output_plain (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err)
 
 
 
+/* the buffer we write the s-expressions to; we re-use it for all
+ * messages */
+static GString *SEXP_BUF = NULL;
+
 static gboolean
 output_sexp (MuMsg *msg, MuMsgIter *iter, MuConfig *opts, GError **err)
 {
-	char *sexp;
 	const MuMsgIterThreadInfo *ti;
+	const MuMsgIterConvInfo *ci;
+
+	ti = (opts->threads && !opts->conversations) ?
+		mu_msg_iter_get_thread_info (iter) : NULL;
+	ci = opts->conversations ? mu_msg_iter_get_conv_info (iter) : NULL;
 
-	ti   = opts->threads ? mu_msg_iter_get_thread_info (iter) : NULL;
-	sexp = mu_msg_to_sexp (msg, mu_msg_iter_get_docid (iter),
-			       ti, MU_MSG_OPTION_HEADERS_ONLY);
-	fputs (sexp, stdout);
-	g_free (sexp);
+	g_string_truncate (SEXP_BUF, 0);
+	mu_msg_append_sexp (SEXP_BUF, msg, mu_msg_iter_get_docid (iter),
+			    ti, ci, MU_MSG_OPTION_HEADERS_ONLY);
+	fwrite (SEXP_BUF->str, 1, SEXP_BUF->len, stdout);
 
 	return TRUE;
 }
@@ -557,6 +637,7 @@ output_prepare (MuConfig *opts, GError **err)
 		g_print ("<messages>\n");
 		return output_xml;
 	case MU_CONFIG_FORMAT_SEXP:
+		SEXP_BUF = g_string_sized_new (4096);
 		return output_sexp;
 
 	default:
@@ -570,6 +651,10 @@ output_finish (MuConfig *opts)
 {
 	if (opts->format == MU_CONFIG_FORMAT_XML)
 		g_print ("</messages>\n");
+	else if (opts->format == MU_CONFIG_FORMAT_SEXP) {
+		g_string_free (SEXP_BUF, TRUE);
+		SEXP_BUF = NULL;
+	}
 }
 
 
@@ -602,6 +687,10 @@ output_query_results (MuMsgIter *iter, MuConfig *opts, GError **err)
 
 	output_finish (opts);
 
+	/* getting the results may have failed part-way */
+	if (rv && mu_msg_iter_failed (iter, err))
+		return FALSE;
+
 	if (rv && count == 0) {
 		mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
 				     "no matches for search expression");
@@ -648,6 +737,10 @@ execute_find (MuStore *store, MuConfig *opts, GError **err)
 
 	if (opts->format == MU_CONFIG_FORMAT_XQUERY)
 		rv = print_xapian_query (oracle, query_str, err);
+	else if (opts->count)
+		rv = print_count (oracle, query_str, err);
+	else if (opts->facets)
+		rv = print_facets (oracle, query_str, opts, err);
 	else
 		rv = process_query (oracle, query_str, opts, err);
 
@@ -36,6 +36,7 @@
 #include "mu-index.h"
 #include "mu-store.h"
 #include "mu-runtime.h"
+#include "mu-spool.h"
 
 static gboolean MU_CAUGHT_SIGNAL;
 
@@ -121,12 +122,30 @@ check_maildir (const char *maildir, GError **err)
 }
 
 
-static MuError
-index_msg_silent_cb (MuIndexStats* stats, void *user_data)
+struct _IndexData {
+	gboolean	 color;
+	MuStore		*store;
+	time_t		 drained; /* when we last drained the spool */
+};
+typedef struct _IndexData IndexData;
+
+
+/* handle the requests 'mu add' and 'mu remove' left in the spool
+ * (about once a second), so they don't have to wait until we're
+ * done; they become part of our current transaction */
+static void
+drain_spool_maybe (IndexData *idata)
 {
-	return MU_CAUGHT_SIGNAL ? MU_STOP: MU_OK;
-}
+	time_t now;
 
+	now = time (NULL);
+	if (now == idata->drained)
+		return;
+
+	mu_spool_drain (mu_runtime_path (MU_RUNTIME_PATH_SPOOL),
+			idata->store, NULL);
+	idata->drained = now;
+}
 
 
 static void
@@ -167,14 +186,19 @@ print_stats (MuIndexStats* stats, gboolean clear, gboolean color)
 }
 
 
-struct _IndexData {
-	gboolean color;
-};
-typedef struct _IndexData IndexData;
+
+/* the callbacks for the cleanup; these don't drain the spool, as
+ * the cleanup walks a list of docids it got beforehand, and a
+ * spooled 'remove' could take documents away from under it */
+static MuError
+cleanup_silent_cb (MuIndexStats* stats, IndexData *idata)
+{
+	return MU_CAUGHT_SIGNAL ? MU_STOP: MU_OK;
+}
 
 
 static MuError
-index_msg_cb  (MuIndexStats* stats, IndexData *idata)
+cleanup_cb (MuIndexStats* stats, IndexData *idata)
 {
 	if (stats->_processed % 25)
 	 	return MU_OK;
@@ -185,6 +209,24 @@ index_msg_cb  (MuIndexStats* stats, IndexData *idata)
 }
 
 
+static MuError
+index_msg_silent_cb (MuIndexStats* stats, IndexData *idata)
+{
+	drain_spool_maybe (idata);
+
+	return cleanup_silent_cb (stats, idata);
+}
+
+
+static MuError
+index_msg_cb  (MuIndexStats* stats, IndexData *idata)
+{
+	drain_spool_maybe (idata);
+
+	return cleanup_cb (stats, idata);
+}
+
+
 
 static gboolean
 database_version_check_and_update (MuStore *store, MuConfig *opts,
@@ -246,11 +288,10 @@ show_time (unsigned t, unsigned processed, gboolean color)
 
 static MuError
 cleanup_missing (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
-		 gboolean show_progress, GError **err)
+		 gboolean show_progress, IndexData *idata, GError **err)
 {
 	MuError rv;
 	time_t t;
-	IndexData idata;
 
 	if (!opts->quiet)
 		g_print ("cleaning up messages [%s]\n",
@@ -259,13 +300,12 @@ cleanup_missing (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
 	mu_index_stats_clear (stats);
 
 	t = time (NULL);
-	idata.color = !opts->nocolor;
 	rv = mu_index_cleanup
 		(midx, stats,
 		 show_progress ?
-		 (MuIndexCleanupDeleteCallback)index_msg_cb :
-		 (MuIndexCleanupDeleteCallback)index_msg_silent_cb,
-		 &idata, err);
+		 (MuIndexCleanupDeleteCallback)cleanup_cb :
+		 (MuIndexCleanupDeleteCallback)cleanup_silent_cb,
+		 idata, err);
 
 	if (!opts->quiet) {
 		print_stats (stats, TRUE, !opts->nocolor);
@@ -295,9 +335,8 @@ index_title (const char* maildir, const char* xapiandir, gboolean color)
 
 static MuError
 cmd_index (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
-	   gboolean show_progress, GError **err)
+	   gboolean show_progress, IndexData *idata, GError **err)
 {
-	IndexData idata;
 	MuError rv;
 	time_t t;
 
@@ -307,12 +346,11 @@ cmd_index (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
 		index_title (opts->maildir, mu_runtime_path(MU_RUNTIME_PATH_XAPIANDB),
 			     !opts->nocolor);
 
-	idata.color = !opts->nocolor;
 	rv = mu_index_run (midx, opts->maildir, opts->reindex, stats,
 			   show_progress ?
 			   (MuIndexMsgCallback)index_msg_cb :
 			   (MuIndexMsgCallback)index_msg_silent_cb,
-			   NULL, &idata);
+			   NULL, idata);
 
 	if (!opts->quiet) {
 		print_stats (stats, TRUE, !opts->nocolor);
@@ -325,7 +363,8 @@ cmd_index (MuIndex *midx, MuConfig *opts, MuIndexStats *stats,
 		MU_WRITE_LOG ("index: processed: %u; updated/new: %u",
 			      stats->_processed, stats->_updated);
 		if (rv == MU_OK && !opts->nocleanup)
-			rv = cleanup_missing (midx, opts, stats, show_progress, err);
+			rv = cleanup_missing (midx, opts, stats, show_progress,
+					      idata, err);
 		if (rv == MU_STOP)
 			rv = MU_OK;
 	} else
@@ -366,6 +405,7 @@ mu_cmd_index (MuStore *store, MuConfig *opts, GError **err)
 {
 	MuIndex *midx;
 	MuIndexStats stats;
+	IndexData idata;
 	gboolean rv, show_progress;
 
 	g_return_val_if_fail (opts, FALSE);
@@ -382,8 +422,15 @@ mu_cmd_index (MuStore *store, MuConfig *opts, GError **err)
 	mu_index_stats_clear (&stats);
 	install_sig_handler ();
 
-	rv = cmd_index (midx, opts, &stats, show_progress, err);
+	idata.color   = !opts->nocolor;
+	idata.store   = store;
+	idata.drained = 0;
+
+	rv = cmd_index (midx, opts, &stats, show_progress, &idata, err);
 	mu_index_destroy (midx);
 
+	/* whatever came in since we last looked */
+	mu_spool_drain (mu_runtime_path (MU_RUNTIME_PATH_SPOOL), store, NULL);
+
 	return rv;
 }
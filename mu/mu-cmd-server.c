@@ -28,6 +28,15 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <glib/gprintf.h>
 
@@ -46,9 +55,11 @@
 #include "mu-cmd.h"
 #include "mu-maildir.h"
 #include "mu-query.h"
+#include "mu-thread-cache.h"
 #include "mu-index.h"
 #include "mu-msg-part.h"
 #include "mu-contacts.h"
+#include "mu-spool.h"
 
 /* signal handling *****************************************************/
 /*
@@ -92,49 +103,437 @@ install_sig_handler (void)
 #define COOKIE_PRE  '\376'
 #define COOKIE_POST '\377'
 
-static void G_GNUC_PRINTF(1, 2)
-print_expr (const char* frm, ...)
+/*
+ * the clients: normally, there's only one, the frontend that started
+ * us, which talks to us through stdin/stdout; but in daemon mode (see
+ * mu_cmd_server), we listen on a socket, and there can be many.
+ *
+ * for each client, we collect the expressions, each framed by its
+ * cookie, in a buffer, and write them in one go (with writev) when
+ * there's enough of them, when the oldest one has waited long enough,
+ * or when a command is done. For the stdout client, writing blocks when
+ * the frontend doesn't keep up with us, so we never buffer much more
+ * than OUT_FLUSH_SIZE bytes. A socket client should not hold up the
+ * others, so whatever its socket does not take right away is kept in
+ * its pending buffer, which the main loop writes when the socket is
+ * ready for it. A client that lets more than CLIENT_PENDING_MAX bytes
+ * pile up is not reading anymore; we disconnect it, rather than
+ * waiting for it (with the lock held) and holding up everyone else.
+ *
+ * 'find' and 'index' write from threads of their own (see cmd_find
+ * and cmd_index), so the output is protected by a lock, and the client
+ * we're writing to is a per-thread setting (see client_set_current).
+ */
+#define OUT_FLUSH_SIZE (64 * 1024)
+#define OUT_FLUSH_SECS 0.1
+#define CLIENT_PENDING_MAX (8 * 1024 * 1024)
+
+struct _Client {
+	int		 infd, outfd;
+	gboolean	 is_socket;
+	GString		*inbuf;	  /* what we read, up to the next newline */
+	gboolean	 quit;	  /* set on EOF and after 'quit' */
+
+	/* the format for the compact header rows (see cmd_protocol) */
+	MuMsgFormat	 format;
+
+	pthread_mutex_t	 lock;	  /* for the output */
+	GString		*buf;	  /* the expressions we did not write yet */
+	GTimer		*timer;	  /* started when buf got its first expression */
+	GString		*pending; /* written, but not taken by the socket yet */
+	gboolean	 dead;	  /* writing failed; ignore any output */
+
+	/* the main loop has a reference, and so have the 'find' and
+	 * 'index' jobs for this client */
+	volatile gint	 refcount;
+};
+typedef struct _Client Client;
+
+/* the client for the current thread */
+static pthread_key_t CLIENT_KEY;
+
+/* the main loop polls this pipe, so other threads can wake it up
+ * when some client has pending output */
+static int WAKE_PIPE[2] = { -1, -1 };
+
+
+static Client*
+client_new (int infd, int outfd, gboolean is_socket)
+{
+	Client *client;
+
+	client		  = g_slice_new0 (Client);
+	client->infd	  = infd;
+	client->outfd	  = outfd;
+	client->is_socket = is_socket;
+	client->inbuf	  = g_string_sized_new (512);
+	client->format	  = MU_MSG_FORMAT_SEXP;
+	client->buf	  = g_string_sized_new (OUT_FLUSH_SIZE + 4096);
+	client->timer	  = g_timer_new ();
+	client->pending	  = g_string_sized_new (0);
+	client->refcount  = 1;
+
+	pthread_mutex_init (&client->lock, NULL);
+
+	return client;
+}
+
+
+static Client*
+client_ref (Client *client)
+{
+	g_atomic_int_inc (&client->refcount);
+	return client;
+}
+
+
+static Client*
+client_current (void)
+{
+	return (Client*)pthread_getspecific (CLIENT_KEY);
+}
+
+static void
+client_set_current (Client *client)
+{
+	pthread_setspecific (CLIENT_KEY, client);
+}
+
+
+static void
+wake_main_loop (void)
 {
-	char *expr;
-	va_list ap;
 	ssize_t rv;
-	size_t exprlen, lenlen;
-	char cookie[16];
-	static int outfd = 0;
 
-	if (outfd == 0)
-		outfd = fileno (stdout);
+	/* if the pipe is full, the main loop is awake anyway */
+	rv = write (WAKE_PIPE[1], "", 1);
+	(void)rv;
+}
+
 
-	expr    = NULL;
+/* write everything in iov; when the frontend is not reading fast
+ * enough (ie., the pipe is full), wait for it */
+static gboolean
+write_all (int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t rv;
+
+	while (iovcnt > 0) {
+
+		rv = writev (fd, iov, iovcnt);
+		if (rv == -1) {
+			struct pollfd pfd;
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return FALSE;
+			pfd.fd	   = fd;
+			pfd.events = POLLOUT;
+			if (poll (&pfd, 1, -1) == -1 && errno != EINTR)
+				return FALSE;
+			continue;
+		}
+
+		/* skip whatever was written already */
+		while (iovcnt > 0 && (size_t)rv >= iov->iov_len) {
+			rv -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+
+	return TRUE;
+}
+
+
+/* write what a socket client takes right away, and make whatever is
+ * left the client's pending output; note, iov[0] may be the pending
+ * output itself. If the client is gone (or does not read anymore), we
+ * mark it as dead. The caller must hold the lock */
+static void
+client_write_socket (Client *client, struct iovec *iov, int iovcnt)
+{
+	ssize_t rv;
+	size_t total;
+	GString *rest;
+	int u;
+
+	for (total = 0, u = 0; u != iovcnt; ++u)
+		total += iov[u].iov_len;
+
+	do
+		rv = writev (client->outfd, iov, iovcnt);
+	while (rv == -1 && errno == EINTR);
+
+	if (rv == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			MU_WRITE_LOG ("client went away: %s", strerror(errno));
+			client->dead = TRUE;
+			return;
+		}
+		rv = 0;
+	}
+
+	if (total - rv >= CLIENT_PENDING_MAX) {
+		MU_WRITE_LOG ("client does not read its output; "
+			      "disconnecting");
+		g_string_truncate (client->pending, 0);
+		client->dead = TRUE;
+		wake_main_loop (); /* so it can get rid of the client */
+		return;
+	}
+
+	rest = g_string_sized_new (total - rv);
+	for (u = 0; u != iovcnt; ++u) {
+		if ((size_t)rv >= iov[u].iov_len) {
+			rv -= iov[u].iov_len;
+			continue;
+		}
+		g_string_append_len (rest, (char*)iov[u].iov_base + rv,
+				     iov[u].iov_len - rv);
+		rv = 0;
+	}
+
+	g_string_free (client->pending, TRUE);
+	client->pending = rest;
+
+	if (client->pending->len > 0)
+		wake_main_loop ();
+}
+
+
+/* write the pending output (if any) followed by the buffered
+ * expressions, followed by the extranum buffers in extra (if any);
+ * the caller must hold the lock */
+static void
+out_write (Client *client, const struct iovec *extra, int extranum)
+{
+	struct iovec iov[5];
+	int u, iovcnt;
+
+	g_return_if_fail (extranum < (int)G_N_ELEMENTS(iov) - 1);
+
+	if (client->dead) {
+		g_string_truncate (client->buf, 0);
+		return;
+	}
+
+	iovcnt = 0;
+	if (client->pending->len > 0) {
+		iov[iovcnt].iov_base  = client->pending->str;
+		iov[iovcnt++].iov_len = client->pending->len;
+	}
+	iov[iovcnt].iov_base  = client->buf->str;
+	iov[iovcnt++].iov_len = client->buf->len;
+	for (u = 0; u != extranum; ++u)
+		iov[iovcnt++] = extra[u];
+
+	if (client->is_socket)
+		client_write_socket (client, iov, iovcnt);
+	else if (!write_all (client->outfd, iov, iovcnt)) {
+		g_critical ("%s: write() failed: %s",
+			   __FUNCTION__, strerror(errno));
+		/* terminate ourselves; note, this may be some thread
+		 * that has signals blocked (see start_thread) */
+		kill (getpid (), SIGTERM);
+	}
+
+	g_string_truncate (client->buf, 0);
+}
+
+
+/* write the buffered expressions, if any; the caller must hold the
+ * lock */
+static void
+out_write_pending (Client *client)
+{
+	if (client->buf->len > 0)
+		out_write (client, NULL, 0);
+}
+
+
+static void
+client_flush (Client *client)
+{
+	pthread_mutex_lock (&client->lock);
+	out_write_pending (client);
+	pthread_mutex_unlock (&client->lock);
+}
+
+
+/* the main loop calls this when a socket client is ready to take
+ * more of its pending output */
+static void
+client_write_more (Client *client)
+{
+	struct iovec iov;
+
+	pthread_mutex_lock (&client->lock);
+
+	if (!client->dead && client->pending->len > 0) {
+		iov.iov_base = client->pending->str;
+		iov.iov_len  = client->pending->len;
+		client_write_socket (client, &iov, 1);
+	}
+
+	pthread_mutex_unlock (&client->lock);
+}
+
+
+static gboolean
+client_has_pending (Client *client)
+{
+	gboolean rv;
+
+	pthread_mutex_lock (&client->lock);
+	rv = !client->dead && client->pending->len > 0;
+	pthread_mutex_unlock (&client->lock);
+
+	return rv;
+}
 
-	va_start (ap, frm);
-	exprlen = g_vasprintf (&expr, frm, ap);
-	va_end (ap);
 
-	/* this cookie tells the frontend where to expect the next
-	 * expression */
+static void
+client_unref (Client *client)
+{
+	if (!g_atomic_int_dec_and_test (&client->refcount))
+		return;
+
+	/* write what's left; for a socket client, only what it takes
+	 * right away, as it may not be reading anymore */
+	out_write_pending (client);
+	if (client->is_socket)
+		close (client->infd);
+
+	g_string_free (client->inbuf, TRUE);
+	g_string_free (client->buf, TRUE);
+	g_string_free (client->pending, TRUE);
+	g_timer_destroy (client->timer);
+	pthread_mutex_destroy (&client->lock);
+
+	g_slice_free (Client, client);
+}
+
+
+/* this cookie tells the frontend where to expect the next
+ * expression, ie.
+ *   COOKIE_PRE <len-of-following-sexp-in-hex> COOKIE_POST
+ */
+static size_t
+format_cookie (char *cookie, size_t exprlen)
+{
+	size_t lenlen;
 
 	cookie[0] = COOKIE_PRE;
 	lenlen = sprintf(cookie + 1, "%x",
 			 (unsigned)exprlen + 1); /* + 1 for \n */
 	cookie[lenlen + 1] = COOKIE_POST;
 
-	/* write the cookie, ie.
-	 *   COOKIE_PRE <len-of-following-sexp-in-hex> COOKIE_POST
-	 */
-	rv = write (outfd, cookie, lenlen + 2);
-	if (rv != -1) {
-		rv = write (outfd, expr, exprlen);
-		g_free (expr);
-	}
-	if (rv != -1)
-		rv = write (outfd, "\n", 1);
-	if (rv == -1) {
-		g_critical ("%s: write() failed: %s",
-			   __FUNCTION__, strerror(errno));
-		/* terminate ourselves */
-		raise (SIGTERM);
+	return lenlen + 2;
+}
+
+
+static void
+out_start_maybe (Client *client)
+{
+	if (client->buf->len == 0)
+		g_timer_start (client->timer);
+}
+
+
+/* output an expression of exprlen bytes, preceded by its cookie; we
+ * may buffer it for a while, so this is for the (many) messages in
+ * the results of some command */
+static void
+print_expr_len (const char *expr, size_t exprlen)
+{
+	Client *client;
+	char cookie[16];
+	size_t cookielen;
+	struct iovec iov[2];
+
+	if (!(client = client_current ()))
+		return;
+
+	pthread_mutex_lock (&client->lock);
+	out_start_maybe (client);
+
+	cookielen = format_cookie (cookie, exprlen);
+	g_string_append_len (client->buf, cookie, cookielen);
+
+	/* a big expression (such as a message view) is not copied;
+	 * we write it straight after the buffered ones */
+	if (exprlen >= OUT_FLUSH_SIZE) {
+		iov[0].iov_base = (char*)expr;
+		iov[0].iov_len	= exprlen;
+		iov[1].iov_base = "\n";
+		iov[1].iov_len	= 1;
+		out_write (client, iov, 2);
+	} else {
+		g_string_append_len (client->buf, expr, exprlen);
+		g_string_append_c (client->buf, '\n');
+
+		if (client->buf->len >= OUT_FLUSH_SIZE ||
+		    g_timer_elapsed (client->timer, NULL) >= OUT_FLUSH_SECS)
+			out_write_pending (client);
 	}
+
+	pthread_mutex_unlock (&client->lock);
+}
+
+
+/* output an expression, and write it (with the ones buffered before
+ * it) right away; this is for errors, progress information and the
+ * like, which the frontend should see immediately */
+static void G_GNUC_PRINTF(1, 2)
+print_expr (const char* frm, ...)
+{
+	Client *client;
+	va_list ap;
+	size_t start, cookielen;
+	char cookie[16];
+
+	if (!(client = client_current ()))
+		return;
+
+	pthread_mutex_lock (&client->lock);
+	out_start_maybe (client);
+
+	/* format the expression in the buffer, and put the cookie in
+	 * front of it once we know its length */
+	start = client->buf->len;
+	va_start (ap, frm);
+	g_string_append_vprintf (client->buf, frm, ap);
+	va_end (ap);
+
+	cookielen = format_cookie (cookie, client->buf->len - start);
+	g_string_insert_len (client->buf, start, cookie, cookielen);
+	g_string_append_c (client->buf, '\n');
+
+	out_write_pending (client);
+	pthread_mutex_unlock (&client->lock);
+}
+
+
+/* output some text without a cookie, such as the prompt (which is for
+ * humans); it goes through the client's buffer like everything
+ * else, so it can't end up in the middle of some expression */
+static void
+print_raw (const char *str)
+{
+	Client *client;
+
+	if (!(client = client_current ()))
+		return;
+
+	pthread_mutex_lock (&client->lock);
+	g_string_append (client->buf, str);
+	out_write_pending (client);
+	pthread_mutex_unlock (&client->lock);
 }
 
 
@@ -166,38 +565,6 @@ print_and_clear_g_error (GError **err)
 }
 
 
-static GSList*
-read_line_as_list (GError **err)
-{
-	char *line;
-	GSList *lst;
-	GString *gstr;
-
-	line = NULL;
-	gstr = g_string_sized_new (512);
-
-	fputs (";; mu> ", stdout);
-
-	do {
-		int kar;
-
-		kar = fgetc (stdin);
-		if (kar == '\n' || kar == EOF)
-			break;
-		else
-			gstr = g_string_append_c (gstr, (char)kar);
-
-	} while (1);
-
-	line = g_string_free (gstr, FALSE);
-	lst = mu_str_esc_to_list (line, err);
-
-	g_free (line);
-
-	return lst;
-}
-
-
 static const char*
 get_string_from_args (GSList *args, const char *param, gboolean optional,
 		      GError **err)
@@ -256,82 +623,56 @@ get_bool_from_args (GSList *args, const char *param, gboolean optional, GError *
 
 
 
-/* NOTE: this assumes there is only _one_ docid (message) for the
- * particular message id */
+/* get the docid for the message with the given message-id; if there
+ * are more messages with that message-id (e.g., a sent message that
+ * was moved), we prefer one that is readable */
 static unsigned
-get_docid_from_msgid (MuQuery *query, const char *str, GError **err)
+get_docid_from_msgid (MuStore *store, const char *str, GError **err)
 {
-	gchar *querystr;
+	GSList *docids, *cur;
 	unsigned docid;
-	MuMsgIter *iter;
 
-	querystr = g_strdup_printf ("msgid:%s", str);
-	iter = mu_query_run (query, querystr, FALSE,
-			     MU_MSG_FIELD_ID_NONE, FALSE, 1, err);
-	g_free (querystr);
+	docids = mu_store_get_docids_for_msgids (store, &str, 1, err);
+	if (!docids)
+		return MU_STORE_INVALID_DOCID;
 
-	docid = MU_STORE_INVALID_DOCID;
-	if (!iter || mu_msg_iter_is_done (iter))
-		mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
-				     "could not find message %s", str);
-	else {
-		MuMsg *msg;
-		msg = mu_msg_iter_get_msg_floating (iter);
-		if (!mu_msg_is_readable(msg)) {
-			mu_util_g_set_error (err, MU_ERROR_FILE_CANNOT_READ,
-					     "'%s' is not readable",
-					     mu_msg_get_path(msg));
-		} else
-			docid = mu_msg_iter_get_docid (iter);
+	docid = GPOINTER_TO_SIZE (docids->data);
+	for (cur = docids->next ? docids : NULL; cur; cur = g_slist_next (cur)) {
+		char *path;
+		gboolean readable;
 
-		mu_msg_iter_destroy (iter);
+		path	 = mu_store_get_path
+			(store, GPOINTER_TO_SIZE (cur->data), NULL);
+		readable = path && access (path, R_OK) == 0;
+		g_free (path);
+
+		if (readable) {
+			docid = GPOINTER_TO_SIZE (cur->data);
+			break;
+		}
 	}
 
+	g_slist_free (docids);
+
 	return docid;
 }
 
 
 /* get a *list* of all messages with the given message id */
 static GSList*
-get_docids_from_msgids (MuQuery *query, const char *str, GError **err)
+get_docids_from_msgids (MuStore *store, const char *str, GError **err)
 {
-	gchar *querystr;
-	MuMsgIter *iter;
-	GSList *lst;
-
-	querystr = g_strdup_printf ("msgid:%s", str);
-	iter = mu_query_run (query, querystr, FALSE,
-			     MU_MSG_FIELD_ID_NONE, FALSE,-1 /*unlimited*/,
-			     err);
-	g_free (querystr);
-
-	if (!iter || mu_msg_iter_is_done (iter)) {
-		mu_util_g_set_error (err, MU_ERROR_NO_MATCHES,
-				     "could not find message %s", str);
-		return NULL;
-	}
-
-	lst = NULL;
-	do {
-		lst = g_slist_prepend
-			(lst,
-			 GSIZE_TO_POINTER(mu_msg_iter_get_docid (iter)));
-	} while (mu_msg_iter_next (iter));
-
-	mu_msg_iter_destroy (iter);
-
-	return lst;
+	return mu_store_get_docids_for_msgids (store, &str, 1, err);
 }
 
 
-/* the string contains either a number (docid) or a message-id if it
- * doesn't look like a number, and the query param is non-nil, try to
- * locale the message with message-id in the database, and return its
- * docid */
+/* the args contain either a docid:, a msgid: or a path:; in the
+ * latter cases, look up the message with that message-id or path in
+ * the database, and return its docid */
 static unsigned
-determine_docid (MuQuery *query, GSList *args, GError **err)
+determine_docid (MuStore *store, GSList *args, GError **err)
 {
-	const char* docidstr, *msgidstr;
+	const char* docidstr, *msgidstr, *pathstr;
 
 	docidstr = get_string_from_args (args, "docid", TRUE, err);
 	if (docidstr)
@@ -339,13 +680,17 @@ determine_docid (MuQuery *query, GSList *args, GError **err)
 
 	/* no docid: param; use msgid: instead */
 	msgidstr = get_string_from_args (args, "msgid", TRUE, err);
-	if (!msgidstr) {
-		mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
-				     "neither docid nor msgid specified");
-		return MU_STORE_INVALID_DOCID;
-	}
+	if (msgidstr)
+		return get_docid_from_msgid (store, msgidstr, err);
+
+	/* ... or path: (which is what 'mu remove' sends us) */
+	pathstr = get_string_from_args (args, "path", TRUE, err);
+	if (pathstr)
+		return mu_store_get_docid_for_path (store, pathstr, err);
 
-	return get_docid_from_msgid (query, msgidstr, err);
+	mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+			     "neither docid, msgid nor path specified");
+	return MU_STORE_INVALID_DOCID;
 }
 
 
@@ -364,57 +709,597 @@ determine_docid (MuQuery *query, GSList *args, GError **err)
 struct _ServerContext {
 	MuStore *store;
 	MuQuery *query;
+
+	/* cache for the results of recent 'find' commands */
+	GHashTable	*find_cache;
+	GQueue		*find_cache_lru;
+	guint64		 find_cache_rev;
+	gsize		 find_cache_bytes;
+
+	/* the message-ids and references of the messages we threaded
+	 * before; this survives changes to the store, so we need to
+	 * tell it about messages we change or remove */
+	MuThreadCache	*thread_cache;
+
+	/* the buffer we render message s-expressions into; we re-use
+	 * it for every message */
+	GString		*sexpbuf;
+
+	/* the thread running the current 'find' (if finding is
+	 * TRUE), the client it's for, and the flag that tells it to
+	 * stop */
+	pthread_t	 finder;
+	gboolean	 finding;
+	Client		*finder_client;
+	volatile gint	 find_cancelled;
+	volatile gint	 find_done; /* the thread is about to exit */
+
+	/* the cursors for 'fetch' (see cmd_fetch) */
+	GHashTable	*cursors;
+	unsigned	 cursor_id;
+
+	/* the store to read from; normally, that's just store, but
+	 * while 'index' is running, it's a read-only snapshot, and
+	 * query uses that snapshot as well (see cmd_index) */
+	MuStore		*rstore;
+	MuQuery		*wquery;	/* the query for store, while
+					 * indexing */
+	time_t		 snapshot_time;
+	volatile gint	 snapshot_stale; /* reopen it right away */
+	time_t		 flush_time;	/* when the indexer last
+					 * committed store */
+
+	/* the thread running 'index' (if indexing is TRUE); it sets
+	 * index_done when it's finished with store */
+	pthread_t	 indexer;
+	gboolean	 indexing;
+	Client		*index_client;
+	char		*index_path;
+	volatile gint	 index_done;
+	volatile gint	 index_cancelled;
+
+	/* the commands that write to store, queued while indexing;
+	 * writes_unflushed counts the ones that were queued, but are
+	 * not committed yet (see writes_wait) */
+	pthread_mutex_t	 writes_lock;
+	pthread_cond_t	 writes_flushed;
+	GQueue		*writes;
+	unsigned	 writes_unflushed;
+
+	/* when we last handled the requests 'mu add' and 'mu remove'
+	 * left in the spool (see spool_drain_maybe) */
+	time_t		 spool_time;
+
+	/* the rendered s-expressions of the messages we viewed (or
+	 * prefetched) recently (see view_cache_lookup) */
+	GHashTable	*view_cache;
+	GQueue		*view_cache_lru;
+	unsigned	 view_hits, view_misses;
+
+	/* the docids of the results of the last 'find' (and of the
+	 * 'fetch'es for its cursor, if it has one), in order */
+	GArray		*results;
+	unsigned	 results_cursor;
+
+	/* the thread prefetching views (if prefetching is TRUE), the
+	 * messages it should prefetch, and the options to use */
+	pthread_t	 prefetcher;
+	gboolean	 prefetching;
+	GArray		*prefetch;
+	MuMsgOptions	 prefetch_opts;
+	volatile gint	 prefetch_cancelled;
+	volatile gint	 prefetch_done;
 };
 typedef struct _ServerContext ServerContext;
 
+
 /*************************************************************************/
-/* implementation for the commands -- for each command <x>, there is a
- * dedicated function cmd_<x>. These function all are of the type CmdFunc
- *
- * these functions return errors only if they don't handle them
- * themselves, where 'handling' is defined as 'report it using
- * print_and_clear_g_error'
+/* the find-cache; front-ends (e.g. mu4e) tend to repeat the same
+ * 'find' commands many times, and as long as the store does not
+ * change, the results will be the same. So, we keep the rendered
+ * s-expressions for the last few queries around.
  *
- * if function return non-MU_OK, the repl will print the error instead
+ * the cache is only valid for a specific store revision, ie., it is
+ * invalidated as soon as we add, update or remove messages.
  */
 
-typedef MuError (*CmdFunc) (ServerContext*,GSList*,GError**);
-
+/* the maximum number of results we keep in the cache */
+#define FIND_CACHE_MAX 10
+/* ... and the maximum size of all their s-expressions together; we
+ * don't cache results bigger than FIND_CACHE_ENTRY_BYTES at all */
+#define FIND_CACHE_BYTES	(32 * 1024 * 1024)
+#define FIND_CACHE_ENTRY_BYTES	(8 * 1024 * 1024)
+
+/* the results of a 'find': the s-expressions we sent, and the docids
+ * of the messages they describe */
+struct _FindResults {
+	GPtrArray	*sexps;
+	GArray		*docids;
+	gsize		 bytes;	/* the size of the s-expressions */
+};
+typedef struct _FindResults FindResults;
 
-/* 'add' adds a message to the database, and takes two parameters:
- * 'path', which is the full path to the message, and 'maildir', which
- * is the maildir this message lives in (e.g. "/inbox"). response with
- * an (:info ...) message with information about the newly added
- * message (details: see code below)
- */
-static MuError
-cmd_add (ServerContext *ctx, GSList *args, GError **err)
+static FindResults*
+find_results_new (void)
 {
-	unsigned docid;
-	const char *maildir, *path;
-
-	GET_STRING_OR_ERROR_RETURN (args, "path", &path, err);
-	GET_STRING_OR_ERROR_RETURN (args, "maildir", &maildir, err);
+	FindResults *results;
 
-	docid = mu_store_add_path (ctx->store, path, maildir, err);
-	if (docid == MU_STORE_INVALID_DOCID)
-		print_and_clear_g_error (err);
-	else {
-		gchar *escpath;
-		escpath = mu_str_escape_c_literal (path, TRUE);
-		print_expr ("(:info add :path %s :docid %u)", escpath, docid);
-		g_free (escpath);
-	}
+	results	        = g_slice_new (FindResults);
+	results->sexps  = g_ptr_array_new_with_free_func
+		((GDestroyNotify)g_free);
+	results->docids = g_array_new (FALSE, FALSE, sizeof(unsigned));
+	results->bytes  = 0;
 
-	return MU_OK;
+	return results;
 }
 
-
 static void
-each_part (MuMsg *msg, MuMsgPart *part, GSList **attlist)
+find_results_destroy (FindResults *results)
 {
-	char *att, *cachefile;
-	GError *err;
+	if (!results)
+		return;
+
+	g_ptr_array_unref (results->sexps);
+	g_array_unref (results->docids);
+
+	g_slice_free (FindResults, results);
+}
+
+static void
+find_cache_init (ServerContext *ctx)
+{
+	ctx->find_cache = g_hash_table_new_full
+		(g_str_hash, g_str_equal, (GDestroyNotify)g_free,
+		 (GDestroyNotify)find_results_destroy);
+	ctx->find_cache_lru   = g_queue_new ();
+	ctx->find_cache_rev   = mu_store_revision (ctx->rstore);
+	ctx->find_cache_bytes = 0;
+}
+
+static void
+find_cache_clear (ServerContext *ctx)
+{
+	/* the hash table owns the keys; the queue only refers to them */
+	g_queue_clear (ctx->find_cache_lru);
+	g_hash_table_remove_all (ctx->find_cache);
+	ctx->find_cache_bytes = 0;
+}
+
+static void
+find_cache_destroy (ServerContext *ctx)
+{
+	g_queue_free (ctx->find_cache_lru);
+	g_hash_table_destroy (ctx->find_cache);
+}
+
+
+static char*
+find_cache_key (const char *query, MuMsgFieldId sortfield, int maxnum,
+		MuQueryFlags qflags, MuMsgFormat format, const char *fields)
+{
+	return g_strdup_printf ("%s\t%d\t%d\t%d\t%d\t%s", query,
+				(int)sortfield, maxnum, (int)qflags,
+				fields ? (int)format : -1,
+				fields ? fields : "");
+}
+
+
+/* get the cached results for key, or NULL if there are none */
+static FindResults*
+find_cache_lookup (ServerContext *ctx, const char *key)
+{
+	GList *cur;
+	gpointer origkey, results;
+
+	if (ctx->find_cache_rev != mu_store_revision (ctx->rstore)) {
+		find_cache_clear (ctx);
+		ctx->find_cache_rev = mu_store_revision (ctx->rstore);
+		return NULL;
+	}
+
+	if (!g_hash_table_lookup_extended (ctx->find_cache, key,
+					   &origkey, &results))
+		return NULL;
+
+	/* move to the head of the queue; it's the most recently used
+	 * one now */
+	cur = g_queue_find (ctx->find_cache_lru, origkey);
+	g_queue_unlink (ctx->find_cache_lru, cur);
+	g_queue_push_head_link (ctx->find_cache_lru, cur);
+
+	return (FindResults*)results;
+}
+
+
+/* add results to the cache; the cache takes ownership of both key
+ * and results */
+static void
+find_cache_add (ServerContext *ctx, char *key, FindResults *results)
+{
+	FindResults *oldest;
+	char *oldkey;
+	unsigned u;
+
+	for (u = 0; u != results->sexps->len; ++u)
+		results->bytes += strlen
+			((const char*)g_ptr_array_index (results->sexps, u));
+
+	if (results->bytes > FIND_CACHE_ENTRY_BYTES ||
+	    g_hash_table_lookup (ctx->find_cache, key)) {
+		g_free (key);
+		find_results_destroy (results);
+		return;
+	}
+
+	g_hash_table_insert (ctx->find_cache, key, results);
+	g_queue_push_head (ctx->find_cache_lru, key);
+	ctx->find_cache_bytes += results->bytes;
+
+	/* make room, but always keep the new one */
+	while (g_queue_get_length (ctx->find_cache_lru) > 1 &&
+	       (g_queue_get_length (ctx->find_cache_lru) > FIND_CACHE_MAX ||
+		ctx->find_cache_bytes > FIND_CACHE_BYTES)) {
+		oldkey = (char*)g_queue_pop_tail (ctx->find_cache_lru);
+		oldest = (FindResults*)g_hash_table_lookup
+			(ctx->find_cache, oldkey);
+		ctx->find_cache_bytes -= oldest->bytes;
+		g_hash_table_remove (ctx->find_cache, oldkey);
+	}
+}
+
+/*************************************************************************/
+/* cursors; with 'cursor:true', 'find' only sends the first page of
+ * results, and keeps the iterator around, so the next pages can be
+ * fetched (see cmd_fetch) without running the query again, and without
+ * sending the earlier results again.
+ *
+ * a cursor is only valid for the store revision it was created for,
+ * and we forget about it when it has not been used for a while.
+ */
+
+/* the maximum number of cursors we keep */
+#define CURSOR_MAX 8
+/* the number of seconds after which an unused cursor expires */
+#define CURSOR_TIMEOUT 300
+
+struct _Cursor {
+	MuMsgIter	*iter;
+	MuQueryFlags	 qflags;
+	MuMsgFieldId	*fields;   /* or NULL for the full headers */
+	MuMsgFormat	 format;
+	unsigned	 pagesize;
+	guint64		 revision;
+	time_t		 last_used;
+};
+typedef struct _Cursor Cursor;
+
+static void
+cursor_destroy (Cursor *cursor)
+{
+	mu_msg_iter_destroy (cursor->iter);
+	g_free (cursor->fields);
+
+	g_slice_free (Cursor, cursor);
+}
+
+static void
+cursors_init (ServerContext *ctx)
+{
+	ctx->cursors = g_hash_table_new_full
+		(g_direct_hash, g_direct_equal, NULL,
+		 (GDestroyNotify)cursor_destroy);
+	ctx->cursor_id = 0;
+}
+
+static void
+cursors_destroy (ServerContext *ctx)
+{
+	g_hash_table_destroy (ctx->cursors);
+}
+
+
+struct _ExpireData {
+	guint64		 revision;
+	time_t		 now;
+	gpointer	 oldest_id;
+	time_t		 oldest;
+};
+typedef struct _ExpireData ExpireData;
+
+static gboolean
+each_cursor_expire (gpointer id, Cursor *cursor, ExpireData *edata)
+{
+	if (cursor->revision != edata->revision ||
+	    edata->now - cursor->last_used > CURSOR_TIMEOUT)
+		return TRUE;
+
+	if (!edata->oldest_id || cursor->last_used < edata->oldest) {
+		edata->oldest_id = id;
+		edata->oldest	 = cursor->last_used;
+	}
+
+	return FALSE;
+}
+
+/* forget about the cursors that have expired; if room is TRUE, make
+ * sure there's room for another one */
+static void
+cursors_expire (ServerContext *ctx, gboolean room)
+{
+	ExpireData edata;
+
+	edata.revision	= mu_store_revision (ctx->rstore);
+	edata.now	= time (NULL);
+	edata.oldest_id = NULL;
+	edata.oldest	= 0;
+
+	g_hash_table_foreach_remove (ctx->cursors,
+				     (GHRFunc)each_cursor_expire, &edata);
+
+	if (room && edata.oldest_id &&
+	    g_hash_table_size (ctx->cursors) >= CURSOR_MAX)
+		g_hash_table_remove (ctx->cursors, edata.oldest_id);
+}
+
+/* add a cursor; the context takes ownership of iter and fields.
+ * returns the cursor id */
+static unsigned
+cursor_add (ServerContext *ctx, MuMsgIter *iter, MuQueryFlags qflags,
+	    MuMsgFieldId *fields, MuMsgFormat format, unsigned pagesize)
+{
+	Cursor *cursor;
+
+	cursors_expire (ctx, TRUE);
+
+	cursor		  = g_slice_new (Cursor);
+	cursor->iter	  = iter;
+	cursor->qflags	  = qflags;
+	cursor->fields	  = fields;
+	cursor->format	  = format;
+	cursor->pagesize  = pagesize;
+	cursor->revision  = mu_store_revision (ctx->rstore);
+	cursor->last_used = time (NULL);
+
+	/* 0 is not a valid id */
+	if (++ctx->cursor_id == 0)
+		++ctx->cursor_id;
+	g_hash_table_insert (ctx->cursors, GUINT_TO_POINTER(ctx->cursor_id),
+			     cursor);
+
+	return ctx->cursor_id;
+}
+
+/* get the cursor with the given id, or NULL if it does not exist (or
+ * has expired) */
+static Cursor*
+cursor_lookup (ServerContext *ctx, unsigned id)
+{
+	Cursor *cursor;
+
+	cursors_expire (ctx, FALSE);
+
+	cursor = g_hash_table_lookup (ctx->cursors, GUINT_TO_POINTER(id));
+	if (cursor)
+		cursor->last_used = time (NULL);
+
+	return cursor;
+}
+
+
+/*************************************************************************/
+/* the view-cache; front-ends (e.g. mu4e) tend to view the messages in
+ * the list of results one after the other, and rendering a message
+ * (which means parsing the whole file) is the slowest part of that.
+ * So, we keep the (:view ...) s-expressions of the last few messages
+ * we rendered, and while there's nothing else to do, we render the
+ * next few messages in the list ahead of time (see prefetch_run).
+ *
+ * an entry is only valid for the same view options, and as long as
+ * the message file has the same path, modification time and size;
+ * any change to a message (such as 'move') gives it a new path, so we
+ * don't need to tell the cache about those.
+ */
+
+/* the maximum number of views we keep in the cache */
+#define VIEW_CACHE_MAX 32
+/* we don't cache views bigger than this */
+#define VIEW_CACHE_SEXP_MAX (1024 * 1024)
+/* the number of messages after the viewed one we prefetch */
+#define VIEW_PREFETCH_NUM 3
+
+struct _CachedView {
+	char		*path;
+	time_t		 mtime;
+	off_t		 size;
+	MuMsgOptions	 opts;
+	char		*sexp;
+	size_t		 len;
+};
+typedef struct _CachedView CachedView;
+
+static void
+cached_view_destroy (CachedView *view)
+{
+	g_free (view->path);
+	g_free (view->sexp);
+
+	g_slice_free (CachedView, view);
+}
+
+static void
+view_cache_init (ServerContext *ctx)
+{
+	ctx->view_cache = g_hash_table_new_full
+		(g_direct_hash, g_direct_equal, NULL,
+		 (GDestroyNotify)cached_view_destroy);
+	ctx->view_cache_lru = g_queue_new ();
+	ctx->view_hits	    = 0;
+	ctx->view_misses    = 0;
+}
+
+static void
+view_cache_destroy (ServerContext *ctx)
+{
+	g_queue_free (ctx->view_cache_lru);
+	g_hash_table_destroy (ctx->view_cache);
+}
+
+static void
+view_cache_remove (ServerContext *ctx, unsigned docid)
+{
+	if (g_hash_table_remove (ctx->view_cache, GUINT_TO_POINTER(docid)))
+		g_queue_remove (ctx->view_cache_lru,
+				GUINT_TO_POINTER(docid));
+}
+
+/* get the cached view for docid, if it's still valid; we need to
+ * check the message file for that */
+static CachedView*
+view_cache_get (ServerContext *ctx, unsigned docid, MuMsgOptions opts)
+{
+	CachedView *view;
+	struct stat statbuf;
+	char *path;
+	gboolean valid;
+
+	view = g_hash_table_lookup (ctx->view_cache, GUINT_TO_POINTER(docid));
+	if (!view || view->opts != opts)
+		return NULL;
+
+	path  = mu_store_get_path (ctx->rstore, docid, NULL);
+	valid = path && g_strcmp0 (path, view->path) == 0 &&
+		stat (path, &statbuf) == 0 &&
+		statbuf.st_mtime == view->mtime &&
+		statbuf.st_size == view->size;
+	g_free (path);
+
+	if (!valid) {
+		view_cache_remove (ctx, docid);
+		return NULL;
+	}
+
+	return view;
+}
+
+/* get the cached view for docid, or NULL if there's none (or it's no
+ * longer valid) */
+static CachedView*
+view_cache_lookup (ServerContext *ctx, unsigned docid, MuMsgOptions opts)
+{
+	CachedView *view;
+	GList *cur;
+
+	view = view_cache_get (ctx, docid, opts);
+	if (!view) {
+		++ctx->view_misses;
+		return NULL;
+	}
+
+	/* move to the head of the queue; it's the most recently used
+	 * one now */
+	cur = g_queue_find (ctx->view_cache_lru, GUINT_TO_POINTER(docid));
+	g_queue_unlink (ctx->view_cache_lru, cur);
+	g_queue_push_head_link (ctx->view_cache_lru, cur);
+
+	++ctx->view_hits;
+	return view;
+}
+
+/* add the view for docid to the cache, replacing the one that's
+ * there (if any); statbuf is for the message file, from before it
+ * was rendered */
+static void
+view_cache_add (ServerContext *ctx, unsigned docid, MuMsgOptions opts,
+		const char *path, const struct stat *statbuf, GString *sexp)
+{
+	CachedView *view;
+
+	if (sexp->len > VIEW_CACHE_SEXP_MAX)
+		return;
+
+	view_cache_remove (ctx, docid);
+
+	view	    = g_slice_new (CachedView);
+	view->path  = g_strdup (path);
+	view->mtime = statbuf->st_mtime;
+	view->size  = statbuf->st_size;
+	view->opts  = opts;
+	view->sexp  = g_strndup (sexp->str, sexp->len);
+	view->len   = sexp->len;
+
+	g_hash_table_insert (ctx->view_cache, GUINT_TO_POINTER(docid), view);
+	g_queue_push_head (ctx->view_cache_lru, GUINT_TO_POINTER(docid));
+
+	if (g_queue_get_length (ctx->view_cache_lru) > VIEW_CACHE_MAX)
+		g_hash_table_remove (ctx->view_cache,
+				     g_queue_pop_tail (ctx->view_cache_lru));
+}
+
+
+/* remember the docids of the results the frontend is looking at now;
+ * for a cursor, the 'fetch'es add to them */
+static void
+results_set (ServerContext *ctx, GArray *docids, unsigned cursor)
+{
+	if (ctx->results)
+		g_array_unref (ctx->results);
+
+	ctx->results	    = docids ? g_array_ref (docids) : NULL;
+	ctx->results_cursor = cursor;
+}
+
+
+/*************************************************************************/
+/* implementation for the commands -- for each command <x>, there is a
+ * dedicated function cmd_<x>. These function all are of the type CmdFunc
+ *
+ * these functions return errors only if they don't handle them
+ * themselves, where 'handling' is defined as 'report it using
+ * print_and_clear_g_error'
+ *
+ * if function return non-MU_OK, the repl will print the error instead
+ */
+
+typedef MuError (*CmdFunc) (ServerContext*,GSList*,GError**);
+
+
+/* 'add' adds a message to the database, and takes two parameters:
+ * 'path', which is the full path to the message, and (optionally)
+ * 'maildir', which is the maildir this message lives in
+ * (e.g. "/inbox"). response with an (:info ...) message with
+ * information about the newly added message (details: see code
+ * below)
+ */
+static MuError
+cmd_add (ServerContext *ctx, GSList *args, GError **err)
+{
+	unsigned docid;
+	const char *maildir, *path;
+
+	GET_STRING_OR_ERROR_RETURN (args, "path", &path, err);
+	maildir = get_string_from_args (args, "maildir", TRUE, NULL);
+
+	docid = mu_store_add_path (ctx->store, path, maildir, err);
+	if (docid == MU_STORE_INVALID_DOCID)
+		print_and_clear_g_error (err);
+	else {
+		gchar *escpath;
+		/* we may have updated an existing message */
+		mu_thread_cache_remove (ctx->thread_cache, docid);
+		escpath = mu_str_escape_c_literal (path, TRUE);
+		print_expr ("(:info add :path %s :docid %u)", escpath, docid);
+		g_free (escpath);
+	}
+
+	return MU_OK;
+}
+
+
+static void
+each_part (MuMsg *msg, MuMsgPart *part, GSList **attlist)
+{
+	char *att, *cachefile;
+	GError *err;
 
 	/* exclude things that don't look like proper attachments */
 	if (!mu_msg_part_maybe_attachment(part))
@@ -513,7 +1398,7 @@ cmd_compose (ServerContext *ctx, GSList *args, GError **err)
 		MuMsg *msg;
 		const char *docidstr;
 		GET_STRING_OR_ERROR_RETURN (args, "docid", &docidstr, err);
-		msg = mu_store_get_msg (ctx->store, atoi(docidstr), err);
+		msg = mu_store_get_msg (ctx->rstore, atoi(docidstr), err);
 		if (!msg) {
 			print_and_clear_g_error (err);
 			return MU_OK;
@@ -638,61 +1523,301 @@ cmd_contacts (ServerContext *ctx, GSList *args, GError **err)
 }
 
 
-
-static unsigned
-print_sexps (MuMsgIter *iter, gboolean threads, unsigned maxnum)
+/*
+ * 'count' counts the number of messages matching some query, without
+ * retrieving them; it takes a parameter 'query' with the search query
+ * and optionally 'estimate' (true|false), in which case we only get
+ * an estimate of the number (which is faster for big result sets)
+ *
+ * returns:
+ * => (:count <number of matches> :query <query>)
+ */
+static MuError
+cmd_count (ServerContext *ctx, GSList *args, GError **err)
 {
-	unsigned u;
-	u = 0;
+	const char *querystr;
+	gboolean estimate;
+	unsigned count;
+	char *escquery;
 
-	while (!mu_msg_iter_is_done (iter) && u < maxnum && !MU_TERMINATE) {
+	GET_STRING_OR_ERROR_RETURN (args, "query", &querystr, err);
+	estimate = get_bool_from_args (args, "estimate", TRUE, NULL);
 
-		MuMsg *msg;
-		msg = mu_msg_iter_get_msg_floating (iter);
+	if (estimate)
+		count = mu_query_count_estimate (ctx->query, querystr, err);
+	else
+		count = mu_query_count (ctx->query, querystr, err);
 
-		if (mu_msg_is_readable (msg)) {
-			char *sexp;
-			const MuMsgIterThreadInfo* ti;
-
-			ti = threads ? mu_msg_iter_get_thread_info (iter) : NULL;
-			sexp = mu_msg_to_sexp (msg, mu_msg_iter_get_docid (iter),
-					       ti, MU_MSG_OPTION_HEADERS_ONLY);
-			print_expr ("%s", sexp);
-			g_free (sexp);
-			++u;
-		}
-		mu_msg_iter_next (iter);
+	if (count == (unsigned)-1) {
+		print_and_clear_g_error (err);
+		return MU_OK;
+	}
+
+	/* we echo the query, so the frontend can tell which count
+	 * this is */
+	escquery = mu_str_escape_c_literal (querystr, TRUE);
+	print_expr ("(:count %u :query %s)", count, escquery);
+	g_free (escquery);
+
+	return MU_OK;
+}
+
+
+
+struct _FacetsData {
+	GString		*gstr;
+	MuQueryFacet	 facet; /* the facet we're currently printing */
+};
+typedef struct _FacetsData FacetsData;
+
+static void
+each_facet_sexp (MuQueryFacet facet, const char *val, unsigned count,
+		 FacetsData *fdata)
+{
+	/* are we starting a new facet? */
+	if (facet != fdata->facet) {
+		if (fdata->facet != MU_QUERY_FACET_NONE)
+			g_string_append (fdata->gstr, ") ");
+		g_string_append_printf (fdata->gstr, ":%s (",
+					mu_query_facet_name (facet));
+		fdata->facet = facet;
+	}
+
+	if (mu_query_facet_is_numeric (facet))
+		g_string_append_printf (fdata->gstr, "(%s . %u)", val, count);
+	else {
+		char *escval;
+		escval = mu_str_escape_c_literal (val, TRUE);
+		g_string_append_printf (fdata->gstr, "(%s . %u)",
+					escval, count);
+		g_free (escval);
 	}
-	return u;
 }
 
 
+/*
+ * 'facets' counts the messages matching some query per value of some
+ * facets (maildir, flag, year, month, weekday, from, size), without
+ * retrieving the messages. It takes a parameter 'query' with the
+ * search query, and optionally 'facets', a comma-separated list of
+ * facets (default: 'all')
+ *
+ * returns:
+ * => (:facets (:maildir (("/inbox" . 12) ...) :flag (...) ...) :query <query>)
+ */
 static MuError
-save_part (MuMsg *msg, unsigned index, GSList *args, GError **err)
+cmd_facets (ServerContext *ctx, GSList *args, GError **err)
 {
-	gboolean rv;
-	const gchar *path;
-	gchar *escpath;
+	const char *querystr, *facetsstr;
+	MuQueryFacet facets;
+	FacetsData fdata;
+	char *escquery;
 
-	GET_STRING_OR_ERROR_RETURN (args, "path", &path, err);
+	GET_STRING_OR_ERROR_RETURN (args, "query", &querystr, err);
+	facetsstr = get_string_from_args (args, "facets", TRUE, NULL);
 
-	rv = mu_msg_part_save (msg, MU_MSG_OPTION_OVERWRITE,
-			       path, index, err);
-	if (!rv) {
+	facets = mu_query_facets_from_str (facetsstr ? facetsstr : "all");
+	if (facets == MU_QUERY_FACET_NONE) {
+		print_error (MU_ERROR_IN_PARAMETERS, "invalid facets");
+		return MU_OK;
+	}
+
+	fdata.gstr  = g_string_sized_new (1024);
+	fdata.facet = MU_QUERY_FACET_NONE;
+	g_string_append (fdata.gstr, "(:facets (");
+
+	if (!mu_query_facets (ctx->query, querystr, facets,
+			      (MuQueryFacetForeachFunc)each_facet_sexp,
+			      &fdata, err)) {
+		g_string_free (fdata.gstr, TRUE);
 		print_and_clear_g_error (err);
 		return MU_OK;
 	}
 
-	escpath = mu_str_escape_c_literal (path, FALSE);
-	print_expr ("(:info save :message \"%s has been saved\")",
-		    escpath);
+	if (fdata.facet != MU_QUERY_FACET_NONE)
+		g_string_append (fdata.gstr, ")");
+
+	escquery = mu_str_escape_c_literal (querystr, TRUE);
+	g_string_append_printf (fdata.gstr, ") :query %s)", escquery);
+	g_free (escquery);
+
+	print_expr ("%s", fdata.gstr->str);
+	g_string_free (fdata.gstr, TRUE);
 
-	g_free (escpath);
 	return MU_OK;
 }
 
 
-static MuError
+/*************************************************************************/
+/* start a thread for some long-running command; signals are blocked
+ * in there, so they're delivered to the main thread, which is the
+ * one that handles them (see serve) */
+static gboolean
+start_thread (pthread_t *thread, void *(*func)(void*), void *data)
+{
+	sigset_t all, old;
+	int rv;
+
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+	rv = pthread_create (thread, NULL, func, data);
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+	return rv == 0;
+}
+
+
+/* 'find' runs in a thread of its own, so we can read the next command
+ * while it's still busy; that way, a new 'find' can cancel the one
+ * that's running (which is then not useful anymore). Other commands
+ * wait for the running 'find' to finish, as we cannot use our Xapian
+ * database from two threads at the same time; so there's never more
+ * than one command running.
+ */
+struct _FindJob {
+	ServerContext	*ctx;
+	char		*query;
+	MuMsgFieldId	 sortfield;
+	int		 maxnum;
+	MuQueryFlags	 qflags;
+	char		*fields; /* comma-separated, or NULL */
+	MuMsgFormat	 format;
+	gboolean	 cursor; /* page through the results? */
+	Client		*client;
+};
+typedef struct _FindJob FindJob;
+
+/* this is the last thing the finder thread does, so after this, the
+ * main loop can reap it (see find_reap_maybe) */
+static void
+find_job_destroy (FindJob *job)
+{
+	g_atomic_int_set (&job->ctx->find_done, 1);
+
+	g_free (job->query);
+	g_free (job->fields);
+	client_unref (job->client);
+
+	g_slice_free (FindJob, job);
+}
+
+static gboolean
+find_is_cancelled (ServerContext *ctx)
+{
+	return MU_TERMINATE || g_atomic_int_get (&ctx->find_cancelled);
+}
+
+/* wait until the running 'find' (if any) is done */
+static void
+find_wait (ServerContext *ctx)
+{
+	if (!ctx->finding)
+		return;
+
+	pthread_join (ctx->finder, NULL);
+	ctx->finding = FALSE;
+}
+
+/* if the running 'find' is done, clean up after it */
+static void
+find_reap_maybe (ServerContext *ctx)
+{
+	if (ctx->finding && g_atomic_int_get (&ctx->find_done))
+		find_wait (ctx);
+}
+
+/* stop the running 'find' (if any) */
+static void
+find_cancel (ServerContext *ctx)
+{
+	if (!ctx->finding)
+		return;
+
+	g_atomic_int_set (&ctx->find_cancelled, 1);
+	find_wait (ctx);
+	g_atomic_int_set (&ctx->find_cancelled, 0);
+}
+
+
+/* print the s-expressions for the messages in iter; if sexps is
+ * non-NULL, they are added to it as well, and if docids is non-NULL,
+ * their docids are added to that. If fields is non-NULL, we only
+ * print those fields, in the compact format (see cmd_protocol) */
+static unsigned
+print_sexps (ServerContext *ctx, MuMsgIter *iter, MuQueryFlags qflags,
+	     unsigned maxnum, MuMsgFormat format, const MuMsgFieldId *fields,
+	     GPtrArray *sexps, GArray *docids)
+{
+	unsigned u, docid;
+	GString *buf;
+
+	u   = 0;
+	buf = ctx->sexpbuf;
+
+	while (!mu_msg_iter_is_done (iter) && u < maxnum &&
+	       !find_is_cancelled (ctx)) {
+
+		MuMsg *msg;
+		msg = mu_msg_iter_get_msg_floating (iter);
+
+		if (mu_msg_is_readable (msg)) {
+			const MuMsgIterThreadInfo *ti;
+			const MuMsgIterConvInfo *ci;
+
+			docid = mu_msg_iter_get_docid (iter);
+			ci = (qflags & MU_QUERY_FLAG_CONVERSATIONS) ?
+				mu_msg_iter_get_conv_info (iter) : NULL;
+			ti = (!ci && (qflags & MU_QUERY_FLAG_THREADS)) ?
+				mu_msg_iter_get_thread_info (iter) : NULL;
+
+			g_string_truncate (buf, 0);
+			if (fields)
+				mu_msg_append_fields (buf, msg, format, docid,
+						      fields, ti, ci);
+			else
+				mu_msg_append_sexp
+					(buf, msg, docid, ti, ci,
+					 MU_MSG_OPTION_HEADERS_ONLY);
+			print_expr_len (buf->str, buf->len);
+			if (sexps)
+				g_ptr_array_add (sexps,
+						 g_strndup (buf->str, buf->len));
+			if (docids)
+				g_array_append_val (docids, docid);
+			++u;
+		}
+		mu_msg_iter_next (iter);
+	}
+	return u;
+}
+
+
+static MuError
+save_part (MuMsg *msg, unsigned index, GSList *args, GError **err)
+{
+	gboolean rv;
+	const gchar *path;
+	gchar *escpath;
+
+	GET_STRING_OR_ERROR_RETURN (args, "path", &path, err);
+
+	rv = mu_msg_part_save (msg, MU_MSG_OPTION_OVERWRITE,
+			       path, index, err);
+	if (!rv) {
+		print_and_clear_g_error (err);
+		return MU_OK;
+	}
+
+	escpath = mu_str_escape_c_literal (path, FALSE);
+	print_expr ("(:info save :message \"%s has been saved\")",
+		    escpath);
+
+	g_free (escpath);
+	return MU_OK;
+}
+
+
+static MuError
 open_part (MuMsg *msg, unsigned index, GError **err)
 {
 	char *targetpath;
@@ -785,7 +1910,7 @@ cmd_extract (ServerContext *ctx, GSList *args, GError **err)
 	GET_STRING_OR_ERROR_RETURN (args, "action", &actionstr, err);
 	GET_STRING_OR_ERROR_RETURN (args, "index",  &indexstr, err);
 	index = atoi (indexstr);
-	docid = determine_docid (ctx->query, args, err);
+	docid = determine_docid (ctx->rstore, args, err);
 	if (docid == MU_STORE_INVALID_DOCID) {
 		print_and_clear_g_error (err);
 		return MU_OK;
@@ -795,7 +1920,7 @@ cmd_extract (ServerContext *ctx, GSList *args, GError **err)
 		print_error (MU_ERROR_IN_PARAMETERS, "invalid action");
 		return MU_OK;
 	}
-	msg = mu_store_get_msg (ctx->store, docid, err);
+	msg = mu_store_get_msg (ctx->rstore, docid, err);
 	if (!msg) {
 		print_error (MU_ERROR, "failed to get message");
 		return MU_OK;
@@ -817,8 +1942,8 @@ cmd_extract (ServerContext *ctx, GSList *args, GError **err)
 
 /* parse the find parameters, and return the values as out params */
 static MuError
-get_find_params (GSList *args, gboolean *threads, MuMsgFieldId *sortfield,
-		 gboolean *reverse, int *maxnum, GError **err)
+get_find_params (GSList *args, MuMsgFieldId *sortfield, int *maxnum,
+		 MuQueryFlags *qflags, GError **err)
 {
 	const char *maxnumstr, *sortfieldstr;
 
@@ -826,9 +1951,18 @@ get_find_params (GSList *args, gboolean *threads, MuMsgFieldId *sortfield,
 	maxnumstr = get_string_from_args (args, "maxnum", TRUE, NULL);
 	*maxnum = maxnumstr ? atoi (maxnumstr) : 0;
 
-	/* whether to show threads or not */
-	*threads = get_bool_from_args (args, "threads", TRUE, NULL);
-	*reverse = get_bool_from_args (args, "reverse", TRUE, NULL);
+	/* whether to show threads (or conversations) or not */
+	*qflags = MU_QUERY_FLAG_NONE;
+	if (get_bool_from_args (args, "threads", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_THREADS;
+	if (get_bool_from_args (args, "conversations", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_CONVERSATIONS;
+	if (get_bool_from_args (args, "reverse", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_DESCENDING;
+	if (get_bool_from_args (args, "include-related", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_INCLUDE_RELATED;
+	if (get_bool_from_args (args, "group-subjects", TRUE, NULL))
+		*qflags |= MU_QUERY_FLAG_GROUP_SUBJECTS;
 
 	/* field to sort by */
 	sortfieldstr = get_string_from_args (args, "sortfield", TRUE, NULL);
@@ -847,11 +1981,229 @@ get_find_params (GSList *args, gboolean *threads, MuMsgFieldId *sortfield,
 }
 
 
+/* the fields in the compact header rows, if the 'find' command
+ * does not specify them */
+#define DEFAULT_FIELDS "subject,from,to,cc,date,size,msgid,path,maildir,"\
+	"prio,flag"
+
+/* parse a comma-separated list of field names into an array,
+ * terminated by MU_MSG_FIELD_ID_NONE; free with g_free */
+static MuMsgFieldId*
+parse_fields (const char *fieldsstr, GError **err)
+{
+	gchar **names;
+	MuMsgFieldId *fields;
+	unsigned u;
+
+	names  = g_strsplit (fieldsstr, ",", -1);
+	fields = g_new (MuMsgFieldId, g_strv_length (names) + 1);
+
+	for (u = 0; names[u]; ++u) {
+		fields[u] = mu_msg_field_id_from_name
+			(g_strstrip (names[u]), FALSE);
+		if (!mu_msg_field_is_projectable (fields[u])) {
+			mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
+					     "not a valid field: '%s'",
+					     names[u]);
+			g_free (fields);
+			g_strfreev (names);
+			return NULL;
+		}
+	}
+	fields[u] = MU_MSG_FIELD_ID_NONE;
+
+	g_strfreev (names);
+	return fields;
+}
+
+
+/* 'find' with a cursor: send the first page of results, and if
+ * there are more, keep the iterator as a cursor. We don't use the
+ * find-cache for this */
+static void
+find_run_cursor (FindJob *job)
+{
+	ServerContext *ctx;
+	MuMsgIter *iter;
+	MuMsgFieldId *fields;
+	unsigned foundnum, id;
+	GArray *docids;
+	GError *err;
+
+	ctx = job->ctx;
+	err = NULL;
+
+	fields = NULL;
+	if (job->fields && !(fields = parse_fields (job->fields, &err))) {
+		print_and_clear_g_error (&err);
+		return;
+	}
+
+	/* we want all the results, even if we only send maxnum of
+	 * them for now */
+	iter = mu_query_run (ctx->query, job->query, job->sortfield, -1,
+			     job->qflags, &err);
+	if (!iter) {
+		if (err && err->code == MU_ERROR_CANCELLED)
+			g_clear_error (&err);
+		else
+			print_and_clear_g_error (&err);
+		g_free (fields);
+		return;
+	}
+
+	print_expr ("(:erase t)");
+	docids	 = g_array_new (FALSE, FALSE, sizeof(unsigned));
+	foundnum = print_sexps (ctx, iter, job->qflags, job->maxnum,
+				job->format, fields, NULL, docids);
+
+	if (mu_msg_iter_failed (iter, &err)) {
+		print_and_clear_g_error (&err);
+		mu_msg_iter_destroy (iter);
+		g_free (fields);
+	} else if (find_is_cancelled (ctx) || mu_msg_iter_is_done (iter)) {
+		if (!find_is_cancelled (ctx)) {
+			print_expr ("(:found %u)", foundnum);
+			results_set (ctx, docids, 0);
+		}
+		mu_msg_iter_destroy (iter);
+		g_free (fields);
+	} else {
+		id = cursor_add (ctx, iter, job->qflags, fields,
+				 job->format, job->maxnum);
+		print_expr ("(:found %u :cursor %u)", foundnum, id);
+		results_set (ctx, docids, id);
+	}
+
+	g_array_unref (docids);
+}
+
+
+/* the part of 'find' that runs in the finder thread */
+static void*
+find_run (void *data)
+{
+	FindJob *job;
+	ServerContext *ctx;
+	MuMsgIter *iter;
+	unsigned foundnum, u;
+	MuMsgFieldId *fields;
+	char *key;
+	FindResults *results;
+	gboolean failed;
+	GError *err;
+
+	job = (FindJob*)data;
+	ctx = job->ctx;
+	err = NULL;
+
+	client_set_current (job->client);
+
+	if (job->cursor) {
+		find_run_cursor (job);
+		find_job_destroy (job);
+		return NULL;
+	}
+
+	/* maybe we've seen this one before? */
+	key   = find_cache_key (job->query, job->sortfield, job->maxnum,
+				job->qflags, job->format, job->fields);
+	results = find_cache_lookup (ctx, key);
+	if (results) {
+		print_expr ("(:erase t)");
+		for (u = 0; u != results->sexps->len &&
+			     !find_is_cancelled (ctx); ++u) {
+			const char *sexp;
+			sexp = (const char*)g_ptr_array_index
+				(results->sexps, u);
+			print_expr_len (sexp, strlen (sexp));
+		}
+		if (!find_is_cancelled (ctx)) {
+			print_expr ("(:found %u)", results->sexps->len);
+			results_set (ctx, results->docids, 0);
+		}
+		g_free (key);
+		find_job_destroy (job);
+		return NULL;
+	}
+
+	fields = NULL;
+	if (job->fields && !(fields = parse_fields (job->fields, &err))) {
+		print_and_clear_g_error (&err);
+		g_free (key);
+		find_job_destroy (job);
+		return NULL;
+	}
+
+	/* note: when we're threading, mu_query_run uses *all* messages
+	 * to determine the threads, but only gives us the threads for
+	 * the first maxnum ones */
+	iter = mu_query_run (ctx->query, job->query, job->sortfield,
+			     job->maxnum, job->qflags, &err);
+	if (!iter) {
+		/* a cancelled find has nothing to say */
+		if (err && err->code == MU_ERROR_CANCELLED)
+			g_clear_error (&err);
+		else
+			print_and_clear_g_error (&err);
+		g_free (fields);
+		g_free (key);
+		find_job_destroy (job);
+		return NULL;
+	}
+
+	/* before sending new results, send an 'erase' message, so the
+	 * frontend knows it should erase the headers buffer. this
+	 * will ensure that the output of two finds will not be
+	 * mixed. */
+	print_expr ("(:erase t)");
+	results	 = find_results_new ();
+	foundnum = print_sexps (ctx, iter, job->qflags,
+				job->maxnum > 0 ? job->maxnum : G_MAXINT32,
+				job->format, fields, results->sexps,
+				results->docids);
+	failed = mu_msg_iter_failed (iter, &err);
+	mu_msg_iter_destroy (iter);
+	g_free (fields);
+
+	/* don't report or cache incomplete results */
+	if (failed) {
+		print_and_clear_g_error (&err);
+		g_free (key);
+		find_results_destroy (results);
+	} else if (!find_is_cancelled (ctx)) {
+		print_expr ("(:found %u)", foundnum);
+		results_set (ctx, results->docids, 0);
+		find_cache_add (ctx, key, results);
+	} else {
+		g_free (key);
+		find_results_destroy (results);
+	}
+
+	find_job_destroy (job);
+	return NULL;
+}
+
+
 /*
  * 'find' finds a list of messages matching some query, and takes a
  * parameter 'query' with the search query, and (optionally) a
  * parameter 'maxnum' with the maximum number of messages to return.
  *
+ * With a parameter 'fields' (a comma-separated list of field names,
+ * such as "subject,from,date"), or when the frontend asked for the
+ * JSON format, each message is described in the compact format, with
+ * only those fields (see cmd_protocol).
+ *
+ * With 'cursor:true' (and some 'maxnum'), only the first maxnum
+ * messages are sent; if there are more, the (:found ...) includes a
+ * cursor id, ie. (:found <number> :cursor <id>), which can be
+ * used with 'fetch' to get the next ones.
+ *
+ * The results are sent while we're reading the next commands; a new
+ * 'find' cancels this one if it's still running, and then this one
+ * does not send its (:found ...).
+ *
  * returns:
  * => list of s-expressions, each describing a message =>
  * (:found <number of found messages>)
@@ -859,39 +2211,100 @@ get_find_params (GSList *args, gboolean *threads, MuMsgFieldId *sortfield,
 static MuError
 cmd_find (ServerContext *ctx, GSList *args, GError **err)
 {
-	MuMsgIter *iter;
-	unsigned foundnum;
+	FindJob *job;
+	Client *client;
 	int maxnum;
-	gboolean threads, reverse;
+	MuQueryFlags qflags;
 	MuMsgFieldId sortfield;
-	const char *querystr;
+	const char *querystr, *fieldsstr;
 
 	GET_STRING_OR_ERROR_RETURN (args, "query", &querystr, err);
-	if (get_find_params (args, &threads, &sortfield,
-			     &reverse, &maxnum, err) != MU_OK) {
+	if (get_find_params (args, &sortfield, &maxnum, &qflags, err)
+	    != MU_OK) {
 		print_and_clear_g_error (err);
 		return MU_OK;
 	}
 
-	/* note: when we're threading, we get *all* messages, and then
-	 * only return maxnum; this is so that we maximimize the
-	 * change of all messages in a thread showing up */
-	iter = mu_query_run (ctx->query, querystr, threads,
-			     sortfield, reverse,
-			     threads ? -1 : maxnum, err);
-	if (!iter) {
-		print_and_clear_g_error (err);
+	client	  = client_current ();
+	fieldsstr = get_string_from_args (args, "fields", TRUE, NULL);
+	if (!fieldsstr && client->format != MU_MSG_FORMAT_SEXP)
+		fieldsstr = DEFAULT_FIELDS;
+
+	job		= g_slice_new0 (FindJob);
+	job->ctx	= ctx;
+	job->query	= g_strdup (querystr);
+	job->sortfield	= sortfield;
+	job->maxnum	= maxnum;
+	job->qflags	= qflags;
+	job->fields	= g_strdup (fieldsstr);
+	job->format	= client->format;
+	job->cursor	= maxnum > 0 &&
+		get_bool_from_args (args, "cursor", TRUE, NULL);
+	job->client	= client_ref (client);
+
+	ctx->find_done = 0;
+	if (!start_thread (&ctx->finder, find_run, job)) {
+		g_warning ("cannot create thread; searching in the "
+			   "foreground");
+		find_run (job);
+		client_set_current (client);
+	} else {
+		ctx->finding	   = TRUE;
+		ctx->finder_client = client;
+	}
+
+	return MU_OK;
+}
+
+
+/*
+ * 'fetch' gets the next messages for a cursor that 'find' gave us;
+ * it takes a parameter 'cursor' with the cursor id, and (optionally)
+ * 'maxnum', the maximum number of messages to get; by default, as many
+ * as the 'find' got. A cursor expires when the database changes, or
+ * when it has not been used for a while.
+ *
+ * returns:
+ * => list of s-expressions, each describing a message =>
+ * (:fetched <number of messages> [:cursor <id>])
+ * the cursor id is only there if there are more messages
+ */
+static MuError
+cmd_fetch (ServerContext *ctx, GSList *args, GError **err)
+{
+	Cursor *cursor;
+	const char *idstr, *maxnumstr;
+	unsigned id, maxnum, fetchednum;
+
+	GET_STRING_OR_ERROR_RETURN (args, "cursor", &idstr, err);
+	id = (unsigned)strtoul (idstr, NULL, 10);
+
+	cursor = cursor_lookup (ctx, id);
+	if (!cursor) {
+		print_error (MU_ERROR_IN_PARAMETERS,
+			     "no such cursor (it may have expired)");
 		return MU_OK;
 	}
 
-	/* before sending new results, send an 'erase' message, so the
-	 * frontend knows it should erase the headers buffer. this
-	 * will ensure that the output of two finds will not be
-	 * mixed. */
-	print_expr ("(:erase t)");
-	foundnum = print_sexps (iter, threads, maxnum > 0 ? maxnum : G_MAXINT32);
-	print_expr ("(:found %u)", foundnum);
-	mu_msg_iter_destroy (iter);
+	maxnumstr = get_string_from_args (args, "maxnum", TRUE, NULL);
+	maxnum	  = maxnumstr ? (unsigned)atoi (maxnumstr) : 0;
+	if (maxnum == 0)
+		maxnum = cursor->pagesize;
+
+	/* the frontend shows these after the ones it has */
+	fetchednum = print_sexps (ctx, cursor->iter, cursor->qflags, maxnum,
+				  cursor->format, cursor->fields, NULL,
+				  id == ctx->results_cursor ?
+				  ctx->results : NULL);
+
+	if (mu_msg_iter_failed (cursor->iter, err)) {
+		print_and_clear_g_error (err);
+		g_hash_table_remove (ctx->cursors, GUINT_TO_POINTER(id));
+	} else if (mu_msg_iter_is_done (cursor->iter)) {
+		print_expr ("(:fetched %u)", fetchednum);
+		g_hash_table_remove (ctx->cursors, GUINT_TO_POINTER(id));
+	} else
+		print_expr ("(:fetched %u :cursor %u)", fetchednum, id);
 
 	return MU_OK;
 }
@@ -937,23 +2350,6 @@ cmd_guile (ServerContext *ctx, GSList *args, GError **err)
 
 
 
-static MuError
-index_msg_cb (MuIndexStats *stats, void *user_data)
-{
-	if (MU_TERMINATE)
-		return MU_STOP;
-
-	if (stats->_processed % 1000)
-		return MU_OK;
-
-	print_expr ("(:info index :status running "
-		    ":processed %u :updated %u)",
-		   stats->_processed, stats->_updated);
-
-	return MU_OK;
-}
-
-
 static void
 set_my_addresses (MuStore *store, const char *addrstr)
 {
@@ -968,50 +2364,499 @@ set_my_addresses (MuStore *store, const char *addrstr)
 	g_strfreev (my_addresses);
 }
 
-/*
- * 'index' (re)indexs maildir at path:<path>, and responds with (:info
- * index ... ) messages while doing so (see the code)
+/*************************************************************************/
+/* 'index' runs in a thread of its own, so we can keep on handling
+ * commands in the mean time; but while indexing, that thread is the
+ * only one that may use our (writable) store:
+ *
+ * - the commands that only read use a read-only snapshot of the
+ *   database instead, which we reopen every SNAPSHOT_SECS seconds, so
+ *   it sees the messages the indexer committed; the indexer commits
+ *   at least that often as well;
+ * - the commands that write (add, move, remove, sent) are queued, and
+ *   the indexer thread runs them between two messages.
  */
+
+/* look in the spool about this often */
+#define SPOOL_SECS 1
+
+/* we take at most this many requests from the spool at a time */
+#define SPOOL_BATCH_MAX 1000
+
+/* a request 'mu add' or 'mu remove' left in the spool while we have
+ * the store (see mu-spool.h) */
+struct _SpoolReq {
+	MuSpoolOp	 op;
+	char		*path;
+};
+typedef struct _SpoolReq SpoolReq;
+
+static void
+spool_req_destroy (SpoolReq *req)
+{
+	g_free (req->path);
+	g_slice_free (SpoolReq, req);
+}
+
+
 static MuError
-cmd_index (ServerContext *ctx, GSList *args, GError **err)
+each_spooled (MuSpoolOp op, const char *path, GPtrArray *reqs)
 {
-	MuIndex *index;
-	const char *path;
-	MuIndexStats stats, stats2;
-	MuError rv;
+	SpoolReq *req;
 
-	GET_STRING_OR_ERROR_RETURN (args, "path", &path, err);
-	set_my_addresses (ctx->store, get_string_from_args
-			  (args, "my-addresses", TRUE, NULL));
+	if (reqs->len == SPOOL_BATCH_MAX)
+		return MU_STOP; /* the rest stays in the spool */
 
-	index = mu_index_new (ctx->store, err);
-	if (!index) {
-		print_and_clear_g_error (err);
-		return MU_OK;
+	req	  = g_slice_new (SpoolReq);
+	req->op	  = op;
+	req->path = g_strdup (path);
+	g_ptr_array_add (reqs, req);
 
-	}
+	return MU_OK;
+}
 
-	mu_index_stats_clear (&stats);
-	rv = mu_index_run (index, path, FALSE, &stats, index_msg_cb, NULL, NULL);
-	if (rv != MU_OK && rv != MU_STOP) {
-		print_error (MU_ERROR_INTERNAL, "indexing failed");
-		goto leave;
+
+/* handle the requests, in order. We look up the docids of the
+ * messages to remove all at once, so we can drop them from the
+ * thread-cache; a message that's added in the same batch isn't found
+ * then, but adding it has dropped its docid already */
+static void
+spool_run (ServerContext *ctx, GPtrArray *reqs)
+{
+	const char **paths;
+	unsigned *docids, docid;
+	guint u, n;
+
+	paths  = g_new (const char*, reqs->len);
+	docids = g_new (unsigned, reqs->len);
+
+	for (u = n = 0; u != reqs->len; ++u) {
+		SpoolReq *req;
+		req = (SpoolReq*)g_ptr_array_index (reqs, u);
+		if (req->op == MU_SPOOL_OP_REMOVE)
+			paths[n++] = req->path;
 	}
 
-	mu_index_stats_clear (&stats2);
-	rv = mu_index_cleanup (index, &stats2, NULL, NULL, err);
-	if (rv != MU_OK && rv != MU_STOP) {
-		print_error (MU_ERROR_INTERNAL, "cleanup failed");
-		goto leave;
+	if (!mu_store_get_docids_for_paths (ctx->store, paths, n, docids,
+					    NULL))
+		for (u = 0; u != n; ++u)
+			docids[u] = MU_STORE_INVALID_DOCID;
+
+	for (u = n = 0; u != reqs->len; ++u) {
+		SpoolReq *req;
+		gboolean ok;
+
+		req = (SpoolReq*)g_ptr_array_index (reqs, u);
+		if (req->op == MU_SPOOL_OP_ADD) {
+			docid = mu_store_add_path (ctx->store, req->path,
+						   NULL, NULL);
+			ok    = docid != MU_STORE_INVALID_DOCID;
+		} else {
+			docid = docids[n++];
+			ok    = mu_store_remove_path (ctx->store, req->path);
+		}
+
+		if (!ok)
+			MU_WRITE_LOG ("spool: failed to %s %s",
+				      req->op == MU_SPOOL_OP_ADD ?
+				      "add" : "remove", req->path);
+		if (docid != MU_STORE_INVALID_DOCID)
+			mu_thread_cache_remove (ctx->thread_cache, docid);
 	}
 
-	mu_store_flush (ctx->store);
-	print_expr ("(:info index :status complete "
-		   ":processed %u :updated %u :cleaned-up %u)",
-		    stats._processed, stats._updated, stats2._cleaned_up);
-leave:
-	mu_index_destroy (index);
-	return MU_OK;
+	g_free (paths);
+	g_free (docids);
+}
+
+/* handle the spooled requests, if it's been a while; only whoever
+ * has the store may do this, ie. the indexer thread while indexing,
+ * and otherwise the main thread while there's no 'find' running */
+static void
+spool_drain_maybe (ServerContext *ctx)
+{
+	time_t now;
+	GPtrArray *reqs;
+
+	if (MU_TERMINATE || g_atomic_int_get (&ctx->index_cancelled))
+		return;
+
+	now = time (NULL);
+	if (now - ctx->spool_time < SPOOL_SECS)
+		return;
+
+	reqs = g_ptr_array_new_with_free_func
+		((GDestroyNotify)spool_req_destroy);
+	mu_spool_foreach (mu_runtime_path (MU_RUNTIME_PATH_SPOOL),
+			  (MuSpoolForeachFunc)each_spooled, reqs, NULL);
+	if (reqs->len > 0)
+		spool_run (ctx, reqs);
+	g_ptr_array_free (reqs, TRUE);
+
+	ctx->spool_time = now;
+}
+
+
+/* reopen the snapshot after this many seconds */
+#define SNAPSHOT_SECS 5
+
+struct _WriteJob {
+	CmdFunc	 func;
+	GSList	*args;
+	Client	*client; /* the client that sent the command */
+};
+typedef struct _WriteJob WriteJob;
+
+/* queue a write command for the indexer thread; returns FALSE if
+ * there's no indexer (anymore), and the caller should run it
+ * itself */
+static gboolean
+writes_queue (ServerContext *ctx, CmdFunc func, GSList *args)
+{
+	WriteJob *job;
+	GSList *cur;
+	gboolean queued;
+
+	if (!ctx->indexing)
+		return FALSE;
+
+	pthread_mutex_lock (&ctx->writes_lock);
+
+	queued = !g_atomic_int_get (&ctx->index_done);
+	if (queued) {
+		job	  = g_slice_new (WriteJob);
+		job->func   = func;
+		job->client = client_ref (client_current ());
+		job->args   = NULL;
+		for (cur = args; cur; cur = g_slist_next (cur))
+			job->args = g_slist_prepend
+				(job->args, g_strdup ((const char*)cur->data));
+		job->args = g_slist_reverse (job->args);
+		g_queue_push_tail (ctx->writes, job);
+		++ctx->writes_unflushed;
+	}
+
+	pthread_mutex_unlock (&ctx->writes_lock);
+
+	return queued;
+}
+
+/* run the queued write commands; if last is TRUE, set index_done
+ * when the queue is empty, so nothing gets queued anymore */
+static void
+writes_run (ServerContext *ctx, gboolean last)
+{
+	WriteJob *job;
+	Client *client;
+	GError *err;
+	unsigned ran;
+
+	client = client_current ();
+
+	for (ran = 0;; ++ran) {
+		pthread_mutex_lock (&ctx->writes_lock);
+		job = (WriteJob*)g_queue_pop_head (ctx->writes);
+		if (!job && last)
+			g_atomic_int_set (&ctx->index_done, 1);
+		pthread_mutex_unlock (&ctx->writes_lock);
+
+		if (!job)
+			break;
+
+		/* the replies are for the client that sent it */
+		client_set_current (job->client);
+		err = NULL;
+		if (job->func (ctx, job->args, &err) != MU_OK)
+			print_and_clear_g_error (&err);
+		client_set_current (client);
+
+		mu_str_free_list (job->args);
+		client_unref (job->client);
+		g_slice_free (WriteJob, job);
+	}
+
+	/* commit the changes, and have the snapshot see them right
+	 * away; e.g., after a 'move', 'view' should get the new
+	 * path */
+	if (ran > 0) {
+		mu_store_flush (ctx->store);
+		ctx->flush_time = time (NULL);
+		g_atomic_int_set (&ctx->snapshot_stale, 1);
+
+		pthread_mutex_lock (&ctx->writes_lock);
+		ctx->writes_unflushed -= ran;
+		pthread_cond_broadcast (&ctx->writes_flushed);
+		pthread_mutex_unlock (&ctx->writes_lock);
+	}
+}
+
+/* wait until the indexer has run and committed the queued write
+ * commands; their replies are sent before that, so otherwise a
+ * command right after them could still see the old snapshot. The
+ * indexer gets to them between two messages, so this is short */
+static void
+writes_wait (ServerContext *ctx)
+{
+	if (!ctx->indexing)
+		return;
+
+	pthread_mutex_lock (&ctx->writes_lock);
+	while (ctx->writes_unflushed > 0)
+		pthread_cond_wait (&ctx->writes_flushed, &ctx->writes_lock);
+	pthread_mutex_unlock (&ctx->writes_lock);
+}
+
+
+/* what the indexer does between two messages, both while indexing
+ * and while cleaning up */
+static MuError
+index_between (ServerContext *ctx)
+{
+	if (MU_TERMINATE || g_atomic_int_get (&ctx->index_cancelled))
+		return MU_STOP;
+
+	writes_run (ctx, FALSE);
+	spool_drain_maybe (ctx);
+
+	/* commit what we have, so the snapshot can see it the next
+	 * time it's reopened */
+	if (time (NULL) - ctx->flush_time >= SNAPSHOT_SECS) {
+		mu_store_flush (ctx->store);
+		ctx->flush_time = time (NULL);
+	}
+
+	return MU_OK;
+}
+
+
+static MuError
+index_cleanup_cb (MuIndexStats *stats, ServerContext *ctx)
+{
+	return index_between (ctx);
+}
+
+
+static MuError
+index_msg_cb (MuIndexStats *stats, ServerContext *ctx)
+{
+	if (index_between (ctx) != MU_OK)
+		return MU_STOP;
+
+	if (stats->_processed % 1000)
+		return MU_OK;
+
+	print_expr ("(:info index :status running "
+		    ":processed %u :updated %u)",
+		   stats->_processed, stats->_updated);
+
+	return MU_OK;
+}
+
+
+/* the indexer thread */
+static void*
+index_run (void *data)
+{
+	ServerContext *ctx;
+	MuIndex *index;
+	MuIndexStats stats, stats2;
+	MuError rv;
+	GError *err;
+
+	ctx = (ServerContext*)data;
+	err = NULL;
+
+	client_set_current (ctx->index_client);
+
+	index = mu_index_new (ctx->store, &err);
+	if (!index) {
+		print_and_clear_g_error (&err);
+		goto leave;
+	}
+
+	mu_index_stats_clear (&stats);
+	rv = mu_index_run (index, ctx->index_path, FALSE, &stats,
+			   (MuIndexMsgCallback)index_msg_cb, NULL, ctx);
+	if (rv != MU_OK && rv != MU_STOP) {
+		print_error (MU_ERROR_INTERNAL, "indexing failed");
+		goto leave;
+	} else if (rv == MU_STOP) { /* we were cancelled */
+		mu_store_flush (ctx->store);
+		goto leave;
+	}
+
+	mu_index_stats_clear (&stats2);
+	rv = mu_index_cleanup (index, &stats2,
+			       (MuIndexCleanupDeleteCallback)index_cleanup_cb,
+			       ctx, &err);
+	if (rv != MU_OK && rv != MU_STOP) {
+		print_error (MU_ERROR_INTERNAL, "cleanup failed");
+		goto leave;
+	} else if (rv == MU_STOP) { /* we were cancelled */
+		mu_store_flush (ctx->store);
+		goto leave;
+	}
+
+	mu_store_flush (ctx->store);
+	print_expr ("(:info index :status complete "
+		   ":processed %u :updated %u :cleaned-up %u)",
+		    stats._processed, stats._updated, stats2._cleaned_up);
+leave:
+	/* we don't know which messages were updated or removed */
+	mu_thread_cache_clear (ctx->thread_cache);
+	mu_index_destroy (index);
+
+	/* after this, we leave store alone */
+	writes_run (ctx, TRUE);
+
+	return NULL;
+}
+
+
+/* the results we cached are for some other store, after switching */
+static void
+forget_results (ServerContext *ctx)
+{
+	g_hash_table_remove_all (ctx->cursors);
+	find_cache_clear (ctx);
+	ctx->find_cache_rev = mu_store_revision (ctx->rstore);
+}
+
+
+/* go back to using store for everything, after indexing */
+static void
+index_finish (ServerContext *ctx)
+{
+	ctx->indexing = FALSE;
+
+	g_free (ctx->index_path);
+	ctx->index_path = NULL;
+
+	client_unref (ctx->index_client);
+	ctx->index_client = NULL;
+
+	g_hash_table_remove_all (ctx->cursors);
+	mu_query_destroy (ctx->query);
+	mu_store_unref (ctx->rstore);
+
+	ctx->query  = ctx->wquery;
+	ctx->rstore = ctx->store;
+	ctx->wquery = NULL;
+
+	forget_results (ctx);
+}
+
+
+/* if the indexer is done, clean up after it */
+static void
+index_reap_maybe (ServerContext *ctx)
+{
+	if (!ctx->indexing || !g_atomic_int_get (&ctx->index_done))
+		return;
+
+	pthread_join (ctx->indexer, NULL);
+	index_finish (ctx);
+}
+
+
+/* stop the indexer (if any), and wait for it */
+static void
+index_cancel (ServerContext *ctx)
+{
+	if (!ctx->indexing)
+		return;
+
+	g_atomic_int_set (&ctx->index_cancelled, 1);
+	pthread_join (ctx->indexer, NULL);
+	g_atomic_int_set (&ctx->index_cancelled, 0);
+
+	index_finish (ctx);
+}
+
+
+/* reopen the snapshot, if it's been a while */
+static void
+snapshot_refresh_maybe (ServerContext *ctx)
+{
+	GError *err;
+
+	if (!ctx->indexing)
+		return;
+	if (!g_atomic_int_get (&ctx->snapshot_stale) &&
+	    time (NULL) - ctx->snapshot_time < SNAPSHOT_SECS)
+		return;
+
+	g_atomic_int_set (&ctx->snapshot_stale, 0);
+
+	err = NULL;
+	if (!mu_store_reopen (ctx->rstore, &err)) {
+		g_warning ("failed to reopen snapshot: %s",
+			   err ? err->message : "something went wrong");
+		g_clear_error (&err);
+	}
+
+	ctx->snapshot_time = time (NULL);
+}
+
+
+/*
+ * 'index' (re)indexs maildir at path:<path>, and responds with (:info
+ * index ... ) messages while doing so (see the code). Indexing runs in
+ * the background, so the replies to other commands may come in
+ * between.
+ */
+static MuError
+cmd_index (ServerContext *ctx, GSList *args, GError **err)
+{
+	const char *path;
+	MuStore *snapshot;
+	MuQuery *query;
+
+	GET_STRING_OR_ERROR_RETURN (args, "path", &path, err);
+
+	if (ctx->indexing) {
+		print_error (MU_ERROR_IN_PARAMETERS, "already indexing");
+		return MU_OK;
+	}
+
+	set_my_addresses (ctx->store, get_string_from_args
+			  (args, "my-addresses", TRUE, NULL));
+
+	/* the snapshot should see what we wrote so far */
+	mu_store_flush (ctx->store);
+	snapshot = mu_store_new_read_only
+		(mu_runtime_path (MU_RUNTIME_PATH_XAPIANDB), err);
+	if (!snapshot)
+		return print_and_clear_g_error (err);
+
+	query = mu_query_new (snapshot, err);
+	if (!query) {
+		mu_store_unref (snapshot);
+		return print_and_clear_g_error (err);
+	}
+	/* the indexer uses the thread cache, so the snapshot query
+	 * can't */
+	mu_query_set_cancel_flag (query, &ctx->find_cancelled);
+
+	ctx->wquery	   = ctx->query;
+	ctx->query	   = query;
+	ctx->rstore	   = snapshot;
+	ctx->snapshot_time = time (NULL);
+	ctx->flush_time	   = ctx->snapshot_time;
+	ctx->snapshot_stale = 0;
+	ctx->index_path	   = g_strdup (path);
+	ctx->index_done	   = 0;
+	ctx->index_client  = client_ref (client_current ());
+	forget_results (ctx);
+
+	if (!start_thread (&ctx->indexer, index_run, ctx)) {
+		g_warning ("cannot create thread; indexing in the "
+			   "foreground");
+		index_run (ctx);
+		index_finish (ctx);
+	} else
+		ctx->indexing = TRUE;
+
+	return MU_OK;
 }
 
 
@@ -1057,7 +2902,7 @@ get_flags (const char *path, const char *flagstr)
 
 
 static MuError
-do_move (MuStore *store, unsigned docid, MuMsg *msg, const char *maildir,
+do_move (ServerContext *ctx, unsigned docid, MuMsg *msg, const char *maildir,
 	 MuFlags flags, GError **err)
 {
 	unsigned rv;
@@ -1079,7 +2924,8 @@ do_move (MuStore *store, unsigned docid, MuMsg *msg, const char *maildir,
 	/* note, after mu_msg_move_to_maildir, path will be the *new*
 	 * path, and flags and maildir fields will be updated as
 	 * wel */
-	rv = mu_store_update_msg (store, docid, msg, err);
+	rv = mu_store_update_msg (ctx->store, docid, msg, err);
+	mu_thread_cache_remove (ctx->thread_cache, docid);
 	if (rv == MU_STORE_INVALID_DOCID) {
 		mu_util_g_set_error (err, MU_ERROR_XAPIAN,
 				"failed to store updated message");
@@ -1113,7 +2959,7 @@ move_msgid_maybe (ServerContext *ctx, GSList *args, GError **err)
 	if (!msgid || !flagstr || maildir )
 		return FALSE;
 
-	if (!(docids = get_docids_from_msgids (ctx->query, msgid, err))) {
+	if (!(docids = get_docids_from_msgids (ctx->store, msgid, err))) {
 		print_and_clear_g_error (err);
 		return TRUE;
 	}
@@ -1136,7 +2982,7 @@ move_msgid_maybe (ServerContext *ctx, GSList *args, GError **err)
 			break;
 		}
 
-		if ((do_move (ctx->store, docid, msg, NULL, flags, err) != MU_OK))
+		if ((do_move (ctx, docid, msg, NULL, flags, err) != MU_OK))
 			print_and_clear_g_error (err);
 
 		mu_msg_unref (msg);
@@ -1174,7 +3020,7 @@ cmd_move (ServerContext *ctx, GSList *args, GError **err)
 	maildir	= get_string_from_args (args, "maildir", TRUE, err);
 	flagstr = get_string_from_args (args, "flags", TRUE, err);
 
-	docid = determine_docid (ctx->query, args, err);
+	docid = determine_docid (ctx->store, args, err);
 	if (docid == MU_STORE_INVALID_DOCID ||
 	    !(msg = mu_store_get_msg (ctx->store, docid, err))) {
 		print_and_clear_g_error (err);
@@ -1198,7 +3044,7 @@ cmd_move (ServerContext *ctx, GSList *args, GError **err)
 		goto leave;
 	}
 
-	if ((do_move (ctx->store, docid, msg, maildir, flags, err) != MU_OK))
+	if ((do_move (ctx, docid, msg, maildir, flags, err) != MU_OK))
 		print_and_clear_g_error (err);
 
 leave:
@@ -1214,100 +3060,120 @@ leave:
 static MuError
 cmd_ping (ServerContext *ctx, GSList *args, GError **err)
 {
-	unsigned doccount;
-	doccount = mu_store_count (ctx->store, err);
+	unsigned doccount, hits, misses;
+	doccount = mu_store_count (ctx->rstore, err);
 
 	if (doccount == (unsigned)-1)
 		return print_and_clear_g_error (err);
 
+	mu_query_cache_stats (ctx->query, &hits, &misses);
+
 	print_expr ("(:pong \"" PACKAGE_NAME "\" "
 		    " :props ("
 #ifdef BUILD_CRYPTO
 		    "  :crypto t "
 #endif /*BUILD_CRYPTO*/
 		    "  :version \"" VERSION "\" "
-		    "  :doccount %u))",doccount);
+		    "  :doccount %u "
+		    "  :query-cache (:hits %u :misses %u) "
+		    "  :thread-cache (:size %u) "
+		    "  :view-cache (:size %u :hits %u :misses %u)))",
+		    doccount, hits, misses,
+		    mu_thread_cache_size (ctx->thread_cache),
+		    g_hash_table_size (ctx->view_cache),
+		    ctx->view_hits, ctx->view_misses);
 
 	return MU_OK;
 }
 
 
-/* 'quit' takes no parameters, terminates this mu server */
-static MuError
-cmd_quit (ServerContext *ctx, GSList *args , GError **err)
-{
-	print_expr (";; quiting");
-
-	return MU_STOP;
-}
-
-
 /*
- * creating a message object just to get a path seems a bit excessive
- * maybe mu_store_get_path could be added if this turns out to be a problem
+ * 'protocol' lets the frontend choose the format for the compact
+ * header rows, which 'find' sends when given a 'fields' parameter:
+ * 'format:sexp' (the default) gives a plist on a single line, such as
+ *     (:docid 12 :subject "hello" :date (19830 24980 0) :flag (seen))
+ * while 'format:json' gives a JSON object, such as
+ *     {"docid":12,"subject":"hello","date":1299603860,"flag":["seen"]}
+ * With 'format:json', 'find' always sends compact rows. All other
+ * output stays the same, so the frontend can tell the rows apart by
+ * their first character.
  *
- * NOTE: not re-entrant.
+ * returns: (:protocol (:format <format>))
  */
-static const char*
-get_path_from_docid (MuStore *store, unsigned docid, GError **err)
+static MuError
+cmd_protocol (ServerContext *ctx, GSList *args, GError **err)
 {
-	MuMsg *msg;
-	const char* msgpath;
-	static char path[PATH_MAX + 1];
+	const char *formatstr;
 
-	msg = mu_store_get_msg (store, docid, err);
-	if (!msg)
-		return NULL;
+	GET_STRING_OR_ERROR_RETURN (args, "format", &formatstr, err);
 
-	msgpath = mu_msg_get_path (msg);
-	if (!msgpath) {
-		mu_msg_unref (msg);
-		return NULL;
+	if (g_strcmp0 (formatstr, "sexp") == 0)
+		client_current()->format = MU_MSG_FORMAT_SEXP;
+	else if (g_strcmp0 (formatstr, "json") == 0)
+		client_current()->format = MU_MSG_FORMAT_JSON;
+	else {
+		print_error (MU_ERROR_IN_PARAMETERS, "unknown format");
+		return MU_OK;
 	}
 
-	strncpy (path, msgpath, sizeof(path));
+	print_expr ("(:protocol (:format %s))", formatstr);
 
-	mu_msg_unref (msg);
-	return path;
+	return MU_OK;
 }
 
 
+/* 'quit' takes no parameters, terminates this mu server */
+static MuError
+cmd_quit (ServerContext *ctx, GSList *args , GError **err)
+{
+	print_expr (";; quiting");
+
+	return MU_STOP;
+}
+
 
-/* 'remove' removes the message with either docid: or msgid:, sends a
- * (:remove ...) message when it succeeds
+/* 'remove' removes the message with either docid:, msgid: or path:,
+ * sends a (:remove ...) message when it succeeds. With
+ * 'keep-file:true', the message is only removed from the database,
+ * not from the file system (that's what 'mu remove' does)
  */
 static MuError
 cmd_remove (ServerContext *ctx, GSList *args, GError **err)
 {
 	unsigned docid;
-	const char *path;
+	char *path;
+	gboolean keep_file;
 
-	docid = determine_docid (ctx->query, args, err);
+	docid = determine_docid (ctx->store, args, err);
 	if (docid == MU_STORE_INVALID_DOCID) {
 		print_and_clear_g_error (err);
 		return MU_OK;
 	}
 
-	path = get_path_from_docid (ctx->store, docid, err);
+	path = mu_store_get_path (ctx->store, docid, err);
 	if (!path) {
 		print_and_clear_g_error (err);
 		return MU_OK;
 	}
 
-	if (unlink (path) != 0) {
+	keep_file = get_bool_from_args (args, "keep-file", TRUE, NULL);
+	if (!keep_file && unlink (path) != 0) {
 		mu_util_g_set_error (err, MU_ERROR_FILE_CANNOT_UNLINK,
 				     "%s", strerror (errno));
 		print_and_clear_g_error (err);
-		return MU_OK;
+		goto leave;
 	}
 
 	if (!mu_store_remove_path (ctx->store, path)) {
 		print_error (MU_ERROR_XAPIAN_REMOVE_FAILED,
 			     "failed to remove from database");
-		return MU_OK;
+		goto leave;
 	}
+	mu_thread_cache_remove (ctx->thread_cache, docid);
 
 	print_expr ("(:remove %u)", docid);
+leave:
+	g_free (path);
 	return MU_OK;
 }
 
@@ -1331,6 +3197,8 @@ cmd_sent (ServerContext *ctx, GSList *args, GError **err)
 		print_and_clear_g_error (err);
 	else {
 		gchar *escpath;
+		/* we may have updated an existing message */
+		mu_thread_cache_remove (ctx->thread_cache, docid);
 		escpath = mu_str_escape_c_literal (path, TRUE);
 		print_expr ("(:sent t :path %s :docid %u)",
 			    escpath, docid);
@@ -1342,46 +3210,187 @@ cmd_sent (ServerContext *ctx, GSList *args, GError **err)
 
 
 
-/* 'view' gets a full (including body etc.) sexp for some message,
- * identified by either docid: or msgid:; return a (:view <sexp>)
- */
-static MuError
-cmd_view (ServerContext *ctx, GSList *args, GError **err)
+/* render the (:view ...) s-expression for docid into buf, and add it
+ * to the view-cache (unless it's decrypted; we don't want to keep
+ * those around) */
+static gboolean
+view_render (ServerContext *ctx, unsigned docid, MuMsgOptions opts,
+	     GString *buf, GError **err)
 {
 	MuMsg *msg;
-	unsigned docid;
-	char *sexp;
-	MuMsgOptions opts;
+	struct stat statbuf;
+	gboolean cache;
 
-	opts = MU_MSG_OPTION_VERIFY;
-	if (get_bool_from_args (args, "extract-images", FALSE, NULL))
-		opts |= MU_MSG_OPTION_EXTRACT_IMAGES;
-	if (get_bool_from_args (args, "use-agent", FALSE, NULL))
-		opts |= MU_MSG_OPTION_USE_AGENT;
-	if (get_bool_from_args (args, "auto-retrieve-key", FALSE, NULL))
-		opts |= MU_MSG_OPTION_AUTO_RETRIEVE;
-	if (get_bool_from_args (args, "extract-encrypted", FALSE, NULL))
-		opts |= MU_MSG_OPTION_DECRYPT;
+	msg = mu_store_get_msg (ctx->rstore, docid, err);
+	if (!msg)
+		return FALSE;
 
-	docid = determine_docid (ctx->query, args, err);
-	if (docid == MU_STORE_INVALID_DOCID) {
-		print_and_clear_g_error (err);
-		return MU_OK;
-	}
+	/* we check the file before reading it; if it changes while
+	 * we're at it, the cache won't give us this version */
+	cache = !(opts & MU_MSG_OPTION_DECRYPT) &&
+		stat (mu_msg_get_path (msg), &statbuf) == 0;
 
-	msg = mu_store_get_msg (ctx->store, docid, err);
-	if (!msg) {
-		print_and_clear_g_error (err);
-		return MU_OK;
-	}
+	g_string_assign (buf, "(:view ");
+	mu_msg_append_sexp (buf, msg, docid, NULL, NULL, opts);
+	g_string_append (buf, ")\n");
 
-	sexp = mu_msg_to_sexp (msg, docid, NULL, opts);
+	if (cache)
+		view_cache_add (ctx, docid, opts, mu_msg_get_path (msg),
+				&statbuf, buf);
 	mu_msg_unref (msg);
 
-	print_expr ("(:view %s)\n", sexp);
-	g_free (sexp);
-
-	return MU_OK;
+	return TRUE;
+}
+
+
+/* the prefetcher renders the views of the messages the frontend is
+ * likely to view next, so they are in the view-cache when it does;
+ * like 'find', it runs in a thread of its own, and it uses the store,
+ * so every command stops it first (see run_cmd). It only starts when
+ * there's nothing else to do (see server_idle) */
+static gboolean
+prefetch_is_cancelled (ServerContext *ctx)
+{
+	return MU_TERMINATE || g_atomic_int_get (&ctx->prefetch_cancelled);
+}
+
+static void*
+prefetch_run (void *data)
+{
+	ServerContext *ctx;
+	GString *buf;
+	unsigned u, docid;
+
+	ctx = (ServerContext*)data;
+	buf = g_string_sized_new (8192);
+
+	for (u = 0; u != ctx->prefetch->len &&
+		     !prefetch_is_cancelled (ctx); ++u) {
+		docid = g_array_index (ctx->prefetch, unsigned, u);
+		if (!view_cache_get (ctx, docid, ctx->prefetch_opts))
+			view_render (ctx, docid, ctx->prefetch_opts, buf,
+				     NULL);
+	}
+
+	g_string_free (buf, TRUE);
+	g_array_set_size (ctx->prefetch, 0);
+
+	g_atomic_int_set (&ctx->prefetch_done, 1);
+	return NULL;
+}
+
+/* start prefetching, if there's something to prefetch */
+static void
+prefetch_start_maybe (ServerContext *ctx)
+{
+	if (ctx->prefetching || ctx->prefetch->len == 0)
+		return;
+
+	ctx->prefetch_done = 0;
+	if (!start_thread (&ctx->prefetcher, prefetch_run, ctx))
+		g_array_set_size (ctx->prefetch, 0); /* never mind */
+	else
+		ctx->prefetching = TRUE;
+}
+
+/* if the prefetcher is done, clean up after it */
+static void
+prefetch_reap_maybe (ServerContext *ctx)
+{
+	if (!ctx->prefetching || !g_atomic_int_get (&ctx->prefetch_done))
+		return;
+
+	pthread_join (ctx->prefetcher, NULL);
+	ctx->prefetching = FALSE;
+}
+
+/* stop the prefetcher (if any); it finishes the message it's
+ * rendering, which is in the cache then */
+static void
+prefetch_stop (ServerContext *ctx)
+{
+	if (!ctx->prefetching)
+		return;
+
+	g_atomic_int_set (&ctx->prefetch_cancelled, 1);
+	pthread_join (ctx->prefetcher, NULL);
+	g_atomic_int_set (&ctx->prefetch_cancelled, 0);
+
+	ctx->prefetching = FALSE;
+}
+
+/* after viewing docid, the frontend will probably view the next
+ * messages in the results */
+static void
+prefetch_after (ServerContext *ctx, unsigned docid, MuMsgOptions opts)
+{
+	unsigned u, last;
+
+	g_array_set_size (ctx->prefetch, 0);
+
+	/* we don't want to ask for passphrases for messages the
+	 * user may never look at */
+	if (!ctx->results || (opts & MU_MSG_OPTION_DECRYPT))
+		return;
+
+	for (u = 0; u != ctx->results->len; ++u)
+		if (g_array_index (ctx->results, unsigned, u) == docid)
+			break;
+
+	last = MIN (u + 1 + VIEW_PREFETCH_NUM, ctx->results->len);
+	for (++u; u < last; ++u) {
+		unsigned next;
+		next = g_array_index (ctx->results, unsigned, u);
+		g_array_append_val (ctx->prefetch, next);
+	}
+
+	ctx->prefetch_opts = opts;
+}
+
+
+/* 'view' gets a full (including body etc.) sexp for some message,
+ * identified by either docid: or msgid:; return a (:view <sexp>)
+ *
+ * we keep the views we rendered (and those of the next messages in
+ * the results of the last 'find'; see prefetch_run) in the
+ * view-cache, so viewing the next message is fast
+ */
+static MuError
+cmd_view (ServerContext *ctx, GSList *args, GError **err)
+{
+	unsigned docid;
+	MuMsgOptions opts;
+	CachedView *view;
+
+	opts = MU_MSG_OPTION_VERIFY;
+	if (get_bool_from_args (args, "extract-images", FALSE, NULL))
+		opts |= MU_MSG_OPTION_EXTRACT_IMAGES;
+	if (get_bool_from_args (args, "use-agent", FALSE, NULL))
+		opts |= MU_MSG_OPTION_USE_AGENT;
+	if (get_bool_from_args (args, "auto-retrieve-key", FALSE, NULL))
+		opts |= MU_MSG_OPTION_AUTO_RETRIEVE;
+	if (get_bool_from_args (args, "extract-encrypted", FALSE, NULL))
+		opts |= MU_MSG_OPTION_DECRYPT;
+
+	docid = determine_docid (ctx->rstore, args, err);
+	if (docid == MU_STORE_INVALID_DOCID) {
+		print_and_clear_g_error (err);
+		return MU_OK;
+	}
+
+	view = view_cache_lookup (ctx, docid, opts);
+	if (view)
+		print_expr_len (view->sexp, view->len);
+	else if (view_render (ctx, docid, opts, ctx->sexpbuf, err))
+		print_expr_len (ctx->sexpbuf->str, ctx->sexpbuf->len);
+	else {
+		print_and_clear_g_error (err);
+		return MU_OK;
+	}
+
+	prefetch_after (ctx, docid, opts);
+
+	return MU_OK;
 }
 
 
@@ -1390,6 +3399,47 @@ cmd_view (ServerContext *ctx, GSList *args, GError **err)
 
 /*************************************************************************/
 
+static gboolean
+is_write_cmd (CmdFunc func)
+{
+	return func == cmd_add || func == cmd_move || func == cmd_remove ||
+		func == cmd_sent;
+}
+
+
+/* run a command, taking care of the 'find' and 'index' that may be
+ * running in the background */
+static MuError
+run_cmd (ServerContext *ctx, CmdFunc func, GSList *args, GError **err)
+{
+	/* a new 'find' cancels the running one for the same client,
+	 * which is not interesting anymore; other commands must wait
+	 * for it */
+	if (func == cmd_find && ctx->finder_client == client_current ())
+		find_cancel (ctx);
+	else
+		find_wait (ctx);
+
+	/* prefetching is never more important than what the
+	 * frontend wants now */
+	prefetch_stop (ctx);
+
+	index_reap_maybe (ctx);
+	if (!is_write_cmd (func))
+		writes_wait (ctx);
+	snapshot_refresh_maybe (ctx);
+
+	if (is_write_cmd (func)) {
+		if (writes_queue (ctx, func, args))
+			return MU_OK;
+		/* the indexer may just have finished */
+		index_reap_maybe (ctx);
+	}
+
+	return func (ctx, args, err);
+}
+
+
 static MuError
 handle_args (ServerContext *ctx, GSList *args, GError **err)
 {
@@ -1402,13 +3452,17 @@ handle_args (ServerContext *ctx, GSList *args, GError **err)
 		{ "add",	cmd_add },
 		{ "compose",	cmd_compose },
 		{ "contacts",   cmd_contacts },
+		{ "count",	cmd_count },
 		{ "extract",    cmd_extract },
+		{ "facets",	cmd_facets },
+		{ "fetch",	cmd_fetch },
 		{ "find",	cmd_find },
 		{ "guile",      cmd_guile },
 		{ "index",	cmd_index },
 		{ "mkdir",	cmd_mkdir },
 		{ "move",	cmd_move },
 		{ "ping",	cmd_ping },
+		{ "protocol",	cmd_protocol },
 		{ "quit",	cmd_quit },
 		{ "remove",	cmd_remove },
 		{ "sent",	cmd_sent },
@@ -1422,8 +3476,10 @@ handle_args (ServerContext *ctx, GSList *args, GError **err)
 		return MU_OK;
 
 	for (u = 0; u != G_N_ELEMENTS (cmd_map); ++u)
-		if (g_strcmp0(cmd, cmd_map[u].cmd) == 0)
-			return cmd_map[u].func (ctx, g_slist_next(args), err);
+		if (g_strcmp0(cmd, cmd_map[u].cmd) == 0) {
+			return run_cmd (ctx, cmd_map[u].func,
+					g_slist_next(args), err);
+		}
 
 	mu_util_g_set_error (err, MU_ERROR_IN_PARAMETERS,
 			     "unknown command '%s'", cmd ? cmd : "");
@@ -1432,52 +3488,660 @@ handle_args (ServerContext *ctx, GSList *args, GError **err)
 
 
 
+/*************************************************************************/
+/* the main loop: we wait for input from the clients (and in daemon
+ * mode, for new clients), and handle the commands they send us, one
+ * at a time. We use plain poll(); there are only a handful of clients
+ * at most.
+ */
+
+/* what we do when there's no input, every SPOOL_SECS or so */
+static void
+server_idle (ServerContext *ctx)
+{
+	find_reap_maybe (ctx);
+	prefetch_reap_maybe (ctx);
+	if (ctx->finding || ctx->prefetching)
+		return; /* the finder/prefetcher uses the store */
+
+	index_reap_maybe (ctx);
+	if (!ctx->indexing)
+		spool_drain_maybe (ctx);
+
+	prefetch_start_maybe (ctx);
+}
+
+
+static void
+greet (Client *client)
+{
+	client_set_current (client);
+	print_raw (";; welcome to " PACKAGE_STRING "\n");
+	print_raw (";; mu> ");
+	client_set_current (NULL);
+}
+
+
+/* handle a line of input from the current client */
+static void
+handle_line (ServerContext *ctx, Client *client, const char *line)
+{
+	GSList *args;
+	GError *err;
+
+	/* args will receive a the command as a list of strings.
+	 * returning NULL indicates an error */
+	err  = NULL;
+	args = mu_str_esc_to_list (line, &err);
+	if (!args || err)
+		print_and_clear_g_error (&err);
+	else {
+		switch (handle_args (ctx, args, &err)) {
+		case MU_OK: break;
+		case MU_STOP:
+			client->quit = TRUE;
+			break;
+		default: /* some error occurred */
+			print_and_clear_g_error (&err);
+		}
+	}
+
+	mu_str_free_list (args);
+
+	if (!client->quit)
+		print_raw (";; mu> ");
+}
+
+
+/* read whatever the client has for us, and handle the commands in
+ * there */
+static void
+client_read (ServerContext *ctx, Client *client)
+{
+	char buf[4096], *nl, *line;
+	ssize_t rv;
+
+	rv = read (client->infd, buf, sizeof(buf));
+	if (rv == -1 &&
+	    (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	if (rv <= 0) { /* EOF, or some error */
+		client->quit = TRUE;
+		return;
+	}
+
+	g_string_append_len (client->inbuf, buf, rv);
+
+	client_set_current (client);
+	while (!client->quit &&
+	       (nl = memchr (client->inbuf->str, '\n', client->inbuf->len))) {
+		line = g_strndup (client->inbuf->str, nl - client->inbuf->str);
+		g_string_erase (client->inbuf, 0, nl - client->inbuf->str + 1);
+		handle_line (ctx, client, line);
+		g_free (line);
+	}
+	client_set_current (NULL);
+}
+
+
+static void
+set_nonblocking (int fd)
+{
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
+}
+
+
+static Client*
+client_accept (int listenfd)
+{
+	int fd;
+	Client *client;
+
+	fd = accept (listenfd, NULL, NULL);
+	if (fd == -1) {
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			g_warning ("accept() failed: %s", strerror (errno));
+		return NULL;
+	}
+
+	set_nonblocking (fd);
+	client = client_new (fd, fd, TRUE);
+	greet (client);
+
+	return client;
+}
+
+
+/* serve the clients until we're terminated, or main_client (if any)
+ * has quit */
+static void
+serve (ServerContext *ctx, GPtrArray *clients, Client *main_client,
+       int listenfd)
+{
+	struct pollfd *pfds;
+	unsigned u, first, num;
+	char drain[64];
+	gboolean done;
+	Client *client;
+
+	done = FALSE;
+	while (!MU_TERMINATE && !done) {
+
+		server_idle (ctx);
+
+		/* whatever the commands had to say, the clients should
+		 * have it before we wait for the next ones */
+		for (u = 0; u != clients->len; ++u)
+			client_flush (g_ptr_array_index (clients, u));
+
+		pfds = g_new0 (struct pollfd, clients->len + 2);
+		num  = 0;
+
+		pfds[num].fd	   = WAKE_PIPE[0];
+		pfds[num++].events = POLLIN;
+		if (listenfd != -1) {
+			pfds[num].fd	   = listenfd;
+			pfds[num++].events = POLLIN;
+		}
+
+		first = num;
+		for (u = 0; u != clients->len; ++u) {
+			client = g_ptr_array_index (clients, u);
+			pfds[num].fd	 = client->infd;
+			pfds[num].events = POLLIN;
+			if (client->is_socket && client_has_pending (client))
+				pfds[num].events |= POLLOUT;
+			++num;
+		}
+
+		if (poll (pfds, num, SPOOL_SECS * 1000) == -1) {
+			g_free (pfds);
+			if (errno == EINTR)
+				continue; /* maybe MU_TERMINATE */
+			g_critical ("poll() failed: %s", strerror (errno));
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN)
+			while (read (WAKE_PIPE[0], drain, sizeof(drain)) > 0)
+				;
+
+		for (u = 0; u != clients->len; ++u) {
+			client = g_ptr_array_index (clients, u);
+			if (pfds[first + u].revents & POLLOUT)
+				client_write_more (client);
+			if (pfds[first + u].revents & (POLLIN|POLLHUP|POLLERR))
+				client_read (ctx, client);
+		}
+
+		/* the clients we're done with; they're closed as soon
+		 * as their 'find' or 'index' (if any) is done with
+		 * them as well */
+		for (u = clients->len; u > 0; --u) {
+			client = g_ptr_array_index (clients, u - 1);
+			if (!client->quit && !client->dead)
+				continue;
+			if (client == main_client)
+				done = TRUE;
+			g_ptr_array_remove_index (clients, u - 1);
+			client_unref (client);
+		}
+
+		if (listenfd != -1 && (pfds[1].revents & POLLIN) &&
+		    (client = client_accept (listenfd)))
+			g_ptr_array_add (clients, client);
+
+		g_free (pfds);
+	}
+}
+
+
+static gboolean
+socket_address (const char *path, struct sockaddr_un *addr, GError **err)
+{
+	if (strlen (path) >= sizeof(addr->sun_path)) {
+		mu_util_g_set_error (err, MU_ERROR_FILE_INVALID_NAME,
+				     "socket path too long: %s", path);
+		return FALSE;
+	}
+
+	memset (addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy (addr->sun_path, path);
+
+	return TRUE;
+}
+
+
+/* connect to the daemon listening on path; returns the socket, or -1
+ * if there's no daemon there */
+static int
+connect_socket (const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (!socket_address (path, &addr, NULL))
+		return -1;
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	if (connect (fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* listen on a socket at path, which only we can use; if there's a
+ * socket there already, but nobody is listening on it, it's a
+ * left-over from some earlier daemon, which we replace */
+static int
+listen_socket (const char *path, GError **err)
+{
+	struct sockaddr_un addr;
+	int fd, rv;
+	mode_t oldmask;
+
+	if (!socket_address (path, &addr, err))
+		return -1;
+
+	if ((fd = connect_socket (path)) != -1) {
+		close (fd);
+		mu_util_g_set_error (err, MU_ERROR_FILE_CANNOT_CREATE,
+				     "a mu server is running already (%s)",
+				     path);
+		return -1;
+	}
+	unlink (path);
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
+		goto errexit;
+
+	oldmask = umask (077);
+	rv	= bind (fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask (oldmask);
+
+	if (rv != 0 || listen (fd, 16) != 0)
+		goto errexit;
+
+	set_nonblocking (fd);
+
+	return fd;
+
+errexit:
+	mu_util_g_set_error (err, MU_ERROR_FILE_CANNOT_CREATE,
+			     "cannot listen on %s: %s", path,
+			     strerror (errno));
+	if (fd != -1)
+		close (fd);
+	return -1;
+}
+
+
 MuError
-mu_cmd_server (MuStore *store, MuConfig *opts/*unused*/, GError **err)
+mu_cmd_server (MuStore *store, MuConfig *opts, GError **err)
 {
 	ServerContext ctx;
-	gboolean do_quit;
+	GPtrArray *clients;
+	Client *main_client;
+	int listenfd;
+	const char *sockpath;
 
 	g_return_val_if_fail (store, MU_ERROR_INTERNAL);
+	g_return_val_if_fail (opts, MU_ERROR_INTERNAL);
 
-	ctx.store = store;
-	ctx.query = mu_query_new (store, err);
-	if (!ctx.query)
+	sockpath = mu_runtime_path (MU_RUNTIME_PATH_SOCKET);
+	listenfd = -1;
+	if (opts->daemon && (listenfd = listen_socket (sockpath, err)) == -1)
 		return MU_G_ERROR_CODE (err);
 
+	if (pthread_key_create (&CLIENT_KEY, NULL) != 0 ||
+	    pipe (WAKE_PIPE) != 0) {
+		mu_util_g_set_error (err, MU_ERROR_INTERNAL,
+				     "failed to set up: %s", strerror (errno));
+		goto errexit;
+	}
+	set_nonblocking (WAKE_PIPE[0]);
+	set_nonblocking (WAKE_PIPE[1]);
+
+	ctx.store  = store;
+	ctx.rstore = store;
+	ctx.query  = mu_query_new (store, err);
+	if (!ctx.query)
+		goto errexit;
+
+	find_cache_init (&ctx);
+	ctx.sexpbuf = g_string_sized_new (8192);
+
+	ctx.thread_cache = mu_thread_cache_new ();
+	mu_query_set_thread_cache (ctx.query, ctx.thread_cache);
+
+	cursors_init (&ctx);
+	view_cache_init (&ctx);
+	ctx.results	   = NULL;
+	ctx.results_cursor = 0;
+
+	ctx.prefetch = g_array_new (FALSE, FALSE, sizeof(unsigned));
+	ctx.prefetching	       = FALSE;
+	ctx.prefetch_cancelled = 0;
+	ctx.prefetch_done      = 0;
+
+	ctx.finding	   = FALSE;
+	ctx.finder_client  = NULL;
+	ctx.find_cancelled = 0;
+	ctx.find_done	   = 0;
+	mu_query_set_cancel_flag (ctx.query, &ctx.find_cancelled);
+
+	ctx.wquery	    = NULL;
+	ctx.indexing	    = FALSE;
+	ctx.index_client    = NULL;
+	ctx.index_path	    = NULL;
+	ctx.index_done	    = 0;
+	ctx.index_cancelled = 0;
+	ctx.writes	    = g_queue_new ();
+	ctx.writes_unflushed = 0;
+	pthread_mutex_init (&ctx.writes_lock, NULL);
+	pthread_cond_init (&ctx.writes_flushed, NULL);
+	ctx.spool_time	    = 0;
+
 	install_sig_handler ();
 
-	g_print (";; welcome to " PACKAGE_STRING "\n");
+	clients = g_ptr_array_new ();
+	if (opts->daemon) {
+		/* a client going away should not take us down */
+		signal (SIGPIPE, SIG_IGN);
+		main_client = NULL;
+		g_print (";; " PACKAGE_STRING " listening on %s\n", sockpath);
+	} else {
+		main_client = client_new (STDIN_FILENO, STDOUT_FILENO, FALSE);
+		g_ptr_array_add (clients, main_client);
+		fflush (stdout);
+		greet (main_client);
+	}
+
+	serve (&ctx, clients, main_client, listenfd);
+
+	find_cancel (&ctx);
+	prefetch_stop (&ctx);
+	index_cancel (&ctx);
+	g_ptr_array_foreach (clients, (GFunc)client_unref, NULL);
+	g_ptr_array_free (clients, TRUE);
+
+	mu_store_flush   (ctx.store);
+	find_cache_destroy (&ctx);
+	cursors_destroy (&ctx);
+	view_cache_destroy (&ctx);
+	results_set (&ctx, NULL, 0);
+	g_array_free (ctx.prefetch, TRUE);
+	mu_query_destroy (ctx.query);
+	mu_thread_cache_destroy (ctx.thread_cache);
+	g_string_free (ctx.sexpbuf, TRUE);
+	g_queue_free (ctx.writes);
+	pthread_cond_destroy (&ctx.writes_flushed);
+	pthread_mutex_destroy (&ctx.writes_lock);
+
+	close (WAKE_PIPE[0]);
+	close (WAKE_PIPE[1]);
+	if (listenfd != -1) {
+		close (listenfd);
+		unlink (sockpath);
+	}
+
+	return MU_OK;
+
+errexit:
+	if (WAKE_PIPE[0] != -1) {
+		close (WAKE_PIPE[0]);
+		close (WAKE_PIPE[1]);
+	}
+	if (listenfd != -1) {
+		close (listenfd);
+		unlink (sockpath);
+	}
+	return MU_G_ERROR_CODE (err);
+}
+
 
-	/*  the main REPL */
-	do_quit = FALSE;
-	while (!MU_TERMINATE && !do_quit) {
+/*************************************************************************/
+/* forwarding: while a daemon is running, it has the database open for
+ * writing, so 'mu add', 'mu remove' and 'mu index' can't; instead,
+ * they send their commands to the daemon (see mu_cmd_execute)
+ */
+
+/* quote str so mu_str_esc_to_list takes it as a single argument */
+static char*
+quote_arg (const char *str)
+{
+	GString *gstr;
+
+	gstr = g_string_sized_new (strlen (str) + 2);
+	g_string_append_c (gstr, '"');
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\')
+			g_string_append_c (gstr, '\\');
+		g_string_append_c (gstr, *str);
+	}
+	g_string_append_c (gstr, '"');
+
+	return g_string_free (gstr, FALSE);
+}
+
+
+/* get the next expression the daemon sends us, skipping anything
+ * that's not an expression (such as the prompt); returns NULL when the
+ * daemon went away */
+static char*
+read_expr (int fd, GString *inbuf)
+{
+	char buf[4096], *pre, *post, *expr;
+	size_t exprlen;
+	ssize_t rv;
+
+	while (1) {
+		pre = memchr (inbuf->str, COOKIE_PRE, inbuf->len);
+		if (!pre)
+			g_string_truncate (inbuf, 0);
+		else {
+			g_string_erase (inbuf, 0, pre - inbuf->str);
+			post = memchr (inbuf->str, COOKIE_POST, inbuf->len);
+			if (post) {
+				exprlen = strtoul (inbuf->str + 1, NULL, 16);
+				if ((size_t)(post - inbuf->str) + 1 + exprlen
+				    <= inbuf->len) {
+					/* without the \n */
+					expr = g_strndup (post + 1,
+							  exprlen ? exprlen - 1 : 0);
+					g_string_erase (inbuf, 0,
+							post - inbuf->str + 1 + exprlen);
+					return expr;
+				}
+			}
+		}
+
+		do
+			rv = read (fd, buf, sizeof(buf));
+		while (rv == -1 && errno == EINTR);
+		if (rv <= 0)
+			return NULL;
+
+		g_string_append_len (inbuf, buf, rv);
+	}
+}
+
+
+/* send a command to the daemon, and get the reply that starts with
+ * done; returns NULL if we got an error instead (or the daemon went
+ * away) */
+static char*
+forward_cmd (int fd, GString *inbuf, const char *cmd, const char *done)
+{
+	struct iovec iov[2];
+	char *expr;
+
+	iov[0].iov_base = (char*)cmd;
+	iov[0].iov_len	= strlen (cmd);
+	iov[1].iov_base = "\n";
+	iov[1].iov_len	= 1;
+	if (!write_all (fd, iov, 2))
+		return NULL;
+
+	while ((expr = read_expr (fd, inbuf))) {
+		if (g_str_has_prefix (expr, done))
+			return expr;
+		if (g_str_has_prefix (expr, "(:error")) {
+			g_warning ("mu server: %s", expr);
+			g_free (expr);
+			return NULL;
+		}
+		g_free (expr);
+	}
+
+	g_warning ("mu server went away");
+	return NULL;
+}
+
+
+/* add or remove (depending on opts->cmd) the messages in opts->params */
+static MuError
+forward_paths (int fd, GString *inbuf, MuConfig *opts, GError **err)
+{
+	gboolean allok, add;
+	int i;
+
+	add = opts->cmd == MU_CONFIG_CMD_ADD;
 
-		GSList *args;
-		GError *my_err = NULL;
+	/* note: params[0] will be 'add' or 'remove' */
+	for (i = 1, allok = TRUE; opts->params[i]; ++i) {
 
-		/* args will receive a the command as a list of
-		 * strings. returning NULL indicates an error */
-		args   = read_line_as_list (&my_err);
-		if (!args || my_err) {
-			print_and_clear_g_error (&my_err);
+		const char *src;
+		char *path, *cmd, *reply;
+
+		src = opts->params[i];
+		if (!g_path_is_absolute (src)) {
+			g_warning ("path is not absolute: %s", src);
+			allok = FALSE;
 			continue;
 		}
 
-		switch (handle_args (&ctx, args, &my_err)) {
-		case MU_OK: break;
-		case MU_STOP:
-			do_quit = TRUE;
-			break;
-		default: /* some error occurred */
-			print_and_clear_g_error (&my_err);
+		path  = quote_arg (src);
+		cmd   = add ?
+			g_strdup_printf ("add path:%s", path) :
+			g_strdup_printf ("remove path:%s keep-file:true", path);
+		reply = forward_cmd (fd, inbuf, cmd,
+				     add ? "(:info add " : "(:remove ");
+		if (!reply) {
+			MU_WRITE_LOG ("failed to %s %s",
+				      add ? "add" : "remove", src);
+			allok = FALSE;
 		}
 
-		mu_str_free_list (args);
+		g_free (reply);
+		g_free (cmd);
+		g_free (path);
 	}
 
-	mu_store_flush   (ctx.store);
-	mu_query_destroy (ctx.query);
+	if (allok)
+		return MU_OK;
+
+	if (add) {
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR_XAPIAN_STORE_FAILED,
+			     "store failed for some message(s)");
+		return MU_ERROR_XAPIAN_STORE_FAILED;
+	} else {
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR_XAPIAN_REMOVE_FAILED,
+			     "remove failed for some message(s)");
+		return MU_ERROR_XAPIAN_REMOVE_FAILED;
+	}
+}
+
+
+static MuError
+forward_index (int fd, GString *inbuf, MuConfig *opts, GError **err)
+{
+	char *path, *addrs, *qaddrs, *cmd, *reply;
+	unsigned processed, updated, cleaned_up;
+
+	path   = quote_arg (opts->maildir);
+	addrs  = opts->my_addresses ?
+		g_strjoinv (",", opts->my_addresses) : NULL;
+	qaddrs = addrs ? quote_arg (addrs) : NULL;
+	cmd    = g_strdup_printf ("index path:%s%s%s", path,
+				  qaddrs ? " my-addresses:" : "",
+				  qaddrs ? qaddrs : "");
+
+	if (!opts->quiet)
+		g_print ("indexing messages under %s [via mu server]\n",
+			 opts->maildir);
+
+	reply = forward_cmd (fd, inbuf, cmd, "(:info index :status complete");
+
+	g_free (cmd);
+	g_free (qaddrs);
+	g_free (addrs);
+	g_free (path);
+
+	if (!reply) {
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR,
+			     "indexing failed");
+		return MU_ERROR;
+	}
+
+	if (!opts->quiet &&
+	    sscanf (reply, "(:info index :status complete :processed %u "
+		    ":updated %u :cleaned-up %u)",
+		    &processed, &updated, &cleaned_up) == 3)
+		g_print ("processed: %u; updated/new: %u, cleaned-up: %u\n",
+			 processed, updated, cleaned_up);
+
+	g_free (reply);
 
 	return MU_OK;
 }
+
+
+gboolean
+mu_cmd_server_forward (MuConfig *opts, MuError *rv, GError **err)
+{
+	int fd;
+	GString *inbuf;
+
+	g_return_val_if_fail (opts, FALSE);
+	g_return_val_if_fail (rv, FALSE);
+
+	switch (opts->cmd) {
+	case MU_CONFIG_CMD_ADD:
+	case MU_CONFIG_CMD_REMOVE:
+		/* without any paths, let the command complain */
+		if (!opts->params[0] || !opts->params[1])
+			return FALSE;
+		break;
+	case MU_CONFIG_CMD_INDEX:
+		/* the daemon can't do these for us */
+		if (opts->rebuild || opts->reindex || !opts->maildir)
+			return FALSE;
+		break;
+	default:
+		return FALSE;
+	}
+
+	fd = connect_socket (mu_runtime_path (MU_RUNTIME_PATH_SOCKET));
+	if (fd == -1)
+		return FALSE; /* no daemon */
+
+	inbuf = g_string_sized_new (4096);
+
+	if (opts->cmd == MU_CONFIG_CMD_INDEX)
+		*rv = forward_index (fd, inbuf, opts, err);
+	else
+		*rv = forward_paths (fd, inbuf, opts, err);
+
+	g_string_free (inbuf, TRUE);
+	close (fd);
+
+	return TRUE;
+}
@@ -27,6 +27,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
 
 #include "mu-msg.h"
 #include "mu-msg-part.h"
@@ -39,6 +41,7 @@
 #include "mu-runtime.h"
 #include "mu-flags.h"
 #include "mu-store.h"
+#include "mu-spool.h"
 
 #ifdef BUILD_CRYPTO
 #include "mu-msg-crypto.h"
@@ -508,12 +511,10 @@ show_version (void)
 
 typedef MuError (*store_func) (MuStore *, MuConfig *, GError **err);
 
-MuError
-with_store (store_func func, MuConfig *opts, gboolean read_only,
-	    GError **err)
+static MuStore*
+open_store (MuConfig *opts, gboolean read_only, GError **err)
 {
 	MuStore *store;
-	MuError merr;
 
 	if (read_only)
 		store = mu_store_new_read_only
@@ -525,15 +526,444 @@ with_store (store_func func, MuConfig *opts, gboolean read_only,
 			 mu_runtime_path(MU_RUNTIME_PATH_CONTACTS),
 			 opts->rebuild, err);
 	if (!store)
-		return MU_G_ERROR_CODE(err);
+		return NULL;
 
 	mu_store_set_my_addresses (store, (const char**)opts->my_addresses);
+
+	/* first, the requests 'mu add' and 'mu remove' left for us
+	 * while someone else had the store */
+	if (!read_only)
+		mu_spool_drain (mu_runtime_path (MU_RUNTIME_PATH_SPOOL),
+				store, NULL);
+
+	return store;
+}
+
+
+MuError
+with_store (store_func func, MuConfig *opts, gboolean read_only,
+	    GError **err)
+{
+	MuStore *store;
+	MuError merr;
+
+	store = open_store (opts, read_only, err);
+	if (!store)
+		return MU_G_ERROR_CODE(err);
+
 	merr = func (store, opts, err);
 	mu_store_unref (store);
 	return merr;
 }
 
 
+/* put the add or remove requests for the paths in the spool, for
+ * the process that has the store (see mu-spool.h) */
+static MuError
+spool_requests (MuConfig *opts, GError **err)
+{
+	gboolean add, allok;
+	const char *spooldir;
+	int i;
+
+	add = opts->cmd == MU_CONFIG_CMD_ADD;
+
+	/* note: params[0] will be 'add' or 'remove' */
+	if (!opts->params[0] || !opts->params[1]) {
+		g_warning ("usage: mu %s <file> [<files>]",
+			   add ? "add" : "remove");
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR_IN_PARAMETERS,
+			     "missing source and/or target");
+		return MU_ERROR_IN_PARAMETERS;
+	}
+
+	spooldir = mu_runtime_path (MU_RUNTIME_PATH_SPOOL);
+	for (i = 1, allok = TRUE; opts->params[i]; ++i) {
+
+		const char* src;
+		src = opts->params[i];
+
+		if (!check_file_okay (src, add)) {
+			allok = FALSE;
+			continue;
+		}
+
+		if (!mu_spool_add (spooldir,
+				   add ? MU_SPOOL_OP_ADD : MU_SPOOL_OP_REMOVE,
+				   src, err))
+			return MU_G_ERROR_CODE(err);
+	}
+
+	if (!allok) {
+		g_set_error (err, MU_ERROR_DOMAIN, MU_ERROR_IN_PARAMETERS,
+			     "invalid path for some message(s)");
+		return MU_ERROR_IN_PARAMETERS;
+	}
+
+	return MU_OK;
+}
+
+
+/*
+ * mu add --stdin, mu remove --stdin: read the paths from stdin, one
+ * per line, until end-of-file, so a delivery pipeline can keep a
+ * single mu around, rather than paying for opening the store (and
+ * for a commit) for every message.
+ *
+ * We commit when no new paths came in for STDIN_IDLE_SECS, but no
+ * later than STDIN_LATENCY_SECS after the first uncommitted change,
+ * or after STDIN_BATCH_MAX changes; this way, a burst of messages
+ * costs only a few commits, while a single message can be found
+ * almost right away.
+ */
+#define STDIN_BATCH_MAX		1000
+#define STDIN_IDLE_SECS		0.2
+#define STDIN_LATENCY_SECS	2.0
+
+/* while we have the store, other mu add/remove leave their requests
+ * in the spool; we look for those every STDIN_SPOOL_SECS. When it's
+ * the other way around, we try to get the store every
+ * STDIN_RETRY_SECS.
+ *
+ * We don't keep the store (and its lock) while there's nothing to do:
+ * after an idle commit, we let go of it, and open it again for the
+ * next path that comes in */
+#define STDIN_SPOOL_SECS	1.0
+#define STDIN_RETRY_SECS	30.0
+
+struct _StdinData {
+	MuConfig	*opts;
+	MuStore		*store;	  /* NULL while we're spooling */
+	GTimer		*timer;
+	unsigned	 pending; /* the number of uncommitted changes */
+	double		 first;	  /* when the first of those was made */
+	double		 last;	  /* when the last of those was made */
+	double		 spool;	  /* when we last looked at the spool */
+	double		 retry;	  /* when to try to get the store again */
+	gboolean	 idle;	  /* we let go of the store, as there was
+				   * nothing to do */
+	gboolean	 allok;
+};
+typedef struct _StdinData StdinData;
+
+static gboolean MU_CAUGHT_SIGNAL;
+
+static void
+sig_handler (int sig)
+{
+	MU_CAUGHT_SIGNAL = TRUE;
+}
+
+static void
+install_sig_handler (void)
+{
+	struct sigaction action;
+	int i, sigs[] = { SIGINT, SIGHUP, SIGTERM };
+
+	MU_CAUGHT_SIGNAL = FALSE;
+
+	/* no SA_RESTART, so poll returns when we get a signal; and
+	 * a second one kills us */
+	action.sa_handler = sig_handler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESETHAND;
+
+	for (i = 0; i != G_N_ELEMENTS(sigs); ++i)
+		if (sigaction (sigs[i], &action, NULL) != 0)
+			g_critical ("set sigaction for %d failed: %s",
+				    sigs[i], strerror (errno));
+}
+
+
+static void
+stdin_try_store (StdinData *sdata)
+{
+	sdata->retry = g_timer_elapsed (sdata->timer, NULL) +
+		STDIN_RETRY_SECS;
+
+	/* this drains the spool as well */
+	sdata->store = open_store (sdata->opts, FALSE, NULL);
+	if (sdata->store && !sdata->idle)
+		MU_WRITE_LOG ("got the database; no longer spooling");
+	else if (!sdata->store && sdata->idle)
+		MU_WRITE_LOG ("database is locked; spooling the requests");
+
+	sdata->idle = FALSE;
+}
+
+
+/* let go of the store, so others can have it while we're idle */
+static void
+stdin_release_store (StdinData *sdata)
+{
+	mu_store_unref (sdata->store);
+	sdata->store = NULL;
+	sdata->idle  = TRUE;
+}
+
+
+static void
+stdin_commit (StdinData *sdata)
+{
+	int drained;
+
+	/* what others left in the spool goes in the same commit */
+	drained = mu_spool_drain (mu_runtime_path (MU_RUNTIME_PATH_SPOOL),
+				  sdata->store, NULL);
+	sdata->spool = g_timer_elapsed (sdata->timer, NULL);
+
+	if (sdata->pending > 0 || drained > 0)
+		mu_store_flush (sdata->store);
+
+	sdata->pending = 0;
+}
+
+
+/* commit if our policy says so; or, with force, if there's anything
+ * to commit at all */
+static void
+stdin_commit_maybe (StdinData *sdata, gboolean force)
+{
+	double now;
+
+	now = g_timer_elapsed (sdata->timer, NULL);
+
+	/* when idle, we get the store again once there's something
+	 * to do (see stdin_handle_path) */
+	if (!sdata->store) {
+		if (!sdata->opts->spool && !sdata->idle &&
+		    now >= sdata->retry)
+			stdin_try_store (sdata);
+		return;
+	}
+
+	if (force ||
+	    sdata->pending >= STDIN_BATCH_MAX ||
+	    (sdata->pending > 0 &&
+	     (now - sdata->last  >= STDIN_IDLE_SECS ||
+	      now - sdata->first >= STDIN_LATENCY_SECS)) ||
+	    now - sdata->spool >= STDIN_SPOOL_SECS)
+		stdin_commit (sdata);
+
+	/* everything is committed, and nothing came in for a while */
+	if (!force && sdata->pending == 0 &&
+	    now - sdata->last >= STDIN_IDLE_SECS)
+		stdin_release_store (sdata);
+}
+
+
+/* how long (in msecs) we can wait for new paths before we need to
+ * commit, or look at the spool */
+static int
+stdin_timeout (StdinData *sdata)
+{
+	double now, secs;
+
+	now  = g_timer_elapsed (sdata->timer, NULL);
+	secs = STDIN_SPOOL_SECS;
+
+	if (sdata->store && sdata->pending > 0)
+		secs = MIN (sdata->last + STDIN_IDLE_SECS,
+			    sdata->first + STDIN_LATENCY_SECS) - now;
+
+	return secs > 0 ? (int)(secs * 1000) + 1 : 0;
+}
+
+
+static void
+stdin_handle_path (StdinData *sdata, const char *path)
+{
+	gboolean add, ok;
+	GError *err;
+
+	add = sdata->opts->cmd == MU_CONFIG_CMD_ADD;
+	err = NULL;
+
+	if (sdata->idle)
+		stdin_try_store (sdata);
+
+	if (!check_file_okay (path, add))
+		ok = FALSE;
+	else if (!sdata->store)
+		ok = mu_spool_add (mu_runtime_path (MU_RUNTIME_PATH_SPOOL),
+				   add ? MU_SPOOL_OP_ADD : MU_SPOOL_OP_REMOVE,
+				   path, &err);
+	else if (add)
+		ok = mu_store_add_path (sdata->store, path, NULL, &err) !=
+			MU_STORE_INVALID_DOCID;
+	else
+		ok = mu_store_remove_path (sdata->store, path);
+
+	if (!ok) {
+		MU_WRITE_LOG ("failed to %s %s: %s", add ? "add" : "remove",
+			      path, err ? err->message : "error");
+		g_clear_error (&err);
+		sdata->allok = FALSE;
+		return;
+	}
+
+	if (!sdata->store)
+		return; /* nothing to commit */
+
+	sdata->last = g_timer_elapsed (sdata->timer, NULL);
+	if (sdata->pending++ == 0)
+		sdata->first = sdata->last;
+
+	if (sdata->pending >= STDIN_BATCH_MAX)
+		stdin_commit (sdata);
+}
+
+
+static void
+stdin_handle_line (StdinData *sdata, char *line)
+{
+	size_t len;
+
+	len = strlen (line);
+	if (len > 0 && line[len - 1] == '\r')
+		line[len - 1] = '\0';
+
+	if (line[0])
+		stdin_handle_path (sdata, line);
+}
+
+
+/* read what's available on stdin, and handle the complete lines;
+ * return FALSE when there's nothing more to read */
+static gboolean
+stdin_read (StdinData *sdata, GString *buf)
+{
+	char chunk[4096], *nl;
+	ssize_t n;
+	gsize start;
+
+	n = read (0, chunk, sizeof(chunk));
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return TRUE;
+	if (n < 0)
+		g_warning ("error reading stdin: %s", strerror (errno));
+	if (n <= 0)
+		return FALSE;
+
+	g_string_append_len (buf, chunk, n);
+
+	for (start = 0; (nl = memchr (buf->str + start, '\n',
+				      buf->len - start)); ) {
+		*nl = '\0';
+		stdin_handle_line (sdata, buf->str + start);
+		start = nl - buf->str + 1;
+	}
+	g_string_erase (buf, 0, start);
+
+	return TRUE;
+}
+
+
+static MuError
+add_or_remove_stdin (MuConfig *opts, GError **err)
+{
+	StdinData sdata;
+	GString *buf;
+	gboolean more;
+
+	memset (&sdata, 0, sizeof(sdata));
+	sdata.opts  = opts;
+	sdata.allok = TRUE;
+
+	if (!opts->spool) {
+		sdata.store = open_store (opts, FALSE, err);
+		if (!sdata.store) {
+			if (MU_G_ERROR_CODE(err) !=
+			    MU_ERROR_XAPIAN_CANNOT_GET_WRITELOCK)
+				return MU_G_ERROR_CODE(err);
+			MU_WRITE_LOG ("database is locked; "
+				      "spooling the requests");
+			g_clear_error (err);
+		}
+	}
+
+	sdata.timer = g_timer_new ();
+	sdata.retry = STDIN_RETRY_SECS;
+	buf	    = g_string_sized_new (1024);
+
+	install_sig_handler ();
+
+	for (more = TRUE; more && !MU_CAUGHT_SIGNAL; ) {
+
+		struct pollfd pfd;
+
+		pfd.fd	   = 0;
+		pfd.events = POLLIN;
+
+		switch (poll (&pfd, 1, stdin_timeout (&sdata))) {
+		case -1:
+			if (errno != EINTR) {
+				g_warning ("poll failed: %s",
+					   strerror (errno));
+				more = FALSE;
+			}
+			break;
+		case 0:
+			break;
+		default:
+			more = stdin_read (&sdata, buf);
+		}
+
+		stdin_commit_maybe (&sdata, FALSE);
+	}
+
+	/* a last line without a newline */
+	if (!MU_CAUGHT_SIGNAL && buf->len > 0)
+		stdin_handle_line (&sdata, buf->str);
+
+	if (sdata.store) {
+		stdin_commit_maybe (&sdata, TRUE);
+		mu_store_unref (sdata.store);
+	}
+
+	g_string_free (buf, TRUE);
+	g_timer_destroy (sdata.timer);
+
+	if (!sdata.allok) {
+		MuError code;
+		code = opts->cmd == MU_CONFIG_CMD_ADD ?
+			MU_ERROR_XAPIAN_STORE_FAILED :
+			MU_ERROR_XAPIAN_REMOVE_FAILED;
+		g_set_error (err, MU_ERROR_DOMAIN, code,
+			     "%s failed for some message(s)",
+			     opts->cmd == MU_CONFIG_CMD_ADD ? "add" : "remove");
+		return code;
+	}
+
+	return MU_OK;
+}
+
+
+/* add or remove messages; when some other process has the store
+ * open for writing (or with --spool), leave the requests for that
+ * process, rather than waiting for it */
+static MuError
+add_or_remove (store_func func, MuConfig *opts, GError **err)
+{
+	MuError rv;
+
+	if (opts->read_stdin)
+		return add_or_remove_stdin (opts, err);
+
+	if (opts->spool)
+		return spool_requests (opts, err);
+
+	rv = with_store (func, opts, FALSE, err);
+	if (rv != MU_ERROR_XAPIAN_CANNOT_GET_WRITELOCK)
+		return rv;
+
+	MU_WRITE_LOG ("database is locked; spooling the request(s)");
+	g_clear_error (err);
+
+	return spool_requests (opts, err);
+}
+
+
 gboolean
 check_params (MuConfig *opts, GError **err)
 {
@@ -550,6 +980,8 @@ check_params (MuConfig *opts, GError **err)
 MuError
 mu_cmd_execute (MuConfig *opts, GError **err)
 {
+	MuError rv;
+
 	g_return_val_if_fail (opts, MU_ERROR_INTERNAL);
 
 	if (opts->version) {
@@ -560,6 +992,11 @@ mu_cmd_execute (MuConfig *opts, GError **err)
 	if (!check_params(opts, err))
 		return MU_G_ERROR_CODE(err);
 
+	/* a running 'mu server --daemon' has the store for itself */
+	if (!opts->spool && !opts->read_stdin &&
+	    mu_cmd_server_forward (opts, &rv, err))
+		return rv;
+
 	switch (opts->cmd) {
 		/* already handled in mu-config.c */
 	case MU_CONFIG_CMD_HELP: return MU_OK;
@@ -575,9 +1012,9 @@ mu_cmd_execute (MuConfig *opts, GError **err)
 	case MU_CONFIG_CMD_INDEX:
 		return with_store (mu_cmd_index, opts, FALSE, err);
 	case MU_CONFIG_CMD_ADD:
-		return with_store (mu_cmd_add, opts, FALSE, err);
+		return add_or_remove (mu_cmd_add, opts, err);
 	case MU_CONFIG_CMD_REMOVE:
-		return with_store (mu_cmd_remove, opts, FALSE, err);
+		return add_or_remove (mu_cmd_remove, opts, err);
 	case MU_CONFIG_CMD_SERVER:
 		return with_store (mu_cmd_server, opts, FALSE, err);
 	default:
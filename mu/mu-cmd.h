@@ -150,6 +150,22 @@ MuError mu_cmd_remove (MuStore *store, MuConfig *opts, GError **err);
  */
 MuError mu_cmd_server (MuStore *store, MuConfig *opts, GError**/*unused*/);
 
+
+/**
+ * if a server daemon (mu server --daemon) is running, let it execute
+ * the add, remove or index command in opts, as we can't open the
+ * database for writing while the daemon has it open
+ *
+ * @param opts configuration options
+ * @param rv receives the result of the command, if it was forwarded
+ * @param err receives error information, or NULL
+ *
+ * @return TRUE if the command was forwarded to the daemon, FALSE if
+ * it wasn't (e.g. because there is no daemon), and the caller should
+ * execute it itself
+ */
+gboolean mu_cmd_server_forward (MuConfig *opts, MuError *rv, GError **err);
+
 /**
  * execute the verify command (to verify signatures)
  * @param store store object to use
@@ -196,6 +196,16 @@ config_options_group_find (void)
 		 "field to sort on", NULL},
 		{"threads", 't', 0, G_OPTION_ARG_NONE, &MU_CONFIG.threads,
 		 "show message threads", NULL},
+		{"conversations", 0, 0, G_OPTION_ARG_NONE,
+		 &MU_CONFIG.conversations,
+		 "show one message per thread (conversation)", NULL},
+		{"include-related", 0, 0, G_OPTION_ARG_NONE,
+		 &MU_CONFIG.include_related,
+		 "include the messages in the threads of the matches",
+		 NULL},
+		{"group-subjects", 0, 0, G_OPTION_ARG_NONE,
+		 &MU_CONFIG.group_subjects,
+		 "when threading, also group threads by subject", NULL},
 		{"bookmark", 'b', 0, G_OPTION_ARG_STRING, &MU_CONFIG.bookmark,
 		 "use a bookmarked query", NULL},
 		{"reverse", 'z', 0, G_OPTION_ARG_NONE, &MU_CONFIG.reverse,
@@ -215,6 +225,12 @@ config_options_group_find (void)
 		 "execute command on each match message", NULL},
 		{"after", 0, 0, G_OPTION_ARG_INT, &MU_CONFIG.after,
 		 "only show messages whose m_time > T (t_time)", NULL},
+		{"count", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.count,
+		 "only show the number of matching messages", NULL},
+		{"facets", 0, 0, G_OPTION_ARG_STRING, &MU_CONFIG.facets,
+		 "only show the number of matching messages per facet "
+		 "('maildir', 'flag', 'year', 'month', 'weekday', 'from', "
+		 "'size' or 'all')", NULL},
 		{NULL, 0, 0, 0, NULL, NULL, NULL}
 	};
 
@@ -384,6 +400,34 @@ config_options_group_verify (void)
 }
 
 
+static GOptionGroup*
+config_options_group_add_remove (MuConfigCmd cmd)
+{
+	GOptionGroup *og;
+	GOptionEntry entries[] = {
+		{"spool", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.spool,
+		 "don't wait for the database; leave the request for the "
+		 "process that has it (false)", NULL},
+		{"stdin", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.read_stdin,
+		 "read the paths from standard input, one per line, "
+		 "until end-of-file (false)", NULL},
+		{NULL, 0, 0, 0, NULL, NULL, NULL}
+	};
+
+	if (cmd == MU_CONFIG_CMD_ADD)
+		og = g_option_group_new("add",
+					"Options for the 'add' command",
+					"", NULL, NULL);
+	else
+		og = g_option_group_new("remove",
+					"Options for the 'remove' command",
+					"", NULL, NULL);
+	g_option_group_add_entries(og, entries);
+
+	return og;
+}
+
+
 static GOptionGroup*
 config_options_group_server (void)
 {
@@ -391,6 +435,9 @@ config_options_group_server (void)
 	GOptionEntry entries[] = {
 		{"maildir", 'm', 0, G_OPTION_ARG_FILENAME, &MU_CONFIG.maildir,
 		 "top of the maildir", NULL},
+		{"daemon", 0, 0, G_OPTION_ARG_NONE, &MU_CONFIG.daemon,
+		 "serve clients on a socket in the mu home directory "
+		 "(false)", NULL},
 		{NULL, 0, 0, 0, NULL, NULL, NULL}
 	};
 
@@ -473,6 +520,9 @@ get_option_group (MuConfigCmd cmd)
 		return config_options_group_verify ();
 	case MU_CONFIG_CMD_VIEW:
 		return config_options_group_view();
+	case MU_CONFIG_CMD_ADD:
+	case MU_CONFIG_CMD_REMOVE:
+		return config_options_group_add_remove (cmd);
 	case MU_CONFIG_CMD_SERVER:
 		return config_options_group_server();
 	default:
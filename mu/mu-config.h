@@ -121,6 +121,15 @@ struct _MuConfig {
 	char	        *sortfield;	/* field to sort by (string) */
 	gboolean	 reverse;	/* sort in revers order (z->a) */
 	gboolean	 threads;       /* show message threads */
+	gboolean	 conversations; /* show one message per
+					 * thread */
+	gboolean	 include_related; /* include messages in the
+					   * threads of the matches */
+	gboolean	 group_subjects; /* group threads by subject */
+	gboolean	 count;		/* only show the number of
+					 * matches */
+	char		*facets;	/* only show the number of
+					 * matches per facet */
 
 	gboolean	 summary;	/* OBSOLETE: use summary_len */
 	int	         summary_len;   /* max # of lines for summary */
@@ -171,6 +180,17 @@ struct _MuConfig {
 	gboolean	 overwrite;	/* should we overwrite same-named files */
 	gboolean         play;          /* after saving, try to 'play'
 					 * (open) the attmnt using xdgopen */
+
+	/* options for add, remove */
+	gboolean	 spool;		/* leave the request in the
+					 * spool, rather than opening
+					 * the store */
+	gboolean	 read_stdin;	/* read the paths from stdin,
+					 * until end-of-file */
+
+	/* options for server */
+	gboolean	 daemon;	/* listen on a socket, rather
+					 * than stdin/stdout */
 };
 typedef struct _MuConfig MuConfig;
 
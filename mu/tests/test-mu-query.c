@@ -95,7 +95,7 @@ run_and_count_matches (const char *xpath, const char *query)
 	MuQuery  *mquery;
 	MuMsgIter *iter;
 	MuStore *store;
-	guint count1, count2;
+	guint count1, count2, count3;
 	GError *err;
 
 	err = NULL;
@@ -130,8 +130,9 @@ run_and_count_matches (const char *xpath, const char *query)
 	}
 
 
-	iter = mu_query_run (mquery, query, FALSE, MU_MSG_FIELD_ID_NONE,
-			     FALSE, -1, NULL);
+	iter = mu_query_run (mquery, query, MU_MSG_FIELD_ID_NONE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
+	count3 = mu_query_count (mquery, query, NULL);
 	mu_query_destroy (mquery);
 	g_assert (iter);
 
@@ -151,6 +152,7 @@ run_and_count_matches (const char *xpath, const char *query)
 	mu_msg_iter_destroy (iter);
 
 	g_assert_cmpuint (count1, ==, count2);
+	g_assert_cmpuint (count1, ==, count3);
 
 	return count1;
 }
@@ -291,8 +293,8 @@ test_mu_query_accented_chars_01 (void)
 	query = mu_query_new (store, NULL);
 	mu_store_unref (store);
 
-	iter = mu_query_run (query, "fünkÿ", FALSE, MU_MSG_FIELD_ID_NONE,
-			     FALSE, -1, NULL);
+	iter = mu_query_run (query, "fünkÿ", MU_MSG_FIELD_ID_NONE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
 	err = NULL;
 	msg = mu_msg_iter_get_msg_floating (iter); /* don't unref */
 	if (!msg) {
@@ -532,6 +534,93 @@ test_mu_query_tags_02 (void)
 }
 
 
+static MuQuery*
+get_query (const char *xpath)
+{
+	MuQuery  *mquery;
+	MuStore *store;
+	GError *err;
+
+	err = NULL;
+	store = mu_store_new_read_only (xpath, &err);
+	g_assert_no_error (err);
+	g_assert (store);
+
+	mquery = mu_query_new (store, &err);
+	g_assert_no_error (err);
+	g_assert (mquery);
+
+	mu_store_unref (store);
+
+	return mquery;
+}
+
+
+static void
+test_mu_query_cache (void)
+{
+	MuQuery  *mquery;
+	unsigned u, hits, misses;
+
+	mquery = get_query (DB_PATH1);
+
+	for (u = 0; u != 3; ++u) {
+		MuMsgIter *iter;
+		iter = mu_query_run (mquery, "subject:elisp",
+				     MU_MSG_FIELD_ID_NONE, -1,
+				     MU_QUERY_FLAG_NONE, NULL);
+		g_assert (iter);
+		g_assert (!mu_msg_iter_is_done (iter));
+		mu_msg_iter_destroy (iter);
+	}
+
+	mu_query_cache_stats (mquery, &hits, &misses);
+	g_assert_cmpuint (misses, ==, 1);
+	g_assert_cmpuint (hits, ==, 2);
+
+	mu_query_destroy (mquery);
+}
+
+
+static void
+count_facet (MuQueryFacet facet, const char *val, unsigned count,
+	     unsigned *counts)
+{
+	g_assert (mu_query_facet_name (facet));
+	g_assert (val);
+
+	counts[facet == MU_QUERY_FACET_MAILDIR ? 0 : 1] += count;
+}
+
+static void
+test_mu_query_facets (void)
+{
+	MuQuery  *mquery;
+	unsigned counts[2];
+	GError *err;
+
+	mquery = get_query (DB_PATH1);
+
+	g_assert_cmpuint (mu_query_facets_from_str ("maildir,year"), ==,
+			  MU_QUERY_FACET_MAILDIR|MU_QUERY_FACET_YEAR);
+	g_assert_cmpuint (mu_query_facets_from_str ("maildir,foo"), ==,
+			  MU_QUERY_FACET_NONE);
+
+	/* each message lives in exactly one maildir */
+	err = NULL;
+	memset (counts, 0, sizeof(counts));
+	g_assert (mu_query_facets (mquery, "",
+				   MU_QUERY_FACET_MAILDIR|MU_QUERY_FACET_SIZE,
+				   (MuQueryFacetForeachFunc)count_facet,
+				   counts, &err));
+	g_assert_no_error (err);
+	g_assert_cmpuint (counts[0], ==, mu_query_count (mquery, "", NULL));
+	g_assert_cmpuint (counts[1], ==, counts[0]);
+
+	mu_query_destroy (mquery);
+}
+
+
 static void
 test_mu_query_preprocess (void)
 {
@@ -604,6 +693,10 @@ main (int argc, char *argv[])
 			 test_mu_query_tags);
 	g_test_add_func ("/mu-query/test-mu-query-tags_02",
 			 test_mu_query_tags_02);
+	g_test_add_func ("/mu-query/test-mu-query-cache",
+			 test_mu_query_cache);
+	g_test_add_func ("/mu-query/test-mu-query-facets",
+			 test_mu_query_facets);
 
 	if (!g_test_verbose())
 	    g_log_set_handler (NULL,
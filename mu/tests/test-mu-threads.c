@@ -33,6 +33,7 @@
 #include "test-mu-common.h"
 #include "mu-query.h"
 #include "mu-str.h"
+#include "mu-threader.h"
 
 static gchar*
 fill_database (const char *testdir)
@@ -57,7 +58,8 @@ fill_database (const char *testdir)
 
 /* note: this also *moves the iter* */
 static MuMsgIter*
-run_and_get_iter (const char *xpath, const char *query)
+run_and_get_iter_full (const char *xpath, const char *query, int maxnum,
+		       MuQueryFlags flags)
 {
 	MuQuery  *mquery;
 	MuStore *store;
@@ -70,14 +72,21 @@ run_and_get_iter (const char *xpath, const char *query)
 	mu_store_unref (store);
 	g_assert (query);
 
-	iter = mu_query_run (mquery, query, TRUE, MU_MSG_FIELD_ID_DATE,
-			     FALSE, -1, NULL);
+	iter = mu_query_run (mquery, query, MU_MSG_FIELD_ID_DATE, maxnum,
+			     flags, NULL);
 	mu_query_destroy (mquery);
 	g_assert (iter);
 
 	return iter;
 }
 
+static MuMsgIter*
+run_and_get_iter (const char *xpath, const char *query, int maxnum)
+{
+	return run_and_get_iter_full (xpath, query, maxnum,
+				      MU_QUERY_FLAG_THREADS);
+}
+
 
 static void
 test_mu_threads_01 (void)
@@ -110,7 +119,7 @@ test_mu_threads_01 (void)
 	xpath = fill_database (MU_TESTMAILDIR3);
 	g_assert (xpath != NULL);
 
-	iter = run_and_get_iter (xpath, "abc");
+	iter = run_and_get_iter (xpath, "abc", -1);
 	g_assert (iter);
 	g_assert (!mu_msg_iter_is_done(iter));
 
@@ -147,6 +156,262 @@ test_mu_threads_01 (void)
 	mu_msg_iter_destroy (iter);
 }
 
+/* when we want only a few messages, we should get the complete
+ * threads for those, with the same thread-paths as before */
+static void
+test_mu_threads_maxnum (void)
+{
+	gchar *xpath;
+	MuMsgIter *iter;
+	unsigned u;
+
+	struct {
+		const char* threadpath;
+		const char *msgid;
+	}   items [] = {
+		{"0",     "root0@msg.id"},
+		{"0:0",   "child0.0@msg.id"},
+		{"0:1",   "child0.1@msg.id"},
+		{"0:1:0", "child0.1.0@msg.id"},
+		{"1",     "root1@msg.id"}
+	};
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	/* the first thread has 4 messages, so we need the second
+	 * one as well */
+	iter = run_and_get_iter (xpath, "abc", 5);
+	g_assert (iter);
+
+	for (u = 0; !mu_msg_iter_is_done (iter); ++u) {
+		const MuMsgIterThreadInfo *ti;
+		MuMsg *msg;
+
+		g_assert (u < G_N_ELEMENTS(items));
+
+		ti  = mu_msg_iter_get_thread_info (iter);
+		msg = mu_msg_iter_get_msg_floating (iter);
+		g_assert (ti && msg);
+
+		g_assert_cmpstr (ti->threadpath,==,items[u].threadpath);
+		g_assert_cmpstr (mu_msg_get_msgid(msg),==,items[u].msgid);
+
+		mu_msg_iter_next (iter);
+	}
+	g_assert_cmpuint (u,==,G_N_ELEMENTS(items));
+
+	g_free (xpath);
+	mu_msg_iter_destroy (iter);
+}
+
+/* one message per thread; none of the messages have been seen */
+static void
+test_mu_threads_conversations (void)
+{
+	gchar *xpath;
+	MuMsgIter *iter;
+	unsigned convnum, msgnum, maxmsgnum;
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	iter = run_and_get_iter_full (xpath, "abc", -1,
+				      MU_QUERY_FLAG_CONVERSATIONS);
+	g_assert (iter);
+
+	convnum = msgnum = maxmsgnum = 0;
+	for (; !mu_msg_iter_is_done (iter); mu_msg_iter_next (iter)) {
+		const MuMsgIterConvInfo *ci;
+
+		ci = mu_msg_iter_get_conv_info (iter);
+		g_assert (ci);
+		g_assert_cmpuint (ci->unreadnum,==,ci->msgnum);
+
+		++convnum;
+		msgnum	 += ci->msgnum;
+		maxmsgnum = MAX(maxmsgnum, ci->msgnum);
+	}
+
+	/* root0, root1, root2, child3.0.0.0.0 and the absent root4 */
+	g_assert_cmpuint (convnum,==,5);
+	g_assert_cmpuint (msgnum,==,10);
+	g_assert_cmpuint (maxmsgnum,==,4);
+
+	g_free (xpath);
+	mu_msg_iter_destroy (iter);
+}
+
+/* find one message, and include the rest of its thread */
+static void
+test_mu_threads_include_related (void)
+{
+	gchar *xpath;
+	MuMsgIter *iter;
+	unsigned u;
+
+	const char* msgids[] = {
+		"root0@msg.id",
+		"child0.0@msg.id",
+		"child0.1@msg.id",
+		"child0.1.0@msg.id"
+	};
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	iter = run_and_get_iter_full (xpath, "msgid:child0.1.0@msg.id", -1,
+				      MU_QUERY_FLAG_THREADS |
+				      MU_QUERY_FLAG_INCLUDE_RELATED);
+	g_assert (iter);
+
+	for (u = 0; !mu_msg_iter_is_done (iter); ++u) {
+		MuMsg *msg;
+
+		g_assert (u < G_N_ELEMENTS(msgids));
+		msg = mu_msg_iter_get_msg_floating (iter);
+		g_assert_cmpstr (mu_msg_get_msgid (msg),==,msgids[u]);
+
+		mu_msg_iter_next (iter);
+	}
+	g_assert_cmpuint (u,==,G_N_ELEMENTS(msgids));
+
+	g_free (xpath);
+	mu_msg_iter_destroy (iter);
+}
+
+
+/* get the thread paths for some query, as a string */
+static gchar*
+get_thread_paths (MuQuery *mquery, const char *query, unsigned *count)
+{
+	MuMsgIter *iter;
+	GString *gstr;
+
+	iter = mu_query_run (mquery, query, MU_MSG_FIELD_ID_DATE, -1,
+			     MU_QUERY_FLAG_THREADS, NULL);
+	g_assert (iter);
+
+	gstr = g_string_sized_new (256);
+	for (*count = 0; !mu_msg_iter_is_done (iter);
+	     mu_msg_iter_next (iter), ++*count)
+		g_string_append_printf
+			(gstr, "%u %s\n", mu_msg_iter_get_docid (iter),
+			 mu_msg_iter_get_thread_info (iter)->threadpath);
+
+	mu_msg_iter_destroy (iter);
+
+	return g_string_free (gstr, FALSE);
+}
+
+/* threading with a thread cache should give the same results as
+ * threading without one, whether the cache is empty or not */
+static void
+test_mu_threads_cache (void)
+{
+	gchar *xpath, *paths, *paths2;
+	MuStore *store;
+	MuQuery *mquery;
+	MuThreadCache *tcache;
+	unsigned count, count2;
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+	mquery = mu_query_new (store, NULL);
+	mu_store_unref (store);
+	g_assert (mquery);
+
+	paths  = get_thread_paths (mquery, "abc", &count);
+	g_assert_cmpuint (count, >, 0);
+
+	tcache = mu_thread_cache_new ();
+	mu_query_set_thread_cache (mquery, tcache);
+
+	/* this one fills the cache... */
+	paths2 = get_thread_paths (mquery, "abc", &count2);
+	g_assert_cmpstr (paths, ==, paths2);
+	g_assert_cmpuint (mu_thread_cache_size (tcache), ==, count);
+	g_free (paths2);
+
+	/* ...and this one uses it */
+	paths2 = get_thread_paths (mquery, "abc", &count2);
+	g_assert_cmpstr (paths, ==, paths2);
+	g_free (paths2);
+
+	/* forgetting about a message only means we need to get it
+	 * from the database again */
+	mu_thread_cache_remove (tcache, (guint)strtoul (paths, NULL, 10));
+	g_assert_cmpuint (mu_thread_cache_size (tcache), ==, count - 1);
+	paths2 = get_thread_paths (mquery, "abc", &count2);
+	g_assert_cmpstr (paths, ==, paths2);
+	g_assert_cmpuint (mu_thread_cache_size (tcache), ==, count);
+	g_free (paths2);
+
+	mu_query_destroy (mquery);
+	mu_thread_cache_destroy (tcache);
+
+	g_free (paths);
+	g_free (xpath);
+}
+
+
+/* a cancelled threaded query gives no iter; a cancelled unthreaded
+ * one stops iterating */
+static void
+test_mu_threads_cancel (void)
+{
+	gchar *xpath;
+	MuStore *store;
+	MuQuery *mquery;
+	MuMsgIter *iter;
+	GError *err;
+	volatile gint cancelled;
+
+	xpath = fill_database (MU_TESTMAILDIR3);
+	g_assert (xpath != NULL);
+
+	store = mu_store_new_read_only (xpath, NULL);
+	g_assert (store);
+	mquery = mu_query_new (store, NULL);
+	mu_store_unref (store);
+	g_assert (mquery);
+
+	cancelled = 0;
+	mu_query_set_cancel_flag (mquery, &cancelled);
+
+	iter = mu_query_run (mquery, "abc", MU_MSG_FIELD_ID_NONE, -1,
+			     MU_QUERY_FLAG_NONE, NULL);
+	g_assert (iter);
+	g_assert (!mu_msg_iter_is_done (iter));
+
+	g_atomic_int_set (&cancelled, 1);
+	g_assert (mu_msg_iter_is_cancelled (iter));
+	g_assert (mu_msg_iter_is_done (iter));
+	g_assert (!mu_msg_iter_next (iter));
+	mu_msg_iter_destroy (iter);
+
+	err  = NULL;
+	iter = mu_query_run (mquery, "abc", MU_MSG_FIELD_ID_DATE, -1,
+			     MU_QUERY_FLAG_THREADS, &err);
+	g_assert (!iter);
+	g_assert_error (err, MU_ERROR_DOMAIN, MU_ERROR_CANCELLED);
+	g_clear_error (&err);
+
+	/* once reset, queries work again */
+	g_atomic_int_set (&cancelled, 0);
+	iter = mu_query_run (mquery, "abc", MU_MSG_FIELD_ID_DATE, -1,
+			     MU_QUERY_FLAG_THREADS, NULL);
+	g_assert (iter);
+	g_assert (!mu_msg_iter_is_done (iter));
+	mu_msg_iter_destroy (iter);
+
+	mu_query_destroy (mquery);
+	g_free (xpath);
+}
+
 
 struct _tinfo {
 	const char* threadpath;
@@ -180,7 +445,7 @@ test_mu_threads_rogue (void)
 	xpath = fill_database (MU_TESTMAILDIR3);
 	g_assert (xpath != NULL);
 
-	iter = run_and_get_iter (xpath, "def");
+	iter = run_and_get_iter (xpath, "def", -1);
 	g_assert (iter);
 	g_assert (!mu_msg_iter_is_done(iter));
 
@@ -226,6 +491,148 @@ test_mu_threads_rogue (void)
 
 
 
+
+/* benchmark for the threader itself; we thread a lot of synthetic
+ * messages, in threads of PERF_THREAD_SIZE messages, where each
+ * message refers to the root of its thread and to its parent. We add
+ * them from newest to oldest (as a date-descending query would), so
+ * most containers are created by the references, and sort them by
+ * date. In every other thread, the replies have lost their
+ * references (as happens with some mailing lists), so we can compare
+ * the cost of grouping the threads by subject. Only run with "-m
+ * perf" */
+#define PERF_MSG_NUM	 1000000
+#define PERF_THREAD_SIZE 10
+
+static double
+thread_perf (gchar **msgids, gchar **refs, gchar **subjects,
+	     gboolean group_subjects, guint *rootnum)
+{
+	MuThreader *threader;
+	MuContainerThreadInfo *tinfo;
+	unsigned u;
+	double secs;
+
+	g_test_timer_start ();
+
+	threader = mu_threader_new (PERF_MSG_NUM, MU_MSG_FIELD_ID_DATE);
+	if (group_subjects)
+		mu_threader_group_subjects (threader,
+					    MU_THREADER_SUBJECT_WINDOW);
+	for (u = PERF_MSG_NUM; u != 0; --u)
+		mu_threader_add (threader, u, msgids[u - 1], refs[u - 1],
+				 subjects[u - 1], (gint64)u * 60,
+				 (gint64)u * 60, NULL);
+	tinfo = mu_threader_finish (threader, PERF_MSG_NUM, 0, TRUE);
+	mu_threader_destroy (threader);
+
+	secs = g_test_timer_elapsed ();
+
+	g_assert_cmpuint (tinfo->len, ==, PERF_MSG_NUM);
+	for (*rootnum = 0, u = 0; u != tinfo->len; ++u)
+		if (tinfo->infos[u].level == 0)
+			++*rootnum;
+
+	mu_container_thread_info_destroy (tinfo);
+
+	return secs;
+}
+
+
+static void
+test_mu_threads_perf (void)
+{
+	gchar **msgids, **refs, **subjects;
+	unsigned u, rootnum;
+	double secs;
+
+	msgids	 = g_new (gchar*, PERF_MSG_NUM);
+	refs	 = g_new (gchar*, PERF_MSG_NUM);
+	subjects = g_new (gchar*, PERF_MSG_NUM);
+
+	for (u = 0; u != PERF_MSG_NUM; ++u) {
+		unsigned root, thread;
+		root	    = u - u % PERF_THREAD_SIZE;
+		thread	    = u / PERF_THREAD_SIZE;
+		msgids[u]   = g_strdup_printf ("msg%u@bench.id", u);
+		refs[u]	    = (u == root || thread % 2) ? NULL :
+			g_strdup_printf ("msg%u@bench.id,msg%u@bench.id",
+					 root, u - 1);
+		subjects[u] = g_strdup_printf ("%stopic %u",
+					       u == root ? "" : "Re: ",
+					       thread);
+	}
+
+	secs = thread_perf (msgids, refs, subjects, FALSE, &rootnum);
+	g_test_minimized_result (secs, "threading %u messages: %.3fs",
+				 PERF_MSG_NUM, secs);
+	g_assert_cmpuint (rootnum, ==, (PERF_MSG_NUM / PERF_THREAD_SIZE) *
+			  (PERF_THREAD_SIZE + 1) / 2);
+
+	secs = thread_perf (msgids, refs, subjects, TRUE, &rootnum);
+	g_test_minimized_result (secs, "threading %u messages, grouping "
+				 "by subject: %.3fs", PERF_MSG_NUM, secs);
+	g_assert_cmpuint (rootnum, ==, PERF_MSG_NUM / PERF_THREAD_SIZE);
+
+	for (u = 0; u != PERF_MSG_NUM; ++u) {
+		g_free (msgids[u]);
+		g_free (refs[u]);
+		g_free (subjects[u]);
+	}
+	g_free (msgids);
+	g_free (refs);
+	g_free (subjects);
+}
+
+
+/* group threads by subject, but only within the window */
+static void
+test_mu_threads_group_subjects (void)
+{
+	MuThreader *threader;
+	MuContainerThreadInfo *tinfo;
+	unsigned u;
+	gint64 day;
+
+	struct {
+		guint docid;
+		const char *threadpath;
+	} items[] = {
+		{ 1, "0" },
+		{ 2, "0:0" },
+		{ 3, "1" },
+		{ 4, "2" }
+	};
+
+	day = 60 * 60 * 24;
+
+	threader = mu_threader_new (4, MU_MSG_FIELD_ID_NONE);
+	mu_threader_group_subjects (threader, MU_THREADER_SUBJECT_WINDOW);
+
+	mu_threader_add (threader, 1, "a@msg.id", NULL, "foo", day, 0, NULL);
+	/* a reply to 1, but it refers to a message we don't have */
+	mu_threader_add (threader, 2, "b@msg.id", "missing@msg.id",
+			 "Re: foo", 2 * day, 0, NULL);
+	mu_threader_add (threader, 3, "c@msg.id", NULL, "bar", 3 * day,
+			 0, NULL);
+	/* same subject, but too late to be grouped with 1 */
+	mu_threader_add (threader, 4, "d@msg.id", NULL, "foo", 100 * day,
+			 0, NULL);
+
+	tinfo = mu_threader_finish (threader, 4, 0, FALSE);
+	mu_threader_destroy (threader);
+
+	g_assert_cmpuint (tinfo->len, ==, G_N_ELEMENTS(items));
+	for (u = 0; u != G_N_ELEMENTS(items); ++u) {
+		g_assert_cmpuint (tinfo->docids[u], ==, items[u].docid);
+		g_assert_cmpstr (tinfo->infos[u].threadpath, ==,
+				 items[u].threadpath);
+	}
+
+	mu_container_thread_info_destroy (tinfo);
+}
+
+
 int
 main (int argc, char *argv[])
 {
@@ -234,7 +641,23 @@ main (int argc, char *argv[])
 	g_test_init (&argc, &argv, NULL);
 
 	g_test_add_func ("/mu-query/test-mu-threads-01", test_mu_threads_01);
+	g_test_add_func ("/mu-query/test-mu-threads-maxnum",
+			 test_mu_threads_maxnum);
+	g_test_add_func ("/mu-query/test-mu-threads-conversations",
+			 test_mu_threads_conversations);
+	g_test_add_func ("/mu-query/test-mu-threads-include-related",
+			 test_mu_threads_include_related);
+	g_test_add_func ("/mu-query/test-mu-threads-cache",
+			 test_mu_threads_cache);
+	g_test_add_func ("/mu-query/test-mu-threads-cancel",
+			 test_mu_threads_cancel);
 	g_test_add_func ("/mu-query/test-mu-threads-rogue", test_mu_threads_rogue);
+	g_test_add_func ("/mu-query/test-mu-threads-group-subjects",
+			 test_mu_threads_group_subjects);
+
+	if (g_test_perf ())
+		g_test_add_func ("/mu-query/test-mu-threads-perf",
+				 test_mu_threads_perf);
 
 	g_log_set_handler (NULL,
 			   G_LOG_LEVEL_MASK | G_LOG_FLAG_FATAL| G_LOG_FLAG_RECURSION,
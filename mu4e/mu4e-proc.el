@@ -224,6 +224,12 @@ The server output is as follows:
 	    (funcall mu4e-contacts-func
 	      (plist-get sexp :contacts)))
 
+	  ;; received the number of matches for some query
+	  ((plist-get sexp :count)
+	    (funcall mu4e-count-func
+	      (plist-get sexp :count)
+	      (plist-get sexp :query)))
+
 	  ;; something got moved/flags changed
 	  ((plist-get sexp :update)
 	    (funcall mu4e-update-func
@@ -458,6 +464,16 @@ seen AFTER (the time_t value)."
     (if personal "true" "false")
     (or after 0)))
 
+(defun mu4e~proc-count (query &optional estimate)
+  "Sends the count command to the mu server, to get the number of
+messages matching QUERY, without retrieving the messages
+themselves. If ESTIMATE is non-nil, only get an estimate. Expects
+a (:count <n> :query <query>) in response."
+  (mu4e~proc-send-command
+    "count query:\"%s\" estimate:%s"
+    query
+    (if estimate "true" "false")))
+
 (defun mu4e~proc-view (docid-or-msgid &optional images)
   "Get one particular message based on its DOCID-OR-MSGID (keyword
 argument). Optionally, if IMAGES is non-nil, backend will any
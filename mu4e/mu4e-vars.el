@@ -573,6 +573,11 @@ the server process.")
   "A function called for each (:contacts (<list-of-contacts>) sexp
 received from the server process.")
 
+(defvar mu4e-count-func 'mu4e~default-handler
+  "A function called for each (:count <n> :query <query>) sexp
+received from the server process; the function is passed the
+number of matches and the query.")
+
 (defvar mu4e-temp-func 'mu4e~default-handler
   "A function called for each (:temp <file> <cookie>) sexp received
 from the server process.")